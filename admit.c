@@ -0,0 +1,139 @@
+/*
+ * admit.c -- decide, as each connection is accepted, whether to serve it.
+ *
+ * A connection is turned away if the process already has its share of
+ * conf.max_conns open, or its share of conf.max_conns_per_ip from the
+ * same address. The caps are split evenly across the workers, which
+ * keeps every count private to its process: nothing is shared on the
+ * request path, and the counts of a worker that dies die with it.
+ *
+ * Addresses are hashed into a fixed table of counters, so the decision
+ * takes one multiply and one lookup however many clients there are, and
+ * the table never grows. Addresses that collide share a counter, which
+ * can only make the cap stricter for them.
+ *
+ * A refused connection is answered at once with a 503 and a Retry-After
+ * header, before its request is even read, and closed: under a flood the
+ * server spends almost nothing on each one, and clients are told to come
+ * back rather than left waiting in the backlog.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include "admit.h"
+#include "clock.h"
+#include "conf.h"
+#include "metrics.h"
+#include "tls.h"
+
+
+static int open_max;                          // This process's share of max_conns
+static int ip_max;                            //   and of max_conns_per_ip
+static int open_now;
+static uint16_t per_ip[1 << ADMIT_BITS];
+
+
+/**
+ * slot -- the counter an address is counted in
+ * @remote: the address
+ */
+static inline uint16_t *slot(const struct sockaddr_in *remote)
+{
+        return &per_ip[(uint32_t)(remote->sin_addr.s_addr * 2654435761u) >> (32 - ADMIT_BITS)];
+}
+
+
+/**
+ * admit_init -- take this process's share of the caps
+ * @share: the number of processes the caps are split between
+ */
+void admit_init(int share)
+{
+        /* Rounded up, so a small cap still lets every worker serve */
+        open_max = (conf.max_conns + share - 1) / share;
+        ip_max   = (conf.max_conns_per_ip + share - 1) / share;
+
+        if (ip_max > UINT16_MAX)
+                ip_max = UINT16_MAX;
+}
+
+
+/**
+ * admit -- count a new connection in, if there is room for it
+ * @remote: address of the remote host
+ *  RET: 1 if it is admitted (and must be released), 0 if not
+ */
+int admit(const struct sockaddr_in *remote)
+{
+        uint16_t *n = slot(remote);
+
+        if (conf.max_conns && open_now >= open_max)
+                return 0;
+        if (conf.max_conns_per_ip && *n >= ip_max)
+                return 0;
+
+        open_now++;
+
+        if (*n < UINT16_MAX)
+                (*n)++;
+
+        return 1;
+}
+
+
+/**
+ * admit_release -- count a connection out
+ * @remote: address of the remote host
+ */
+void admit_release(const struct sockaddr_in *remote)
+{
+        uint16_t *n = slot(remote);
+
+        open_now--;
+
+        if (*n > 0)
+                (*n)--;
+}
+
+
+/**
+ * admit_refuse -- answer a connection that was not admitted, and close it
+ * @fd: the accepted socket
+ *
+ * Over TLS there is no answering before a handshake, which would cost
+ * more than the connection is worth, so the connection is just closed.
+ */
+void admit_refuse(int fd)
+{
+        static time_t logged;
+        char response[256];
+        char scratch[1024];
+        int len;
+
+        len = snprintf(response, sizeof(response),
+                       "HTTP/1.1 503 Service Unavailable\r\n"
+                       "Retry-After: %d\r\n"
+                       "Content-Length: 0\r\n"
+                       "%s"
+                       "Connection: close\r\n\r\n",
+                       conf.retry_after, clock_now()->date);
+
+        if (!tls_ctx && send(fd, response, len, MSG_NOSIGNAL|MSG_DONTWAIT) > 0)
+                METRICS_ADD(bytes, len);
+
+        METRICS_ADD(status[UNAVAILABLE], 1);
+
+        /* Closing on an unread request would reset the 503 away */
+        shutdown(fd, SHUT_WR);
+        while (recv(fd, scratch, sizeof(scratch), MSG_DONTWAIT) > 0)
+                ;
+        close(fd);
+
+        /* One line a second is enough to say it is happening */
+        if (clock_now()->sec != logged) {
+                logged = clock_now()->sec;
+                record(UNAVAILABLE, NULL, "over capacity, refusing connections");
+        }
+}
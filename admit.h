@@ -0,0 +1,18 @@
+#ifndef __ADMIT_H
+#define __ADMIT_H
+
+#include <netinet/in.h>
+
+
+/* Connections counted per address, hashed into 2^ADMIT_BITS counters */
+#define ADMIT_BITS 12
+
+
+/* Function prototypes */
+void admit_init(int share);
+int admit(const struct sockaddr_in *remote);
+void admit_release(const struct sockaddr_in *remote);
+void admit_refuse(int fd);
+
+
+#endif
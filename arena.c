@@ -0,0 +1,122 @@
+/*
+ * arena.c -- per-connection bump allocator.
+ *
+ * Everything a request needs to allocate (the log line, the response
+ * header) is carved out of one block owned by the connection, and all of
+ * it is released at once, in O(1), when the request is finished. In the
+ * steady state a request makes no calls to malloc() at all.
+ *
+ * Should a request outgrow the block (a very long URL, say), the excess
+ * is malloc()ed and chained to the arena, to be freed on the next reset.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include "arena.h"
+
+
+/* Alignment of every allocation */
+#define ALIGN(n) (((n) + 15) & ~(size_t)15)
+
+
+/**
+ * arena_init -- make an arena over a block of memory
+ * @a   : the arena
+ * @mem : the block (not freed by the arena)
+ * @size: size of the block
+ */
+void arena_init(struct arena_t *a, void *mem, size_t size)
+{
+        a->base  = mem;
+        a->size  = size;
+        a->used  = 0;
+        a->spill = NULL;
+}
+
+
+/**
+ * arena_alloc -- allocate n bytes from an arena
+ * @a: the arena
+ * @n: bytes wanted
+ *  RET: pointer to the bytes, or NULL if out of memory
+ */
+void *arena_alloc(struct arena_t *a, size_t n)
+{
+        struct spill_t *s;
+        void *p;
+
+        if (ALIGN(n) <= a->size - a->used) {
+                p = a->base + a->used;
+                a->used += ALIGN(n);
+                return p;
+        }
+
+        if (s = malloc(sizeof(*s) + n), !s)
+                return NULL;
+
+        s->next  = a->spill;
+        a->spill = s;
+
+        return s->mem;
+}
+
+
+/**
+ * arena_printf -- format a string into an arena
+ * @a  : the arena
+ * @fmt: format string
+ * @...: format string arguments
+ *  RET: the '\0'-terminated string, or NULL if out of memory
+ */
+char *arena_printf(struct arena_t *a, const char *fmt, ...)
+{
+        va_list args;
+        size_t room;
+        char *str;
+        int len;
+
+        /* Format straight into the free space, if it fits */
+        room = a->size - a->used;
+
+        va_start(args, fmt);
+        len = vsnprintf(a->base + a->used, room, fmt, args);
+        va_end(args);
+
+        if (len < 0)
+                return NULL;
+
+        if ((size_t)len < room) {
+                str = a->base + a->used;
+                a->used += ALIGN(len + 1);
+                if (a->used > a->size)
+                        a->used = a->size;
+                return str;
+        }
+
+        if (str = arena_alloc(a, len + 1), !str)
+                return NULL;
+
+        va_start(args, fmt);
+        vsnprintf(str, len + 1, fmt, args);
+        va_end(args);
+
+        return str;
+}
+
+
+/**
+ * arena_reset -- release everything allocated from an arena
+ * @a: the arena
+ */
+void arena_reset(struct arena_t *a)
+{
+        struct spill_t *s;
+
+        while ((s = a->spill)) {
+                a->spill = s->next;
+                free(s);
+        }
+
+        a->used = 0;
+}
@@ -0,0 +1,34 @@
+#ifndef __ARENA_H
+#define __ARENA_H
+
+#include <stddef.h>
+
+
+/* Bytes of scratch space each connection starts with */
+#define ARENA_SIZE 2048
+
+
+/* Memory that didn't fit, released on reset */
+struct spill_t {
+        struct spill_t *next;
+        char mem[];
+};
+
+
+/* Bump allocator over a caller-provided block */
+struct arena_t {
+        char *base;                  // The block
+        size_t size;                 // Its size
+        size_t used;                 // Bytes handed out so far
+        struct spill_t *spill;       // Overflow allocations, if any
+};
+
+
+/* Function prototypes */
+void arena_init(struct arena_t *a, void *mem, size_t size);
+void *arena_alloc(struct arena_t *a, size_t n);
+char *arena_printf(struct arena_t *a, const char *fmt, ...);
+void arena_reset(struct arena_t *a);
+
+
+#endif
@@ -0,0 +1,133 @@
+/*
+ * bench_alloc.c -- heap allocations per request, before and after the arena.
+ *
+ * Each round formats what one request used to allocate: the ACCEPT and
+ * RESPONSE log lines and the response header. "legacy" is the old
+ * sequence, reproduced here: sesprep() pumpf()s the session line, then
+ * record() pumpf()s a copy of it to write out. "arena" formats the same
+ * lines and header into a connection arena and resets it afterwards.
+ *
+ * malloc() and friends are interposed to count every call, including
+ * those libc makes on behalf of open_memstream().
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "../arena.h"
+#include "../textutils.h"
+
+
+#define ROUNDS 1000000
+
+#define RESOURCE "/ganoo.jpeg"
+#define HOST     "www.example.com"
+#define ADDR     "192.168.10.42"
+#define PORT     51234
+#define TIME     "2024-05-01 12:00:00"
+
+
+extern void *__libc_malloc(size_t);
+extern void *__libc_calloc(size_t, size_t);
+extern void *__libc_realloc(void *, size_t);
+extern void __libc_free(void *);
+
+static unsigned long allocs;
+static volatile size_t sink;
+
+
+void *malloc(size_t n)             { allocs++; return __libc_malloc(n); }
+void *calloc(size_t n, size_t m)   { allocs++; return __libc_calloc(n, m); }
+void *realloc(void *p, size_t n)   { allocs++; return __libc_realloc(p, n); }
+void free(void *p)                 { __libc_free(p); }
+
+
+static double seconds(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+
+        return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+static void legacy_record(char **session, const char *tag, const char *figure)
+{
+        char *buffer;
+
+        free(*session);
+        pumpf(session, "%s: %s %s %s %s:%hu (%s)",
+              tag, RESOURCE, HOST, figure, ADDR, PORT, TIME);
+        pumpf(&buffer, "%s", *session);
+
+        sink += strlen(buffer);
+        free(buffer);
+}
+
+
+static void legacy(void)
+{
+        static char header[512];
+        char *session = NULL;
+
+        legacy_record(&session, "INFO", "<---");
+        legacy_record(&session, "INFO", "--->");
+
+        sink += snprintf(header, sizeof(header),
+                         "HTTP/1.1 200 OK\r\nContent-Type: %s\r\nContent-Length: %lld\r\n",
+                         "image/jpeg", 123456LL);
+        free(session);
+}
+
+
+static void arena(struct arena_t *a)
+{
+        char *line;
+        char *header;
+
+        line = arena_printf(a, "%s: %s %s %s %s:%hu (%s)",
+                            "INFO", RESOURCE, HOST, "<---", ADDR, PORT, TIME);
+        sink += strlen(line);
+        line = arena_printf(a, "%s: %s %s %s %s:%hu (%s)",
+                            "INFO", RESOURCE, HOST, "--->", ADDR, PORT, TIME);
+        sink += strlen(line);
+
+        header = arena_alloc(a, 512);
+        sink += snprintf(header, 512,
+                         "HTTP/1.1 200 OK\r\nContent-Type: %s\r\nContent-Length: %lld\r\n",
+                         "image/jpeg", 123456LL);
+
+        arena_reset(a);
+}
+
+
+int main(void)
+{
+        char scratch[ARENA_SIZE];
+        struct arena_t a;
+        unsigned long n;
+        double t;
+        int i;
+
+        n = allocs;
+        t = seconds();
+        for (i=0; i<ROUNDS; i++)
+                legacy();
+        t = seconds() - t;
+        printf("alloc: legacy  %5.2f mallocs/request %7.1f ns/request\n",
+               (double)(allocs - n) / ROUNDS, t * 1e9 / ROUNDS);
+
+        arena_init(&a, scratch, sizeof(scratch));
+
+        n = allocs;
+        t = seconds();
+        for (i=0; i<ROUNDS; i++)
+                arena(&a);
+        t = seconds() - t;
+        printf("alloc: arena   %5.2f mallocs/request %7.1f ns/request\n",
+               (double)(allocs - n) / ROUNDS, t * 1e9 / ROUNDS);
+
+        return 0;
+}
@@ -0,0 +1,136 @@
+/*
+ * bench_mime.c -- the perfect hash against the linear scans it replaced.
+ *
+ * "legacy" is the old get_file_extension(), reproduced here with its
+ * ten-entry table: strlen() and strncmp() against the tail of the path
+ * for every entry. "linear" is the same scan over all of mime.types
+ * (read at startup), which is what the old code would have become had
+ * the table grown. "hash" is mime_lookup().
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "../mime.h"
+
+
+#define ROUNDS 1000000
+
+
+struct ext_t { char *ext; char *filetype; };
+
+static struct ext_t supported_ext[]={
+        {"gif", "image/gif" },
+        {"jpg", "image/jpeg"},
+        {"jpeg","image/jpeg"},
+        {"png", "image/png" },
+        {"zip", "image/zip" },
+        {"gz",  "image/gz"  },
+        {"tar", "image/tar" },
+        {"htm", "text/html" },
+        {"html","text/html" },
+        {"css", "text/css"  },
+        {0,0}
+};
+
+static struct ext_t *all_ext;
+
+
+static const char *PATHS[]={
+        "index.html", "ganoo.jpeg", "css/site.css", "dist/app.tar.gz",
+        "docs/manual.pdf", "media/intro.webm", "fonts/sans.woff2",
+        "data/export.xyz",
+};
+#define NPATHS (sizeof(PATHS)/sizeof(PATHS[0]))
+
+
+static volatile size_t sink;
+
+
+static double seconds(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+
+        return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+static char *scan(struct ext_t *table, const char *buf, size_t buflen)
+{
+        size_t len;
+        int i;
+
+        for (i=0; table[i].ext != NULL; i++) {
+                len = strlen(table[i].ext);
+                if (len <= buflen && !strncmp(&buf[buflen-len], table[i].ext, len))
+                        return table[i].filetype;
+        }
+        return NULL;
+}
+
+
+static void load(const char *path)
+{
+        char line[1024];
+        char *type;
+        char *ext;
+        FILE *f;
+        int n = 0;
+
+        if (f = fopen(path, "r"), !f) {
+                perror(path);
+                exit(1);
+        }
+
+        while (fgets(line, sizeof(line), f)) {
+                if (line[0] == '#' || !(type = strtok(line, " \t\n")))
+                        continue;
+                type = strdup(type);
+                while ((ext = strtok(NULL, " \t\n"))) {
+                        all_ext = realloc(all_ext, (n+2)*sizeof(*all_ext));
+                        all_ext[n++] = (struct ext_t){ strdup(ext), type };
+                }
+        }
+        all_ext[n] = (struct ext_t){ 0, 0 };
+
+        fclose(f);
+}
+
+
+int main(void)
+{
+        size_t len[NPATHS];
+        double t;
+        size_t i;
+        int r;
+
+        load("mime.types");
+
+        for (i=0; i<NPATHS; i++)
+                len[i] = strlen(PATHS[i]);
+
+        t = seconds();
+        for (r=0; r<ROUNDS; r++)
+                for (i=0; i<NPATHS; i++)
+                        sink += (size_t)scan(supported_ext, PATHS[i], len[i]);
+        printf("mime: legacy  %7.1f ns/lookup (10 entries)\n",
+               (seconds() - t) * 1e9 / ROUNDS / NPATHS);
+
+        t = seconds();
+        for (r=0; r<ROUNDS/10; r++)
+                for (i=0; i<NPATHS; i++)
+                        sink += (size_t)scan(all_ext, PATHS[i], len[i]);
+        printf("mime: linear  %7.1f ns/lookup (mime.types)\n",
+               (seconds() - t) * 1e9 / (ROUNDS/10) / NPATHS);
+
+        t = seconds();
+        for (r=0; r<ROUNDS; r++)
+                for (i=0; i<NPATHS; i++)
+                        sink += (size_t)mime_lookup(PATHS[i], len[i]);
+        printf("mime: hash    %7.1f ns/lookup (mime.types)\n",
+               (seconds() - t) * 1e9 / ROUNDS / NPATHS);
+
+        return 0;
+}
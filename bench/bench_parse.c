@@ -0,0 +1,133 @@
+/*
+ * bench_parse.c -- the request parser against the path it replaced.
+ *
+ * "legacy" is the old sequence, reproduced here: rewrite CR/LF to '*',
+ * bdup() the request, strtok() it, field() every token for GET, Host
+ * and User-Agent, pumpf() each match, then strcasestr() for Connection.
+ * "parse" is parse_request() plus the same three header lookups, fed
+ * the whole request at once and (parse/split) in 7-byte reads.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "../parse.h"
+#include "../textutils.h"
+
+
+#define ROUNDS 1000000
+
+
+static const char REQUEST[] =
+        "GET /ganoo.jpeg HTTP/1.1\r\n"
+        "Host: www.example.com\r\n"
+        "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:128.0) Gecko/20100101 Firefox/128.0\r\n"
+        "Accept: image/avif,image/webp,image/png,image/svg+xml,image/*;q=0.8,*/*;q=0.5\r\n"
+        "Accept-Language: en-US,en;q=0.5\r\n"
+        "Accept-Encoding: gzip, deflate, br, zstd\r\n"
+        "Connection: keep-alive\r\n"
+        "Referer: http://www.example.com/\r\n"
+        "Sec-Fetch-Dest: image\r\n"
+        "Sec-Fetch-Mode: no-cors\r\n"
+        "Sec-Fetch-Site: same-origin\r\n"
+        "Priority: u=5, i\r\n"
+        "\r\n";
+
+
+static volatile size_t sink;
+
+
+static double seconds(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+
+        return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+static void legacy(char *request)
+{
+        char *resource = NULL, *host = NULL, *agent = NULL;
+        char *copy, *token, *clean, *buf;
+        int i = 0;
+
+	for (buf = request; *buf; buf++) {
+		if (*buf=='\r' || *buf=='\n')
+                        *buf = '*';
+        }
+
+        copy = bdup(request);
+
+        for (token = strtok(copy, "**"); token != NULL; token = strtok(NULL, "**")) {
+                if (clean = field(token, "GET "), clean != NULL) {
+                        while (clean[++i] && clean[i] != ' ')
+                        ;
+                        clean[i] = '\0';
+                        pumpf(&resource, "%s", clean);
+                }
+                if (clean = field(token, "Host: "), clean != NULL)
+                        pumpf(&host, "%s", clean);
+                if (clean = field(token, "User-Agent: "), clean != NULL)
+                        pumpf(&agent, "%s", clean);
+        }
+
+        sink += (strcasestr(request, "*Connection:") != NULL);
+        sink += strlen(resource) + strlen(host) + strlen(agent);
+
+        free(copy);
+        free(resource);
+        free(host);
+        free(agent);
+}
+
+
+static void parse(const char *request, size_t len, size_t step)
+{
+        struct req_t req;
+        size_t have;
+        int ret;
+
+        parse_reset(&req);
+
+        for (have = step; ; have += step) {
+                if (have > len)
+                        have = len;
+                if (ret = parse_request(&req, request, have), ret != PARSE_AGAIN)
+                        break;
+        }
+
+        sink += ret + req.target.len;
+        sink += parse_header(&req, "Host")->len;
+        sink += parse_header(&req, "User-Agent")->len;
+        sink += parse_header(&req, "Connection")->len;
+}
+
+
+int main(void)
+{
+        char buf[sizeof(REQUEST)];
+        double t;
+        int i;
+
+        t = seconds();
+        for (i=0; i<ROUNDS; i++) {
+                memcpy(buf, REQUEST, sizeof(REQUEST));
+                legacy(buf);
+        }
+        printf("parse: legacy       %7.1f ns/request\n", (seconds() - t) * 1e9 / ROUNDS);
+
+        t = seconds();
+        for (i=0; i<ROUNDS; i++)
+                parse(REQUEST, sizeof(REQUEST)-1, sizeof(REQUEST));
+        printf("parse: parse        %7.1f ns/request\n", (seconds() - t) * 1e9 / ROUNDS);
+
+        t = seconds();
+        for (i=0; i<ROUNDS; i++)
+                parse(REQUEST, sizeof(REQUEST)-1, 7);
+        printf("parse: parse/split  %7.1f ns/request\n", (seconds() - t) * 1e9 / ROUNDS);
+
+        return 0;
+}
@@ -0,0 +1,493 @@
+/*
+ * loadgen.c -- a closed-loop HTTP/1.1 load generator.
+ *
+ * usage: loadgen [-a addr] [-p port] [-c conns] [-t threads] [-d secs] [-C] [-s] path
+ *
+ * Each of the conns connections sends a GET for path, reads the whole
+ * response, and sends the next as soon as it is done; with -C it asks
+ * for Connection: close and opens a new connection for every request.
+ * The connections are shared out among threads, each with its own epoll
+ * set.
+ *
+ * With -s every connection speaks TLS, without checking the server's
+ * certificate, and a new connection resumes the session of the one it
+ * replaces, as a browser would.
+ *
+ * Latency is measured from the request being written (or, with -C, the
+ * connection being started) to the last byte of the response. At the end
+ * one line is printed: requests per second, MB/s of response bodies,
+ * the p50/p99/p999 latency and the number of failures. The exit status
+ * is 1 if no request at all succeeded.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <openssl/ssl.h>
+
+
+#define MAX_THREADS 64
+#define HEAD_SIZE   8192
+#define READ_SIZE   262144
+
+
+struct client_t {
+        int fd;
+        int connecting;          // Waiting for connect() (and the handshake)
+        SSL *ssl;                // With -s, the TLS session
+        SSL_SESSION *session;    //   and the last one, to resume
+        char head[HEAD_SIZE];    // The response header, until it is complete
+        size_t hlen;
+        int status;
+        long long want;          // Body bytes expected, -1 until known
+        long long got;           // Body bytes received
+        int closing;             // The server will close after this response
+        double start;
+};
+
+
+struct thread_t {
+        pthread_t tid;
+        int nclients;
+        double *lat;             // Latency of every completed request
+        size_t nlat;
+        size_t cap;
+        unsigned long long bytes;
+        unsigned long errors;
+};
+
+
+static struct sockaddr_in addr;
+static char request[1024];
+static size_t reqlen;
+static int close_each;
+static double stop_at;
+static SSL_CTX *tls;
+
+
+static double now(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+
+        return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+/**
+ * client_open -- start connecting a client
+ *  RET: 0, or -1 if the connection could not even be started
+ */
+static int client_open(int ep, struct client_t *cl)
+{
+        struct epoll_event ev;
+        int one = 1;
+
+        if (cl->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0), cl->fd < 0)
+                return -1;
+
+        setsockopt(cl->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+        cl->start = now();
+
+        if (connect(cl->fd, (struct sockaddr *)&addr, sizeof(addr)) < 0
+        && errno != EINPROGRESS) {
+                close(cl->fd);
+                return -1;
+        }
+
+        cl->connecting = 1;
+
+        ev.events   = EPOLLIN | EPOLLOUT;
+        ev.data.ptr = cl;
+
+        return epoll_ctl(ep, EPOLL_CTL_ADD, cl->fd, &ev);
+}
+
+
+/**
+ * client_close -- close a client's connection, keeping its TLS session
+ */
+static void client_close(struct client_t *cl)
+{
+        SSL_SESSION *session;
+
+        if (cl->ssl) {
+                if (session = SSL_get1_session(cl->ssl), session) {
+                        SSL_SESSION_free(cl->session);
+                        cl->session = session;
+                }
+                SSL_free(cl->ssl);
+                cl->ssl = NULL;
+        }
+
+        close(cl->fd);
+}
+
+
+/**
+ * client_handshake -- take a TLS handshake as far as the socket allows
+ *  RET: 1 when it is done, 0 if it must wait, -1 on error
+ */
+static int client_handshake(int ep, struct client_t *cl)
+{
+        struct epoll_event ev = { .data.ptr = cl };
+        int ret;
+
+        if (!cl->ssl) {
+                if (cl->ssl = SSL_new(tls), !cl->ssl)
+                        return -1;
+                SSL_set_fd(cl->ssl, cl->fd);
+                SSL_set_connect_state(cl->ssl);
+                if (cl->session)
+                        SSL_set_session(cl->ssl, cl->session);
+        }
+
+        if (ret = SSL_do_handshake(cl->ssl), ret == 1)
+                return 1;
+
+        /* Wait for the one it needs, not spin on a writable socket */
+        switch (SSL_get_error(cl->ssl, ret)) {
+        case SSL_ERROR_WANT_READ:
+                ev.events = EPOLLIN;
+                break;
+        case SSL_ERROR_WANT_WRITE:
+                ev.events = EPOLLIN | EPOLLOUT;
+                break;
+        default:
+                return -1;
+        }
+
+        return epoll_ctl(ep, EPOLL_CTL_MOD, cl->fd, &ev);
+}
+
+
+/**
+ * client_send -- write the request and wait for the response
+ *  RET: 0, or -1 on error
+ */
+static int client_send(int ep, struct client_t *cl)
+{
+        struct epoll_event ev = { .events = EPOLLIN, .data.ptr = cl };
+
+        cl->hlen = 0;
+        cl->want = -1;
+        cl->got  = 0;
+
+        if (!close_each)
+                cl->start = now();
+
+        if (cl->ssl ? SSL_write(cl->ssl, request, reqlen) != (int)reqlen
+                    : write(cl->fd, request, reqlen) != (ssize_t)reqlen)
+                return -1;
+
+        if (cl->connecting) {
+                cl->connecting = 0;
+                return epoll_ctl(ep, EPOLL_CTL_MOD, cl->fd, &ev);
+        }
+        return 0;
+}
+
+
+/**
+ * client_header -- take what is known from a complete response header
+ *  RET: 0, or -1 if it makes no sense
+ */
+static int client_header(struct client_t *cl)
+{
+        char *p;
+
+        cl->head[cl->hlen] = '\0';
+
+        if (strncmp(cl->head, "HTTP/1.", 7) || cl->hlen < 12)
+                return -1;
+
+        cl->status = atoi(cl->head + 9);
+
+        if (p = strcasestr(cl->head, "\r\nContent-Length:"), !p)
+                return -1;
+
+        cl->want    = atoll(p + 17);
+        cl->closing = strcasestr(cl->head, "\r\nConnection: close\r\n") != NULL;
+
+        return 0;
+}
+
+
+/**
+ * client_read -- take in what has arrived of the response
+ * @buf: scratch space
+ *  RET: 1 if the response is complete, 0 if not, -1 on error
+ */
+static int client_read(struct client_t *cl, char *buf)
+{
+        char *end;
+        ssize_t n;
+        size_t take;
+
+        for (;;) {
+                if (cl->ssl && (n = SSL_read(cl->ssl, buf, READ_SIZE), n <= 0))
+                        return (SSL_get_error(cl->ssl, n) == SSL_ERROR_WANT_READ) ? 0 : -1;
+                if (!cl->ssl && (n = read(cl->fd, buf, READ_SIZE), n < 0))
+                        return (errno == EAGAIN) ? 0 : -1;
+                if (n == 0)
+                        return -1;
+
+                if (cl->want < 0) {
+                        /* Still in the header: keep it until its blank line */
+                        take = sizeof(cl->head) - 1 - cl->hlen;
+                        take = ((size_t)n < take) ? (size_t)n : take;
+
+                        memcpy(cl->head + cl->hlen, buf, take);
+                        cl->head[cl->hlen + take] = '\0';
+
+                        if (end = strstr(cl->head, "\r\n\r\n"), !end) {
+                                if (cl->hlen += take, cl->hlen == sizeof(cl->head) - 1)
+                                        return -1;
+                                continue;
+                        }
+
+                        /* What follows the blank line is body */
+                        n -= (end + 4 - cl->head) - cl->hlen;
+                        cl->hlen = end + 4 - cl->head;
+
+                        if (client_header(cl) < 0)
+                                return -1;
+                }
+
+                if (cl->got += n, cl->got >= cl->want)
+                        return 1;
+        }
+}
+
+
+/**
+ * client_done -- account for a response and start the next request
+ */
+static void client_done(int ep, struct client_t *cl, struct thread_t *t, int ok)
+{
+        double end = now();
+
+        if (ok && cl->status >= 200 && cl->status < 400) {
+                if (t->nlat == t->cap) {
+                        t->cap = t->cap ? 2 * t->cap : 65536;
+                        if (t->lat = realloc(t->lat, t->cap * sizeof(double)), !t->lat) {
+                                perror("loadgen");
+                                exit(1);
+                        }
+                }
+                t->lat[t->nlat++] = end - cl->start;
+                t->bytes += cl->got;
+        } else {
+                t->errors++;
+        }
+
+        if (end >= stop_at) {
+                client_close(cl);
+                cl->fd = -1;
+                return;
+        }
+
+        if (ok && !close_each && !cl->closing && client_send(ep, cl) == 0)
+                return;
+
+        client_close(cl);
+
+        while (client_open(ep, cl) < 0) {
+                t->errors++;
+                if (now() >= stop_at) {
+                        cl->fd = -1;
+                        return;
+                }
+        }
+}
+
+
+/**
+ * run -- drive one thread's share of the connections until time is up
+ */
+static void *run(void *arg)
+{
+        struct epoll_event events[256];
+        struct thread_t *t = arg;
+        struct client_t *clients;
+        struct client_t *cl;
+        char *buf;
+        int live;
+        int ep;
+        int ret;
+        int n;
+        int i;
+
+        clients = calloc(t->nclients, sizeof(*clients));
+        buf     = malloc(READ_SIZE);
+        ep      = epoll_create1(0);
+
+        if (!clients || !buf || ep < 0) {
+                perror("loadgen");
+                exit(1);
+        }
+
+        for (i=0; i<t->nclients; i++) {
+                if (client_open(ep, &clients[i]) < 0) {
+                        perror("connect");
+                        exit(1);
+                }
+        }
+
+        for (live = t->nclients; live > 0; ) {
+                n = epoll_wait(ep, events, 256, 100);
+
+                for (i=0; i<n; i++) {
+                        cl = events[i].data.ptr;
+
+                        if (cl->connecting) {
+                                if (events[i].events & (EPOLLERR | EPOLLHUP))
+                                        client_done(ep, cl, t, 0);
+                                else if (tls && (ret = client_handshake(ep, cl)) <= 0) {
+                                        if (ret < 0)
+                                                client_done(ep, cl, t, 0);
+                                } else if (client_send(ep, cl) < 0)
+                                        client_done(ep, cl, t, 0);
+                        } else if (ret = client_read(cl, buf), ret != 0) {
+                                client_done(ep, cl, t, ret > 0);
+                        }
+
+                        if (cl->fd < 0)
+                                live--;
+                }
+
+                /* Don't wait forever on a server that has stopped answering */
+                if (now() > stop_at + 5)
+                        break;
+        }
+
+        for (i=0; i<t->nclients; i++) {
+                SSL_free(clients[i].ssl);
+                SSL_SESSION_free(clients[i].session);
+        }
+
+        free(buf);
+        free(clients);
+        close(ep);
+
+        return NULL;
+}
+
+
+static int by_value(const void *a, const void *b)
+{
+        double x = *(const double *)a;
+        double y = *(const double *)b;
+
+        return (x > y) - (x < y);
+}
+
+
+int main(int argc, char *argv[])
+{
+        static struct thread_t threads[MAX_THREADS];
+        const char *host = "127.0.0.1";
+        unsigned long long bytes = 0;
+        unsigned long errors = 0;
+        double duration = 5;
+        double *lat;
+        double elapsed;
+        size_t nlat = 0;
+        size_t k;
+        int nthreads = 1;
+        int conns = 16;
+        int use_tls = 0;
+        int port = 55555;
+        int ch;
+        int i;
+
+        while ((ch = getopt(argc, argv, "a:p:c:t:d:Cs")) != -1) {
+                switch (ch) {
+                case 'a': host       = optarg;       break;
+                case 'p': port       = atoi(optarg); break;
+                case 'c': conns      = atoi(optarg); break;
+                case 't': nthreads   = atoi(optarg); break;
+                case 'd': duration   = atof(optarg); break;
+                case 'C': close_each = 1;            break;
+                case 's': use_tls    = 1;            break;
+                default:
+                        goto usage;
+                }
+        }
+
+        if (optind != argc - 1 || conns < 1 || nthreads < 1 || nthreads > MAX_THREADS)
+                goto usage;
+
+        if (nthreads > conns)
+                nthreads = conns;
+
+        addr.sin_family = AF_INET;
+        addr.sin_port   = htons(port);
+        if (inet_pton(AF_INET, host, &addr.sin_addr) != 1)
+                goto usage;
+
+        if (use_tls && (tls = SSL_CTX_new(TLS_client_method()), !tls)) {
+                fprintf(stderr, "loadgen: SSL_CTX_new failed\n");
+                return 1;
+        }
+
+        reqlen = snprintf(request, sizeof(request),
+                          "GET %s HTTP/1.1\r\nHost: %s\r\nConnection: %s\r\n\r\n",
+                          argv[optind], host, close_each ? "close" : "keep-alive");
+
+        elapsed = now();
+        stop_at = elapsed + duration;
+
+        for (i=0; i<nthreads; i++) {
+                threads[i].nclients = conns / nthreads + (i < conns % nthreads);
+                pthread_create(&threads[i].tid, NULL, run, &threads[i]);
+        }
+        for (i=0; i<nthreads; i++) {
+                pthread_join(threads[i].tid, NULL);
+                nlat   += threads[i].nlat;
+                bytes  += threads[i].bytes;
+                errors += threads[i].errors;
+        }
+
+        elapsed = now() - elapsed;
+
+        if (lat = malloc((nlat + 1) * sizeof(double)), !lat) {
+                perror("loadgen");
+                return 1;
+        }
+        for (k = 0, i = 0; i < nthreads; i++) {
+                memcpy(lat + k, threads[i].lat, threads[i].nlat * sizeof(double));
+                k += threads[i].nlat;
+                free(threads[i].lat);
+        }
+
+        qsort(lat, nlat, sizeof(double), by_value);
+
+        #define PCT(p) (nlat ? lat[(size_t)((nlat - 1) * (p))] * 1e3 : 0.0)
+
+        printf("%-16s %5d %-10s %10.0f req/s %9.1f MB/s  p50 %8.3f  p99 %8.3f  p999 %8.3f ms  %lu errors\n",
+               argv[optind], conns, close_each ? "close" : "keep-alive",
+               nlat / elapsed, bytes / elapsed / 1e6,
+               PCT(0.5), PCT(0.99), PCT(0.999), errors);
+
+        free(lat);
+
+        return nlat ? 0 : 1;
+
+usage:
+        fprintf(stderr, "usage: loadgen [-a addr] [-p port] [-c conns] [-t threads] [-d secs] [-C] [-s] path\n");
+        return 1;
+}
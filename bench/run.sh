@@ -0,0 +1,71 @@
+#!/bin/sh
+#
+# run.sh -- benchmark a local cloth serving a copy of www/
+#
+# usage: bench/run.sh            (from the top of the tree, after make)
+#
+# Starts ./cloth on $PORT over a scratch copy of www/ with two generated
+# large files added, then runs bench/loadgen against a small, a medium
+# and a large file, with keep-alive and with a connection per request,
+# at each of $CONNS concurrent connections. One line per run; keep the
+# output of a baseline to compare a change against.
+#
+# Environment:
+#       PORT      port to serve on                (default 8089)
+#       CONNS     concurrencies to try            (default "1 16 128")
+#       DURATION  seconds per run                 (default 5)
+#       THREADS   loadgen threads                 (default 2)
+#       ARGS      extra arguments for cloth       (e.g. "-w 4 -o cache_mb=0")
+#       TLS       1 to serve and load over TLS, with a throwaway certificate
+#
+
+PORT=${PORT:-8089}
+CONNS=${CONNS:-"1 16 128"}
+DURATION=${DURATION:-5}
+THREADS=${THREADS:-2}
+ARGS=${ARGS:-}
+
+TLS=${TLS:-0}
+
+ROOT=$(mktemp -d /tmp/cloth-bench.XXXXXX)
+KEYS=$(mktemp -d /tmp/cloth-keys.XXXXXX)
+
+# Workers sharing the port through SO_REUSEPORT must be gone before the
+# next run starts, or they would answer some of its requests
+cleanup() {
+        while pkill -f "cloth -p $PORT "; do
+                sleep 0.2
+        done
+        rm -rf "$ROOT" "$KEYS"
+}
+trap cleanup EXIT INT TERM
+
+cp -r www/. "$ROOT"/
+head -c 1048576  /dev/urandom > "$ROOT"/large-1m.bin
+head -c 16777216 /dev/urandom > "$ROOT"/large-16m.bin
+
+# The key is kept out of the www root
+if [ "$TLS" = 1 ]; then
+        openssl req -x509 -newkey ec -pkeyopt ec_paramgen_curve:P-256 -nodes \
+                -keyout "$KEYS"/key.pem -out "$KEYS"/cert.pem -days 1 \
+                -subj /CN=localhost 2>/dev/null || exit 1
+        ARGS="$ARGS -c $KEYS/cert.pem -k $KEYS/key.pem"
+        LOADGEN_ARGS="-s"
+fi
+
+./cloth -p "$PORT" -d "$ROOT" $ARGS || exit 1
+
+# Wait for the server to come up
+for i in 1 2 3 4 5 6 7 8 9 10; do
+        ./bench/loadgen $LOADGEN_ARGS -p "$PORT" -c 1 -d 0.1 /index.html >/dev/null 2>&1 && break
+        sleep 0.2
+done
+
+echo "cloth $ARGS, $DURATION s per run, $THREADS loadgen threads"
+
+for path in /index.html /ganoo.jpeg /large-1m.bin /large-16m.bin; do
+        for c in $CONNS; do
+                ./bench/loadgen $LOADGEN_ARGS -p "$PORT" -c "$c" -t "$THREADS" -d "$DURATION" "$path"
+                ./bench/loadgen $LOADGEN_ARGS -p "$PORT" -c "$c" -t "$THREADS" -d "$DURATION" -C "$path"
+        done
+done
@@ -0,0 +1,227 @@
+/*
+ * bundle.c -- serve the www root from one archive, mapped at startup.
+ *
+ * With -b, every file is looked up in a bundle made by mkbundle instead
+ * of in the file system: the bundle is mapped once, before any worker is
+ * forked, and a request costs a hash lookup in its index, with no path
+ * walk, open() or stat(). Each file is in the bundle with its response
+ * header already rendered and, for text, gzip and brotli copies, so the
+ * response is the header and the body, straight from the mapping.
+ *
+ * Nothing is read at startup but the bundle's first page, so it takes
+ * the same few milliseconds however many files there are; the index and
+ * bodies are paged in (and shared between the workers) as they are used.
+ * A file is only checked against the bounds of the bundle the first time
+ * it is asked for, when its entry is made. Entries are made per worker,
+ * once, and kept, just as if every file were cached (see cache.h).
+ *
+ * The bundle must not change under the server: replace it (mkbundle
+ * writes a new one and renames it into place) and reload with SIGUSR2.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "bundle.h"
+#include "log.h"
+
+
+static char *map;
+static size_t size;
+static const struct bundle_head_t *head;
+static const struct bundle_file_t *files;
+static const uint32_t *slots;
+static struct entry_t **made;        // Entries made so far, ENC_COUNT a file
+
+
+/**
+ * inside -- check that a run of bytes lies inside the bundle
+ */
+static int inside(uint64_t off, uint64_t len)
+{
+        return off <= size && len <= size - off;
+}
+
+
+/**
+ * bundle_open -- map a bundle, to serve every file from
+ * @file: the bundle
+ *  RET: 0 on success, else -1 (with the reason on stderr)
+ */
+int bundle_open(const char *file)
+{
+        struct stat st;
+        char *p;
+        int fd;
+
+        if (fd = open(file, O_RDONLY|O_CLOEXEC), fd < 0) {
+                perror(file);
+                return -1;
+        }
+
+        if (fstat(fd, &st) < 0)
+                st.st_size = 0;
+
+        p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+
+        if (st.st_size == 0 || p == MAP_FAILED) {
+                fprintf(stderr, "%s: can't be mapped\n", file);
+                return -1;
+        }
+
+        head = (const struct bundle_head_t *)p;
+        size = st.st_size;
+
+        if ((size_t)st.st_size < sizeof(*head)
+        ||  memcmp(head->magic, BUNDLE_MAGIC, sizeof(head->magic))
+        ||  head->size != (uint64_t)st.st_size
+        ||  head->slots <= head->count
+        ||  (head->slots & (head->slots - 1))
+        ||  head->files % sizeof(uint64_t) || head->index % sizeof(uint32_t)
+        ||  !inside(head->files, (uint64_t)head->count * sizeof(*files))
+        ||  !inside(head->index, (uint64_t)head->slots * sizeof(*slots))) {
+                fprintf(stderr, "%s: not a bundle, or not this version\n", file);
+                munmap(p, st.st_size);
+                size = 0;
+                return -1;
+        }
+
+        if (made = calloc((size_t)head->count * ENC_COUNT, sizeof(*made)), !made) {
+                munmap(p, st.st_size);
+                return -1;
+        }
+
+        map   = p;
+        files = (const struct bundle_file_t *)(map + head->files);
+        slots = (const uint32_t *)(map + head->index);
+
+        /* Every lookup starts in the index */
+        madvise(map + head->index, (size_t)head->slots * sizeof(*slots), MADV_WILLNEED);
+
+        return 0;
+}
+
+
+/**
+ * bundle_active -- files are served from a bundle
+ */
+int bundle_active(void)
+{
+        return map != NULL;
+}
+
+
+/**
+ * bundle_find -- find a file in the bundle
+ * @path: path relative to the www root
+ *  RET: the file's number, or -1 if it isn't there
+ */
+static long bundle_find(const char *path)
+{
+        const struct bundle_file_t *f;
+        uint32_t mask;
+        uint32_t h;
+        uint32_t i;
+        size_t len;
+
+        len  = strlen(path);
+        h    = bundle_hash(path, len);
+        mask = head->slots - 1;
+
+        for (i = h & mask; slots[i] != 0; i = (i + 1) & mask) {
+                if (slots[i] > head->count)
+                        return -1;
+
+                f = &files[slots[i] - 1];
+
+                if (f->hash == h && f->plen == len && inside(f->path, len)
+                && !memcmp(map + f->path, path, len))
+                        return slots[i] - 1;
+        }
+
+        return -1;
+}
+
+
+/**
+ * bundle_entry -- make the entry that sends a file in a coding
+ * @f  : the file
+ * @enc: the coding, one the file has
+ *  RET: the entry, or NULL if the bundle is damaged or out of memory
+ */
+static struct entry_t *bundle_entry(const struct bundle_file_t *f, int enc)
+{
+        const struct bundle_var_t *v = &f->var[enc];
+        struct timespec mtime;
+        struct entry_t *e;
+
+        if (!inside(v->header, v->hlen) || !inside(v->body, v->blen)
+        ||  !inside(f->type, 1) || !memchr(map + f->type, '\0', size - f->type))
+                return NULL;
+
+        if (e = calloc(1, sizeof(*e)), !e)
+                return NULL;
+
+        mtime.tv_sec  = f->mtime_sec;
+        mtime.tv_nsec = f->mtime_nsec;
+
+        e->enc    = enc;
+        e->header = map + v->header;
+        e->hlen   = v->hlen;
+        e->body   = map + v->body;
+        e->blen   = v->blen;
+        e->ino    = f->ino;
+        e->fsize  = f->fsize;
+        e->mtime  = mtime;
+        e->refs   = 1;                   // The bundle's own, never let go
+
+        http_rep(&e->rep, map + f->type, v->blen, enc, f->ino, f->fsize, &mtime);
+
+        return e;
+}
+
+
+/**
+ * bundle_get -- find the body of a response in the bundle
+ * @req  : the request
+ * @path : path of the file, relative to the www root
+ * @entry: will point to the entry, which the caller must cache_release()
+ * @why  : will point to an explanatory message on failure
+ *  RET: RESPONSE on success, else the cloth status code of the failure.
+ *
+ * The best coding the client accepts that the bundle has is sent.
+ */
+int bundle_get(const struct req_t *req, const char *path, struct entry_t **entry, char **why)
+{
+        const struct bundle_file_t *f;
+        struct entry_t **e;
+        int accept;
+        long n;
+        int enc;
+
+        if (n = bundle_find(path), n < 0)
+                return *why = "file not found", NOT_FOUND;
+
+        f      = &files[n];
+        accept = http_encodings(req);
+
+        for (enc = ENC_COUNT-1; enc > ENC_IDENTITY; enc--) {
+                if ((accept & ENC_BIT(enc)) && f->var[enc].header)
+                        break;
+        }
+
+        e = &made[n * ENC_COUNT + enc];
+
+        if (!*e && !(*e = bundle_entry(f, enc)))
+                return *why = "damaged bundle", ERROR;
+
+        (*e)->refs++;
+        *entry = *e;
+
+        return RESPONSE;
+}
@@ -0,0 +1,79 @@
+#ifndef __BUNDLE_H
+#define __BUNDLE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "cache.h"
+#include "http.h"
+#include "parse.h"
+
+
+/* The first bytes of a bundle, and of this version of its format */
+#define BUNDLE_MAGIC "clothb01"
+
+/* Bodies this large start on a page; smaller ones don't cross one */
+#define BUNDLE_ALIGN 4096
+
+
+/*
+ * The layout of a bundle, written by mkbundle and mapped by cloth (both
+ * on the same machine, so in its byte order). Offsets are from the start
+ * of the file.
+ */
+struct bundle_head_t {
+        char magic[8];               // BUNDLE_MAGIC
+        uint32_t count;              // Files packed
+        uint32_t slots;              // Hash slots, a power of two above count
+        uint64_t files;              // Offset of the files, count of them
+        uint64_t index;              // Offset of the slots: a file's number + 1,
+                                     //   or 0, each a uint32_t
+        uint64_t size;               // Length of the bundle
+};
+
+/* A file as sent in one content coding */
+struct bundle_var_t {
+        uint64_t header;             // Offset of its rendered header, or 0
+        uint64_t body;               //   and of its body,
+        uint64_t blen;               //   and the length of each
+        uint32_t hlen;
+        uint32_t unused;
+};
+
+/* A file, found by its path */
+struct bundle_file_t {
+        uint32_t hash;               // bundle_hash() of the path
+        uint32_t plen;               // Length of the path
+        uint64_t path;               // Offset of the path, relative to the root
+        uint64_t type;               // Offset of its MIME type, '\0'-terminated
+        uint64_t ino;                // Inode, size and mtime of the file that
+        uint64_t fsize;              //   was packed, which the ETags are made of
+        int64_t mtime_sec;
+        int64_t mtime_nsec;
+        struct bundle_var_t var[ENC_COUNT]; // By content coding
+};
+
+
+/**
+ * bundle_hash -- FNV-1a hash of a path
+ *
+ * Shared by mkbundle, which builds the index, and bundle_get(), which
+ * looks things up in it.
+ */
+static inline uint32_t bundle_hash(const char *path, size_t len)
+{
+        uint32_t h = 2166136261u;
+
+        while (len--)
+                h = (h ^ (unsigned char)*path++) * 16777619u;
+
+        return h;
+}
+
+
+/* Function prototypes */
+int bundle_open(const char *file);
+int bundle_active(void);
+int bundle_get(const struct req_t *req, const char *path, struct entry_t **entry, char **why);
+
+
+#endif
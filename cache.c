@@ -0,0 +1,925 @@
+/*
+ * cache.c -- keep hot files in memory, with their headers pre-rendered.
+ *
+ * A hit costs one hash lookup: the entry already holds the file's bytes
+ * and the status line and entity headers that go in front of them, so
+ * the response is a single writev() with no open(), fstat() or read().
+ *
+ * The cache is per process (one per worker), bounded by the total size
+ * of its entries and evicted least recently used first. An entry that is
+ * still being sent when it is evicted or invalidated is only freed once
+ * the last connection releases it.
+ *
+ * Entries are dropped as soon as their file changes: every directory
+ * holding a cached file is watched with inotify. If inotify can't be
+ * had, each hit instead checks the file's inode and mtime with stat().
+ *
+ * A file may be cached more than once, under different content codings:
+ * read from a precompressed sibling ("x.css.gz"), or compressed from the
+ * identity entry off the event loop (see compress.c) and stored here.
+ * A change to the file drops all of them.
+ *
+ * Files too big to cache are kept open instead, up to open_files of them,
+ * with what fstat() said about them, so that serving one again costs no
+ * path walk, open() or fstat(). Files that could not be opened are kept
+ * too, with the errno of the failure, so neither a missing page nor the
+ * search for precompressed siblings that don't exist walks the file
+ * system each time. The same inotify watches drop them when they change;
+ * without inotify they are looked up again every open_files_ttl seconds.
+ *
+ * The same events keep directory listings current (see listing.c).
+ *
+ * With mmap=1 an open file is also mapped, once, the first time it is
+ * sent, and the mapping is shared by every connection sending it until
+ * the last lets the file go. Nothing in cloth reads the mapped bytes
+ * itself; the kernel does, copying them into the socket, so a file
+ * truncated under its mapping makes the send fail with EFAULT rather
+ * than raise SIGBUS.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <netinet/in.h>
+#include "cache.h"
+#include "http.h"
+#include "listing.h"
+#include "root.h"
+#include "conf.h"
+#include "log.h"
+#include "metrics.h"
+
+
+/* What makes a cached file stale */
+#define WATCH_MASK (IN_MODIFY|IN_ATTRIB|IN_CLOSE_WRITE|IN_CREATE|IN_DELETE \
+                   |IN_MOVED_FROM|IN_MOVED_TO|IN_DELETE_SELF|IN_MOVE_SELF  \
+                   |IN_ONLYDIR)
+
+
+/* Mappings this large may be backed by huge pages */
+#define HUGE_MAP (2 << 20)
+
+
+/* A watched directory */
+struct watch_t { int wd; char *dir; };
+
+
+struct cache_stats_t cache_stats;
+
+static struct entry_t *buckets[CACHE_BUCKETS];
+static struct entry_t *lru_head;
+static struct entry_t *lru_tail;
+
+static struct file_t *file_buckets[CACHE_BUCKETS];
+static struct file_t *file_head;
+static struct file_t *file_tail;
+
+static int enabled;
+static int files_enabled;
+static int fd_notify = -1;
+static struct watch_t *watches;
+static int nwatches;
+
+
+/**
+ * hash -- FNV-1a hash of a '\0'-terminated string
+ */
+static uint32_t hash(const char *str)
+{
+        uint32_t h = 2166136261u;
+
+        while (*str)
+                h = (h ^ (unsigned char)*str++) * 16777619u;
+
+        return h;
+}
+
+
+/**
+ * canonical -- check that a path is one inotify events could name
+ */
+static int canonical(const char *path)
+{
+        return path[0] != '.' && !strstr(path, "//") && !strstr(path, "/.");
+}
+
+
+/******************************************************************************
+ * ENTRIES
+ ******************************************************************************/
+/**
+ * entry_free -- release the memory held by an entry
+ * @e: the entry (freed on return)
+ */
+static void entry_free(struct entry_t *e)
+{
+        free(e->path);
+        free(e->file);
+        free(e->header);
+        free(e->body);
+        free(e);
+}
+
+
+/**
+ * lru_unlink -- take an entry off the LRU list
+ * @e: the entry
+ */
+static void lru_unlink(struct entry_t *e)
+{
+        if (e->prev) e->prev->next = e->next; else lru_head = e->next;
+        if (e->next) e->next->prev = e->prev; else lru_tail = e->prev;
+
+        e->prev = e->next = NULL;
+}
+
+
+/**
+ * lru_append -- make an entry the most recently used
+ * @e: the entry (not on the list)
+ */
+static void lru_append(struct entry_t *e)
+{
+        e->prev = lru_tail;
+        e->next = NULL;
+
+        if (lru_tail) lru_tail->next = e; else lru_head = e;
+        lru_tail = e;
+}
+
+
+/**
+ * entry_drop -- remove an entry from the cache
+ * @e: the entry (freed unless a connection still holds it)
+ */
+static void entry_drop(struct entry_t *e)
+{
+        struct entry_t **p;
+
+        for (p = &buckets[e->hash & (CACHE_BUCKETS-1)]; *p; p = &(*p)->chain) {
+                if (*p == e) {
+                        *p = e->chain;
+                        break;
+                }
+        }
+
+        lru_unlink(e);
+
+        cache_stats.bytes   -= e->cost;
+        cache_stats.entries -= 1;
+
+        if (e->dead = 1, e->refs == 0)
+                entry_free(e);
+}
+
+
+/**
+ * lookup -- find the entry for a path
+ * @path: path relative to the www root
+ * @enc : content coding of the entry
+ * @h   : hash of the path
+ */
+static struct entry_t *lookup(const char *path, int enc, uint32_t h)
+{
+        struct entry_t *e;
+
+        for (e = buckets[h & (CACHE_BUCKETS-1)]; e; e = e->chain) {
+                if (e->hash == h && e->enc == enc && !strcmp(e->path, path))
+                        return e;
+        }
+        return NULL;
+}
+
+
+/**
+ * drop_path -- drop every coding of a path that is cached
+ * @path: path relative to the www root
+ */
+static void drop_path(const char *path)
+{
+        struct entry_t *e;
+        uint32_t h;
+        int enc;
+
+        h = hash(path);
+
+        for (enc = 0; enc < ENC_COUNT; enc++) {
+                if (e = lookup(path, enc, h), e) {
+                        cache_stats.invalidations++;
+                        entry_drop(e);
+                }
+        }
+}
+
+
+/**
+ * insert -- render an entry's header and add it to the cache
+ * @e: the entry, with everything but its header filled in
+ *  RET: 0 on success, else -1 (and the entry is left to the caller)
+ */
+static int insert(struct entry_t *e)
+{
+        char header[HEADER_SIZE];
+        struct entry_t *old;
+        size_t limit;
+
+        limit = (size_t)conf.cache_kb * 1024;
+
+        http_rep(&e->rep, e->rep.type, e->blen, e->enc, e->ino, e->fsize, &e->mtime);
+
+        e->hlen   = http_header(header, sizeof(header), &e->rep);
+        e->header = malloc(e->hlen);
+        e->cost   = sizeof(*e) + strlen(e->path) + 1 + e->hlen + e->blen
+                  + (e->file ? strlen(e->file) + 1 : 0);
+
+        if (!e->header || e->cost > limit)
+                return -1;
+
+        memcpy(e->header, header, e->hlen);
+
+        e->hash = hash(e->path);
+
+        /* A newer copy replaces an older one */
+        if (old = lookup(e->path, e->enc, e->hash), old)
+                entry_drop(old);
+
+        /* Make room, least recently used first */
+        while (lru_head && cache_stats.bytes + e->cost > limit) {
+                cache_stats.evictions++;
+                entry_drop(lru_head);
+        }
+
+        e->chain = buckets[e->hash & (CACHE_BUCKETS-1)];
+        buckets[e->hash & (CACHE_BUCKETS-1)] = e;
+        lru_append(e);
+
+        cache_stats.bytes   += e->cost;
+        cache_stats.entries += 1;
+        cache_stats.stores  += 1;
+
+        return 0;
+}
+
+
+/**
+ * stale -- check a cached file against the file system
+ * @e: the entry
+ *  RET: 1 if the file has changed since it was cached, else 0
+ */
+static int stale(struct entry_t *e)
+{
+        struct stat st;
+
+        if (stat(e->file ? e->file : e->path, &st) < 0)
+                return 1;
+
+        return st.st_ino != e->ino || st.st_dev != e->dev
+            || st.st_size != e->fsize
+            || st.st_mtim.tv_sec  != e->mtime.tv_sec
+            || st.st_mtim.tv_nsec != e->mtime.tv_nsec;
+}
+
+
+/******************************************************************************
+ * OPEN FILES
+ ******************************************************************************/
+/**
+ * file_free -- close a file and release its memory
+ * @f: the file (freed on return)
+ */
+static void file_free(struct file_t *f)
+{
+        if (f->map) {
+                munmap(f->map, f->maplen);
+                METRICS_ADD(maps, -1);
+                METRICS_ADD(mapped, -(int64_t)f->maplen);
+        }
+        if (f->fd >= 0)
+                close(f->fd);
+        free(f->name);
+        free(f);
+}
+
+
+/**
+ * file_unlink -- take a file off the LRU list
+ * @f: the file
+ */
+static void file_unlink(struct file_t *f)
+{
+        if (f->prev) f->prev->next = f->next; else file_head = f->next;
+        if (f->next) f->next->prev = f->prev; else file_tail = f->prev;
+
+        f->prev = f->next = NULL;
+}
+
+
+/**
+ * file_append -- make a file the most recently used
+ * @f: the file (not on the list)
+ */
+static void file_append(struct file_t *f)
+{
+        f->prev = file_tail;
+        f->next = NULL;
+
+        if (file_tail) file_tail->next = f; else file_head = f;
+        file_tail = f;
+}
+
+
+/**
+ * file_drop -- remove a file from the table
+ * @f: the file (closed unless a connection still holds it)
+ */
+static void file_drop(struct file_t *f)
+{
+        struct file_t **p;
+
+        for (p = &file_buckets[f->hash & (CACHE_BUCKETS-1)]; *p; p = &(*p)->chain) {
+                if (*p == f) {
+                        *p = f->chain;
+                        break;
+                }
+        }
+
+        file_unlink(f);
+
+        cache_stats.files -= 1;
+
+        if (f->dead = 1, f->refs == 0)
+                file_free(f);
+}
+
+
+/**
+ * file_lookup -- find the open file with a name
+ * @name: path relative to the www root
+ * @h   : hash of the name
+ */
+static struct file_t *file_lookup(const char *name, uint32_t h)
+{
+        struct file_t *f;
+
+        for (f = file_buckets[h & (CACHE_BUCKETS-1)]; f; f = f->chain) {
+                if (f->hash == h && !strcmp(f->name, name))
+                        return f;
+        }
+        return NULL;
+}
+
+
+/**
+ * drop_file -- forget a file, if it is in the table
+ * @name: path relative to the www root
+ */
+static void drop_file(const char *name)
+{
+        struct file_t *f;
+
+        if (f = file_lookup(name, hash(name)), f)
+                file_drop(f);
+}
+
+
+/******************************************************************************
+ * INOTIFY
+ ******************************************************************************/
+/**
+ * watch_dir -- watch a directory
+ * @dir: path relative to the www root, "." for the root (malloc()ed; the
+ *       table takes it, or it is freed)
+ *  RET: 0 if the directory is (now) watched, else -1
+ */
+static int watch_dir(char *dir)
+{
+        struct watch_t *more;
+        int wd;
+        int i;
+
+        if (wd = inotify_add_watch(fd_notify, dir, WATCH_MASK), wd < 0) {
+                free(dir);
+                return -1;
+        }
+
+        /* The same directory always gets the same descriptor */
+        for (i=0; i<nwatches; i++) {
+                if (watches[i].wd == wd) {
+                        free(dir);
+                        return 0;
+                }
+        }
+
+        if (more = realloc(watches, (nwatches+1)*sizeof(*watches)), !more) {
+                free(dir);
+                return -1;
+        }
+
+        watches = more;
+        watches[nwatches].wd  = wd;
+        watches[nwatches].dir = dir;
+        nwatches++;
+
+        return 0;
+}
+
+
+/**
+ * watch -- watch the directory holding a path
+ * @path: path relative to the www root
+ *  RET: 0 if the directory is (now) watched, else -1
+ */
+static int watch(const char *path)
+{
+        const char *slash;
+        char *dir;
+
+        if (slash = strrchr(path, '/'), slash)
+                dir = strndup(path, slash - path);
+        else
+                dir = strdup(".");
+
+        return dir ? watch_dir(dir) : -1;
+}
+
+
+/**
+ * flush -- drop every entry in the cache
+ */
+static void flush(void)
+{
+        while (lru_head) {
+                cache_stats.invalidations++;
+                entry_drop(lru_head);
+        }
+
+        while (file_head)
+                file_drop(file_head);
+
+        listing_flush();
+}
+
+
+/**
+ * cache_notify -- drop the entries of files reported changed by inotify
+ *
+ * Called by the event loop when the inotify descriptor is readable.
+ */
+void cache_notify(void)
+{
+        char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+        struct inotify_event *ev;
+        char path[BUFSIZE];
+        size_t len;
+        ssize_t n;
+        char *p;
+        int enc;
+        int i;
+
+        while ((n = read(fd_notify, buf, sizeof(buf))) > 0) {
+                for (p = buf; p < buf + n; p += sizeof(*ev) + ev->len) {
+                        ev = (struct inotify_event *)p;
+
+                        /* Lost events, or a whole directory went away */
+                        if (ev->mask & (IN_Q_OVERFLOW|IN_DELETE_SELF|IN_MOVE_SELF|IN_IGNORED)) {
+                                flush();
+                                continue;
+                        }
+
+                        if (ev->len == 0)
+                                continue;
+
+                        for (i=0; i<nwatches && watches[i].wd != ev->wd; i++)
+                                ;
+                        if (i == nwatches)
+                                continue;
+
+                        if (!strcmp(watches[i].dir, "."))
+                                snprintf(path, sizeof(path), "%s", ev->name);
+                        else
+                                snprintf(path, sizeof(path), "%s/%s", watches[i].dir, ev->name);
+
+                        drop_file(path);
+                        drop_path(path);
+                        listing_notify(watches[i].dir, ev->name, ev->mask);
+
+                        /* A sibling changing drops what was read from it */
+                        for (enc = ENC_IDENTITY+1; enc < ENC_COUNT; enc++) {
+                                if (strlen(path) <= strlen(ENCODING_SUFFIX[enc]))
+                                        continue;
+                                len = strlen(path) - strlen(ENCODING_SUFFIX[enc]);
+                                if (!strcmp(path + len, ENCODING_SUFFIX[enc])) {
+                                        path[len] = '\0';
+                                        drop_path(path);
+                                        break;
+                                }
+                        }
+                }
+        }
+}
+
+
+/******************************************************************************
+ * INTERFACE
+ ******************************************************************************/
+/**
+ * cache_init -- prepare the cache of the calling process
+ *  RET: the inotify descriptor for the event loop to poll, or -1
+ */
+int cache_init(void)
+{
+        enabled       = (conf.cache_kb > 0);
+        files_enabled = (conf.open_files > 0);
+
+        if (!enabled && !files_enabled && !conf.listing)
+                return -1;
+
+        if (fd_notify = inotify_init1(IN_NONBLOCK|IN_CLOEXEC), fd_notify < 0)
+                record(ERROR, NULL, "inotify_init1, checking files with stat()");
+
+        return fd_notify;
+}
+
+
+/**
+ * cache_get -- look up a file in the cache
+ * @path: path relative to the www root
+ * @enc : content coding wanted
+ *  RET: the entry, which the caller must cache_release(), or NULL
+ */
+struct entry_t *cache_get(const char *path, int enc)
+{
+        struct entry_t *e;
+
+        if (!enabled)
+                return NULL;
+
+        if (e = lookup(path, enc, hash(path)), e && fd_notify < 0 && stale(e)) {
+                cache_stats.invalidations++;
+                entry_drop(e);
+                e = NULL;
+        }
+
+        if (!e) {
+                cache_stats.misses++;
+                return NULL;
+        }
+
+        cache_stats.hits++;
+
+        lru_unlink(e);
+        lru_append(e);
+
+        e->refs++;
+        return e;
+}
+
+
+/**
+ * cache_put -- read an open file into the cache
+ * @path    : path relative to the www root
+ * @enc     : content coding of the file
+ * @file    : the file's name, if not path (a precompressed sibling)
+ * @fd      : the open file
+ * @st      : the file's status
+ * @filetype: MIME type of the (decoded) file
+ *  RET: the new entry, which the caller must cache_release(), or NULL if
+ *       the file can't or shouldn't be cached.
+ */
+struct entry_t *cache_put(const char *path, int enc, const char *file, int fd,
+                          struct stat *st, const char *filetype)
+{
+        struct entry_t *e;
+        ssize_t n;
+        size_t got;
+
+        if (!enabled || !S_ISREG(st->st_mode)
+        ||  st->st_size > (off_t)conf.cache_file_kb * 1024)
+                return NULL;
+
+        /* Only cache canonical paths, which inotify events can name */
+        if (!canonical(path))
+                return NULL;
+
+        if (fd_notify >= 0 && watch(path) < 0)
+                return NULL;
+
+        if (e = calloc(1, sizeof(*e)), !e)
+                return NULL;
+
+        e->enc   = enc;
+        e->blen  = st->st_size;
+        e->path  = strdup(path);
+        e->file  = file ? strdup(file) : NULL;
+        e->body  = malloc(e->blen ? e->blen : 1);
+        e->fsize = st->st_size;
+        e->dev   = st->st_dev;
+        e->ino   = st->st_ino;
+        e->mtime = st->st_mtim;
+        e->refs  = 1;
+
+        e->rep.type = filetype;
+
+        if (!e->path || (file && !e->file) || !e->body)
+                goto fail;
+
+        for (got = 0; got < e->blen; got += n) {
+                if (n = pread(fd, e->body + got, e->blen - got, got), n <= 0)
+                        goto fail;
+        }
+
+        if (insert(e) < 0)
+                goto fail;
+
+        return e;
+
+fail:
+        entry_free(e);
+        return NULL;
+}
+
+
+/**
+ * cache_store -- cache an encoded copy of a cached file
+ * @src : the identity entry it was made from
+ * @enc : its content coding
+ * @body: the encoded bytes (malloc()ed; the cache takes them)
+ * @blen: their length
+ */
+void cache_store(struct entry_t *src, int enc, char *body, size_t blen)
+{
+        struct entry_t *e;
+
+        if (e = calloc(1, sizeof(*e)), !e) {
+                free(body);
+                return;
+        }
+
+        e->enc   = enc;
+        e->body  = body;
+        e->blen  = blen;
+        e->path  = strdup(src->path);
+        e->fsize = src->fsize;
+        e->dev   = src->dev;
+        e->ino   = src->ino;
+        e->mtime = src->mtime;
+
+        e->rep.type = src->rep.type;
+
+        if (!e->path || insert(e) < 0)
+                entry_free(e);
+}
+
+
+/**
+ * cache_entry -- make an entry for a body made in memory, outside the cache
+ * @path : what it answers, relative to the www root
+ * @type : its MIME type
+ * @body : the bytes (malloc()ed; the entry takes them)
+ * @blen : their length
+ * @ino  : inode of what the body was made from
+ * @mtime:   and when that last changed
+ *  RET: the entry, which the caller must cache_release(), or NULL (and
+ *       the body is freed)
+ *
+ * Such an entry is never looked up; it lives as long as it is held.
+ */
+struct entry_t *cache_entry(const char *path, const char *type, char *body, size_t blen,
+                            ino_t ino, const struct timespec *mtime)
+{
+        char header[HEADER_SIZE];
+        struct entry_t *e;
+
+        if (e = calloc(1, sizeof(*e)), !e) {
+                free(body);
+                return NULL;
+        }
+
+        e->body  = body;
+        e->blen  = blen;
+        e->path  = strdup(path);
+        e->fsize = blen;
+        e->ino   = ino;
+        e->mtime = *mtime;
+        e->refs  = 1;
+        e->dead  = 1;
+
+        http_rep(&e->rep, type, blen, ENC_IDENTITY, ino, blen, mtime);
+
+        e->hlen   = http_header(header, sizeof(header), &e->rep);
+        e->header = malloc(e->hlen);
+
+        if (!e->path || !e->header) {
+                entry_free(e);
+                return NULL;
+        }
+
+        memcpy(e->header, header, e->hlen);
+
+        return e;
+}
+
+
+/**
+ * cache_release -- let go of an entry returned by cache_get() or cache_put()
+ * @e: the entry
+ */
+void cache_release(struct entry_t *e)
+{
+        if (--e->refs == 0 && e->dead)
+                entry_free(e);
+}
+
+
+/**
+ * file_open -- open a file and add it to the table, if it may be kept
+ * @name: path relative to the www root
+ * @h   : hash of the name
+ * @t   : the time now
+ *  RET: the file, open or with the errno of the failure, or NULL if out
+ *       of memory. One that is not kept is dead from the start.
+ */
+static struct file_t *file_open(const char *name, uint32_t h, time_t t)
+{
+        struct file_t *f;
+
+        if (f = calloc(1, sizeof(*f)), !f)
+                return NULL;
+
+        if (f->name = strdup(name), !f->name) {
+                free(f);
+                return NULL;
+        }
+
+        f->hash    = h;
+        f->expires = t + conf.open_files_ttl;
+
+        if (f->fd = root_open(name, O_RDONLY|O_CLOEXEC), f->fd < 0) {
+                f->err = errno;
+        } else if (fstat(f->fd, &f->st) < 0) {
+                f->err = errno;
+                close(f->fd);
+                f->fd = -1;
+        }
+
+        /* Only what an inotify event could name can be kept */
+        if (!files_enabled || !canonical(name) || (fd_notify >= 0 && watch(name) < 0)) {
+                f->dead = 1;
+                return f;
+        }
+
+        while (file_head && cache_stats.files >= (size_t)conf.open_files)
+                file_drop(file_head);
+
+        f->chain = file_buckets[h & (CACHE_BUCKETS-1)];
+        file_buckets[h & (CACHE_BUCKETS-1)] = f;
+        file_append(f);
+
+        cache_stats.files += 1;
+
+        return f;
+}
+
+
+/**
+ * file_get -- find a file already open, or open it
+ * @name: path relative to the www root
+ *  RET: the file, which the caller must file_release(); or NULL, with
+ *       errno set, if it can't be opened
+ */
+struct file_t *file_get(const char *name)
+{
+        struct file_t *f = NULL;
+        uint32_t h;
+        time_t t;
+
+        h = hash(name);
+        t = time(NULL);
+
+        if (files_enabled && (f = file_lookup(name, h), f)
+        && fd_notify < 0 && f->expires <= t) {
+                file_drop(f);
+                f = NULL;
+        }
+
+        if (f) {
+                cache_stats.file_hits++;
+                file_unlink(f);
+                file_append(f);
+        } else {
+                cache_stats.file_misses++;
+                if (f = file_open(name, h, t), !f)
+                        return NULL;
+        }
+
+        if (f->fd < 0) {
+                errno = f->err;
+                if (f->dead)
+                        file_free(f);
+                return NULL;
+        }
+
+        f->refs++;
+        return f;
+}
+
+
+/**
+ * file_release -- let go of a file returned by file_get()
+ * @f: the file
+ */
+void file_release(struct file_t *f)
+{
+        if (--f->refs == 0 && f->dead)
+                file_free(f);
+}
+
+
+/**
+ * file_map -- map the contents of a file, unless they are mapped already
+ * @f: the file
+ *  RET: the mapping, or NULL if the file can't be mapped (and is to be
+ *       sent with sendfile() instead)
+ *
+ * The kernel is told the mapping will be read from start to end, soon,
+ * so it reads ahead, and a large one may use transparent huge pages
+ * where the file system allows them.
+ */
+char *file_map(struct file_t *f)
+{
+        size_t len = f->st.st_size;
+        char *p;
+
+        if (f->map || !S_ISREG(f->st.st_mode) || len == 0)
+                return f->map;
+
+        if (p = mmap(NULL, len, PROT_READ, MAP_SHARED, f->fd, 0), p == MAP_FAILED)
+                return NULL;
+
+        madvise(p, len, MADV_SEQUENTIAL);
+        madvise(p, len, MADV_WILLNEED);
+        if (len >= HUGE_MAP)
+                madvise(p, len, MADV_HUGEPAGE);
+
+        f->map    = p;
+        f->maplen = len;
+
+        METRICS_ADD(maps, 1);
+        METRICS_ADD(mapped, len);
+
+        return p;
+}
+
+
+/**
+ * cache_watch -- have inotify report changes to a directory
+ * @dir: path relative to the www root, "." for the root
+ *  RET: 0 if they will be reported (see cache_notify()), else -1
+ */
+int cache_watch(const char *dir)
+{
+        char *copy;
+
+        if (fd_notify < 0 || !(copy = strdup(dir)))
+                return -1;
+
+        return watch_dir(copy);
+}
+
+
+/**
+ * cache_report -- write the cache counters to the log, every cache_stats
+ *                 seconds (never, if cache_stats is 0)
+ */
+void cache_report(void)
+{
+        static time_t next;
+        char message[512];
+        time_t t;
+
+        if ((!enabled && !files_enabled) || conf.cache_stats == 0)
+                return;
+
+        if (t = time(NULL), t < next)
+                return;
+
+        next = t + conf.cache_stats;
+
+        snprintf(message, sizeof(message),
+                 "cache: %lu hits %lu misses %lu stores %lu evictions "
+                 "%lu invalidations, %zu entries in %zu bytes; "
+                 "%lu open file hits %lu misses, %zu files",
+                 cache_stats.hits, cache_stats.misses, cache_stats.stores,
+                 cache_stats.evictions, cache_stats.invalidations,
+                 cache_stats.entries, cache_stats.bytes,
+                 cache_stats.file_hits, cache_stats.file_misses, cache_stats.files);
+
+        record(RESPONSE, NULL, message);
+}
@@ -0,0 +1,94 @@
+#ifndef __CACHE_H
+#define __CACHE_H
+
+#include <stdint.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "http.h"
+
+
+/* Hash buckets (a power of two) */
+#define CACHE_BUCKETS 4096
+
+
+/* A cached file, ready to be sent as-is */
+struct entry_t {
+        char *path;                  // Key: path relative to the www root
+        int enc;                     //   and content coding of the body
+        uint32_t hash;               // Hash of the path
+        struct rep_t rep;            // Type, validators etc. of the body
+        char *header;                // Pre-rendered status line and headers
+        size_t hlen;                 // Length of the header
+        char *body;                  // The file's contents
+        size_t blen;                 // Length of the body
+        size_t cost;                 // Bytes charged against the cache size
+        char *file;                  // File read, if not path (e.g. "x.css.gz")
+        off_t fsize;                 // Identity of the file when it was read,
+        dev_t dev;                   //   used to check it is still the same
+        ino_t ino;                   //   one when inotify is unavailable
+        struct timespec mtime;
+        unsigned probed;             // Codings known to have no sibling file,
+        unsigned pending;            //   being compressed, or not worth it
+        unsigned futile;             //   (ENC_BIT masks, identity entries only)
+        int refs;                    // Connections still sending it
+        int dead;                    // Out of the cache; free at refs == 0
+        struct entry_t *chain;       // Next entry in the hash bucket
+        struct entry_t *prev;        // LRU list, least recently used first
+        struct entry_t *next;
+};
+
+
+/* A file held open, and what fstat() said about it when it was opened */
+struct file_t {
+        char *name;                  // Key: path relative to the www root
+        uint32_t hash;               // Hash of the name
+        int fd;                      // The open file, or -1 if there is none
+        int err;                     //   and the errno of the failed open
+        struct stat st;              // The file's status
+        char *map;                   // Its contents, mapped (conf.mmap), or NULL
+        size_t maplen;               //   and the length of the mapping
+        time_t expires;              // When to look again, without inotify
+        int refs;                    // Connections still sending it
+        int dead;                    // Out of the table; close at refs == 0
+        struct file_t *chain;        // Next file in the hash bucket
+        struct file_t *prev;         // LRU list, least recently used first
+        struct file_t *next;
+};
+
+
+/* Counters, kept whether or not they are reported */
+struct cache_stats_t {
+        unsigned long hits;
+        unsigned long misses;
+        unsigned long stores;
+        unsigned long evictions;
+        unsigned long invalidations;
+        size_t bytes;
+        size_t entries;
+        unsigned long file_hits;     // Open files (and failures) found again
+        unsigned long file_misses;   //   and looked up in the file system
+        size_t files;
+};
+
+extern struct cache_stats_t cache_stats;
+
+
+/* Function prototypes */
+int cache_init(void);
+struct entry_t *cache_get(const char *path, int enc);
+struct entry_t *cache_put(const char *path, int enc, const char *file, int fd,
+                          struct stat *st, const char *filetype);
+void cache_store(struct entry_t *src, int enc, char *body, size_t blen);
+struct entry_t *cache_entry(const char *path, const char *type, char *body, size_t blen,
+                            ino_t ino, const struct timespec *mtime);
+void cache_release(struct entry_t *e);
+struct file_t *file_get(const char *name);
+void file_release(struct file_t *f);
+char *file_map(struct file_t *f);
+int cache_watch(const char *dir);
+void cache_notify(void);
+void cache_report(void);
+
+
+#endif
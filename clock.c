@@ -0,0 +1,88 @@
+/*
+ * clock.c -- the time of day, formatted at most once a second.
+ *
+ * Every request wants the time as text (the log line, the Date header),
+ * and it only changes once a second. Each process keeps the strings for
+ * the current second here; clock_tick() brings them up to date when the
+ * second has turned, and everything else reads them as they are.
+ *
+ * The event loop ticks the clock once per wakeup, which is cheap: a
+ * coarse clock_gettime() is answered by the vDSO without a system call.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "clock.h"
+
+
+/* strftime format strings */
+#define ISO_TIME        "%Y-%m-%d %H:%M:%S"
+#define COMMON_LOG_TIME "%d/%b/%Y:%H:%M:%S +0000"
+#define HTTP_TIME       "%a, %d %b %Y %H:%M:%S GMT"     // RFC 7231 IMF-fixdate
+
+
+static struct stamp_t stamp = { .sec = -1 };
+
+
+/**
+ * clock_tick -- reformat the cached strings if the second has changed
+ */
+void clock_tick(void)
+{
+        struct timespec ts;
+        char http[32];
+        struct tm tm;
+
+        clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+
+        if (ts.tv_sec == stamp.sec)
+                return;
+
+        stamp.sec = ts.tv_sec;
+        gmtime_r(&ts.tv_sec, &tm);
+
+        strftime(stamp.iso, ISO_LEN, ISO_TIME, &tm);
+        strftime(stamp.clf, CLF_LEN, COMMON_LOG_TIME, &tm);
+        strftime(http, sizeof(http), HTTP_TIME, &tm);
+
+        stamp.date_len = snprintf(stamp.date, DATE_LEN, "Date: %s\r\n", http);
+}
+
+
+/**
+ * clock_now -- the strings for the current second
+ *
+ * The first call ticks the clock; after that it is only as current as
+ * the last clock_tick().
+ */
+const struct stamp_t *clock_now(void)
+{
+        if (stamp.sec < 0)
+                clock_tick();
+
+        return &stamp;
+}
+
+
+/**
+ * clock_http -- format a time as an HTTP date (e.g. for Last-Modified)
+ * @buf: destination buffer
+ * @len: size of the destination buffer
+ * @t  : the time
+ *  RET: length of the formatted date
+ *
+ * A time in the current second is copied from the cache.
+ */
+size_t clock_http(char *buf, size_t len, time_t t)
+{
+        struct tm tm;
+
+        if (t == stamp.sec && len > stamp.date_len - 8) {
+                /* Strip "Date: " and the CRLF */
+                memcpy(buf, stamp.date + 6, stamp.date_len - 8);
+                buf[stamp.date_len - 8] = '\0';
+                return stamp.date_len - 8;
+        }
+
+        return strftime(buf, len, HTTP_TIME, gmtime_r(&t, &tm));
+}
@@ -0,0 +1,29 @@
+#ifndef __CLOCK_H
+#define __CLOCK_H
+
+#include <time.h>
+
+
+/* Sizes of the formatted strings, with their '\0' */
+#define ISO_LEN  24                  // 2024-05-01 12:00:00
+#define CLF_LEN  32                  // 01/May/2024:12:00:00 +0000
+#define DATE_LEN 48                  // Date: Wed, 01 May 2024 12:00:00 GMT\r\n
+
+
+/* The current second, formatted every way it is needed */
+struct stamp_t {
+        time_t sec;                  // The second they were made for
+        char iso[ISO_LEN];           // For the log
+        char clf[CLF_LEN];           // For the log, in Common Log Format
+        char date[DATE_LEN];         // A complete Date header line
+        size_t date_len;             // Length of the Date line
+};
+
+
+/* Function prototypes */
+void clock_tick(void);
+const struct stamp_t *clock_now(void);
+size_t clock_http(char *buf, size_t len, time_t t);
+
+
+#endif
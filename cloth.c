@@ -10,9 +10,24 @@
 #include <sys/socket.h>
 #include <sys/param.h>
 #include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/wait.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include "textutils.h"
+#include "parse.h"
+#include "http.h"
+#include "clock.h"
+#include "event.h"
+#include "admit.h"
+#include "bundle.h"
+#include "uring.h"
+#include "worker.h"
+#include "conf.h"
+#include "metrics.h"
+#include "root.h"
+#include "reload.h"
+#include "tls.h"
 #include "log.h"
 
 /*
@@ -25,12 +40,8 @@
 #endif
 
 
-/* For static buffers */
-#define BUFSIZE 8096
-
-
 /* Message printed on illegal argument usage. */
-#define HELP_MESSAGE "usage: cloth <PORT> <WWW-DIRECTORY>\n"
+#define HELP_MESSAGE "usage: cloth -p <PORT> -d <WWW-DIRECTORY> [-e epoll|uring|fork] [-w WORKERS] [-c CERT -k KEY] [-b BUNDLE] [-o NAME=VALUE]\n"
 
 
 /*
@@ -42,68 +53,40 @@ static const
 char *bad_dir[]={"/","/etc","/bin","/lib","/tmp","/usr","/dev","/sbin",NULL};
 
 
-/*
- * Supported filetypes and extensions. If an HTTP 
- * request asks for anything not on this list, the 
- * request will be greeted with an error message.
- */
-struct ext_t { char *ext; char *filetype; };
-struct ext_t supported_ext[]={ 
-        {"gif", "image/gif" },
-	{"jpg", "image/jpeg"}, 
-	{"jpeg","image/jpeg"},
-	{"png", "image/png" },  
-	{"zip", "image/zip" },  
-	{"gz",  "image/gz"  },  
-	{"tar", "image/tar" },  
-	{"htm", "text/html" },  
-	{"html","text/html" },  
-	{"css", "text/css"  },  
-	{0,0} 
-};
-
-
 /* Buffer to store argument to -d parameter. */
 char www_path[BUFSIZE];
 
 
+/* Children of the fork engine still serving, counted against max_conns */
+static volatile sig_atomic_t children;
+
+
 /****************************************************************************** 
  * HELPERS 
  * The main functions called by the child process when a request is made
  * on the socket being listened to by the server.
  ******************************************************************************/
-/** 
- * Work out the file type and check we support it 
- */
-inline char *get_file_extension(char *buf, size_t buflen)
-{
-        size_t len;
-        int i;
-
-	for (i=0; supported_ext[i].ext != NULL; i++) {
-		len = strlen(supported_ext[i].ext);
-		if (!strncmp(&buf[buflen-len], supported_ext[i].ext, len)) {
-			return supported_ext[i].filetype;
-		}
-	}
-        return NULL;
-}
-
-
 /**
- * copyaddr -- allocate and return a copy of a sockaddr_in structure
+ * send_metrics -- answer with every worker's counters
+ * @fd_socket: the socket
  */
-inline struct sockaddr_in *copyaddr(struct sockaddr_in *addr)
+static void send_metrics(int fd_socket)
 {
-        struct sockaddr_in *new;
+        static char body[METRICS_SIZE];
+        char header[HEADER_SIZE];
+        size_t blen;
+        int hlen;
 
-        new = calloc(1, sizeof(struct sockaddr_in));
+        blen = metrics_render(body, sizeof(body));
+        hlen = http_generated(header, HEADER_SIZE, "text/plain; version=0.0.4", blen);
 
-        new->sin_family = addr->sin_family;
-        new->sin_port   = addr->sin_port;
-        new->sin_addr   = addr->sin_addr;
+        hlen += snprintf(header+hlen, HEADER_SIZE-hlen, "%sConnection: close\r\n\r\n",
+                         clock_now()->date);
 
-        return new;
+        if (send(fd_socket, header, MIN(hlen, HEADER_SIZE-1), MSG_MORE) > 0)
+                METRICS_ADD(bytes, MIN(hlen, HEADER_SIZE-1));
+        if (send(fd_socket, body, blen, 0) > 0)
+                METRICS_ADD(bytes, blen);
 }
 
 
@@ -114,68 +97,89 @@ inline struct sockaddr_in *copyaddr(struct sockaddr_in *addr)
  ******************************************************************************/
 /**
  * web -- child web process that gets forked (so we can exit on error)
- * @fd : socket file descriptor 
- * @hit: request count 
+ * @fd    : socket file descriptor 
+ * @remote: the client's address
+ * @hit   : request count 
  */
-void web(int fd_socket, struct sockaddr_in *remote, int hit)
+void web(int fd_socket, const struct sockaddr_in *remote, int hit)
 {
         struct ses_t session;
 	static char request[BUFSIZE];
-        char *buf;
+        char header[HEADER_SIZE];
+        struct req_t req;
+        size_t nread;
+        char *why;
         int fd_file;
 	char *fstr;
+        int enc;
+        struct stat st;
+        struct rep_t rep;
+        struct range_t range[MAX_RANGES];
+        off_t offset;
+        off_t end;
+        uint64_t start;
         long ret;
+        int code;
+
+        memset(&session, 0, sizeof(session));
+        session.socket = fd_socket;
+
+        /* The clock was last read (if ever) by the parent */
+        clock_tick();
 
         /********************************************** 
          * Receive a new request                      *
          **********************************************/
-        /* Read the request from the socket into the buffer */
-	if (ret = read(fd_socket, request, BUFSIZE), ret <= 0 || ret >= BUFSIZE)
-		log(BAD_REQUEST, &session, "");
-
-        /* Nul-terminate the buffer. */
-	request[ret] = '\0'; 
+        /* Read from the socket until the request is complete, which must
+         * be within header_timeout (SIGALRM ends the process) */
+        parse_reset(&req);
+        alarm(conf.header_timeout);
 
-        /* Replace CR and/or NL with '*' delimiter */
-	for (buf = request; *buf; buf++) {
-		if (*buf=='\r' || *buf=='\n') 
-                        *buf = '*';
+        for (nread = 0; ; nread += ret) {
+                if (ret = parse_request(&req, request, nread), ret > 0)
+                        break;
+                if (ret < 0) {
+                        metrics_response(BAD_REQUEST, metrics_clock());
+                        log(BAD_REQUEST, &session, "Malformed request");
+                }
+                if (ret = read(fd_socket, request+nread, BUFSIZE-nread), ret <= 0)
+                        log(BAD_REQUEST, &session, "");
         }
 
-        sesinfo(&session, fd_socket, remote, request);
+        /* ...and a send may stall for send_timeout */
+        alarm(0);
+        setsockopt(fd_socket, SOL_SOCKET, SO_SNDTIMEO,
+                   &(struct timeval){ .tv_sec = conf.send_timeout }, sizeof(struct timeval));
+
+        start = metrics_clock();
+
+        sesinfo(&session, fd_socket, remote, &req);
 
 	log(ACCEPT, &session, "");
 
+        /* The counters are served from memory, not from the www root */
+        if (slice_is(&req.method, "GET") && slice_is(&req.target, METRICS_PATH)) {
+                log(RESPONSE, &session, "metrics");
+                send_metrics(fd_socket);
+                metrics_response(RESPONSE, start);
+                exit(1);
+        }
+
 
         /********************************************** 
          * Verify that the request is legal           *
          **********************************************/
-        /* Only the GET operation is allowed */
-	if (strncmp(request, "GET ", 4) && strncmp(request, "get ", 4))
-		log(BAD_METHOD, &session, "Only GET supported");
-
-        /* Truncate the request after the filename being requested */
-        for (buf=&request[4]; *buf; buf++) {
-                if (*buf == ' ') {*buf = '\0'; break;};
+        /* Check the request and open the file it names */
+        if (code = http_route(&req, &fstr, &enc, &fd_file, &why), code != RESPONSE) {
+                metrics_response(code, start);
+                log(code, &session, why);
         }
 
-        /* Catch any illegal relative pathnames (..) */
-        if (strstr(request, ".."))
-                log(BAD_REQUEST, &session, "Relative paths not supported");
-
-        /* In the absence of an explicit filename, default to index.html */
-        if (!strncmp(request, "GET /\0", 6) || !strncmp(request, "get /\0", 6))
-		strcpy(request, "GET /index.html");
+        /* Describe the file, for its validators and ranges */
+        if (fstat(fd_file, &st) < 0)
+                log(ERROR, &session, "failed to stat file");
 
-        /* Scan for filename extensions and check against valid ones. */
-        if (fstr = get_file_extension(request, strlen(request)), fstr == NULL)
-                log(NO_METHOD, &session, "file extension not supported");
-
-        /* Open the requested file */
-	if ((fd_file = open(&request[5], O_RDONLY)) == -1)
-		log(ERROR, &session, "failed to open file");
-
-	log(RESPONSE, &session, "");
+        http_rep(&rep, fstr, st.st_size, enc, st.st_ino, st.st_size, &st.st_mtim);
 
 
         /********************************************** 
@@ -183,20 +187,43 @@ void web(int fd_socket, struct sockaddr_in *remote, int hit)
          **********************************************/
         /* 
          * Format and print the HTTP response to the buffer, then write the 
-         * buffer contents to the socket.
+         * buffer contents to the socket. MSG_MORE holds the header back so
+         * it leaves in the same packet as the start of the body. Several
+         * ranges, or none that fit, get the whole file.
          */ 
-	sprintf(request, "HTTP/1.0 200 OK\r\nContent-Type: %s\r\n\r\n", fstr);
-	write(fd_socket, request, strlen(request));
+        offset = 0;
+        end    = st.st_size;
+
+        if (http_fresh(&req, &rep)) {
+                code = NOT_MODIFIED;
+                ret  = http_not_modified(header, HEADER_SIZE, &rep);
+                end  = 0;
+        } else if (http_ranges(&req, &rep, range) == 1) {
+                code   = PARTIAL;
+                ret    = http_partial(header, HEADER_SIZE, &rep, &range[0], NULL,
+                                      range[0].last - range[0].first + 1);
+                offset = range[0].first;
+                end    = range[0].last + 1;
+        } else {
+                code = RESPONSE;
+                ret  = http_header(header, HEADER_SIZE, &rep);
+        }
 
-	/* 
-         * Write the file to the socket in blocks of 8KB (last block may 
-         * be smaller) 
-         */
-	while ((ret = read(fd_file, request, BUFSIZE)) > 0) {
-		write(fd_socket, request, ret);
-	}
+	log(code, &session, "");
+
+        ret += snprintf(header+ret, HEADER_SIZE-ret, "%sConnection: close\r\n\r\n",
+                        clock_now()->date);
+	if (send(fd_socket, header, MIN(ret, HEADER_SIZE-1), (offset < end) ? MSG_MORE : 0) > 0)
+                METRICS_ADD(bytes, MIN(ret, HEADER_SIZE-1));
 
-        free(remote);
+	/* Send the file straight from the page cache */
+        while (offset < end) {
+                if (ret = send_file(fd_socket, fd_file, &offset, end), ret <= 0)
+                        break;
+                METRICS_ADD(bytes, ret);
+        }
+
+        metrics_response(code, start);
 
         #ifdef LINUX
 	sleep(1); // allow socket to drain
@@ -205,6 +232,60 @@ void web(int fd_socket, struct sockaddr_in *remote, int hit)
 }
 
 
+/**
+ * reap -- SIGCHLD handler for the fork engine: collect and count the dead
+ */
+static void reap(int sig)
+{
+        int saved = errno;
+
+        while (waitpid(-1, NULL, WNOHANG) > 0)
+                children--;
+
+        errno = saved;
+}
+
+
+/**
+ * listener -- create a socket listening on the given port
+ * @port     : the port number
+ * @reuseport: allow other sockets to bind the same port (SO_REUSEPORT)
+ */
+int listener(int port, int reuseport)
+{
+	struct sockaddr_in server_addr;
+        int fd_listen;
+        int on = 1;
+
+	memset(&server_addr, 0, sizeof(server_addr));
+	server_addr.sin_family      = AF_INET;
+	server_addr.sin_port        = htons(port);
+	server_addr.sin_addr.s_addr = htonl(INADDR_ANY);
+
+	/* Initialize the socket */
+	if ((fd_listen = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+                log(FATAL, NULL, "socket");
+
+        /* Don't let connections in TIME_WAIT block a restart */
+        setsockopt(fd_listen, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+        /* Let the kernel balance connections across the workers */
+        if (reuseport)
+                if (setsockopt(fd_listen, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0)
+                        log(FATAL, NULL, "SO_REUSEPORT");
+
+        /* Attempt to bind the server's address to the socket */
+	if (bind(fd_listen, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0)
+                log(FATAL, NULL, "bind");
+
+        /* Attempt to listen on the socket */
+	if (listen(fd_listen, conf.listen_backlog) < 0)
+                log(FATAL, NULL, "listen");
+
+        return fd_listen;
+}
+
+
 /**
  * cloth -- the main loop that establishes a socket and listens for requests
  * @www : the www directory to serve files from
@@ -213,65 +294,131 @@ void web(int fd_socket, struct sockaddr_in *remote, int hit)
 void cloth(int port)
 {
 	static struct sockaddr_in client_addr; 
-	static struct sockaddr_in server_addr;
 	socklen_t length;
+        struct sigaction sc = { .sa_handler = reap,
+                                .sa_flags   = SA_RESTART|SA_NOCLDSTOP };
+        sigset_t chld;
+        int fd_workers[MAX_WORKERS];
+        int fd_inherited[MAX_WORKERS];
+        int ninherited;
         int fd_socket;
         int fd_listen;
         int hit;
         int pid;
         int i;
+        int j;
 
         /********************************************** 
          * Prepare the process to run as a daemon     *
          **********************************************/
-        for (i=0; i<NOFILE; i++) /* Close files inherited from parent */
-                close(i);
+        ninherited = reload_inherited(fd_inherited, MAX_WORKERS);
+
+        for (i=0; i<NOFILE; i++) { /* Close files inherited from parent */
+                for (j=0; j<ninherited && fd_inherited[j] != i; j++)
+                        ;
+                if (j == ninherited) /* ...but the listening sockets */
+                        close(i);
+        }
 
         umask(0);                /* Reset file access creation mask */
 	signal(SIGCLD, SIG_IGN); /* Ignore child death */
 	signal(SIGHUP, SIG_IGN); /* Ignore terminal hangups */
+	signal(SIGPIPE, SIG_IGN);/* Writes to closed sockets fail with EPIPE */
 	setpgrp();               /* Create new process group */
+        reload_signals();        /* SIGUSR2 reloads, SIGQUIT drains */
+        log_open();              /* Reopened on SIGHUP */
+        metrics_init(conf.workers > 0 ? conf.workers : 1);
+
+        /* Files are only ever opened beneath the www root (the cwd) */
+        if (root_init(".") < 0)
+                log(FATAL, NULL, "failed to open the www directory");
 
         /*log(INFO, 0, "cloth is starting up...", "", getpid());*/
 
+        /**********************************************
+         * One socket and event loop per worker       *
+         **********************************************/
+        if (conf.workers > 0) {
+                for (i=0; i<conf.workers; i++)
+                        fd_workers[i] = (i < ninherited) ? fd_inherited[i] : listener(port, 1);
+                for (; i<ninherited; i++)
+                        close(fd_inherited[i]);
+
+                reload_ready(); /* the previous generation can drain */
+                workers(fd_workers, conf.workers); /* never returns */
+        }
+
         /**********************************************
          * Establish the server side of the socket    *
+         * (or take over the previous generation's)   *
          **********************************************/
-	server_addr.sin_family      = AF_INET;
-	server_addr.sin_port        = htons(port);
-	server_addr.sin_addr.s_addr = htonl(INADDR_ANY);
+        fd_listen = ninherited ? fd_inherited[0] : listener(port, 0);
+        for (i=1; i<ninherited; i++)
+                close(fd_inherited[i]);
 
-	/* Initialize the socket */
-	if ((fd_listen = socket(AF_INET, SOCK_STREAM, 0)) < 0)
-                log(FATAL, NULL, "socket");
+        reload_ready();
 
-        /* Attempt to bind the server's address to the socket */
-	if (bind(fd_listen, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0)
-                log(FATAL, NULL, "bind");
 
-        /* Attempt to listen on the socket */
-	if (listen(fd_listen, 64) < 0)
-                log(FATAL, NULL, "listen");
+        /**********************************************
+         * Serve every connection from this process   *
+         **********************************************/
+        if (conf.engine == ENGINE_URING)
+                engine_uring(fd_listen); /* returns if io_uring is unavailable */
+        if (conf.engine != ENGINE_FORK)
+                engine_epoll(fd_listen); /* never returns */
 
 
         /**********************************************
-         * Loop forever, listening on the socket      *
+         * Loop forever, forking for each connection  *
+         * (the legacy model, kept for comparison)    *
          **********************************************/
+        /* Children are counted as they exit, instead of ignored */
+        sigemptyset(&chld);
+        sigaddset(&chld, SIGCHLD);
+        sigaction(SIGCHLD, &sc, NULL);
+
 	for (hit=1; ; hit++) {
 		length = sizeof(client_addr);
 
                 /* Attempt to accept on socket */
-		if ((fd_socket = accept(fd_listen, (struct sockaddr *)&client_addr, &length)) < 0)
-                        log(FATAL, NULL, "accept");
+		if ((fd_socket = accept(fd_listen, (struct sockaddr *)&client_addr, &length)) < 0) {
+                        if (errno != EINTR)
+                                log(FATAL, NULL, "accept");
+                        if (reloading && !draining)
+                                reload_exec(&fd_listen, 1);
+                        reloading = 0;
+                        if (draining) /* every child finishes on its own */
+                                exit(0);
+                        continue;
+                }
+
+                METRICS_ADD(accepted, 1);
 
-                /* Fork a new process to handle the request */
-		if ((pid = fork()) < 0)
-                        log(FATAL, NULL, "fork");
+                /* One process per connection: at the cap, a 503 instead */
+                if (conf.max_conns && children >= conf.max_conns) {
+                        admit_refuse(fd_socket);
+                        continue;
+                }
+
+                /* Fork a new process to handle the request (and count it
+                 * before reap() can see it exit) */
+                sigprocmask(SIG_BLOCK, &chld, NULL);
+
+		if ((pid = fork()) < 0) {
+                        sigprocmask(SIG_UNBLOCK, &chld, NULL);
+                        record(ERROR, NULL, "fork");
+                        admit_refuse(fd_socket);
+                        continue;
+                }
+                if (pid > 0)
+                        children++;
+
+                sigprocmask(SIG_UNBLOCK, &chld, NULL);
 
                 /* Child */
                 if (pid == 0) {
                         close(fd_listen);
-                        web(fd_socket, copyaddr(&client_addr), hit); /* never returns */
+                        web(fd_socket, &client_addr, hit); /* never returns; the child has its own copy of client_addr */
                 /* Parent */
                 } else { 
                         close(fd_socket);
@@ -293,14 +440,20 @@ int main(int argc, char **argv)
 {
         #define DEFAULT_PORT 55555
         #define MAX_PORT     60000
+        char *bundle = NULL;
+        char *cert = NULL;
+        char *key = NULL;
         int port;
         int ch;
         int i;
 
         port = DEFAULT_PORT; 
 
+        /* Remembered so SIGUSR2 can start this binary over */
+        reload_init(argv);
+
         /* Check that all required arguments have been supplied */
-        while ((ch = getopt(argc, argv, "p:d:?")) != -1) {
+        while ((ch = getopt(argc, argv, "p:d:e:w:c:k:b:o:?")) != -1) {
                 switch (ch) {
                 case 'p':
                         port = atoi(optarg);
@@ -308,8 +461,40 @@ int main(int argc, char **argv)
                 case 'd':
                         sprintf(www_path, "%s", optarg);
                         break;
+                case 'e':
+                        if (!strcmp(optarg, "epoll"))
+                                conf.engine = ENGINE_EPOLL;
+                        else if (!strcmp(optarg, "uring"))
+                                conf.engine = ENGINE_URING;
+                        else if (!strcmp(optarg, "fork"))
+                                conf.engine = ENGINE_FORK;
+                        else {
+                                printf("%s", HELP_MESSAGE);
+                                exit(1);
+                        }
+                        break;
+                case 'w':
+                        conf.workers = atoi(optarg);
+                        break;
+                case 'c':
+                        cert = optarg;
+                        break;
+                case 'k':
+                        key = optarg;
+                        break;
+                case 'b':
+                        bundle = optarg;
+                        break;
+                case 'o':
+                        if (conf_set(optarg) < 0) {
+                                printf("ERROR: Bad tunable %s\n", optarg);
+                                conf_help();
+                                exit(1);
+                        }
+                        break;
                 case '?':
                         printf("%s", HELP_MESSAGE);
+                        conf_help();
                         exit(1);
                 default:
                         printf("%s", HELP_MESSAGE);
@@ -325,6 +510,33 @@ int main(int argc, char **argv)
                 }
         }
 
+        /* Workers each run an event loop, so they need an event engine */
+        if (conf.workers < 0 || conf.workers > MAX_WORKERS
+        || (conf.workers > 0 && conf.engine == ENGINE_FORK)) {
+                printf("ERROR: -w takes 1-%d workers with -e epoll or uring\n", MAX_WORKERS);
+                exit(3);
+        }
+
+        /* TLS is terminated by the epoll engine, with both halves of a pair */
+        if ((cert || key) && (!cert || !key || conf.engine != ENGINE_EPOLL)) {
+                printf("ERROR: TLS takes both -c and -k, with -e epoll\n");
+                exit(3);
+        }
+        if (cert && tls_init(cert, key) < 0) {
+                printf("ERROR: Can't load the certificate %s or key %s\n", cert, key);
+                exit(3);
+        }
+
+        /* A bundle is mapped once, and shared by every worker */
+        if (bundle && conf.engine == ENGINE_FORK) {
+                printf("ERROR: -b takes -e epoll or uring\n");
+                exit(3);
+        }
+        if (bundle && bundle_open(bundle) < 0) {
+                printf("ERROR: Can't load the bundle %s\n", bundle);
+                exit(3);
+        }
+
         /* Change working directory to the one provided by the caller */
 	if (chdir(www_path) == -1) { 
 		printf("ERROR: Can't change to directory %s\n", www_path);
@@ -0,0 +1,248 @@
+/*
+ * compress.c -- encode cached files with gzip and brotli, off the loop.
+ *
+ * When a client accepts a coding the cache doesn't have for a file, the
+ * identity copy is sent at once and the file is queued here. A thread of
+ * the worker's own encodes it from the copy already in memory and hands
+ * the result back through an eventfd that the event loop polls; the loop
+ * then stores it in the cache, and later requests get the encoded copy.
+ * The loop itself never compresses anything.
+ *
+ * Everything the two threads share is behind one mutex: the loop keeps
+ * a reference to the source entry for as long as a job is queued, and
+ * only the loop ever touches the cache.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <zlib.h>
+#include <brotli/encode.h>
+#include "compress.h"
+#include "http.h"
+#include "conf.h"
+
+
+/* A file to encode, and then the result */
+struct job_t {
+        struct entry_t *src;         // Identity entry (referenced)
+        int enc;                     // Coding wanted
+        char *out;                   // Encoded bytes, or NULL if it failed
+        size_t outlen;
+        struct job_t *next;
+};
+
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  work = PTHREAD_COND_INITIALIZER;
+static struct job_t *todo;           // Jobs for the thread, newest first
+static struct job_t *done;           // Jobs for the loop, in any order
+static int fd_done = -1;             // eventfd: done is not empty
+static int running;
+
+
+/**
+ * gzip -- compress a buffer into the gzip format
+ *  RET: 0 on success, else -1
+ */
+static int gzip(const char *in, size_t len, char **out, size_t *outlen)
+{
+        z_stream z = { 0 };
+        size_t room;
+
+        if (deflateInit2(&z, conf.gzip_level, Z_DEFLATED, 15 + 16, 8,
+                         Z_DEFAULT_STRATEGY) != Z_OK)
+                return -1;
+
+        room = deflateBound(&z, len);
+
+        if (*out = malloc(room), !*out) {
+                deflateEnd(&z);
+                return -1;
+        }
+
+        z.next_in   = (unsigned char *)in;
+        z.avail_in  = len;
+        z.next_out  = (unsigned char *)*out;
+        z.avail_out = room;
+
+        if (deflate(&z, Z_FINISH) != Z_STREAM_END) {
+                deflateEnd(&z);
+                free(*out);
+                return -1;
+        }
+
+        *outlen = z.total_out;
+        deflateEnd(&z);
+
+        return 0;
+}
+
+
+/**
+ * brotli -- compress a buffer into the brotli format
+ *  RET: 0 on success, else -1
+ */
+static int brotli(const char *in, size_t len, char **out, size_t *outlen)
+{
+        *outlen = BrotliEncoderMaxCompressedSize(len);
+
+        if (*out = malloc(*outlen ? *outlen : len + 1024), !*out)
+                return -1;
+
+        if (!BrotliEncoderCompress(conf.brotli_level, BROTLI_DEFAULT_WINDOW,
+                                   BROTLI_MODE_TEXT, len, (uint8_t *)in,
+                                   outlen, (uint8_t *)*out)) {
+                free(*out);
+                return -1;
+        }
+
+        return 0;
+}
+
+
+/**
+ * compressor -- body of the compression thread
+ */
+static void *compressor(void *arg)
+{
+        struct job_t *job;
+        uint64_t one = 1;
+        int ret;
+
+        for (;;) {
+                pthread_mutex_lock(&lock);
+                while (!todo)
+                        pthread_cond_wait(&work, &lock);
+                job  = todo;
+                todo = job->next;
+                pthread_mutex_unlock(&lock);
+
+                /* The source body never changes while it is referenced */
+                if (job->enc == ENC_BR)
+                        ret = brotli(job->src->body, job->src->blen, &job->out, &job->outlen);
+                else
+                        ret = gzip(job->src->body, job->src->blen, &job->out, &job->outlen);
+
+                if (ret < 0)
+                        job->out = NULL;
+
+                pthread_mutex_lock(&lock);
+                job->next = done;
+                done      = job;
+                pthread_mutex_unlock(&lock);
+
+                write(fd_done, &one, sizeof(one));
+        }
+
+        return NULL;
+}
+
+
+/**
+ * compress_init -- start the compression thread of the calling process
+ *  RET: the descriptor for the event loop to poll, or -1 if compression
+ *       is off or unavailable
+ */
+int compress_init(void)
+{
+        pthread_t thread;
+        sigset_t all;
+        sigset_t old;
+
+        if (!conf.compress || conf.cache_kb == 0)
+                return -1;
+
+        if (fd_done = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC), fd_done < 0)
+                return -1;
+
+        /* Signals are for the event loop */
+        sigfillset(&all);
+        pthread_sigmask(SIG_SETMASK, &all, &old);
+
+        if (pthread_create(&thread, NULL, compressor, NULL) == 0) {
+                pthread_detach(thread);
+                running = 1;
+        } else {
+                close(fd_done);
+                fd_done = -1;
+        }
+
+        pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+        return fd_done;
+}
+
+
+/**
+ * compress_request -- have a cached file encoded, unless it already is
+ * @e  : the identity entry
+ * @enc: the coding wanted
+ */
+void compress_request(struct entry_t *e, int enc)
+{
+        struct job_t *job;
+
+        if (!running || (e->pending | e->futile) & ENC_BIT(enc))
+                return;
+
+        if (e->blen < COMPRESS_MIN) {
+                e->futile |= ENC_BIT(enc);
+                return;
+        }
+
+        if (job = calloc(1, sizeof(*job)), !job)
+                return;
+
+        job->src = e;
+        job->enc = enc;
+
+        e->refs++;
+        e->pending |= ENC_BIT(enc);
+
+        pthread_mutex_lock(&lock);
+        job->next = todo;
+        todo      = job;
+        pthread_cond_signal(&work);
+        pthread_mutex_unlock(&lock);
+}
+
+
+/**
+ * compress_done -- cache whatever the thread has finished encoding
+ *
+ * Called by the event loop when the eventfd is readable.
+ */
+void compress_done(void)
+{
+        struct job_t *job;
+        struct job_t *next;
+        uint64_t count;
+
+        read(fd_done, &count, sizeof(count));
+
+        pthread_mutex_lock(&lock);
+        job  = done;
+        done = NULL;
+        pthread_mutex_unlock(&lock);
+
+        for (; job; job = next) {
+                next = job->next;
+
+                job->src->pending &= ~ENC_BIT(job->enc);
+
+                /* Keep it only if the file is unchanged and it paid off */
+                if (!job->out || job->src->dead || job->outlen >= job->src->blen * 9 / 10) {
+                        job->src->futile |= ENC_BIT(job->enc);
+                        free(job->out);
+                } else {
+                        cache_store(job->src, job->enc, job->out, job->outlen);
+                }
+
+                cache_release(job->src);
+                free(job);
+        }
+}
@@ -0,0 +1,17 @@
+#ifndef __COMPRESS_H
+#define __COMPRESS_H
+
+#include "cache.h"
+
+
+/* Smallest body worth compressing */
+#define COMPRESS_MIN 256
+
+
+/* Function prototypes */
+int compress_init(void);
+void compress_request(struct entry_t *e, int enc);
+void compress_done(void);
+
+
+#endif
@@ -0,0 +1,136 @@
+/*
+ * conf.c -- run-time configuration.
+ *
+ * The common settings have their own command line flags (see main()).
+ * Everything else is a named integer tunable, set with -o name=value;
+ * adding one is a matter of adding a member to struct conf_t and a line
+ * to the table below.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "conf.h"
+
+
+/* Defaults */
+struct conf_t conf = {
+        .engine             = ENGINE_EPOLL,
+        .workers            = 0,
+        .keepalive_timeout  = 5,
+        .header_timeout     = 10,
+        .send_timeout       = 30,
+        .keepalive_requests = 100,
+        .drain_timeout      = 30,
+        .max_conns          = 8192,
+        .max_conns_per_ip   = 0,
+        .listen_backlog     = 511,
+        .retry_after        = 1,
+        .pool_kb            = 16384,
+        .cache_kb           = 65536,
+        .cache_file_kb      = 256,
+        .cache_stats        = 0,
+        .open_files         = 256,
+        .open_files_ttl     = 2,
+        .listing            = 0,
+        .listing_page       = 1000,
+        .listing_dirs       = 32,
+        .mmap               = 0,
+        .zerocopy           = 0,
+        .ktls               = 1,
+        .tls_sessions       = 20480,
+        .http2              = 1,
+        .h2_streams         = 100,
+        .log_ring_kb        = 1024,
+        .log_flush_ms       = 100,
+        .log_block          = 0,
+        .log_clf            = 0,
+        .compress           = 1,
+        .gzip_level         = 6,
+        .brotli_level       = 9,
+};
+
+
+/* Tunables accepted by -o */
+struct tunable_t { const char *name; int *value; const char *help; };
+static struct tunable_t tunables[]={
+        { "keepalive_timeout",  &conf.keepalive_timeout,  "seconds an idle connection is kept open" },
+        { "header_timeout",     &conf.header_timeout,     "seconds to receive a request in"         },
+        { "send_timeout",       &conf.send_timeout,       "seconds a response may stall"            },
+        { "keepalive_requests", &conf.keepalive_requests, "requests served over one connection"     },
+        { "drain_timeout",      &conf.drain_timeout,      "seconds to finish responses on SIGQUIT"  },
+        { "max_conns",          &conf.max_conns,          "connections open at once (0: no limit)"  },
+        { "max_conns_per_ip",   &conf.max_conns_per_ip,   "of them from one address (0: no limit)"  },
+        { "listen_backlog",     &conf.listen_backlog,     "connections queued before accept()"      },
+        { "retry_after",        &conf.retry_after,        "seconds a refused client is told to wait"},
+        { "pool_kb",            &conf.pool_kb,            "KB of spare conn buffers kept per worker"},
+        { "cache_kb",           &conf.cache_kb,           "KB of files cached per worker (0: off)"  },
+        { "cache_file_kb",      &conf.cache_file_kb,      "largest file cached, in KB"              },
+        { "cache_stats",        &conf.cache_stats,        "seconds between cache reports (0: off)"  },
+        { "open_files",         &conf.open_files,         "files kept open per worker (0: off)"     },
+        { "open_files_ttl",     &conf.open_files_ttl,     "seconds they are trusted w/o inotify"    },
+        { "listing",            &conf.listing,            "list dirs without index.html (0: off)"   },
+        { "listing_page",       &conf.listing_page,       "entries per page of a listing (0: all)"  },
+        { "listing_dirs",       &conf.listing_dirs,       "directory listings kept per worker"      },
+        { "mmap",               &conf.mmap,               "send them from a mapping (0: sendfile)"  },
+        { "zerocopy",           &conf.zerocopy,           "and with MSG_ZEROCOPY (0: off)"          },
+        { "ktls",               &conf.ktls,               "seal TLS records in the kernel (0: off)" },
+        { "tls_sessions",       &conf.tls_sessions,       "TLS sessions cached for resumption"      },
+        { "http2",              &conf.http2,              "speak HTTP/2, h2 and h2c (0: off)"       },
+        { "h2_streams",         &conf.h2_streams,         "HTTP/2 streams open at once, per conn"   },
+        { "log_ring_kb",        &conf.log_ring_kb,        "KB of log lines buffered per worker"     },
+        { "log_flush_ms",       &conf.log_flush_ms,       "milliseconds between log writes"         },
+        { "log_block",          &conf.log_block,          "wait for room in a full log (0: drop)"   },
+        { "log_clf",            &conf.log_clf,            "log times as 01/May/2024:12:00:00 +0000" },
+        { "compress",           &conf.compress,           "gzip/brotli cached text (0: off)"        },
+        { "gzip_level",         &conf.gzip_level,         "gzip compression level, 1-9"             },
+        { "brotli_level",       &conf.brotli_level,       "brotli compression quality, 0-11"        },
+        { NULL, NULL, NULL }
+};
+
+
+/**
+ * conf_set -- apply a "name=value" tunable
+ * @option: the argument to -o
+ *  RET: 0 on success, -1 for an unknown name or a malformed value
+ */
+int conf_set(const char *option)
+{
+        const char *value;
+        size_t len;
+        char *end;
+        long n;
+        int i;
+
+        if (value = strchr(option, '='), !value)
+                return -1;
+
+        len = value++ - option;
+
+        if (n = strtol(value, &end, 10), *value == '\0' || *end != '\0' || n < 0)
+                return -1;
+
+        for (i=0; tunables[i].name != NULL; i++) {
+                if (strlen(tunables[i].name) == len
+                && !strncmp(tunables[i].name, option, len)) {
+                        *tunables[i].value = (int)n;
+                        return 0;
+                }
+        }
+        return -1;
+}
+
+
+/**
+ * conf_help -- list the tunables and their current values on stdout
+ */
+void conf_help(void)
+{
+        int i;
+
+        printf("tunables (-o name=value):\n");
+
+        for (i=0; tunables[i].name != NULL; i++) {
+                printf("  %-22s %-10d %s\n", tunables[i].name,
+                       *tunables[i].value, tunables[i].help);
+        }
+}
@@ -0,0 +1,55 @@
+#ifndef __CONF_H
+#define __CONF_H
+
+
+/* Connection engines, selected with -e */
+enum engines { ENGINE_EPOLL, ENGINE_FORK, ENGINE_URING };
+
+
+/* Run-time configuration, filled in by main() */
+struct conf_t {
+        int engine;                  // How connections are served
+        int workers;                 // Event loops to run (0: no master)
+        int keepalive_timeout;       // Seconds an idle connection is kept
+        int header_timeout;          // Seconds to receive a request in
+        int send_timeout;            // Seconds a response may make no progress
+        int keepalive_requests;      // Requests served per connection
+        int drain_timeout;           // Seconds a draining worker waits
+        int max_conns;               // Connections open at once (0: no cap)
+        int max_conns_per_ip;        //   of them from one address (0: no cap)
+        int listen_backlog;          // Queue length passed to listen()
+        int retry_after;             // Retry-After sent with a 503
+        int pool_kb;                 // Free buffers each worker keeps ready
+        int cache_kb;                // Size of each worker's file cache
+        int cache_file_kb;           // Largest file that will be cached
+        int cache_stats;             // Seconds between cache reports (0: off)
+        int open_files;              // Files each worker keeps open
+        int open_files_ttl;          // Seconds they are trusted without inotify
+        int listing;                 // List directories without index.html
+        int listing_page;            //   this many entries a page (0: one page)
+        int listing_dirs;            //   keeping this many listings per worker
+        int mmap;                    // Send open files from a mapping
+        int zerocopy;                //   with MSG_ZEROCOPY (epoll only)
+        int ktls;                    // Hand TLS records to the kernel
+        int tls_sessions;            // TLS sessions cached per worker
+        int http2;                   // Speak HTTP/2 (epoll only)
+        int h2_streams;              //   with this many streams at once
+        int log_ring_kb;             // Size of each worker's log ring
+        int log_flush_ms;            // Interval between log flushes
+        int log_block;               // Wait for room in a full ring (0: drop)
+        int log_clf;                 // Log times in Common Log Format
+        int compress;                // Compress cached text (0: off)
+        int gzip_level;              // zlib level, 1-9
+        int brotli_level;            // brotli quality, 0-11
+};
+
+
+extern struct conf_t conf;
+
+
+/* Function prototypes */
+int conf_set(const char *option);
+void conf_help(void);
+
+
+#endif
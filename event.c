@@ -0,0 +1,1427 @@
+/*
+ * event.c -- serve many connections from one process with epoll.
+ *
+ * Every socket is non-blocking and registered edge-triggered for both
+ * reading and writing, once, when it is accepted. Each connection then
+ * steps through a small state machine:
+ *
+ *      CONN_HANDSHAKE - agree on the keys of a TLS session, if any
+ *      CONN_READ      - collect the request until a blank line is seen
+ *      CONN_WRITE     - send the response: headers and cached bodies with
+ *                       sendmsg(), files with sendfile() from the page cache
+ *      CONN_DONE      - the response is out; close, or wait for the next one
+ *      CONN_H2        - speak HTTP/2, many requests at once (see h2.c)
+ *      CONN_CLOSE     - tear the connection down
+ *
+ * A state only advances when the socket will take (or give) no more
+ * bytes, so a slow client never holds up the others.
+ *
+ * Connections are HTTP/1.1 persistent. Requests are parsed in place as
+ * their bytes arrive (see parse.c); those that arrive pipelined are
+ * answered in order, straight from the receive buffer.
+ *
+ * A slow client can't hold a connection open for long, though: each has
+ * a deadline in a timer wheel (see wheel.c), moved whenever it makes
+ * progress, by which its request must arrive or its response be taken.
+ *
+ * A response is a list of pieces, each either in memory or a range of
+ * the file, so a multipart range response is as zero-copy as a whole
+ * file. What a request needs to allocate (its log lines, the response
+ * header, the list of pieces) comes from the connection's arena, which
+ * is emptied in one step when the response is done: a steady stream of
+ * requests never calls malloc().
+ *
+ * Connections, and the buffers they read requests into, come from pools
+ * of their own (see pool.c). A connection only holds a buffer (with the
+ * memory of its arena) while a request is arriving or being answered, so
+ * one that is idle between requests costs a few hundred bytes.
+ *
+ * With mmap=1, a file's range is a piece in memory like any other, from
+ * the file's shared mapping (see file_map()), and goes out gathered with
+ * the headers. With zerocopy=1 as well, large runs of it are sent with
+ * MSG_ZEROCOPY, and the kernel's notifications that they are done are
+ * taken off the socket's error queue as they come.
+ *
+ * Over TLS (see tls.c), a connection whose records the kernel seals is
+ * written to as if it were plaintext, so only its reads differ; any
+ * other is written through OpenSSL, a record at a time.
+ *
+ * A connection turns to HTTP/2 when it opens with the HTTP/2 preface,
+ * asks to be upgraded to h2c, or chose h2 during the TLS handshake, and
+ * stays in CONN_H2 from then on.
+ *
+ * The connections and their states are shared with uring.c, which drives
+ * them from io_uring completions instead; what it needs is exported.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <linux/errqueue.h>
+#include "event.h"
+#include "admit.h"
+#include "bundle.h"
+#include "clock.h"
+#include "compress.h"
+#include "conf.h"
+#include "listing.h"
+#include "metrics.h"
+#include "pool.h"
+#include "reload.h"
+
+
+static int epfd;
+
+
+/* HTTP/2 is spoken (by this engine; uring.c shares conn_parse()) */
+static int http2;
+
+
+/* Smallest run of a mapped file worth sending with MSG_ZEROCOPY */
+#define ZEROCOPY_MIN 16384
+
+
+/* epoll tags for the file cache's inotify and compressor descriptors */
+static int notify_tag;
+static int compress_tag;
+
+
+/* The Date and Connection headers close every response header */
+static const char *CONNECTION[]={ "Connection: close\r\n\r\n",
+                                  "Connection: keep-alive\r\n\r\n" };
+
+
+/* Every connection, for draining */
+static struct conn_t *conns;
+
+
+/* Where connections and their buffers come from */
+static struct pool_t conn_pool = POOL_INIT(sizeof(struct conn_t));
+static struct pool_t buf_pool  = POOL_INIT(sizeof(struct connbuf_t));
+
+
+/******************************************************************************
+ * CONNECTIONS
+ * Creation and destruction of per-connection state.
+ ******************************************************************************/
+/**
+ * conn_open -- allocate the state for a freshly accepted socket
+ * @fd    : the accepted (non-blocking) socket
+ * @remote: address of the remote host
+ */
+struct conn_t *conn_open(int fd, struct sockaddr_in *remote)
+{
+        struct conn_t *c;
+
+        if (c = pool_get(&conn_pool), !c)
+                return NULL;
+
+        memset(c, 0, sizeof(*c));
+
+        c->fd      = fd;
+        c->state   = CONN_READ;
+        c->remote  = *remote;
+        c->pipe[0] = c->pipe[1] = -1;
+
+        /* Until it is given a buffer, whatever it allocates is malloc()ed */
+        arena_init(&c->arena, NULL, 0);
+        c->session.arena = &c->arena;
+
+        /* Over TLS, a handshake comes first (within the same time) */
+        if (tls_ctx) {
+                if (c->ssl = tls_open(fd), !c->ssl) {
+                        pool_put(&conn_pool, c);
+                        return NULL;
+                }
+                c->state = CONN_HANDSHAKE;
+        }
+
+        /* The first request must be complete in header_timeout */
+        conn_timeout(c, conf.header_timeout);
+
+        c->next = conns;
+        if (conns)
+                conns->prev = c;
+        conns = c;
+
+        METRICS_ADD(accepted, 1);
+        METRICS_ADD(active, 1);
+
+        return c;
+}
+
+
+/**
+ * conn_close -- release a connection and everything it holds
+ * @c: the connection (freed on return, unless operations on it are in
+ *     flight; the engine then calls this again when the last is done)
+ */
+void conn_close(struct conn_t *c)
+{
+        if (!c->closing) {
+                c->closing = 1;
+                wheel_cancel(&c->timeout);
+
+                if (c->prev) c->prev->next = c->next; else conns = c->next;
+                if (c->next) c->next->prev = c->prev;
+        }
+
+        /* Shutting the socket down makes them finish, and soon */
+        if (c->inflight > 0) {
+                shutdown(c->fd, SHUT_RDWR);
+                return;
+        }
+
+        if (c->file)
+                file_release(c->file);
+        if (c->entry)
+                cache_release(c->entry);
+
+        if (c->pipe[0] >= 0) {
+                close(c->pipe[0]);
+                close(c->pipe[1]);
+        }
+
+        if (c->h2)
+                h2_free(c);
+        if (c->ssl)
+                tls_close(c->ssl);
+
+        close(c->fd); /* also removes it from the epoll set */
+        admit_release(&c->remote);
+        conn_unbuffer(c);
+        arena_reset(&c->arena);
+        pool_put(&conn_pool, c);
+
+        METRICS_ADD(active, -1);
+}
+
+
+/**
+ * conn_buffer -- give a connection a buffer to read a request into
+ * @c: the connection
+ *  RET: 0 on success (or if it has one), else -1
+ *
+ * The arena is moved into the buffer's scratch memory, so nothing must
+ * be allocated from it yet.
+ */
+int conn_buffer(struct conn_t *c)
+{
+        if (c->buf)
+                return 0;
+
+        if (c->buf = pool_get(&buf_pool), !c->buf) {
+                record(ERROR, NULL, "out of memory for a request buffer");
+                return -1;
+        }
+
+        arena_reset(&c->arena);
+        arena_init(&c->arena, c->buf->scratch, sizeof(c->buf->scratch));
+
+        parse_reset(&c->buf->req);
+
+        METRICS_ADD(buffers, 1);
+
+        return 0;
+}
+
+
+/**
+ * conn_unbuffer -- give a connection's buffer back, once it is idle
+ * @c: the connection, with no bytes of a request received (or none that
+ *     are still needed) and nothing allocated from its arena
+ */
+void conn_unbuffer(struct conn_t *c)
+{
+        if (!c->buf)
+                return;
+
+        arena_reset(&c->arena);
+        arena_init(&c->arena, NULL, 0);
+
+        pool_put(&buf_pool, c->buf);
+
+        c->buf    = NULL;
+        c->nread  = 0;
+        c->reqlen = 0;
+
+        METRICS_ADD(buffers, -1);
+}
+
+
+/**
+ * conn_timeout -- give a connection until some seconds from now
+ * @c   : the connection
+ * @secs: the seconds
+ *
+ * Called whenever it moves along, so it is only ever closed for time
+ * spent stuck in one place: waiting for the rest of a request (for
+ * header_timeout), for the client to take more of the response (for
+ * send_timeout), or for its next request (for keepalive_timeout).
+ */
+void conn_timeout(struct conn_t *c, int secs)
+{
+        if (!c->closing)
+                wheel_set(&c->timeout, wheel_now() + secs);
+}
+
+
+/******************************************************************************
+ * I/O
+ * Reads and writes of the socket, in plaintext or through TLS; each
+ * returns what the system call would, with errno EAGAIN to wait.
+ ******************************************************************************/
+/**
+ * conn_recv -- read what has arrived
+ * @c  : the connection
+ * @buf: where it goes
+ * @len: room there
+ */
+ssize_t conn_recv(struct conn_t *c, void *buf, size_t len)
+{
+        if (c->ssl)
+                return tls_read(c->ssl, buf, len);
+
+        return read(c->fd, buf, len);
+}
+
+
+/**
+ * conn_sendv -- send a run of pieces in memory
+ * @c    : the connection
+ * @iov  : the pieces
+ * @n    : the number of pieces
+ * @flags: MSG_MORE, MSG_ZEROCOPY (plaintext only)
+ */
+ssize_t conn_sendv(struct conn_t *c, struct iovec *iov, int n, int flags)
+{
+        struct msghdr msg = { .msg_iov = iov, .msg_iovlen = n };
+
+        if (c->ssl && !c->ktls)
+                return tls_writev(c->ssl, iov, n);
+
+        return sendmsg(c->fd, &msg, MSG_NOSIGNAL|flags);
+}
+
+
+/**
+ * conn_sendfile -- send part of a file
+ * @c     : the connection
+ * @fd    : the open file
+ * @offset: offset of the next byte to send (advanced by the bytes sent)
+ * @end   : offset one past the last byte to send
+ *  RET: as send_file()
+ */
+ssize_t conn_sendfile(struct conn_t *c, int fd, off_t *offset, off_t end)
+{
+        if (c->ssl && !c->ktls)
+                return tls_send_file(c->ssl, fd, offset, end);
+
+        return send_file(c->fd, fd, offset, end);
+}
+
+
+/******************************************************************************
+ * STATE MACHINE
+ * Each step runs until its state is finished or the socket would block,
+ * and returns 0 in the latter case.
+ ******************************************************************************/
+/**
+ * conn_body -- open the body of a response, and cache it if it is small
+ * @path    : path of the file, relative to the www root
+ * @enc     : content coding; other than identity, the file read is the
+ *            precompressed sibling, e.g. "style.css.br"
+ * @filetype: MIME type of the (decoded) file
+ * @entry   : will point to the cache entry, if it is cached
+ * @file    : otherwise, to the open file
+ * @rep     :   and will hold what it is
+ * @why     : will point to an explanatory message on failure
+ *  RET: RESPONSE on success, else the cloth status code of the failure.
+ */
+static int conn_body(char *path, int enc, char *filetype, struct entry_t **entry,
+                     struct file_t **file, struct rep_t *rep, char **why)
+{
+        char name[BUFSIZE];
+        struct file_t *f;
+
+        if (snprintf(name, sizeof(name), "%s%s", path, ENCODING_SUFFIX[enc]) >= (int)sizeof(name))
+                return *why = "path too long", ERROR;
+
+        /* Open the requested file, unless it is open already */
+        if (f = file_get(name), !f)
+                return http_unopened(errno, why);
+
+        /* The body is sent by offset, so its size must be known */
+        if (enc && !S_ISREG(f->st.st_mode)) {
+                file_release(f);
+                return *why = "not a regular file", ERROR;
+        }
+
+        /* Small files are read into the cache and sent from there */
+        if (*entry = cache_put(path, enc, enc ? name : NULL, f->fd, &f->st, filetype), *entry) {
+                file_release(f);
+                return RESPONSE;
+        }
+
+        *file = f;
+
+        /* The first connection to send it maps it for all of them */
+        if (conf.mmap)
+                file_map(f);
+
+        http_rep(rep, filetype, f->st.st_size, enc, f->st.st_ino, f->st.st_size, &f->st.st_mtim);
+
+        return RESPONSE;
+}
+
+
+/**
+ * conn_file -- find the body of a response, in the cache or on disk
+ * @req     : the request
+ * @path    : path of the file, relative to the www root
+ * @filetype: MIME type of the file
+ * @entry   : will point to the cache entry, if it is cached
+ * @file    : otherwise, to the open file
+ * @rep     :   and will hold what it is
+ * @why     : will point to an explanatory message on failure
+ *  RET: RESPONSE on success, else the cloth status code of the failure.
+ *
+ * Text is sent in the best coding the client accepts that the cache has
+ * or a precompressed sibling file provides. Failing both, it goes out as
+ * it is, and (if it is cached) is queued to be compressed for next time.
+ */
+static int conn_file(const struct req_t *req, char *path, char *filetype,
+                     struct entry_t **entry, struct file_t **file, struct rep_t *rep, char **why)
+{
+        struct entry_t *e;
+        int accept;
+        int code;
+        int enc;
+
+        accept = http_compressible(filetype) ? http_encodings(req) : 0;
+
+        for (enc = ENC_COUNT-1; enc > ENC_IDENTITY; enc--) {
+                if ((accept & ENC_BIT(enc)) && (*entry = cache_get(path, enc)))
+                        return RESPONSE;
+        }
+
+        /* Siblings are only looked for until the cache knows there are none */
+        e = cache_get(path, ENC_IDENTITY);
+
+        for (enc = ENC_COUNT-1; enc > ENC_IDENTITY; enc--) {
+                if (!(accept & ENC_BIT(enc)) || (e && (e->probed & ENC_BIT(enc))))
+                        continue;
+                if (conn_body(path, enc, filetype, entry, file, rep, why) == RESPONSE) {
+                        if (e)
+                                cache_release(e);
+                        return RESPONSE;
+                }
+                if (e)
+                        e->probed |= ENC_BIT(enc);
+        }
+
+        *why = "";
+
+        if (!e) {
+                if (code = conn_body(path, ENC_IDENTITY, filetype, entry, file, rep, why), code != RESPONSE)
+                        return code;
+                if (!(e = *entry))
+                        return RESPONSE;
+                e->probed |= accept;
+        }
+
+        for (enc = ENC_COUNT-1; enc > ENC_IDENTITY; enc--) {
+                if (accept & ENC_BIT(enc))
+                        compress_request(e, enc);
+        }
+
+        *entry = e;
+
+        return RESPONSE;
+}
+
+
+/**
+ * conn_lookup -- find what answers a request for a file, and how
+ * @req   : the request
+ * @entry : will point to the cache entry, if it is cached
+ * @file  : otherwise, to the open file
+ * @rep   :   and will hold what it is
+ * @range : will hold the ranges to send, for PARTIAL (room for MAX_RANGES)
+ * @nrange: will hold the number of ranges
+ * @why   : will point to an explanatory message on failure
+ *  RET: RESPONSE, PARTIAL, NOT_MODIFIED or UNSATISFIED, else the cloth
+ *       status code of the failure.
+ *
+ * Shared with h2.c, which answers the requests of its streams the same way.
+ */
+int conn_lookup(const struct req_t *req, struct entry_t **entry, struct file_t **file,
+                struct rep_t *rep, struct range_t *range, int *nrange, char **why)
+{
+        const struct rep_t *r;
+        char path[BUFSIZE];
+        char *filetype;
+        int code;
+
+        *nrange = 0;
+
+        if (code = http_path(req, path, sizeof(path), &filetype, why), code != RESPONSE)
+                return code;
+
+        /* A bundle holds every file there is; the file system is not used */
+        if (bundle_active())
+                code = bundle_get(req, path, entry, why);
+        else
+                code = conn_file(req, path, filetype, entry, file, rep, why);
+
+        /* A directory without an index.html may be listed instead */
+        if (code == NOT_FOUND && conf.listing && !bundle_active())
+                code = listing_get(req, path, entry, why);
+
+        if (code != RESPONSE)
+                return code;
+
+        r = *entry ? &(*entry)->rep : rep;
+
+        /* The client's copy may do, or it may want only some of it */
+        if (http_fresh(req, r))
+                return NOT_MODIFIED;
+        if (*nrange = http_ranges(req, r, range), *nrange > 0)
+                return PARTIAL;
+        if (*nrange < 0)
+                return *nrange = 0, UNSATISFIED;
+
+        return RESPONSE;
+}
+
+
+/**
+ * conn_fail -- answer with an error
+ * @c   : the connection, its keepalive decided (0 after a framing error)
+ * @code: the cloth status code
+ * @why : an explanatory message
+ */
+static void conn_fail(struct conn_t *c, int code, char *why)
+{
+        char *header;
+
+        c->seg    = arena_alloc(&c->arena, sizeof(struct seg_t));
+        header    = arena_alloc(&c->arena, HEADER_SIZE);
+
+        if (!c->seg || !header) {
+                c->state = CONN_CLOSE;
+                return;
+        }
+
+        c->seg[0] = (struct seg_t){ header, 0, http_error(header, HEADER_SIZE, code, why, c->keepalive) };
+        c->nseg   = 1;
+        c->code   = code;
+        c->state  = CONN_WRITE;
+}
+
+
+/**
+ * conn_piece -- add a piece to the response, unless it is empty
+ * @c  : the connection
+ * @p  : bytes in memory, or NULL for a range of the file
+ * @off: offset of the range of the file
+ * @len: length of the piece
+ */
+static inline void conn_piece(struct conn_t *c, char *p, off_t off, size_t len)
+{
+        if (len > 0)
+                c->seg[c->nseg++] = (struct seg_t){ p, off, len };
+}
+
+
+/**
+ * conn_body_piece -- add part of the body to the response
+ * @c    : the connection
+ * @range: the bytes of the body to add
+ */
+static inline void conn_body_piece(struct conn_t *c, const struct range_t *range)
+{
+        size_t len = range->last - range->first + 1;
+
+        if (c->entry)
+                conn_piece(c, c->entry->body + range->first, 0, len);
+        else if (c->file->map)
+                conn_piece(c, c->file->map + range->first, 0, len);
+        else
+                conn_piece(c, NULL, range->first, len);
+}
+
+
+/**
+ * conn_copy -- copy a string into the connection's arena
+ *  RET: the copy, or NULL
+ */
+static char *conn_copy(struct conn_t *c, const char *str, size_t len)
+{
+        char *p;
+
+        if (p = arena_alloc(&c->arena, len), p)
+                memcpy(p, str, len);
+
+        return p;
+}
+
+
+/**
+ * conn_head -- add the status line and headers to the response
+ * @c     : the connection
+ * @header: the status line and the headers particular to this response
+ * @hlen  : their length
+ *  RET: 0 on success, -1 if out of memory
+ */
+static int conn_head(struct conn_t *c, char *header, size_t hlen)
+{
+        const struct stamp_t *stamp;
+        char *date;
+
+        /* The clock's Date line changes under a send that has to wait */
+        stamp = clock_now();
+
+        if (date = conn_copy(c, stamp->date, stamp->date_len), !date)
+                return -1;
+
+        conn_piece(c, header, 0, hlen);
+        conn_piece(c, date, 0, stamp->date_len);
+        conn_piece(c, (char *)CONNECTION[c->keepalive], 0, strlen(CONNECTION[c->keepalive]));
+
+        return 0;
+}
+
+
+/**
+ * conn_respond -- lay out the response to a request for a file
+ * @c     : the connection
+ * @code  : RESPONSE, PARTIAL, NOT_MODIFIED or UNSATISFIED
+ * @rep   : the representation of the file
+ * @range : the ranges to send, for PARTIAL
+ * @nrange: the number of ranges
+ *  RET: 0 on success, -1 if out of memory
+ */
+static int conn_respond(struct conn_t *c, int code, const struct rep_t *rep,
+                        struct range_t *range, int nrange)
+{
+        struct range_t whole;
+        char buf[HEADER_SIZE];
+        char boundary[32];
+        char **part = NULL;
+        size_t *plen = NULL;
+        off_t length = 0;
+        char *header;
+        size_t hlen;
+        int i;
+
+        if (c->seg = arena_alloc(&c->arena, (4 + 2*nrange) * sizeof(struct seg_t)), !c->seg)
+                return -1;
+
+        c->nseg   = 0;
+        c->segidx = 0;
+
+        /* Multipart bodies: the part headers come first, to know the length */
+        if (code == PARTIAL && nrange > 1) {
+                snprintf(boundary, sizeof(boundary), "%08lx%08lx", random(), random());
+
+                part = arena_alloc(&c->arena, (nrange + 1) * sizeof(char *));
+                plen = arena_alloc(&c->arena, (nrange + 1) * sizeof(size_t));
+                if (!part || !plen)
+                        return -1;
+
+                for (i=0; i<=nrange; i++) {
+                        plen[i] = http_part(buf, sizeof(buf), rep, (i < nrange) ? &range[i] : NULL, boundary);
+                        if (part[i] = conn_copy(c, buf, plen[i]), !part[i])
+                                return -1;
+                        length += plen[i];
+                        if (i < nrange)
+                                length += range[i].last - range[i].first + 1;
+                }
+        }
+
+        /* The header; that of a whole cached file is ready-made */
+        if (code == RESPONSE && c->entry) {
+                header = c->entry->header;
+                hlen   = c->entry->hlen;
+        } else {
+                if (code == RESPONSE)
+                        hlen = http_header(buf, sizeof(buf), rep);
+                else if (code == NOT_MODIFIED)
+                        hlen = http_not_modified(buf, sizeof(buf), rep);
+                else if (code == UNSATISFIED)
+                        hlen = http_unsatisfied(buf, sizeof(buf), rep);
+                else if (nrange == 1)
+                        hlen = http_partial(buf, sizeof(buf), rep, &range[0], NULL,
+                                            range[0].last - range[0].first + 1);
+                else
+                        hlen = http_partial(buf, sizeof(buf), rep, NULL, boundary, length);
+
+                if (header = conn_copy(c, buf, hlen), !header)
+                        return -1;
+        }
+
+        if (conn_head(c, header, hlen) < 0)
+                return -1;
+
+        switch (code) {
+        case RESPONSE:
+                whole = (struct range_t){ 0, rep->size - 1 };
+                conn_body_piece(c, &whole);
+                break;
+        case PARTIAL:
+                if (nrange == 1) {
+                        conn_body_piece(c, &range[0]);
+                        break;
+                }
+                for (i=0; i<nrange; i++) {
+                        conn_piece(c, part[i], 0, plen[i]);
+                        conn_body_piece(c, &range[i]);
+                }
+                conn_piece(c, part[nrange], 0, plen[nrange]);
+                break;
+        }
+
+        c->code  = code;
+        c->state = CONN_WRITE;
+
+        return 0;
+}
+
+
+/**
+ * conn_metrics -- lay out a response with every worker's counters
+ * @c: the connection
+ *  RET: 0 on success, -1 if out of memory
+ */
+static int conn_metrics(struct conn_t *c)
+{
+        char buf[HEADER_SIZE];
+        char *header;
+        char *body;
+        size_t hlen;
+        size_t blen;
+
+        c->seg    = arena_alloc(&c->arena, 4 * sizeof(struct seg_t));
+        body      = arena_alloc(&c->arena, METRICS_SIZE);
+        c->nseg   = 0;
+        c->segidx = 0;
+
+        if (!c->seg || !body)
+                return -1;
+
+        blen = metrics_render(body, METRICS_SIZE);
+        hlen = http_generated(buf, sizeof(buf), "text/plain; version=0.0.4", blen);
+
+        if (header = conn_copy(c, buf, hlen), !header)
+                return -1;
+        if (conn_head(c, header, hlen) < 0)
+                return -1;
+
+        conn_piece(c, body, 0, blen);
+
+        c->code  = RESPONSE;
+        c->state = CONN_WRITE;
+
+        return 0;
+}
+
+
+/**
+ * conn_route -- act on a complete request and start the response
+ * @c: the connection
+ */
+static void conn_route(struct conn_t *c)
+{
+        struct range_t range[MAX_RANGES];
+        const struct rep_t *rep;
+        char *why;
+        int nrange;
+        int code;
+
+        c->start = metrics_clock();
+
+        sesinfo(&c->session, c->fd, &c->remote, &c->buf->req);
+
+        record(ACCEPT, &c->session, "");
+
+        c->keepalive = http_keepalive(&c->buf->req)
+                    && ++c->served < conf.keepalive_requests
+                    && !draining;
+
+        /* The counters are served from memory, not from the www root */
+        if (slice_is(&c->buf->req.method, "GET") && slice_is(&c->buf->req.target, METRICS_PATH)) {
+                record(RESPONSE, &c->session, "metrics");
+                if (conn_metrics(c) < 0)
+                        c->state = CONN_CLOSE;
+                return;
+        }
+
+        code = conn_lookup(&c->buf->req, &c->entry, &c->file, &c->rep, range, &nrange, &why);
+        rep  = c->entry ? &c->entry->rep : &c->rep;
+
+        record(code, &c->session, why);
+
+        switch (code) {
+        case RESPONSE:
+        case PARTIAL:
+        case NOT_MODIFIED:
+        case UNSATISFIED:
+                if (conn_respond(c, code, rep, range, nrange) < 0)
+                        c->state = CONN_CLOSE;
+                break;
+        default:
+                /* The error page is sent even to a HEAD, which the client
+                 * won't expect a body after, so that one has to close */
+                if (slice_is(&c->buf->req.method, "HEAD"))
+                        c->keepalive = 0;
+                conn_fail(c, code, why);
+                break;
+        }
+}
+
+
+/**
+ * conn_parse -- parse what has arrived of a request, and answer it if it
+ *               is complete
+ * @c: the connection
+ *  RET: 1 if the response is laid out, 0 if more must be read first
+ */
+int conn_parse(struct conn_t *c)
+{
+        struct connbuf_t *b = c->buf;
+        int ret;
+
+        /* With no buffer, nothing has arrived */
+        if (!b)
+                return 0;
+
+        /* The first bytes of a request start the clock on the rest */
+        if (c->waiting && c->nread > 0) {
+                c->waiting = 0;
+                conn_timeout(c, conf.header_timeout);
+        }
+
+        /* HTTP/2 with prior knowledge opens with its preface instead */
+        if (http2 && c->served == 0) {
+                if (ret = h2_preface(b->request, c->nread), ret == 0)
+                        return 0;
+                if (ret > 0) {
+                        h2_open(c, b->request, c->nread);
+                        conn_unbuffer(c); /* HTTP/2 reads into its own */
+                        return 1;
+                }
+        }
+
+        if (ret = parse_request(&b->req, b->request, c->nread), ret > 0 && !http_bodyless(&b->req)) {
+                c->start = metrics_clock();
+                record(BAD_REQUEST, NULL, "request with a body");
+                c->keepalive = 0;
+                conn_fail(c, BAD_REQUEST, "Request bodies are not accepted");
+        } else if (ret > 0) {
+                c->reqlen = ret;
+                if (http2 && !c->ssl && h2_upgradable(&b->req)) {
+                        h2_upgrade(c);
+                        conn_unbuffer(c);
+                } else {
+                        conn_route(c);
+                }
+        } else if (ret == PARSE_BAD) {
+                c->start = metrics_clock();
+                record(BAD_REQUEST, NULL, "malformed request");
+                c->keepalive = 0;
+                conn_fail(c, BAD_REQUEST, "Malformed request");
+        } else if (ret == PARSE_OVERFLOW || c->nread == BUFSIZE) {
+                c->start = metrics_clock();
+                record(OVERFLOW, NULL, "request too large");
+                c->keepalive = 0;
+                conn_fail(c, OVERFLOW, "");
+        } else {
+                return 0;
+        }
+
+        conn_timeout(c, conf.send_timeout);
+
+        return 1;
+}
+
+
+/**
+ * conn_read -- collect the request, until it is complete or EAGAIN
+ * @c: the connection
+ */
+static int conn_read(struct conn_t *c)
+{
+        ssize_t n;
+
+        for (;;) {
+                /* Parse whatever has arrived since the last call */
+                if (conn_parse(c))
+                        return 1;
+
+                if (conn_buffer(c) < 0) {
+                        c->state = CONN_CLOSE;
+                        return 1;
+                }
+
+                if (n = conn_recv(c, c->buf->request+c->nread, BUFSIZE-c->nread), n == 0) {
+                        c->state = CONN_CLOSE; /* remote hung up */
+                        return 1;
+                }
+                if (n < 0) {
+                        if (errno != EAGAIN && errno != EINTR) {
+                                c->state = CONN_CLOSE;
+                                return 1;
+                        }
+                        /* Idle, it needs no buffer until more arrives */
+                        if (c->nread == 0)
+                                conn_unbuffer(c);
+                        return 0;
+                }
+                c->nread += n;
+        }
+}
+
+
+/**
+ * conn_iov -- gather the run of pieces in memory that is to go out next
+ * @c   : the connection
+ * @iov : will hold them (room for MAX_IOV)
+ * @more: will be MSG_MORE if more of the response follows them, else 0
+ *  RET: the number of pieces gathered
+ */
+int conn_iov(struct conn_t *c, struct iovec *iov, int *more)
+{
+        struct seg_t *s;
+        int i;
+
+        for (i=0; i < MAX_IOV && c->segidx+i < c->nseg && c->seg[c->segidx+i].p; i++) {
+                s = &c->seg[c->segidx+i];
+                iov[i] = (struct iovec){ s->p, s->len };
+        }
+
+        /* Hold it back until what follows can join it in one packet */
+        *more = (c->segidx + i < c->nseg) ? MSG_MORE : 0;
+
+        return i;
+}
+
+
+/**
+ * conn_sent -- step over bytes of pieces in memory that have gone out
+ * @c: the connection
+ * @n: the number of bytes, which may end mid-piece
+ */
+void conn_sent(struct conn_t *c, size_t n)
+{
+        METRICS_ADD(bytes, n);
+        conn_timeout(c, conf.send_timeout);
+
+        for (; n > 0 && n >= c->seg[c->segidx].len; c->segidx++)
+                n -= c->seg[c->segidx].len;
+
+        if (n > 0) {
+                c->seg[c->segidx].p   += n;
+                c->seg[c->segidx].len -= n;
+        }
+}
+
+
+/**
+ * conn_zerocopy -- cut a run of pieces down to its first kind, in the
+ *                  mapped file or not, and say how to send them
+ * @c   : the connection
+ * @iov : the run, from conn_iov()
+ * @n   : its length (shortened to the pieces kept)
+ * @more: set to MSG_MORE if any are cut off
+ *  RET: MSG_ZEROCOPY for a large enough run of the mapped file, else 0
+ *
+ * The kernel reads the pages of a zero-copy send long after sendmsg()
+ * returns. That is safe for the mapping, which is never written (and
+ * unmapping it leaves the pages the kernel has pinned alone), but not
+ * for the arena, which the next response reuses: the headers go out in
+ * a copying send of their own, and MSG_MORE still joins them to the body.
+ */
+static int conn_zerocopy(struct conn_t *c, struct iovec *iov, size_t *n, int *more)
+{
+        char *map = c->file ? c->file->map : NULL;
+        size_t bytes = 0;
+        size_t i;
+        int first;
+
+        if (!map)
+                return 0;
+
+        #define MAPPED(v) ((char *)(v).iov_base >= map && (char *)(v).iov_base < map + c->file->maplen)
+
+        first = MAPPED(iov[0]);
+
+        for (i=0; i<*n && MAPPED(iov[i]) == first; i++)
+                bytes += iov[i].iov_len;
+
+        #undef MAPPED
+
+        if (i < *n) {
+                *n    = i;
+                *more = MSG_MORE;
+        }
+
+        return (first && bytes >= ZEROCOPY_MIN) ? MSG_ZEROCOPY : 0;
+}
+
+
+/**
+ * conn_reap -- count the zero-copy sends the error queue says are done
+ * @c: the connection
+ *  RET: 0 if that was all there was to EPOLLERR, -1 if the socket failed
+ */
+static int conn_reap(struct conn_t *c)
+{
+        char control[128];
+        struct msghdr msg;
+        struct cmsghdr *cm;
+        struct sock_extended_err *ee;
+        socklen_t len = sizeof(int);
+        int err = 0;
+        uint32_t n;
+
+        for (;;) {
+                msg = (struct msghdr){ .msg_control = control, .msg_controllen = sizeof(control) };
+
+                if (recvmsg(c->fd, &msg, MSG_ERRQUEUE) < 0)
+                        break;
+
+                for (cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+                        ee = (struct sock_extended_err *)CMSG_DATA(cm);
+                        if (ee->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+                                return -1;
+
+                        /* Notifications of a range of sends, by number */
+                        n = ee->ee_data - ee->ee_info + 1;
+                        METRICS_ADD(zerocopy, n);
+                        if (ee->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+                                METRICS_ADD(zerocopy_copied, n);
+                }
+        }
+
+        if (errno != EAGAIN && errno != EINTR)
+                return -1;
+        if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err)
+                return -1;
+
+        return 0;
+}
+
+
+/**
+ * conn_write -- send the response, until it is all out or EAGAIN
+ * @c: the connection
+ */
+static int conn_write(struct conn_t *c)
+{
+        struct iovec iov[MAX_IOV];
+        struct seg_t *s;
+        size_t niov;
+        ssize_t n;
+        int more;
+        int zc;
+
+        while (c->segidx < c->nseg) {
+                s = &c->seg[c->segidx];
+
+                if (s->len == 0) {
+                        c->segidx++;
+                        continue;
+                }
+
+                /* A range of the file, straight from the page cache */
+                if (s->p == NULL) {
+                        if (n = conn_sendfile(c, c->file->fd, &s->off, s->off + s->len), n <= 0) {
+                                if (n < 0 && (errno == EAGAIN || errno == EINTR))
+                                        return 0;
+                                c->state = CONN_CLOSE; /* error, or file truncated */
+                                return 1;
+                        }
+                        METRICS_ADD(bytes, n);
+                        conn_timeout(c, conf.send_timeout);
+                        s->len -= n;
+                        continue;
+                }
+
+                /* A run of pieces in memory goes out in one sendmsg() */
+                niov = conn_iov(c, iov, &more);
+                zc   = c->zerocopy ? conn_zerocopy(c, iov, &niov, &more) : 0;
+                n    = conn_sendv(c, iov, niov, more|zc);
+
+                /* Past optmem_max, no more notifications fit: copy instead */
+                if (n < 0 && zc && errno == ENOBUFS)
+                        n = conn_sendv(c, iov, niov, more);
+
+                if (n < 0) {
+                        if (errno == EAGAIN || errno == EINTR)
+                                return 0;
+                        c->state = CONN_CLOSE; /* error, or mapped file truncated */
+                        return 1;
+                }
+
+                conn_sent(c, n);
+        }
+
+        c->state = CONN_DONE;
+
+        return 1;
+}
+
+
+/**
+ * conn_handshake -- take the TLS handshake as far as the socket allows
+ * @c: the connection
+ */
+static int conn_handshake(struct conn_t *c)
+{
+        int ret;
+
+        if (ret = tls_handshake(c->ssl), ret == 0)
+                return 0;
+
+        if (ret < 0) {
+                c->state = CONN_CLOSE;
+                return 1;
+        }
+
+        c->ktls  = tls_offloaded(c->ssl);
+        c->state = CONN_READ;
+
+        /* A client that chose h2 starts with the preface, as with prior knowledge */
+        if (http2 && tls_h2(c->ssl))
+                h2_open(c, NULL, 0);
+
+        return 1;
+}
+
+
+/**
+ * conn_done -- finish a response, and make ready for the next request
+ * @c: the connection
+ */
+void conn_done(struct conn_t *c)
+{
+        metrics_response(c->code, c->start);
+
+        if (c->file)
+                file_release(c->file);
+        if (c->entry)
+                cache_release(c->entry);
+
+        memset(&c->session, 0, sizeof(c->session));
+        c->session.arena = &c->arena;
+        arena_reset(&c->arena);
+
+        c->file    = NULL;
+        c->entry   = NULL;
+        c->seg     = NULL;
+        c->nseg    = c->segidx = 0;
+
+        if (!c->keepalive) {
+                c->state = CONN_CLOSE;
+                return;
+        }
+
+        /* Whatever followed the request is the start of the next one */
+        memmove(c->buf->request, c->buf->request+c->reqlen, c->nread-c->reqlen);
+        c->nread -= c->reqlen;
+        c->reqlen = 0;
+        parse_reset(&c->buf->req);
+
+        /* Pipelined, the next request is already under way; if not, the
+         * buffer is given back until it starts */
+        c->waiting = (c->nread == 0);
+        if (c->waiting)
+                conn_unbuffer(c);
+        conn_timeout(c, c->waiting ? conf.keepalive_timeout : conf.header_timeout);
+
+        c->state = CONN_READ;
+}
+
+
+/**
+ * conn_run -- drive a connection through its states until it would block
+ * @c: the connection (may be freed on return)
+ */
+static void conn_run(struct conn_t *c)
+{
+        for (;;) {
+                switch (c->state) {
+                case CONN_HANDSHAKE:
+                        if (!conn_handshake(c))
+                                return;
+                        break;
+                case CONN_READ:
+                        if (!conn_read(c))
+                                return;
+                        break;
+                case CONN_WRITE:
+                        if (!conn_write(c))
+                                return;
+                        break;
+                case CONN_DONE:
+                        conn_done(c);
+                        break;
+                case CONN_H2:
+                        if (!h2_run(c))
+                                return;
+                        break;
+                case CONN_CLOSE:
+                        conn_close(c);
+                        return;
+                }
+        }
+}
+
+
+/**
+ * conn_event -- dispatch an epoll event to the connection's current state
+ * @c     : the connection
+ * @events: the epoll event mask
+ */
+static void conn_event(struct conn_t *c, uint32_t events)
+{
+        /* Zero-copy sends report that they are done as errors */
+        if ((events & EPOLLERR) && c->zerocopy && conn_reap(c) == 0)
+                events &= ~EPOLLERR;
+
+        if (events & (EPOLLERR|EPOLLHUP)) {
+                conn_close(c);
+                return;
+        }
+
+        switch (c->state) {
+        case CONN_HANDSHAKE:
+        case CONN_H2:
+                conn_run(c);
+                break;
+        case CONN_READ:
+                if (events & (EPOLLIN|EPOLLRDHUP))
+                        conn_run(c);
+                break;
+        case CONN_WRITE:
+                if (events & EPOLLOUT)
+                        conn_run(c);
+                break;
+        }
+}
+
+
+/**
+ * conn_expire -- close every connection whose time is up
+ */
+void conn_expire(void)
+{
+        struct timeout_t *t;
+
+        while (t = wheel_next(), t)
+                conn_close((struct conn_t *)((char *)t - offsetof(struct conn_t, timeout)));
+}
+
+
+/**
+ * conn_drain -- wind the connections down, once this worker is draining
+ *  RET: 1 when every one is gone, or the drain has run out of time
+ *
+ * Every response is now sent with "Connection: close". Connections
+ * waiting for a request are closed too, once they have been quiet for
+ * another second: closing one the moment its last response went out
+ * would race a client already sending its next request, which would be
+ * reset. HTTP/2 connections are sent GOAWAY, and close when their open
+ * streams are done.
+ */
+int conn_drain(void)
+{
+        static time_t deadline;
+        struct conn_t *next;
+        struct conn_t *c;
+
+        if (!deadline) {
+                deadline = wheel_now() + conf.drain_timeout;
+
+                for (c = conns; c; c = next) {
+                        next = c->next;
+                        if (c->state == CONN_READ && c->nread == 0) {
+                                conn_timeout(c, 1);
+                        } else if (c->state == CONN_H2) {
+                                h2_drain(c);
+                                conn_run(c); /* may close it */
+                        }
+                }
+        }
+
+        conn_expire();
+
+        return conns == NULL || wheel_now() >= deadline;
+}
+
+
+/******************************************************************************
+ * ACCEPT
+ ******************************************************************************/
+/**
+ * accept_all -- accept every pending connection on the listening socket
+ * @fd_listen: the (non-blocking) listening socket
+ */
+static void accept_all(int fd_listen)
+{
+        struct sockaddr_in remote;
+        struct epoll_event ev;
+        struct conn_t *c;
+        socklen_t length;
+        int on = 1;
+        int fd;
+
+        for (;;) {
+                length = sizeof(remote);
+
+                fd = accept4(fd_listen, (struct sockaddr *)&remote, &length,
+                             SOCK_NONBLOCK|SOCK_CLOEXEC);
+                if (fd < 0) {
+                        if (errno == EINTR || errno == ECONNABORTED)
+                                continue;
+                        if (errno != EAGAIN)
+                                record(ERROR, NULL, "accept");
+                        return;
+                }
+
+                /* Over capacity: a 503 now, rather than a wait in the backlog */
+                if (!admit(&remote)) {
+                        admit_refuse(fd);
+                        continue;
+                }
+
+                if (c = conn_open(fd, &remote), !c) {
+                        record(ERROR, NULL, "conn_open");
+                        admit_release(&remote);
+                        close(fd);
+                        continue;
+                }
+
+                /* Mapped files may then leave without a copy */
+                if (conf.mmap && conf.zerocopy && !c->ssl)
+                        c->zerocopy = !setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &on, sizeof(on));
+
+                ev.events   = EPOLLIN|EPOLLOUT|EPOLLRDHUP|EPOLLET;
+                ev.data.ptr = c;
+
+                if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+                        record(ERROR, NULL, "epoll_ctl");
+                        conn_close(c);
+                }
+        }
+}
+
+
+/******************************************************************************
+ * ENGINE
+ ******************************************************************************/
+/**
+ * engine_epoll -- serve connections on a listening socket, forever
+ * @fd_listen: the listening socket
+ */
+void engine_epoll(int fd_listen)
+{
+        struct epoll_event events[MAX_EVENTS];
+        struct epoll_event ev;
+        int fd_notify;
+        int fd_compress;
+        int n;
+        int i;
+
+        if (epfd = epoll_create1(EPOLL_CLOEXEC), epfd < 0)
+                log(FATAL, NULL, "epoll_create1");
+
+        /* Log lines are written out by a thread of this process */
+        log_async();
+
+        http2 = conf.http2;
+
+        /* Each worker admits its share of the connections, and times them */
+        admit_init(conf.workers > 0 ? conf.workers : 1);
+        wheel_init();
+
+        /* Each worker has a cache of its own, watched with inotify */
+        if (fd_notify = cache_init(), fd_notify >= 0) {
+                ev.events   = EPOLLIN|EPOLLET;
+                ev.data.ptr = &notify_tag;
+
+                if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd_notify, &ev) < 0)
+                        log(FATAL, NULL, "epoll_ctl");
+        }
+
+        /* ...and compresses text for it in a thread */
+        if (fd_compress = compress_init(), fd_compress >= 0) {
+                ev.events   = EPOLLIN|EPOLLET;
+                ev.data.ptr = &compress_tag;
+
+                if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd_compress, &ev) < 0)
+                        log(FATAL, NULL, "epoll_ctl");
+        }
+
+        fcntl(fd_listen, F_SETFL, fcntl(fd_listen, F_GETFL) | O_NONBLOCK);
+
+        /* The listening socket is the only one without a connection */
+        ev.events   = EPOLLIN|EPOLLET;
+        ev.data.ptr = NULL;
+
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd_listen, &ev) < 0)
+                log(FATAL, NULL, "epoll_ctl");
+
+        for (;;) {
+                /* Only without workers; a master does this for its own */
+                if (reloading && !draining)
+                        reload_exec(&fd_listen, 1);
+                reloading = 0;
+
+                /* Stop accepting; the next generation has the socket too */
+                if (draining && fd_listen >= 0) {
+                        epoll_ctl(epfd, EPOLL_CTL_DEL, fd_listen, NULL);
+                        close(fd_listen);
+                        fd_listen = -1;
+                }
+                if (draining && conn_drain()) {
+                        log_flush();
+                        exit(0);
+                }
+
+                /* Wake at least once a second to expire idle connections */
+                if (n = epoll_wait(epfd, events, MAX_EVENTS, 1000), n < 0) {
+                        if (errno == EINTR)
+                                continue;
+                        log(FATAL, NULL, "epoll_wait");
+                }
+
+                clock_tick();
+
+                for (i=0; i<n; i++) {
+                        if (events[i].data.ptr == NULL)
+                                accept_all(fd_listen);
+                        else if (events[i].data.ptr == &notify_tag)
+                                cache_notify();
+                        else if (events[i].data.ptr == &compress_tag)
+                                compress_done();
+                        else
+                                conn_event(events[i].data.ptr, events[i].events);
+                }
+
+                conn_expire();
+                cache_report();
+        }
+}
@@ -0,0 +1,105 @@
+#ifndef __EVENT_H
+#define __EVENT_H
+
+#include <time.h>
+#include <stdint.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include "arena.h"
+#include "cache.h"
+#include "http.h"
+#include "parse.h"
+#include "log.h"
+#include "wheel.h"
+#include "tls.h"
+#include "h2.h"
+
+
+/* Events returned by a single call to epoll_wait() */
+#define MAX_EVENTS 256
+
+/* Pieces of a response gathered into one sendmsg() */
+#define MAX_IOV 64
+
+/* Connection states */
+enum conn_state { CONN_READ, CONN_WRITE, CONN_DONE, CONN_CLOSE, CONN_HANDSHAKE, CONN_H2 };
+
+
+/* A piece of a response: bytes in memory, or a range of the open file */
+struct seg_t {
+        char *p;                     // Next byte to send; NULL for the file
+        off_t off;                   // Next byte of the file to send
+        size_t len;                  // Bytes left to send
+};
+
+
+/*
+ * What a connection needs only while it reads a request and answers it,
+ * taken from a pool then and given back while it is idle (see conn_buffer())
+ */
+struct connbuf_t {
+        char request[BUFSIZE];       // Raw text of the request
+        struct req_t req;            // The request, parsed in place
+        char scratch[ARENA_SIZE];    // The memory of the connection's arena
+        struct iovec iov[MAX_IOV];   // io_uring: the pieces sendmsg() sends
+};
+
+
+/* Per-connection state machine */
+struct conn_t {
+        int fd;                      // Socket file descriptor
+        int state;                   // One of enum conn_state
+        struct sockaddr_in remote;   // Address of the remote host
+        struct ses_t session;        // Logging information
+        struct connbuf_t *buf;       // Its buffer, or NULL while none is held
+        size_t nread;                // Bytes of request received so far
+        size_t reqlen;               // Length of the request being answered
+        int keepalive;               // Keep the connection after this response
+        int served;                  // Requests answered so far
+        int waiting;                 // Idle between requests
+        struct timeout_t timeout;    // When it is closed, if nothing happens
+        struct conn_t *prev;         // Every connection, for draining
+        struct conn_t *next;
+        struct arena_t arena;        // Everything this request allocates
+        struct seg_t *seg;           // The response, piece by piece
+        int nseg;                    // Number of pieces
+        int segidx;                  // First piece not completely sent
+        struct entry_t *entry;       // Cached file being sent, or NULL
+        struct file_t *file;         // File being sent, or NULL
+        struct rep_t rep;            //   and what it is
+        int code;                    // Status of the response being sent
+        uint64_t start;              // metrics_clock() when it was asked for
+        int closing;                 // conn_close() has been called
+        int zerocopy;                // Mapped files are sent with MSG_ZEROCOPY
+        SSL *ssl;                    // TLS session, or NULL for plaintext
+        int ktls;                    //   sealed by the kernel, not OpenSSL
+        struct h2_t *h2;             // HTTP/2 state, once it is spoken
+        int inflight;                // io_uring operations not yet complete
+        struct msghdr msg;           // io_uring: the sendmsg() in flight
+        int pipe[2];                 // io_uring: file ranges are spliced through
+        size_t piped;                //   and the bytes in it, not yet sent
+};
+
+
+/* Function prototypes */
+void engine_epoll(int fd_listen);
+struct conn_t *conn_open(int fd, struct sockaddr_in *remote);
+void conn_close(struct conn_t *c);
+int conn_buffer(struct conn_t *c);
+void conn_unbuffer(struct conn_t *c);
+int conn_parse(struct conn_t *c);
+int conn_lookup(const struct req_t *req, struct entry_t **entry, struct file_t **file,
+                struct rep_t *rep, struct range_t *range, int *nrange, char **why);
+ssize_t conn_recv(struct conn_t *c, void *buf, size_t len);
+ssize_t conn_sendv(struct conn_t *c, struct iovec *iov, int n, int flags);
+ssize_t conn_sendfile(struct conn_t *c, int fd, off_t *offset, off_t end);
+int conn_iov(struct conn_t *c, struct iovec *iov, int *more);
+void conn_sent(struct conn_t *c, size_t n);
+void conn_done(struct conn_t *c);
+void conn_timeout(struct conn_t *c, int secs);
+void conn_expire(void);
+int conn_drain(void);
+
+
+#endif
@@ -0,0 +1,1478 @@
+/*
+ * h2.c -- HTTP/2 (RFC 9113), over TLS (h2) or plaintext (h2c).
+ *
+ * A connection speaks HTTP/2 from the start if the client says so: by
+ * opening with the preface (prior knowledge), by choosing h2 during the
+ * TLS handshake (ALPN, see tls.c), or by asking for an upgrade to h2c in
+ * an HTTP/1.1 request, which is then answered as stream 1.
+ *
+ * Frames are read into a buffer of one frame's size and acted on as they
+ * complete. Each request is decoded (see hpack.c) into a request like any
+ * other and answered the same way, from the file cache or the open-file
+ * table (see conn_lookup()); its response header is rendered as for
+ * HTTP/1.1 and then encoded, field by field.
+ *
+ * Writes go out a batch at a time: the control and HEADERS frames that
+ * are queued, then up to H2_BATCH DATA frames, each a 9-byte header and a
+ * payload that is never copied: a piece of a cached body or a mapping,
+ * sent with the headers in one sendmsg(), or a range of a file, sent with
+ * sendfile(). Each DATA frame goes to the stream that is most urgent (by
+ * the RFC 9218 priority header), among those not waiting on a stream they
+ * depend on (RFC 7540 priorities), and that has had the least of its
+ * weighted share; no stream is sent more than its flow-control window, or
+ * the connection's, allows.
+ *
+ * Not done: server push, a dynamic table or Huffman coding for responses
+ * (their headers are small), multipart ranges (the whole file is sent),
+ * request bodies (they are thrown away), and the reshuffling that RFC
+ * 7540 exclusive dependencies ask for.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include "h2.h"
+#include "event.h"
+#include "conf.h"
+#include "clock.h"
+#include "metrics.h"
+#include "pool.h"
+#include "reload.h"
+
+
+/* Frame types */
+enum frames { H2_DATA, H2_HEADERS, H2_PRIORITY, H2_RST_STREAM, H2_SETTINGS,
+              H2_PUSH_PROMISE, H2_PING, H2_GOAWAY, H2_WINDOW_UPDATE,
+              H2_CONTINUATION, H2_PRIORITY_UPDATE = 0x10 };
+
+/* Frame flags */
+#define FLAG_END_STREAM  0x01
+#define FLAG_ACK         0x01
+#define FLAG_END_HEADERS 0x04
+#define FLAG_PADDED      0x08
+#define FLAG_PRIORITY    0x20
+
+/* Settings */
+enum settings { SETTINGS_HEADER_TABLE_SIZE = 1, SETTINGS_ENABLE_PUSH,
+                SETTINGS_MAX_CONCURRENT_STREAMS, SETTINGS_INITIAL_WINDOW_SIZE,
+                SETTINGS_MAX_FRAME_SIZE, SETTINGS_MAX_HEADER_LIST_SIZE };
+
+/* Error codes */
+enum errors { NO_ERROR, PROTOCOL_ERROR, INTERNAL_ERROR, FLOW_CONTROL_ERROR,
+              SETTINGS_TIMEOUT, STREAM_CLOSED, FRAME_SIZE_ERROR, REFUSED_STREAM,
+              CANCEL, COMPRESSION_ERROR, CONNECT_ERROR, ENHANCE_YOUR_CALM };
+
+
+/* Flow-control windows */
+#define WINDOW_DEFAULT 65535
+#define WINDOW_MAX     0x7fffffff
+
+/* Room always kept in the queue for a GOAWAY */
+#define GOAWAY_ROOM (H2_HEADER + 8)
+
+/* Defaults for a stream's priority */
+#define WEIGHT_DEFAULT  16
+#define URGENCY_DEFAULT 3
+
+/* Dependencies followed up the tree, at most (the client may loop them) */
+#define DEPTH_MAX 8
+
+
+/* Where connections' HTTP/2 state, and their streams, come from */
+static struct pool_t h2_pool     = POOL_INIT(sizeof(struct h2_t));
+static struct pool_t stream_pool = POOL_INIT(sizeof(struct h2_stream_t));
+
+
+/* Fields of a response that mean nothing in HTTP/2 */
+static const char *HOP_BY_HOP[]={ "connection", "keep-alive", "proxy-connection",
+                                  "transfer-encoding", "upgrade", NULL };
+
+
+/******************************************************************************
+ * FRAMES
+ ******************************************************************************/
+static inline uint32_t get32(const uint8_t *p)
+{
+        return (uint32_t)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+
+static inline void put32(uint8_t *p, uint32_t v)
+{
+        p[0] = v >> 24;
+        p[1] = v >> 16;
+        p[2] = v >> 8;
+        p[3] = v;
+}
+
+
+/**
+ * frame_header -- lay out the header of a frame
+ * @p    : where it goes (H2_HEADER bytes)
+ * @len  : length of the payload
+ * @type : one of enum frames
+ * @flags: its flags
+ * @id   : the stream, or 0 for the connection
+ */
+static void frame_header(uint8_t *p, size_t len, int type, int flags, uint32_t id)
+{
+        p[0] = len >> 16;
+        p[1] = len >> 8;
+        p[2] = len;
+        p[3] = type;
+        p[4] = flags;
+        put32(p + 5, id);
+}
+
+
+/**
+ * h2_queue -- queue a frame to go out ahead of any more DATA
+ * @h2     : the connection
+ * @type   : one of enum frames
+ * @flags  : its flags
+ * @id     : the stream, or 0 for the connection
+ * @payload: the payload
+ * @len    : its length
+ *  RET: 0, or -1 if the queue is full
+ */
+static int h2_queue(struct h2_t *h2, int type, int flags, uint32_t id,
+                    const void *payload, size_t len)
+{
+        size_t room = (type == H2_GOAWAY) ? H2_OUT : H2_OUT - GOAWAY_ROOM;
+
+        if (h2->nout + H2_HEADER + len > room)
+                return -1;
+
+        frame_header(h2->out + h2->nout, len, type, flags, id);
+        memcpy(h2->out + h2->nout + H2_HEADER, payload, len);
+        h2->nout += H2_HEADER + len;
+
+        return 0;
+}
+
+
+/**
+ * h2_goaway -- say no more streams will be answered
+ * @h2  : the connection
+ * @code: NO_ERROR to finish those already open; else the error that
+ *        closes the connection as soon as GOAWAY is out
+ */
+static void h2_goaway(struct h2_t *h2, int code)
+{
+        uint8_t p[8];
+
+        if (h2->fatal || (code == NO_ERROR && h2->goaway))
+                return;
+
+        put32(p, h2->last_id);
+        put32(p + 4, code);
+
+        h2_queue(h2, H2_GOAWAY, 0, 0, p, sizeof(p));
+
+        h2->goaway = 1;
+        h2->fatal  = (code != NO_ERROR);
+}
+
+
+/**
+ * h2_control -- queue a control frame
+ *
+ * A client that has it queue more of them than fit, faster than it
+ * reads them (PING, SETTINGS...), is flooding the connection.
+ */
+static void h2_control(struct h2_t *h2, int type, int flags, uint32_t id,
+                       const void *payload, size_t len)
+{
+        if (h2_queue(h2, type, flags, id, payload, len) < 0)
+                h2_goaway(h2, ENHANCE_YOUR_CALM);
+}
+
+
+/******************************************************************************
+ * STREAMS
+ ******************************************************************************/
+/**
+ * h2_stream -- find an open stream
+ *  RET: the stream, or NULL if it is not open
+ */
+static struct h2_stream_t *h2_stream(struct h2_t *h2, uint32_t id)
+{
+        struct h2_stream_t *s;
+
+        for (s = h2->streams; s; s = s->next) {
+                if (s->id == id)
+                        return s->ended ? NULL : s;
+        }
+        return NULL;
+}
+
+
+/**
+ * h2_end -- be done with a stream: its response is out, or it is reset
+ * @h2  : the connection
+ * @s   : the stream (freed by h2_reap(), once nothing of it is being sent)
+ * @sent: its response was sent whole
+ */
+static void h2_end(struct h2_t *h2, struct h2_stream_t *s, int sent)
+{
+        if (s->ended)
+                return;
+
+        if (sent)
+                metrics_response(s->code, s->start);
+
+        s->ended = 1;
+        h2->nstreams--;
+}
+
+
+/**
+ * h2_reset -- end a stream with an error
+ */
+static void h2_reset(struct h2_t *h2, uint32_t id, int code)
+{
+        struct h2_stream_t *s;
+        uint8_t p[4];
+
+        put32(p, code);
+        h2_control(h2, H2_RST_STREAM, 0, id, p, sizeof(p));
+
+        if (s = h2_stream(h2, id), s)
+                h2_end(h2, s, 0);
+}
+
+
+/**
+ * stream_free -- release a stream and everything it holds
+ */
+static void stream_free(struct h2_stream_t *s)
+{
+        if (s->file)
+                file_release(s->file);
+        if (s->entry)
+                cache_release(s->entry);
+
+        free(s->hbuf);
+        free(s->head);
+        free(s->extra);
+        pool_put(&stream_pool, s);
+}
+
+
+/**
+ * h2_reap -- free the streams that have ended
+ * @h2: the connection, with no write under way
+ */
+static void h2_reap(struct h2_t *h2)
+{
+        struct h2_stream_t **sp;
+        struct h2_stream_t *s;
+
+        for (sp = &h2->streams; (s = *sp); ) {
+                if (s->ended) {
+                        *sp = s->next;
+                        stream_free(s);
+                } else {
+                        sp = &s->next;
+                }
+        }
+}
+
+
+/**
+ * h2_prioritize -- apply RFC 7540 priority fields to a stream
+ * @s: the stream
+ * @p: the fields: exclusive bit and dependency (4 bytes), weight (1)
+ */
+static void h2_prioritize(struct h2_stream_t *s, const uint8_t *p)
+{
+        uint32_t parent = get32(p) & 0x7fffffff;
+
+        s->parent = (parent == s->id) ? 0 : parent;
+        s->weight = p[4] + 1;
+}
+
+
+/**
+ * h2_urgency -- read the urgency of an RFC 9218 priority field value
+ * @value  : the value, e.g. "u=1, i", or NULL
+ * @urgency: the urgency, if the value gives none
+ */
+static int h2_urgency(const struct slice_t *value, int urgency)
+{
+        const char *p;
+        size_t i;
+
+        for (i=0; value && i + 2 < value->len; i++) {
+                p = value->p + i;
+                if (p[0] == 'u' && p[1] == '=' && p[2] >= '0' && p[2] <= '7'
+                && (i == 0 || p[-1] == ',' || p[-1] == ' '))
+                        return p[2] - '0';
+        }
+        return urgency;
+}
+
+
+/******************************************************************************
+ * RESPONSES
+ ******************************************************************************/
+/**
+ * h2_body -- point a stream's body at part of what it is sending
+ * @s    : the stream
+ * @first: offset of the first byte
+ * @len  : the number of bytes
+ */
+static void h2_body(struct h2_stream_t *s, off_t first, size_t len)
+{
+        if (s->entry)
+                s->p = s->entry->body + first;
+        else if (s->file->map)
+                s->p = s->file->map + first;
+        else
+                s->off = first;
+
+        s->len = len;
+}
+
+
+/**
+ * h2_route -- act on a stream's request, and lay out the response
+ * @c   : the connection
+ * @s   : the stream
+ * @code: RESPONSE if the request is well-formed, else its failure
+ *  RET: 0, or -1 if out of memory
+ */
+static int h2_route(struct conn_t *c, struct h2_stream_t *s, int code)
+{
+        const struct stamp_t *stamp = clock_now();
+        struct range_t range[MAX_RANGES];
+        const struct rep_t *rep;
+        char buf[HEADER_SIZE];
+        const char *body;
+        char *why = "";
+        size_t hlen = 0;
+        size_t len;
+        int nrange = 0;
+
+        s->start = metrics_clock();
+
+        sesinfo(&s->session, c->fd, &c->remote, &s->req);
+
+        record(ACCEPT, &s->session, "");
+
+        /* The counters are served from memory, not from the www root */
+        if (code == RESPONSE && slice_is(&s->req.method, "GET")
+        &&  slice_is(&s->req.target, METRICS_PATH)) {
+                record(RESPONSE, &s->session, "metrics");
+
+                if (s->extra = malloc(METRICS_SIZE), !s->extra)
+                        return -1;
+
+                s->p    = s->extra;
+                s->len  = metrics_render(s->extra, METRICS_SIZE);
+                s->code = RESPONSE;
+                hlen    = http_generated(buf, sizeof(buf), "text/plain; version=0.0.4", s->len);
+                goto head;
+        }
+
+        if (code == RESPONSE)
+                code = conn_lookup(&s->req, &s->entry, &s->file, &s->rep, range, &nrange, &why);
+        else if (code == BAD_REQUEST)
+                why = "Malformed request";
+
+        /* Several ranges would make a multipart body: the whole file will do */
+        if (code == PARTIAL && nrange > 1)
+                code = RESPONSE;
+
+        record(code, &s->session, why);
+
+        rep     = s->entry ? &s->entry->rep : &s->rep;
+        s->code = code;
+
+        switch (code) {
+        case RESPONSE:
+                if (s->entry)
+                        memcpy(buf, s->entry->header, hlen = s->entry->hlen);
+                else
+                        hlen = http_header(buf, sizeof(buf), rep);
+                h2_body(s, 0, rep->size);
+                break;
+        case PARTIAL:
+                len  = range[0].last - range[0].first + 1;
+                hlen = http_partial(buf, sizeof(buf), rep, &range[0], NULL, len);
+                h2_body(s, range[0].first, len);
+                break;
+        case NOT_MODIFIED:
+                hlen = http_not_modified(buf, sizeof(buf), rep);
+                break;
+        case UNSATISFIED:
+                hlen = http_unsatisfied(buf, sizeof(buf), rep);
+                break;
+        default:
+                /* The error page is a whole response, Date and all */
+                hlen = http_error(buf, sizeof(buf), code, why, 0);
+
+                if (body = memmem(buf, hlen, "\r\n\r\n", 4), body) {
+                        body += 4;
+                        len   = buf + hlen - body;
+                        if (s->extra = malloc(len + 1), !s->extra)
+                                return -1;
+                        memcpy(s->extra, body, len);
+                        s->p   = s->extra;
+                        s->len = len;
+                        hlen   = body - buf;
+                }
+                stamp = NULL;
+                break;
+        }
+
+head:
+        /* Its fields, and the Date, are encoded when there is room */
+        if (s->head = malloc(hlen + (stamp ? stamp->date_len : 0)), !s->head)
+                return -1;
+
+        memcpy(s->head, buf, hlen);
+        if (stamp) {
+                memcpy(s->head + hlen, stamp->date, stamp->date_len);
+                hlen += stamp->date_len;
+        }
+        s->hlen = hlen;
+
+        return 0;
+}
+
+
+/**
+ * h2_headers -- queue the HEADERS of a stream's response
+ * @h2: the connection
+ * @s : the stream
+ *  RET: 0, or -1 if the queue has no room for them yet
+ *
+ * The fields come from the HTTP/1.1 text of the header, a line at a
+ * time after the status line, names in lowercase.
+ */
+static int h2_headers(struct h2_t *h2, struct h2_stream_t *s)
+{
+        const char *end = s->head + s->hlen;
+        const char *line;
+        const char *colon;
+        const char *value;
+        const char *eol;
+        char name[64];
+        uint8_t *out;
+        size_t room;
+        size_t nlen;
+        size_t vlen;
+        size_t n;
+        size_t m;
+        int i;
+
+        if (h2->nout + H2_HEADER + GOAWAY_ROOM >= H2_OUT)
+                return -1;
+
+        out  = h2->out + h2->nout + H2_HEADER;
+        room = H2_OUT - GOAWAY_ROOM - h2->nout - H2_HEADER;
+
+        if (n = hpack_status(out, room, STATUS[s->code].http), !n)
+                return -1;
+
+        line = memchr(s->head, '\n', s->hlen);
+
+        for (line = line ? line + 1 : end; line < end; line = eol + 1) {
+                if (eol = memchr(line, '\n', end - line), !eol)
+                        break;
+                if (colon = memchr(line, ':', eol - line), !colon)
+                        continue;
+                if (nlen = colon - line, nlen >= sizeof(name))
+                        continue;
+
+                for (i=0; i<(int)nlen; i++)
+                        name[i] = tolower((unsigned char)line[i]);
+                name[nlen] = '\0';
+
+                for (i=0; HOP_BY_HOP[i] && strcmp(name, HOP_BY_HOP[i]); i++)
+                        ;
+                if (HOP_BY_HOP[i])
+                        continue;
+
+                for (value = colon + 1; value < eol && *value == ' '; value++)
+                        ;
+                vlen = eol - value - (eol[-1] == '\r');
+
+                if (m = hpack_field(out + n, room - n, name, nlen, value, vlen), !m)
+                        return -1;
+                n += m;
+        }
+
+        frame_header(h2->out + h2->nout, n, H2_HEADERS,
+                     FLAG_END_HEADERS | (s->len ? 0 : FLAG_END_STREAM), s->id);
+
+        h2->nout += H2_HEADER + n;
+        s->headed = 1;
+
+        if (s->len == 0)
+                h2_end(h2, s, 1);
+
+        return 0;
+}
+
+
+/******************************************************************************
+ * REQUESTS
+ ******************************************************************************/
+/**
+ * h2_fields -- make a stream's request from the fields of its HEADERS
+ * @h2      : the connection, with the fields in h2->fields
+ * @s       : the stream
+ * @f       : the fields
+ * @n       : the number of fields
+ * @overflow: some fields were too many, or too long, to keep
+ *  RET: RESPONSE, BAD_REQUEST, OVERFLOW, or -1 if out of memory
+ *
+ * The pseudo-fields stand in for the request line, and :authority for
+ * the Host header; the fields are moved to memory of the stream's own.
+ */
+static int h2_fields(struct h2_t *h2, struct h2_stream_t *s, const struct header_t *f,
+                     int n, int overflow)
+{
+        static const struct slice_t host = { "host", 4 };
+        struct slice_t authority = { NULL, 0 };
+        struct slice_t name;
+        struct slice_t value;
+        size_t used;
+        int i;
+
+        used = n ? (size_t)(f[n-1].value.p + f[n-1].value.len - h2->fields) : 0;
+
+        if (s->hbuf = malloc(used + 1), !s->hbuf)
+                return -1;
+
+        memcpy(s->hbuf, h2->fields, used);
+
+        parse_reset(&s->req);
+        s->req.minor = 1;
+
+        #define MOVE(sl) (struct slice_t){ s->hbuf + ((sl).p - h2->fields), (sl).len }
+
+        for (i=0; i<n; i++) {
+                name  = MOVE(f[i].name);
+                value = MOVE(f[i].value);
+
+                if (name.len > 0 && name.p[0] == ':') {
+                        if (slice_is(&name, ":method"))
+                                s->req.method = value;
+                        else if (slice_is(&name, ":path"))
+                                s->req.target = value;
+                        else if (slice_is(&name, ":authority"))
+                                authority = value;
+                        continue;
+                }
+
+                if (s->req.nheaders == MAX_HEADERS) {
+                        overflow = 1;
+                        continue;
+                }
+                s->req.headers[s->req.nheaders++] = (struct header_t){ name, value };
+        }
+
+        #undef MOVE
+
+        if (authority.p && !parse_header(&s->req, "Host")) {
+                if (s->req.nheaders == MAX_HEADERS)
+                        overflow = 1;
+                else
+                        s->req.headers[s->req.nheaders++] = (struct header_t){ host, authority };
+        }
+
+        if (overflow)
+                return OVERFLOW;
+        if (!s->req.method.p || !s->req.target.p)
+                return BAD_REQUEST;
+
+        return RESPONSE;
+}
+
+
+/**
+ * h2_open_stream -- open a stream, at the back of the list
+ *  RET: the stream, or NULL if out of memory
+ */
+static struct h2_stream_t *h2_open_stream(struct h2_t *h2, uint32_t id)
+{
+        struct h2_stream_t **sp;
+        struct h2_stream_t *s;
+
+        if (s = pool_get(&stream_pool), !s)
+                return NULL;
+
+        memset(s, 0, sizeof(*s));
+
+        s->id      = id;
+        s->window  = h2->initial;
+        s->weight  = WEIGHT_DEFAULT;
+        s->urgency = URGENCY_DEFAULT;
+        s->vtime   = h2->vtime;
+
+        for (sp = &h2->streams; *sp; sp = &(*sp)->next)
+                ;
+        *sp = s;
+
+        h2->nstreams++;
+        h2->requests++;
+        h2->last_id = id;
+
+        METRICS_ADD(h2_streams, 1);
+
+        return s;
+}
+
+
+/**
+ * h2_request -- decode a complete header block, and answer it
+ * @c    : the connection
+ * @id   : its stream
+ * @prio : RFC 7540 priority fields, or NULL
+ * @block: the block
+ * @len  : its length
+ */
+static void h2_request(struct conn_t *c, uint32_t id, const uint8_t *prio,
+                       const uint8_t *block, size_t len)
+{
+        struct h2_t *h2 = c->h2;
+        struct header_t f[MAX_HEADERS + 8];
+        struct h2_stream_t *s;
+        int code;
+        int ret;
+        int n;
+
+        /* Every block is decoded, to keep the table in step */
+        ret = hpack_decode(&h2->hpack, block, len, h2->fields, sizeof(h2->fields),
+                           f, MAX_HEADERS + 8, &n);
+
+        if (ret == HPACK_ERROR) {
+                h2_goaway(h2, COMPRESSION_ERROR);
+                return;
+        }
+
+        /* Trailers, or a stream opened after GOAWAY: nothing to answer */
+        if (id <= h2->last_id || h2->goaway)
+                return;
+
+        if (h2->nstreams >= conf.h2_streams) {
+                h2->last_id = id;
+                h2_reset(h2, id, REFUSED_STREAM);
+                return;
+        }
+
+        if (s = h2_open_stream(h2, id), !s) {
+                h2_reset(h2, id, REFUSED_STREAM);
+                return;
+        }
+
+        if (prio)
+                h2_prioritize(s, prio);
+
+        if (code = h2_fields(h2, s, f, n, ret == HPACK_OVERFLOW), code < 0
+        ||  h2_route(c, s, code) < 0) {
+                h2_reset(h2, id, INTERNAL_ERROR);
+                return;
+        }
+
+        s->urgency = h2_urgency(parse_header(&s->req, "Priority"), s->urgency);
+
+        /* Past keepalive_requests, or draining, the connection winds down */
+        if (h2->requests >= conf.keepalive_requests || draining)
+                h2_goaway(h2, NO_ERROR);
+}
+
+
+/**
+ * h2_settings -- apply the client's settings
+ * @h2 : the connection
+ * @p  : the settings
+ * @len: their length (a multiple of 6)
+ *  RET: NO_ERROR, or the error they are
+ */
+static int h2_settings(struct h2_t *h2, const uint8_t *p, size_t len)
+{
+        struct h2_stream_t *s;
+        uint32_t v;
+
+        for (; len >= 6; p += 6, len -= 6) {
+                v = get32(p + 2);
+
+                switch (p[0] << 8 | p[1]) {
+                case SETTINGS_ENABLE_PUSH:
+                        if (v > 1)
+                                return PROTOCOL_ERROR;
+                        break;
+                case SETTINGS_INITIAL_WINDOW_SIZE:
+                        if (v > WINDOW_MAX)
+                                return FLOW_CONTROL_ERROR;
+                        /* Open streams' windows move by the difference */
+                        for (s = h2->streams; s; s = s->next)
+                                s->window += (int64_t)v - h2->initial;
+                        h2->initial = v;
+                        break;
+                case SETTINGS_MAX_FRAME_SIZE:
+                        if (v < H2_FRAME || v > 0xffffff)
+                                return PROTOCOL_ERROR;
+                        h2->max_frame = (v < H2_DATA_MAX) ? v : H2_DATA_MAX;
+                        break;
+                }
+        }
+
+        return NO_ERROR;
+}
+
+
+/**
+ * h2_frame -- act on a frame
+ * @c    : the connection
+ * @type : its type
+ * @flags: its flags
+ * @id   : its stream
+ * @p    : its payload
+ * @len  : the payload's length
+ */
+static void h2_frame(struct conn_t *c, int type, int flags, uint32_t id,
+                     const uint8_t *p, size_t len)
+{
+        struct h2_t *h2 = c->h2;
+        struct h2_stream_t *s;
+        const uint8_t *prio = NULL;
+        uint8_t ack[4];
+        uint32_t inc;
+        int err;
+
+        /* Nothing may come between the frames of a header block */
+        if (h2->block && type != H2_CONTINUATION) {
+                h2_goaway(h2, PROTOCOL_ERROR);
+                return;
+        }
+
+        switch (type) {
+        case H2_DATA:
+                if (id == 0) {
+                        h2_goaway(h2, PROTOCOL_ERROR);
+                        break;
+                }
+                /* Request bodies aren't wanted; the window is given back,
+                 * the stream's too while more of its body may follow */
+                if (len > 0) {
+                        put32(ack, len);
+                        h2_control(h2, H2_WINDOW_UPDATE, 0, 0, ack, sizeof(ack));
+                        if (!(flags & FLAG_END_STREAM) && h2_stream(h2, id))
+                                h2_control(h2, H2_WINDOW_UPDATE, 0, id, ack, sizeof(ack));
+                }
+                break;
+
+        case H2_HEADERS:
+                if (id == 0 || !(id & 1)) {
+                        h2_goaway(h2, PROTOCOL_ERROR);
+                        break;
+                }
+                if (flags & FLAG_PADDED) {
+                        if (len < 1 || p[0] >= len) {
+                                h2_goaway(h2, PROTOCOL_ERROR);
+                                break;
+                        }
+                        len -= 1 + p[0];
+                        p++;
+                }
+                if (flags & FLAG_PRIORITY) {
+                        if (len < 5) {
+                                h2_goaway(h2, FRAME_SIZE_ERROR);
+                                break;
+                        }
+                        prio = p;
+                        p   += 5;
+                        len -= 5;
+                }
+                if (flags & FLAG_END_HEADERS) {
+                        h2_request(c, id, prio, p, len);
+                        break;
+                }
+                /* The rest of the block follows in CONTINUATION frames */
+                if (h2->block = malloc(H2_BLOCK), !h2->block || len > H2_BLOCK) {
+                        h2_goaway(h2, h2->block ? ENHANCE_YOUR_CALM : INTERNAL_ERROR);
+                        break;
+                }
+                memcpy(h2->block, p, len);
+                h2->blen    = len;
+                h2->bstream = id;
+                h2->bflags  = flags;
+                if (prio)
+                        memcpy(h2->bprio, prio, sizeof(h2->bprio));
+                break;
+
+        case H2_CONTINUATION:
+                if (!h2->block || id != h2->bstream) {
+                        h2_goaway(h2, PROTOCOL_ERROR);
+                        break;
+                }
+                if (h2->blen + len > H2_BLOCK) {
+                        h2_goaway(h2, ENHANCE_YOUR_CALM);
+                        break;
+                }
+                memcpy(h2->block + h2->blen, p, len);
+                h2->blen += len;
+
+                if (flags & FLAG_END_HEADERS) {
+                        h2_request(c, id, (h2->bflags & FLAG_PRIORITY) ? h2->bprio : NULL,
+                                   h2->block, h2->blen);
+                        free(h2->block);
+                        h2->block = NULL;
+                }
+                break;
+
+        case H2_PRIORITY:
+                if (id == 0 || len != 5) {
+                        h2_goaway(h2, id ? FRAME_SIZE_ERROR : PROTOCOL_ERROR);
+                        break;
+                }
+                if (s = h2_stream(h2, id), s)
+                        h2_prioritize(s, p);
+                break;
+
+        case H2_PRIORITY_UPDATE:
+                if (id != 0 || len < 4) {
+                        h2_goaway(h2, PROTOCOL_ERROR);
+                        break;
+                }
+                if (s = h2_stream(h2, get32(p) & 0x7fffffff), s) {
+                        struct slice_t value = { (const char *)p + 4, len - 4 };
+                        s->urgency = h2_urgency(&value, URGENCY_DEFAULT);
+                }
+                break;
+
+        case H2_RST_STREAM:
+                if (id == 0 || len != 4) {
+                        h2_goaway(h2, id ? FRAME_SIZE_ERROR : PROTOCOL_ERROR);
+                        break;
+                }
+                if (s = h2_stream(h2, id), s)
+                        h2_end(h2, s, 0);
+                break;
+
+        case H2_SETTINGS:
+                if (id != 0 || len % 6 || ((flags & FLAG_ACK) && len)) {
+                        h2_goaway(h2, id ? PROTOCOL_ERROR : FRAME_SIZE_ERROR);
+                        break;
+                }
+                if (flags & FLAG_ACK)
+                        break;
+                if (err = h2_settings(h2, p, len), err) {
+                        h2_goaway(h2, err);
+                        break;
+                }
+                h2_control(h2, H2_SETTINGS, FLAG_ACK, 0, NULL, 0);
+                break;
+
+        case H2_PING:
+                if (id != 0 || len != 8) {
+                        h2_goaway(h2, id ? PROTOCOL_ERROR : FRAME_SIZE_ERROR);
+                        break;
+                }
+                if (!(flags & FLAG_ACK))
+                        h2_control(h2, H2_PING, FLAG_ACK, 0, p, len);
+                break;
+
+        case H2_GOAWAY:
+                /* The client will open no more: finish what it has */
+                h2->goaway = 1;
+                break;
+
+        case H2_WINDOW_UPDATE:
+                if (len != 4) {
+                        h2_goaway(h2, FRAME_SIZE_ERROR);
+                        break;
+                }
+                inc = get32(p) & 0x7fffffff;
+
+                if (id == 0) {
+                        if (inc == 0 || h2->window + inc > WINDOW_MAX)
+                                h2_goaway(h2, inc ? FLOW_CONTROL_ERROR : PROTOCOL_ERROR);
+                        else
+                                h2->window += inc;
+                } else if (s = h2_stream(h2, id), s) {
+                        if (inc == 0 || s->window + inc > WINDOW_MAX)
+                                h2_reset(h2, id, inc ? FLOW_CONTROL_ERROR : PROTOCOL_ERROR);
+                        else
+                                s->window += inc;
+                }
+                break;
+
+        case H2_PUSH_PROMISE:
+                h2_goaway(h2, PROTOCOL_ERROR);
+                break;
+
+        default:
+                break; /* unknown types are ignored */
+        }
+}
+
+
+/**
+ * h2_frames -- act on every complete frame that has arrived
+ * @c: the connection
+ */
+static void h2_frames(struct conn_t *c)
+{
+        struct h2_t *h2 = c->h2;
+        uint8_t *p = h2->in;
+        size_t left = h2->nin;
+        size_t len;
+
+        /* The client's preface comes first */
+        if (h2->preface < H2_PREFACE_LEN) {
+                len = H2_PREFACE_LEN - h2->preface;
+                len = (left < len) ? left : len;
+
+                if (memcmp(p, H2_PREFACE + h2->preface, len)) {
+                        h2_goaway(h2, PROTOCOL_ERROR);
+                        left = 0;
+                }
+                h2->preface += len;
+                p           += len;
+                left        -= len;
+        }
+
+        while (!h2->fatal && left >= H2_HEADER) {
+                if (len = p[0] << 16 | p[1] << 8 | p[2], len > H2_FRAME) {
+                        h2_goaway(h2, FRAME_SIZE_ERROR);
+                        break;
+                }
+                if (left < H2_HEADER + len)
+                        break;
+
+                h2_frame(c, p[3], p[4], get32(p + 5) & 0x7fffffff, p + H2_HEADER, len);
+
+                p    += H2_HEADER + len;
+                left -= H2_HEADER + len;
+        }
+
+        /* Whatever comes after an error is ignored */
+        if (h2->fatal)
+                left = 0;
+
+        memmove(h2->in, p, left);
+        h2->nin = left;
+}
+
+
+/******************************************************************************
+ * SCHEDULING
+ ******************************************************************************/
+/**
+ * h2_ready -- a stream has DATA to send, and the window to send it
+ */
+static inline int h2_ready(const struct h2_stream_t *s)
+{
+        return s->headed && !s->ended && s->len > 0 && s->window > 0;
+}
+
+
+/**
+ * h2_blocked -- a stream depends on another that can send, and is as urgent
+ * @h2: the connection
+ * @s : the stream
+ *
+ * Streams that depend on a stream that can't send, or no longer exists,
+ * share its place instead (RFC 7540 5.3).
+ */
+static int h2_blocked(struct h2_t *h2, const struct h2_stream_t *s)
+{
+        const struct h2_stream_t *a;
+        uint32_t id = s->parent;
+        int depth;
+
+        for (depth=0; id && depth < DEPTH_MAX; depth++) {
+                if (a = h2_stream(h2, id), !a)
+                        return 0;
+                if (h2_ready(a) && a->urgency <= s->urgency)
+                        return 1;
+                id = a->parent;
+        }
+        return 0;
+}
+
+
+/**
+ * h2_next -- choose the stream the next DATA frame goes to
+ * @h2: the connection
+ *  RET: the stream, or NULL if none can send
+ *
+ * The most urgent, of those not waiting on another, and of those the one
+ * that has had least of its share: each frame sent moves a stream's
+ * virtual time on by its length over its weight (weighted fair queueing).
+ */
+static struct h2_stream_t *h2_next(struct h2_t *h2)
+{
+        struct h2_stream_t *best = NULL;
+        struct h2_stream_t *s;
+
+        for (s = h2->streams; s; s = s->next) {
+                if (!h2_ready(s) || h2_blocked(h2, s))
+                        continue;
+                if (!best || s->urgency < best->urgency
+                || (s->urgency == best->urgency && s->vtime < best->vtime))
+                        best = s;
+        }
+        return best;
+}
+
+
+/**
+ * h2_batch -- gather the next write: the queued frames, then DATA
+ * @h2: the connection, with no write under way
+ *  RET: the number of pieces to write
+ */
+static int h2_batch(struct h2_t *h2)
+{
+        struct h2_stream_t *s;
+        size_t len;
+        int i;
+
+        h2_reap(h2);
+
+        /* Upgraded, the answer to stream 1 waits for the client's preface:
+         * a client may only have room for so much after the 101 */
+        for (s = h2->streams; s && h2->preface == H2_PREFACE_LEN; s = s->next) {
+                if (!s->headed && !s->ended && h2_headers(h2, s) < 0)
+                        break;
+        }
+
+        h2->npiece   = 0;
+        h2->pieceidx = 0;
+        h2->batched  = h2->nout;
+
+        if (h2->nout > 0)
+                h2->piece[h2->npiece++] = (struct h2_piece_t){ (char *)h2->out, -1, 0, h2->nout };
+
+        for (i=0; i<H2_BATCH && h2->window > 0 && !h2->fatal && h2->preface == H2_PREFACE_LEN; i++) {
+                if (s = h2_next(h2), !s)
+                        break;
+
+                len = s->len;
+                len = ((int64_t)len > s->window)  ? (size_t)s->window  : len;
+                len = ((int64_t)len > h2->window) ? (size_t)h2->window : len;
+                len = (len > h2->max_frame) ? h2->max_frame : len;
+
+                frame_header(h2->fh[i], len, H2_DATA, (len == s->len) ? FLAG_END_STREAM : 0, s->id);
+
+                h2->piece[h2->npiece++] = (struct h2_piece_t){ (char *)h2->fh[i], -1, 0, H2_HEADER };
+                h2->piece[h2->npiece++] = (struct h2_piece_t){ s->p, s->file ? s->file->fd : -1, s->off, len };
+
+                if (s->p)
+                        s->p += len;
+                else
+                        s->off += len;
+
+                s->len     -= len;
+                s->window  -= len;
+                h2->window -= len;
+
+                /* A stream that was blocked starts again from now */
+                if (s->vtime < h2->vtime)
+                        s->vtime = h2->vtime;
+                h2->vtime = s->vtime;
+                s->vtime += (uint64_t)len * 256 / s->weight;
+
+                if (s->len == 0)
+                        h2_end(h2, s, 1);
+        }
+
+        return h2->npiece;
+}
+
+
+/******************************************************************************
+ * I/O
+ ******************************************************************************/
+/**
+ * h2_sent -- step over bytes of pieces in memory that have gone out
+ */
+static void h2_sent(struct h2_t *h2, size_t n)
+{
+        struct h2_piece_t *pc;
+
+        for (; n > 0 && n >= h2->piece[h2->pieceidx].len; h2->pieceidx++)
+                n -= h2->piece[h2->pieceidx].len;
+
+        if (n > 0) {
+                pc = &h2->piece[h2->pieceidx];
+                pc->p   += n;
+                pc->len -= n;
+        }
+}
+
+
+/**
+ * h2_write -- send what is queued, a batch at a time
+ * @c       : the connection
+ * @progress: set if anything was sent
+ *  RET: 1 when there is nothing more to send, 0 if the socket is full,
+ *       -1 if it failed
+ */
+static int h2_write(struct conn_t *c, int *progress)
+{
+        struct h2_t *h2 = c->h2;
+        struct iovec iov[MAX_IOV];
+        struct h2_piece_t *pc;
+        ssize_t n;
+        int more;
+        int i;
+
+        for (;;) {
+                if (h2->pieceidx == h2->npiece) {
+                        /* Frames queued since the batch began move up */
+                        memmove(h2->out, h2->out + h2->batched, h2->nout - h2->batched);
+                        h2->nout   -= h2->batched;
+                        h2->batched = 0;
+
+                        if (h2_batch(h2) == 0)
+                                return 1;
+                }
+
+                pc = &h2->piece[h2->pieceidx];
+
+                if (pc->len == 0) {
+                        h2->pieceidx++;
+                        continue;
+                }
+
+                if (pc->p == NULL) {
+                        /* A range of a file, straight from the page cache */
+                        if (n = conn_sendfile(c, pc->fd, &pc->off, pc->off + pc->len), n > 0)
+                                pc->len -= n;
+                        else if (n == 0)
+                                return -1; /* file truncated */
+                } else {
+                        /* A run of pieces in memory goes out in one sendmsg() */
+                        for (i=0; i < MAX_IOV && h2->pieceidx+i < h2->npiece && pc[i].p; i++)
+                                iov[i] = (struct iovec){ pc[i].p, pc[i].len };
+
+                        more = (h2->pieceidx + i < h2->npiece) ? MSG_MORE : 0;
+
+                        if (n = conn_sendv(c, iov, i, more), n > 0)
+                                h2_sent(h2, n);
+                }
+
+                if (n < 0)
+                        return (errno == EAGAIN || errno == EINTR) ? 0 : -1;
+
+                METRICS_ADD(bytes, n);
+                *progress = 1;
+        }
+}
+
+
+/**
+ * h2_read -- read frames and act on them
+ * @c       : the connection
+ * @progress: set if anything was read
+ *  RET: 0 if the socket is empty, or reading must wait on writing;
+ *       1 if it stopped to let the queue empty; -1 at the end or on error
+ */
+static int h2_read(struct conn_t *c, int *progress)
+{
+        struct h2_t *h2 = c->h2;
+        ssize_t n;
+
+        for (;;) {
+                if (h2->fatal)
+                        return 0;
+
+                /* A client that won't take its answers is read no more */
+                if (h2->nout > H2_OUT / 2)
+                        return 1;
+
+                if (n = conn_recv(c, h2->in + h2->nin, sizeof(h2->in) - h2->nin), n == 0)
+                        return -1;
+                if (n < 0)
+                        return (errno == EAGAIN || errno == EINTR) ? 0 : -1;
+
+                h2->nin  += n;
+                *progress = 1;
+
+                h2_frames(c);
+        }
+}
+
+
+/******************************************************************************
+ * CONNECTIONS
+ ******************************************************************************/
+/**
+ * h2_preface -- see if a connection opens with the HTTP/2 preface
+ * @buf: what has arrived
+ * @len: its length
+ *  RET: 1 if it does, 0 if it may (too little has arrived), else -1
+ */
+int h2_preface(const char *buf, size_t len)
+{
+        if (memcmp(buf, H2_PREFACE, (len < H2_PREFACE_LEN) ? len : H2_PREFACE_LEN))
+                return -1;
+
+        return (len >= H2_PREFACE_LEN) ? 1 : 0;
+}
+
+
+/**
+ * base64url -- decode base64url (RFC 4648 5), padded or not
+ * @in  : the text
+ * @out : the bytes
+ * @size: room for them
+ *  RET: the number of bytes, or -1 if the text is malformed or too long
+ */
+static int base64url(const struct slice_t *in, uint8_t *out, size_t size)
+{
+        uint32_t acc = 0;
+        size_t n = 0;
+        size_t i;
+        int bits = 0;
+        int v;
+        char ch;
+
+        for (i=0; i<in->len && in->p[i] != '='; i++) {
+                ch = in->p[i];
+
+                if (ch >= 'A' && ch <= 'Z')      v = ch - 'A';
+                else if (ch >= 'a' && ch <= 'z') v = ch - 'a' + 26;
+                else if (ch >= '0' && ch <= '9') v = ch - '0' + 52;
+                else if (ch == '-')              v = 62;
+                else if (ch == '_')              v = 63;
+                else                             return -1;
+
+                acc   = acc << 6 | v;
+                bits += 6;
+
+                if (bits >= 8) {
+                        if (n == size)
+                                return -1;
+                        bits -= 8;
+                        out[n++] = acc >> bits;
+                }
+        }
+
+        return n;
+}
+
+
+/**
+ * h2_upgradable -- a request asks to be answered in h2c
+ * @req: the request
+ *
+ * It has "Upgrade: h2c" and the settings to start with, well-formed.
+ */
+int h2_upgradable(const struct req_t *req)
+{
+        const struct slice_t *upgrade = parse_header(req, "Upgrade");
+        const struct slice_t *settings = parse_header(req, "HTTP2-Settings");
+        uint8_t p[H2_FRAME];
+        int n;
+        size_t i;
+
+        if (!upgrade || !settings || !slice_is(&req->method, "GET"))
+                return 0;
+
+        if (n = base64url(settings, p, sizeof(p)), n < 0 || n % 6)
+                return 0;
+
+        for (i=0; i + 3 <= upgrade->len; i++) {
+                if (!strncasecmp(upgrade->p + i, "h2c", 3)
+                && (i == 0 || upgrade->p[i-1] == ' ' || upgrade->p[i-1] == ',')
+                && (i + 3 == upgrade->len || upgrade->p[i+3] == ' ' || upgrade->p[i+3] == ','))
+                        return 1;
+        }
+        return 0;
+}
+
+
+/**
+ * h2_new -- start speaking HTTP/2
+ * @c    : the connection
+ * @first: raw bytes to send ahead of the server's settings, or NULL
+ *  RET: the connection's state, or NULL if out of memory (and it is
+ *       to be closed)
+ */
+static struct h2_t *h2_new(struct conn_t *c, const char *first)
+{
+        struct h2_t *h2;
+        uint8_t settings[12];
+
+        if (h2 = pool_get(&h2_pool), !h2) {
+                c->state = CONN_CLOSE;
+                return NULL;
+        }
+
+        memset(h2, 0, sizeof(*h2));
+
+        hpack_init(&h2->hpack);
+
+        h2->window    = WINDOW_DEFAULT;
+        h2->initial   = WINDOW_DEFAULT;
+        h2->max_frame = H2_FRAME;
+
+        if (first) {
+                memcpy(h2->out, first, strlen(first));
+                h2->nout = strlen(first);
+        }
+
+        settings[0] = 0;
+        settings[1] = SETTINGS_MAX_CONCURRENT_STREAMS;
+        put32(settings + 2, conf.h2_streams);
+        settings[6] = 0;
+        settings[7] = SETTINGS_MAX_HEADER_LIST_SIZE;
+        put32(settings + 8, BUFSIZE);
+
+        h2_queue(h2, H2_SETTINGS, 0, 0, settings, sizeof(settings));
+
+        c->h2    = h2;
+        c->state = CONN_H2;
+
+        conn_timeout(c, conf.keepalive_timeout);
+
+        METRICS_ADD(h2_conns, 1);
+
+        return h2;
+}
+
+
+/**
+ * h2_open -- start speaking HTTP/2, the client's preface first
+ * @c   : the connection
+ * @data: what has arrived from the client so far (from the preface on)
+ * @len : its length, at most BUFSIZE
+ */
+void h2_open(struct conn_t *c, const char *data, size_t len)
+{
+        struct h2_t *h2;
+
+        if (h2 = h2_new(c, NULL), !h2)
+                return;
+
+        memcpy(h2->in, data, len);
+        h2->nin = len;
+
+        h2_frames(c);
+}
+
+
+/**
+ * h2_upgrade -- switch to h2c, answering the request as stream 1
+ * @c: the connection, its request parsed and h2_upgradable()
+ */
+void h2_upgrade(struct conn_t *c)
+{
+        static const char *SWITCHING = "HTTP/1.1 101 Switching Protocols\r\n"
+                                       "Connection: Upgrade\r\n"
+                                       "Upgrade: h2c\r\n\r\n";
+        uint8_t settings[H2_FRAME];
+        struct h2_stream_t *s;
+        struct h2_t *h2;
+        int n;
+
+        if (h2 = h2_new(c, SWITCHING), !h2)
+                return;
+
+        n = base64url(parse_header(&c->buf->req, "HTTP2-Settings"), settings, sizeof(settings));
+
+        if (h2_settings(h2, settings, n) != NO_ERROR
+        || !(s = h2_open_stream(h2, 1))
+        || !(s->hbuf = malloc(c->reqlen))) {
+                c->state = CONN_CLOSE;
+                return;
+        }
+
+        /* The request, again, in memory of the stream's own */
+        memcpy(s->hbuf, c->buf->request, c->reqlen);
+        parse_reset(&s->req);
+        parse_request(&s->req, s->hbuf, c->reqlen);
+
+        if (h2_route(c, s, RESPONSE) < 0) {
+                c->state = CONN_CLOSE;
+                return;
+        }
+
+        /* The preface may have followed it already */
+        memcpy(h2->in, c->buf->request + c->reqlen, c->nread - c->reqlen);
+        h2->nin = c->nread - c->reqlen;
+
+        h2_frames(c);
+}
+
+
+/**
+ * h2_run -- read and write until the socket would block both ways
+ * @c: the connection
+ *  RET: 0 if it must wait on the socket, 1 if its state has changed
+ */
+int h2_run(struct conn_t *c)
+{
+        struct h2_t *h2 = c->h2;
+        int progress = 0;
+        int rd;
+        int wr;
+
+        for (;;) {
+                rd = h2_read(c, &progress);
+                wr = h2_write(c, &progress);
+
+                if (rd < 0 || wr < 0) {
+                        c->state = CONN_CLOSE;
+                        return 1;
+                }
+
+                /* Done, once GOAWAY and the last response are out */
+                if (wr == 1 && (h2->fatal || (h2->goaway && h2->nstreams == 0))) {
+                        c->state = CONN_CLOSE;
+                        return 1;
+                }
+
+                /* Reading held back for a queue that is now empty: go on */
+                if (rd == 0 || wr == 0)
+                        break;
+        }
+
+        if (progress)
+                conn_timeout(c, (h2->nstreams > 0 || h2->nout > 0) ? conf.send_timeout
+                                                                    : conf.keepalive_timeout);
+
+        return 0;
+}
+
+
+/**
+ * h2_drain -- send GOAWAY, to finish the streams open and take no more
+ * @c: the connection (run it to send it)
+ */
+void h2_drain(struct conn_t *c)
+{
+        h2_goaway(c->h2, NO_ERROR);
+}
+
+
+/**
+ * h2_free -- release the HTTP/2 state of a connection being closed
+ * @c: the connection
+ */
+void h2_free(struct conn_t *c)
+{
+        struct h2_stream_t *s;
+
+        while (s = c->h2->streams, s) {
+                c->h2->streams = s->next;
+                stream_free(s);
+        }
+
+        hpack_free(&c->h2->hpack);
+        free(c->h2->block);
+        pool_put(&h2_pool, c->h2);
+
+        c->h2 = NULL;
+}
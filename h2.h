@@ -0,0 +1,118 @@
+#ifndef __H2_H
+#define __H2_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include "cache.h"
+#include "hpack.h"
+#include "http.h"
+#include "log.h"
+#include "parse.h"
+
+
+/* Length of a frame header */
+#define H2_HEADER 9
+
+/* Largest frame payload received (the default SETTINGS_MAX_FRAME_SIZE) */
+#define H2_FRAME 16384
+
+/* Largest DATA frame sent, however large the peer allows */
+#define H2_DATA_MAX 65536
+
+/* Room for frames queued ahead of DATA: control frames, and HEADERS */
+#define H2_OUT 16384
+
+/* Largest header block, CONTINUATION frames included */
+#define H2_BLOCK 65536
+
+/* DATA frames gathered into one write */
+#define H2_BATCH 16
+
+/* The client connection preface */
+#define H2_PREFACE "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define H2_PREFACE_LEN 24
+
+
+/* A request, and the response to it */
+struct h2_stream_t {
+        uint32_t id;                 // Stream identifier
+        int64_t window;              // Bytes the peer will take on it
+        uint32_t parent;             // RFC 7540 dependency, 0 for none
+        int weight;                  //   and weight, 1-256
+        int urgency;                 // RFC 9218 urgency, 0 (first) to 7
+        uint64_t vtime;              // Virtual time: its share, taken so far
+        char *hbuf;                  // The fields of the request,
+        struct req_t req;            //   which the request points into
+        struct ses_t session;        // Logging information
+        struct entry_t *entry;       // Cached file being sent, or NULL
+        struct file_t *file;         // File being sent, or NULL
+        struct rep_t rep;            //   and what it is
+        char *head;                  // HTTP/1.1 text of the response header,
+        size_t hlen;                 //   turned into HEADERS when there is room
+        char *extra;                 // A body made up on the spot, or NULL
+        char *p;                     // Next byte of the body; NULL for the file
+        off_t off;                   // Next byte of the file to send
+        size_t len;                  // Bytes of the body left to send
+        int code;                    // Cloth status code of the response
+        uint64_t start;              // metrics_clock() when it was asked for
+        int headed;                  // HEADERS queued
+        int ended;                   // END_STREAM sent, or reset: free it
+        struct h2_stream_t *next;
+};
+
+
+/* A piece of a write: bytes in memory, or a range of a file */
+struct h2_piece_t {
+        char *p;                     // Next byte; NULL for the file
+        int fd;                      // The file
+        off_t off;                   // Next byte of the file to send
+        size_t len;                  // Bytes left to send
+};
+
+
+/* An HTTP/2 connection */
+struct h2_t {
+        struct hpack_t hpack;        // The request decoder's dynamic table
+        uint8_t in[H2_HEADER + H2_FRAME]; // Frames as they arrive
+        size_t nin;                  //   and their bytes
+        size_t preface;              // Bytes of the preface matched
+        uint8_t *block;              // A header block awaiting CONTINUATION,
+        size_t blen;                 //   its length so far,
+        uint32_t bstream;            //   its stream,
+        int bflags;                  //   the flags of its HEADERS
+        uint8_t bprio[5];            //   and their priority fields
+        uint8_t out[H2_OUT];         // Frames queued to go before any DATA
+        size_t nout;                 //   and their bytes
+        size_t batched;              //   of which are in the write under way
+        struct h2_piece_t piece[1 + 2*H2_BATCH]; // The write under way
+        int npiece;
+        int pieceidx;
+        uint8_t fh[H2_BATCH][H2_HEADER]; // Its DATA frame headers
+        struct h2_stream_t *streams; // Open streams, oldest first
+        int nstreams;
+        int requests;                // Streams opened
+        uint32_t last_id;            // Highest stream opened by the client
+        int64_t window;              // Bytes the peer will take, in all
+        int64_t initial;             // SETTINGS_INITIAL_WINDOW_SIZE of the peer
+        size_t max_frame;            // Largest DATA payload to send
+        uint64_t vtime;              // Virtual time of the last DATA frame
+        int goaway;                  // GOAWAY sent or received: no new streams
+        int fatal;                   //   for an error: close once it is out
+        char fields[BUFSIZE];        // Fields of a request, being decoded
+};
+
+
+struct conn_t;
+
+
+/* Function prototypes */
+int h2_preface(const char *buf, size_t len);
+int h2_upgradable(const struct req_t *req);
+void h2_open(struct conn_t *c, const char *data, size_t len);
+void h2_upgrade(struct conn_t *c);
+int h2_run(struct conn_t *c);
+void h2_drain(struct conn_t *c);
+void h2_free(struct conn_t *c);
+
+
+#endif
@@ -0,0 +1,606 @@
+/*
+ * hpack.c -- HTTP/2 header compression (RFC 7541).
+ *
+ * Requests arrive compressed against a static table of common fields and
+ * a dynamic table of recent ones, with strings optionally in a Huffman
+ * code. The decoder keeps the dynamic table as a ring of at most
+ * HPACK_ENTRIES entries, and decodes the Huffman code canonically from
+ * the table of code lengths alone: the codes of RFC 7541 Appendix B are
+ * the canonical ones for those lengths.
+ *
+ * Responses are encoded without the dynamic table, so the encoder keeps
+ * no state: every field is a literal that is not indexed, its name taken
+ * from the static table where it can be. A response header is a few
+ * hundred bytes, and it costs nothing to keep it that way.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "hpack.h"
+
+
+/* The static table (Appendix A), from index 1 */
+static const struct { const char *name; const char *value; } STATIC[]={
+        { ":authority",                  "" },
+        { ":method",                     "GET" },
+        { ":method",                     "POST" },
+        { ":path",                       "/" },
+        { ":path",                       "/index.html" },
+        { ":scheme",                     "http" },
+        { ":scheme",                     "https" },
+        { ":status",                     "200" },
+        { ":status",                     "204" },
+        { ":status",                     "206" },
+        { ":status",                     "304" },
+        { ":status",                     "400" },
+        { ":status",                     "404" },
+        { ":status",                     "500" },
+        { "accept-charset",              "" },
+        { "accept-encoding",             "gzip, deflate" },
+        { "accept-language",             "" },
+        { "accept-ranges",               "" },
+        { "accept",                      "" },
+        { "access-control-allow-origin", "" },
+        { "age",                         "" },
+        { "allow",                       "" },
+        { "authorization",               "" },
+        { "cache-control",               "" },
+        { "content-disposition",         "" },
+        { "content-encoding",            "" },
+        { "content-language",            "" },
+        { "content-length",              "" },
+        { "content-location",            "" },
+        { "content-range",               "" },
+        { "content-type",                "" },
+        { "cookie",                      "" },
+        { "date",                        "" },
+        { "etag",                        "" },
+        { "expect",                      "" },
+        { "expires",                     "" },
+        { "from",                        "" },
+        { "host",                        "" },
+        { "if-match",                    "" },
+        { "if-modified-since",           "" },
+        { "if-none-match",               "" },
+        { "if-range",                    "" },
+        { "if-unmodified-since",         "" },
+        { "last-modified",               "" },
+        { "link",                        "" },
+        { "location",                    "" },
+        { "max-forwards",                "" },
+        { "proxy-authenticate",          "" },
+        { "proxy-authorization",         "" },
+        { "range",                       "" },
+        { "referer",                     "" },
+        { "refresh",                     "" },
+        { "retry-after",                 "" },
+        { "server",                      "" },
+        { "set-cookie",                  "" },
+        { "strict-transport-security",   "" },
+        { "transfer-encoding",           "" },
+        { "user-agent",                  "" },
+        { "vary",                        "" },
+        { "via",                         "" },
+        { "www-authenticate",            "" },
+};
+
+#define STATIC_COUNT (int)(sizeof(STATIC) / sizeof(STATIC[0]))
+
+
+/* Lengths of the Huffman codes of bytes 0-255 (Appendix B); EOS is 30 */
+static const uint8_t HUFFMAN_LEN[256]={
+        13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+        28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+         6, 10, 10, 12, 13,  6,  8, 11, 10, 10,  8, 11,  8,  6,  6,  6,
+         5,  5,  5,  6,  6,  6,  6,  6,  6,  6,  7,  8, 15,  6, 12, 10,
+        13,  6,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7,
+         7,  7,  7,  7,  7,  7,  7,  7,  8,  7,  8, 13, 19, 13, 14,  6,
+        15,  5,  6,  5,  6,  5,  6,  6,  6,  5,  7,  7,  6,  6,  6,  5,
+         6,  7,  6,  5,  5,  6,  7,  7,  7,  7,  7, 15, 11, 14, 13, 28,
+        20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+        24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+        22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+        21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+        26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+        19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+        20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+        26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+};
+
+#define HUFFMAN_MAX 30
+#define HUFFMAN_EOS 256
+
+
+/* The canonical code: codes of each length, and the symbols in code order */
+static uint16_t counts[HUFFMAN_MAX + 1];
+static uint16_t symbols[257];
+
+
+/* Longest string decoded on the stack; longer ones are malloc()ed */
+#define STRING_STACK 4096
+
+
+/**
+ * huffman_init -- sort the symbols into canonical code order
+ */
+static void huffman_init(void)
+{
+        int len;
+        int n = 0;
+        int s;
+
+        for (len=1; len<=HUFFMAN_MAX; len++) {
+                for (s=0; s<=HUFFMAN_EOS; s++) {
+                        if ((s < 256 ? HUFFMAN_LEN[s] : HUFFMAN_MAX) == len) {
+                                symbols[n++] = s;
+                                counts[len]++;
+                        }
+                }
+        }
+}
+
+
+/**
+ * huffman -- decode a Huffman-coded string
+ * @in : the code
+ * @len: its length
+ * @out: the decoded bytes (room for len * 8 / 5 + 1)
+ *  RET: the number of bytes decoded, or -1 if the code is malformed
+ *
+ * A code is read a bit at a time until it is one of those of its length
+ * (first through first + count); a string ends with at most 7 bits of
+ * padding, all ones, the start of EOS.
+ */
+static long huffman(const uint8_t *in, size_t len, char *out)
+{
+        unsigned code = 0;
+        unsigned first = 0;
+        int index = 0;
+        int bits = 0;
+        int ones = 1;
+        long n = 0;
+        size_t i;
+        int b;
+
+        if (!counts[HUFFMAN_MAX])
+                huffman_init();
+
+        for (i=0; i<len; i++) {
+                for (b=7; b>=0; b--) {
+                        code |= (in[i] >> b) & 1;
+                        ones &= (in[i] >> b) & 1;
+                        bits++;
+
+                        if (code - first < counts[bits]) {
+                                if (symbols[index + code - first] == HUFFMAN_EOS)
+                                        return -1;
+                                out[n++] = symbols[index + code - first];
+                                code = first = index = bits = 0;
+                                ones = 1;
+                                continue;
+                        }
+
+                        index += counts[bits];
+                        first  = (first + counts[bits]) << 1;
+                        code <<= 1;
+
+                        if (bits == HUFFMAN_MAX)
+                                return -1;
+                }
+        }
+
+        return (bits <= 7 && ones) ? n : -1;
+}
+
+
+/**
+ * integer -- decode an integer with an n-bit prefix
+ * @p     : the first byte (advanced past the integer)
+ * @end   : the end of the input
+ * @prefix: bits of the first byte that are the integer's
+ * @v     : will hold it
+ *  RET: 0, or -1 if it is truncated or absurdly large
+ */
+static int integer(const uint8_t **p, const uint8_t *end, int prefix, uint32_t *v)
+{
+        uint32_t max = (1u << prefix) - 1;
+        uint32_t x;
+        int shift = 0;
+        uint8_t b;
+
+        if (*p == end)
+                return -1;
+
+        if (x = *(*p)++ & max, x < max) {
+                *v = x;
+                return 0;
+        }
+
+        do {
+                if (*p == end || shift > 21)
+                        return -1;
+                b = *(*p)++;
+                x += (uint32_t)(b & 0x7f) << shift;
+                shift += 7;
+        } while (b & 0x80);
+
+        *v = x;
+        return 0;
+}
+
+
+/**
+ * string -- decode a string literal
+ * @p    : its first byte (advanced past it)
+ * @end  : the end of the input
+ * @stack: STRING_STACK bytes it may be decoded into
+ * @str  : will point to it: into the input, the stack, or *heap
+ * @len  : will hold its length
+ * @heap : will hold memory malloc()ed for it, to be freed, or NULL
+ *  RET: 0, or -1 if it is malformed
+ */
+static int string(const uint8_t **p, const uint8_t *end, char *stack,
+                  const char **str, size_t *len, char **heap)
+{
+        char *out = stack;
+        uint32_t n;
+        long got;
+        int coded;
+
+        *heap = NULL;
+
+        if (*p == end)
+                return -1;
+
+        coded = **p & 0x80;
+
+        if (integer(p, end, 7, &n) < 0 || n > (size_t)(end - *p))
+                return -1;
+
+        if (!coded) {
+                *str = (const char *)*p;
+                *len = n;
+                *p  += n;
+                return 0;
+        }
+
+        /* No code is shorter than 5 bits */
+        if (n * 8 / 5 + 1 > STRING_STACK && (out = *heap = malloc(n * 8 / 5 + 1), !out))
+                return -1;
+
+        if (got = huffman(*p, n, out), got < 0) {
+                free(*heap);
+                *heap = NULL;
+                return -1;
+        }
+
+        *str = out;
+        *len = got;
+        *p  += n;
+        return 0;
+}
+
+
+/**
+ * evict -- drop the oldest entries until the table is within a size
+ * @t   : the table
+ * @size: the size
+ */
+static void evict(struct hpack_t *t, size_t size)
+{
+        struct hpack_entry_t *e;
+
+        while (t->count > 0 && t->size > size) {
+                e = &t->ent[(t->head - t->count + 1 + HPACK_ENTRIES) % HPACK_ENTRIES];
+                t->size -= e->nlen + e->vlen + 32;
+                t->count--;
+                free(e->name);
+                e->name = NULL;
+        }
+}
+
+
+/**
+ * insert -- add a field to the dynamic table, evicting to make room
+ *
+ * The name may be that of an entry about to be evicted (4.4), so it is
+ * copied before anything is.
+ */
+static void insert(struct hpack_t *t, const char *name, size_t nlen,
+                   const char *value, size_t vlen)
+{
+        struct hpack_entry_t *e;
+        size_t size = nlen + vlen + 32;
+        char *p;
+
+        /* One too big for the table just empties it (4.4) */
+        if (size > t->max) {
+                evict(t, 0);
+                return;
+        }
+
+        if (p = malloc(nlen + vlen + 1), !p) {
+                evict(t, 0);  /* can't keep in step with the encoder */
+                return;
+        }
+
+        memcpy(p, name, nlen);
+        memcpy(p + nlen, value, vlen);
+
+        evict(t, t->max - size);
+
+        t->head = (t->head + 1) % HPACK_ENTRIES;
+        e = &t->ent[t->head];
+
+        *e = (struct hpack_entry_t){ p, nlen, vlen };
+
+        t->count++;
+        t->size += size;
+}
+
+
+/**
+ * lookup -- find the field at an index of the static and dynamic tables
+ *  RET: 0, or -1 if there is no such index
+ */
+static int lookup(struct hpack_t *t, uint32_t index, const char **name, size_t *nlen,
+                  const char **value, size_t *vlen)
+{
+        struct hpack_entry_t *e;
+
+        if (index == 0)
+                return -1;
+
+        if (index <= STATIC_COUNT) {
+                *name  = STATIC[index-1].name;
+                *nlen  = strlen(*name);
+                *value = STATIC[index-1].value;
+                *vlen  = strlen(*value);
+                return 0;
+        }
+
+        if (index -= STATIC_COUNT + 1, index >= (uint32_t)t->count)
+                return -1;
+
+        e = &t->ent[(t->head - index + HPACK_ENTRIES) % HPACK_ENTRIES];
+
+        *name  = e->name;
+        *nlen  = e->nlen;
+        *value = e->name + e->nlen;
+        *vlen  = e->vlen;
+        return 0;
+}
+
+
+/**
+ * hpack_init -- start an empty dynamic table
+ */
+void hpack_init(struct hpack_t *t)
+{
+        memset(t, 0, sizeof(*t));
+        t->max = HPACK_TABLE;
+}
+
+
+/**
+ * hpack_free -- release the entries of a dynamic table
+ */
+void hpack_free(struct hpack_t *t)
+{
+        evict(t, 0);
+}
+
+
+/**
+ * hpack_decode -- decode a header block
+ * @t   : the connection's dynamic table
+ * @in  : the block
+ * @len : its length
+ * @buf : where the names and values are copied
+ * @size: its size
+ * @hdr : the fields, pointing into buf
+ * @max : room in hdr
+ * @n   : will hold the number of fields
+ *  RET: HPACK_OK, HPACK_ERROR or HPACK_OVERFLOW
+ *
+ * Every field is decoded, whether or not it can be kept, so that the
+ * table stays as the encoder thinks it is.
+ */
+int hpack_decode(struct hpack_t *t, const uint8_t *in, size_t len, char *buf, size_t size,
+                 struct header_t *hdr, int max, int *n)
+{
+        char stack[2][STRING_STACK];
+        const uint8_t *end = in + len;
+        const char *name;
+        const char *value;
+        char *nheap;
+        char *vheap;
+        size_t nlen;
+        size_t vlen;
+        size_t used = 0;
+        int overflow = 0;
+        uint32_t index;
+        int indexing;
+        int fields = 0;
+
+        *n = 0;
+
+        while (in < end) {
+                nheap = vheap = NULL;
+                indexing = 0;
+
+                if (*in & 0x80) {
+                        /* Indexed (6.1) */
+                        if (integer(&in, end, 7, &index) < 0
+                        ||  lookup(t, index, &name, &nlen, &value, &vlen) < 0)
+                                return HPACK_ERROR;
+                } else if ((*in & 0xe0) == 0x20) {
+                        /* Dynamic table size update (6.3), only ahead of
+                         * the block's first field (4.2) */
+                        if (fields > 0 || integer(&in, end, 5, &index) < 0 || index > HPACK_TABLE)
+                                return HPACK_ERROR;
+                        evict(t, t->max = index);
+                        continue;
+                } else {
+                        /* Literal, with incremental indexing (6.2.1) or without */
+                        indexing = *in & 0x40;
+
+                        if (integer(&in, end, indexing ? 6 : 4, &index) < 0)
+                                return HPACK_ERROR;
+
+                        if (index) {
+                                if (lookup(t, index, &name, &nlen, &value, &vlen) < 0)
+                                        return HPACK_ERROR;
+                        } else if (string(&in, end, stack[0], &name, &nlen, &nheap) < 0) {
+                                return HPACK_ERROR;
+                        }
+
+                        if (string(&in, end, stack[1], &value, &vlen, &vheap) < 0) {
+                                free(nheap);
+                                return HPACK_ERROR;
+                        }
+                }
+
+                fields++;
+
+                /* Keep it, if there is room */
+                if (*n < max && nlen + vlen <= size - used) {
+                        memcpy(buf + used, name, nlen);
+                        hdr[*n].name = (struct slice_t){ buf + used, nlen };
+                        used += nlen;
+
+                        memcpy(buf + used, value, vlen);
+                        hdr[*n].value = (struct slice_t){ buf + used, vlen };
+                        used += vlen;
+
+                        (*n)++;
+                } else {
+                        overflow = 1;
+                }
+
+                /* Last, as it can evict the entry the name came from */
+                if (indexing)
+                        insert(t, name, nlen, value, vlen);
+
+                free(nheap);
+                free(vheap);
+        }
+
+        return overflow ? HPACK_OVERFLOW : HPACK_OK;
+}
+
+
+/**
+ * put_integer -- encode an integer with an n-bit prefix
+ * @out   : where it goes
+ * @room  : bytes there
+ * @first : bits of the first byte above the prefix
+ * @prefix: bits of the first byte that are the integer's
+ * @v     : the integer
+ *  RET: bytes written, or 0 if there is no room
+ */
+static size_t put_integer(uint8_t *out, size_t room, uint8_t first, int prefix, size_t v)
+{
+        size_t max = (1u << prefix) - 1;
+        size_t n = 1;
+
+        if (room < 1)
+                return 0;
+
+        if (v < max) {
+                out[0] = first | v;
+                return 1;
+        }
+
+        out[0] = first | max;
+
+        for (v -= max; ; v >>= 7) {
+                if (n == room)
+                        return 0;
+                if (v < 0x80) {
+                        out[n++] = v;
+                        return n;
+                }
+                out[n++] = 0x80 | (v & 0x7f);
+        }
+}
+
+
+/**
+ * put_string -- encode a string literal, as it is (not Huffman-coded)
+ *  RET: bytes written, or 0 if there is no room
+ */
+static size_t put_string(uint8_t *out, size_t room, const char *s, size_t len)
+{
+        size_t n;
+
+        if (n = put_integer(out, room, 0x00, 7, len), !n || room - n < len)
+                return 0;
+
+        memcpy(out + n, s, len);
+
+        return n + len;
+}
+
+
+/**
+ * hpack_field -- encode a field, as a literal not added to the table
+ * @out  : where it goes
+ * @room : bytes there
+ * @name : its name, lowercase
+ * @nlen : length of the name
+ * @value: its value
+ * @vlen : length of the value
+ *  RET: bytes written, or 0 if there is no room
+ */
+size_t hpack_field(uint8_t *out, size_t room, const char *name, size_t nlen,
+                   const char *value, size_t vlen)
+{
+        size_t n;
+        size_t m;
+        int i;
+
+        for (i=0; i<STATIC_COUNT; i++) {
+                if (strlen(STATIC[i].name) == nlen && !memcmp(STATIC[i].name, name, nlen))
+                        break;
+        }
+
+        if (i < STATIC_COUNT) {
+                n = put_integer(out, room, 0x00, 4, i + 1);
+        } else if (n = put_integer(out, room, 0x00, 4, 0), n) {
+                n = (m = put_string(out + n, room - n, name, nlen), m) ? n + m : 0;
+        }
+
+        if (!n || (m = put_string(out + n, room - n, value, vlen), !m))
+                return 0;
+
+        return n + m;
+}
+
+
+/**
+ * hpack_status -- encode the :status pseudo-header
+ * @out   : where it goes
+ * @room  : bytes there
+ * @status: the status code
+ *  RET: bytes written, or 0 if there is no room
+ */
+size_t hpack_status(uint8_t *out, size_t room, int status)
+{
+        char code[8];
+        int i;
+
+        snprintf(code, sizeof(code), "%03d", (unsigned)status % 1000);
+
+        /* :status 200, 204, 206, 304, 400, 404 and 500 are indexed */
+        for (i=7; i<14; i++) {
+                if (!strcmp(STATIC[i].value, code)) {
+                        if (room < 1)
+                                return 0;
+                        out[0] = 0x80 | (i + 1);
+                        return 1;
+                }
+        }
+
+        return hpack_field(out, room, ":status", 7, code, 3);
+}
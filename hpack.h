@@ -0,0 +1,50 @@
+#ifndef __HPACK_H
+#define __HPACK_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "parse.h"
+
+
+/* Size of the decoder's dynamic table, as advertised (the default) */
+#define HPACK_TABLE 4096
+
+/* Most entries it can hold, each costing at least 32 bytes */
+#define HPACK_ENTRIES (HPACK_TABLE / 32)
+
+
+/* Results of hpack_decode() */
+#define HPACK_OK         0  // every field decoded
+#define HPACK_ERROR     -1  // malformed: a connection error
+#define HPACK_OVERFLOW  -2  // well-formed, but too many or too large to keep
+
+
+/* An entry of the dynamic table: its name, then its value, in one block */
+struct hpack_entry_t {
+        char *name;
+        size_t nlen;
+        size_t vlen;
+};
+
+
+/* The decoder's dynamic table, a ring of entries, newest at head */
+struct hpack_t {
+        struct hpack_entry_t ent[HPACK_ENTRIES];
+        int head;                    // Slot of the newest entry
+        int count;                   // Entries held
+        size_t size;                 // Their size, as RFC 7541 counts it
+        size_t max;                  // The most it may be (size updates)
+};
+
+
+/* Function prototypes */
+void hpack_init(struct hpack_t *t);
+void hpack_free(struct hpack_t *t);
+int hpack_decode(struct hpack_t *t, const uint8_t *in, size_t len, char *buf, size_t size,
+                 struct header_t *hdr, int max, int *n);
+size_t hpack_field(uint8_t *out, size_t room, const char *name, size_t nlen,
+                   const char *value, size_t vlen);
+size_t hpack_status(uint8_t *out, size_t room, int status);
+
+
+#endif
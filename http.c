@@ -0,0 +1,804 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <strings.h>
+#include <stdint.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/param.h>
+#include <sys/sendfile.h>
+#include <netinet/in.h>
+#include "http.h"
+#include "parse.h"
+#include "clock.h"
+#include "mime.h"
+#include "root.h"
+#include "log.h"
+
+
+/* Content codings, by enum encodings, and the suffix of precompressed files */
+const char *ENCODING[]={ "identity", "gzip", "br" };
+const char *ENCODING_SUFFIX[]={ "", ".gz", ".br" };
+
+
+/******************************************************************************
+ * ROUTING
+ * Shared by every connection engine: decide whether a request is legal and
+ * which file (if any) will be sent in response to it.
+ ******************************************************************************/
+/**
+ * http_path -- validate a request and find the file it asks for
+ * @req     : the parsed request
+ * @path    : will hold the file's path, relative to the www directory
+ * @size    : size of the path buffer
+ * @filetype: will point to the MIME type of the file
+ * @why     : will point to an explanatory message on failure
+ *  RET: RESPONSE on success, else the cloth status code of the failure.
+ */
+int http_path(const struct req_t *req, char *path, size_t size, char **filetype, char **why)
+{
+        const char *query;
+        size_t len;
+
+        *why = "";
+
+        /* Only the GET operation is allowed */
+        if (!slice_is(&req->method, "GET"))
+		return *why = "Only GET supported", BAD_METHOD;
+
+        /* The query string (if any) names no file */
+        if (len = req->target.len, query = memchr(req->target.p, '?', len), query)
+                len = query - req->target.p;
+
+        /* Only absolute paths that fit the buffer make sense */
+        if (len == 0 || req->target.p[0] != '/' || len >= size)
+                return *why = "Bad request target", BAD_REQUEST;
+
+        memcpy(path, req->target.p + 1, len - 1);
+        path[len - 1] = '\0';
+
+        /* Catch any illegal relative pathnames (..) and embedded nuls */
+        if (strstr(path, "..") || strlen(path) != len - 1)
+                return *why = "Relative paths not supported", BAD_REQUEST;
+
+        /* In the absence of an explicit filename, default to index.html */
+        if ((len == 1 || path[len - 2] == '/')
+        &&  snprintf(path + len - 1, size - len + 1, "index.html") >= (int)(size - len + 1))
+                return *why = "Bad request target", BAD_REQUEST;
+
+        /* Only files with an extension listed in mime.types are served */
+        if (*filetype = (char *)mime_lookup(path, strlen(path)), !*filetype)
+                return *why = "file extension not supported", NO_METHOD;
+
+        return RESPONSE;
+}
+
+
+/**
+ * http_route -- validate a request and open the file it asks for
+ * @req     : the parsed request
+ * @filetype: will point to the MIME type of the file
+ * @enc     : will hold the content coding of the file opened
+ * @fd_file : will hold the open file descriptor
+ * @why     : will point to an explanatory message on failure
+ *  RET: RESPONSE on success, else the cloth status code of the failure.
+ *
+ * A precompressed sibling (e.g. "style.css.br") is opened instead of the
+ * file if the client accepts its coding.
+ */
+int http_route(const struct req_t *req, char **filetype, int *enc, int *fd_file, char **why)
+{
+        char path[BUFSIZE];
+        char file[BUFSIZE];
+        int accept;
+        int code;
+
+        if (code = http_path(req, path, sizeof(path), filetype, why), code != RESPONSE)
+                return code;
+
+        accept = http_compressible(*filetype) ? http_encodings(req) : 0;
+
+        for (*enc = ENC_COUNT-1; *enc > ENC_IDENTITY; (*enc)--) {
+                if (!(accept & ENC_BIT(*enc)))
+                        continue;
+                if (snprintf(file, sizeof(file), "%s%s", path, ENCODING_SUFFIX[*enc]) >= (int)sizeof(file))
+                        continue;
+                if ((*fd_file = root_open(file, O_RDONLY)) != -1)
+                        return RESPONSE;
+        }
+
+        /* Open the requested file */
+	if ((*fd_file = root_open(path, O_RDONLY)) == -1)
+		return http_unopened(errno, why);
+
+        return RESPONSE;
+}
+
+
+/**
+ * http_unopened -- the status code for a file that could not be opened
+ * @err: errno of the failed open
+ * @why: will point to an explanatory message
+ *  RET: the cloth status code
+ */
+int http_unopened(int err, char **why)
+{
+        switch (err) {
+        case ENOENT:
+        case ENOTDIR:
+                return *why = "file not found", NOT_FOUND;
+        case EXDEV:
+        case ELOOP:
+                return *why = "path leaves the www root", BAD_REQUEST;
+        }
+
+        return *why = "failed to open file", ERROR;
+}
+
+
+/******************************************************************************
+ * HEADERS
+ * Each of these formats the status line and entity headers of a response.
+ * The header is left open, so the caller can add the Date and Connection
+ * headers (and the blank line) that depend on the moment and connection
+ * rather than the file.
+ ******************************************************************************/
+/**
+ * http_rep -- describe a representation of a file
+ * @rep  : the representation
+ * @type : MIME type of the decoded body
+ * @size : length of the body as sent
+ * @enc  : content coding of the body
+ * @ino  : inode of the file it comes from
+ * @fsize: size of that file
+ * @mtime: modification time of that file
+ *
+ * The ETag is made of the file's inode, size and mtime, and the coding,
+ * so it changes whenever the bytes sent could.
+ */
+void http_rep(struct rep_t *rep, const char *type, off_t size, int enc,
+              ino_t ino, off_t fsize, const struct timespec *mtime)
+{
+        rep->type  = type;
+        rep->size  = size;
+        rep->mtime = mtime->tv_sec;
+        rep->enc   = enc;
+
+        snprintf(rep->etag, ETAG_LEN, "\"%lx-%llx-%llx%s%s\"",
+                 (unsigned long)ino, (unsigned long long)fsize,
+                 (unsigned long long)mtime->tv_sec * 1000000000ull + mtime->tv_nsec,
+                 enc ? "-" : "", enc ? ENCODING[enc] : "");
+}
+
+
+/**
+ * validators -- format the headers every representation is sent with
+ *  RET: length of the formatted headers
+ */
+static int validators(char *buf, size_t len, const struct rep_t *rep)
+{
+        char modified[32];
+        int n;
+
+        clock_http(modified, sizeof(modified), rep->mtime);
+
+        n = snprintf(buf, len,
+                     "Last-Modified: %s\r\n"
+                     "ETag: %s\r\n"
+                     "%s%s%s"
+                     "%s",
+                     modified, rep->etag,
+                     rep->enc ? "Content-Encoding: " : "",
+                     rep->enc ? ENCODING[rep->enc] : "",
+                     rep->enc ? "\r\n" : "",
+                     http_compressible(rep->type) ? "Vary: Accept-Encoding\r\n" : "");
+
+        return (n < 0) ? 0 : MIN((size_t)n, len-1);
+}
+
+
+/**
+ * http_header -- format the header of a 200 response
+ * @buf: destination buffer
+ * @len: size of the destination buffer
+ * @rep: the representation sent
+ *  RET: length of the formatted header
+ *
+ * Types that are negotiated get a Vary header whether or not this
+ * response is encoded.
+ */
+int http_header(char *buf, size_t len, const struct rep_t *rep)
+{
+        int n;
+
+        n = snprintf(buf, len,
+                     "HTTP/1.1 200 OK\r\n"
+                     "Content-Type: %s\r\n"
+                     "Content-Length: %lld\r\n"
+                     "Accept-Ranges: bytes\r\n",
+                     rep->type, (long long)rep->size);
+
+        n = (n < 0) ? 0 : MIN((size_t)n, len-1);
+
+        return n + validators(buf + n, len - n, rep);
+}
+
+
+/**
+ * http_generated -- format the header of a 200 response made up on the spot
+ * @buf   : destination buffer
+ * @len   : size of the destination buffer
+ * @type  : MIME type of the body
+ * @length: length of the body
+ *  RET: length of the formatted header
+ */
+int http_generated(char *buf, size_t len, const char *type, size_t length)
+{
+        int n;
+
+        n = snprintf(buf, len,
+                     "HTTP/1.1 200 OK\r\n"
+                     "Content-Type: %s\r\n"
+                     "Content-Length: %zu\r\n"
+                     "Cache-Control: no-store\r\n",
+                     type, length);
+
+        return (n < 0) ? 0 : MIN((size_t)n, len-1);
+}
+
+
+/**
+ * http_partial -- format the header of a 206 response
+ * @buf     : destination buffer
+ * @len     : size of the destination buffer
+ * @rep     : the representation
+ * @range   : the range sent, for a single range
+ * @boundary: the multipart boundary, for several (then range is unused)
+ * @length  : length of the body
+ *  RET: length of the formatted header
+ */
+int http_partial(char *buf, size_t len, const struct rep_t *rep,
+                 const struct range_t *range, const char *boundary, off_t length)
+{
+        int n;
+
+        if (boundary)
+                n = snprintf(buf, len,
+                             "HTTP/1.1 206 Partial Content\r\n"
+                             "Content-Type: multipart/byteranges; boundary=%s\r\n"
+                             "Content-Length: %lld\r\n",
+                             boundary, (long long)length);
+        else
+                n = snprintf(buf, len,
+                             "HTTP/1.1 206 Partial Content\r\n"
+                             "Content-Type: %s\r\n"
+                             "Content-Length: %lld\r\n"
+                             "Content-Range: bytes %lld-%lld/%lld\r\n",
+                             rep->type, (long long)length,
+                             (long long)range->first, (long long)range->last,
+                             (long long)rep->size);
+
+        n = (n < 0) ? 0 : MIN((size_t)n, len-1);
+
+        return n + validators(buf + n, len - n, rep);
+}
+
+
+/**
+ * http_part -- format the header of one part of a multipart/byteranges body
+ * @buf     : destination buffer
+ * @len     : size of the destination buffer
+ * @rep     : the representation
+ * @range   : the range in the part, or NULL for the closing delimiter
+ * @boundary: the multipart boundary
+ *  RET: length of the formatted header
+ */
+int http_part(char *buf, size_t len, const struct rep_t *rep,
+              const struct range_t *range, const char *boundary)
+{
+        int n;
+
+        if (!range)
+                n = snprintf(buf, len, "\r\n--%s--\r\n", boundary);
+        else
+                n = snprintf(buf, len,
+                             "\r\n--%s\r\n"
+                             "Content-Type: %s\r\n"
+                             "Content-Range: bytes %lld-%lld/%lld\r\n\r\n",
+                             boundary, rep->type,
+                             (long long)range->first, (long long)range->last,
+                             (long long)rep->size);
+
+        return (n < 0) ? 0 : MIN((size_t)n, len-1);
+}
+
+
+/**
+ * http_not_modified -- format the header of a 304 response
+ * @buf: destination buffer
+ * @len: size of the destination buffer
+ * @rep: the representation the client already has
+ *  RET: length of the formatted header
+ */
+int http_not_modified(char *buf, size_t len, const struct rep_t *rep)
+{
+        int n;
+
+        n = snprintf(buf, len, "HTTP/1.1 304 Not Modified\r\n");
+        n = (n < 0) ? 0 : MIN((size_t)n, len-1);
+
+        return n + validators(buf + n, len - n, rep);
+}
+
+
+/**
+ * http_unsatisfied -- format the header of a 416 response
+ * @buf: destination buffer
+ * @len: size of the destination buffer
+ * @rep: the representation none of the ranges fall in
+ *  RET: length of the formatted header
+ */
+int http_unsatisfied(char *buf, size_t len, const struct rep_t *rep)
+{
+        int n;
+
+        n = snprintf(buf, len,
+                     "HTTP/1.1 416 Range Not Satisfiable\r\n"
+                     "Content-Range: bytes */%lld\r\n"
+                     "Content-Length: 0\r\n",
+                     (long long)rep->size);
+
+        return (n < 0) ? 0 : MIN((size_t)n, len-1);
+}
+
+
+/**
+ * has_token -- look for a token in a comma-separated header value
+ * @value: the header value, or NULL
+ * @token: the token (compared case-insensitively)
+ */
+static int has_token(const struct slice_t *value, const char *token)
+{
+        struct slice_t item;
+        const char *p;
+        const char *end;
+        const char *comma;
+
+        if (!value)
+                return 0;
+
+        for (p = value->p, end = p + value->len; p < end; p = comma + 1) {
+                if (comma = memchr(p, ',', end - p), !comma)
+                        comma = end;
+
+                for (item.p = p; item.p < comma && *item.p == ' '; item.p++)
+                        ;
+                for (item.len = comma - item.p; item.len && item.p[item.len-1] == ' '; item.len--)
+                        ;
+
+                if (slice_is(&item, token))
+                        return 1;
+        }
+        return 0;
+}
+
+
+/**
+ * http_keepalive -- decide whether the connection outlives a request
+ * @req: the parsed request
+ *  RET: 1 to keep the connection open, else 0
+ *
+ * HTTP/1.1 connections persist unless the client says "Connection: close";
+ * HTTP/1.0 connections close unless it says "Connection: keep-alive".
+ */
+int http_keepalive(const struct req_t *req)
+{
+        const struct slice_t *conn;
+
+        conn = parse_header(req, "Connection");
+
+        if (has_token(conn, "close"))
+                return 0;
+        if (has_token(conn, "keep-alive"))
+                return 1;
+
+        return req->minor >= 1;
+}
+
+
+/**
+ * http_bodyless -- check that a request carries no body
+ * @req: the parsed request
+ *  RET: 1 if it has none, else 0
+ *
+ * Bodies are never read, so a request that has one (any Transfer-Encoding,
+ * or a Content-Length that isn't zero, in any of its copies) is refused:
+ * its body would otherwise be parsed as the next request on the connection.
+ */
+int http_bodyless(const struct req_t *req)
+{
+        const struct header_t *h;
+        size_t i;
+        int n;
+
+        for (n=0; n<req->nheaders; n++) {
+                h = &req->headers[n];
+
+                if (slice_is(&h->name, "Transfer-Encoding"))
+                        return 0;
+
+                if (slice_is(&h->name, "Content-Length")) {
+                        if (h->value.len == 0)
+                                return 0;
+                        for (i=0; i<h->value.len; i++) {
+                                if (h->value.p[i] != '0')
+                                        return 0;
+                        }
+                }
+        }
+        return 1;
+}
+
+
+/******************************************************************************
+ * CONTENT CODING
+ ******************************************************************************/
+/**
+ * http_compressible -- decide whether a type is worth compressing
+ * @filetype: MIME type of the body
+ *  RET: 1 for text-like types, whose encoding is negotiated, else 0
+ */
+int http_compressible(const char *filetype)
+{
+        static const char *TEXTUAL[]={ "application/javascript", "application/json",
+                                       "application/xml", "application/xhtml+xml",
+                                       "application/rss+xml", "application/atom+xml",
+                                       "image/svg+xml", NULL };
+        int i;
+
+        if (!strncmp(filetype, "text/", 5))
+                return 1;
+
+        for (i=0; TEXTUAL[i] != NULL; i++) {
+                if (!strcmp(filetype, TEXTUAL[i]))
+                        return 1;
+        }
+        return 0;
+}
+
+
+/**
+ * q_zero -- check the parameters of an Accept-Encoding item for q=0
+ * @p  : just past the coding
+ * @end: end of the item
+ *  RET: 1 if the item is refused outright, else 0
+ */
+static int q_zero(const char *p, const char *end)
+{
+        while (p < end && (p = memchr(p, ';', end - p))) {
+                for (p++; p < end && *p == ' '; p++)
+                        ;
+                if (end - p >= 2 && (*p == 'q' || *p == 'Q') && p[1] == '=') {
+                        if (p += 2, p == end || *p != '0')
+                                return 0;
+                        for (p++; p < end && (*p == '.' || *p == '0'); p++)
+                                ;
+                        return p == end || *p == ' ' || *p == ';';
+                }
+        }
+        return 0;
+}
+
+
+/**
+ * http_encodings -- find the content codings a client accepts
+ * @req: the parsed request
+ *  RET: a mask of ENC_BIT()s; identity is always acceptable and not in it
+ */
+int http_encodings(const struct req_t *req)
+{
+        const struct slice_t *value;
+        struct slice_t coding;
+        const char *p;
+        const char *end;
+        const char *comma;
+        int mask = 0;
+        int enc;
+
+        if (value = parse_header(req, "Accept-Encoding"), !value)
+                return 0;
+
+        for (p = value->p, end = p + value->len; p < end; p = comma + 1) {
+                if (comma = memchr(p, ',', end - p), !comma)
+                        comma = end;
+
+                for (coding.p = p; coding.p < comma && *coding.p == ' '; coding.p++)
+                        ;
+                for (coding.len = 0; coding.p + coding.len < comma
+                                  && coding.p[coding.len] != ';'
+                                  && coding.p[coding.len] != ' '; coding.len++)
+                        ;
+
+                if (q_zero(coding.p + coding.len, comma))
+                        continue;
+
+                if (slice_is(&coding, "*"))
+                        mask |= ENC_BIT(ENC_GZIP) | ENC_BIT(ENC_BR);
+
+                for (enc = ENC_IDENTITY+1; enc < ENC_COUNT; enc++) {
+                        if (slice_is(&coding, ENCODING[enc]))
+                                mask |= ENC_BIT(enc);
+                }
+        }
+        return mask;
+}
+
+
+/******************************************************************************
+ * CONDITIONS AND RANGES
+ ******************************************************************************/
+/**
+ * http_date -- parse an HTTP date (IMF-fixdate)
+ * @value: the header value
+ *  RET: the time, or -1 if it is not a date
+ */
+static time_t http_date(const struct slice_t *value)
+{
+        char buf[64];
+        struct tm tm = { 0 };
+        char *end;
+
+        if (value->len >= sizeof(buf))
+                return -1;
+
+        memcpy(buf, value->p, value->len);
+        buf[value->len] = '\0';
+
+        if (end = strptime(buf, "%a, %d %b %Y %H:%M:%S GMT", &tm), !end || *end)
+                return -1;
+
+        return timegm(&tm);
+}
+
+
+/**
+ * etag_match -- look for an ETag in an If-None-Match list (weakly)
+ * @value: the header value
+ * @etag : the representation's ETag
+ */
+static int etag_match(const struct slice_t *value, const char *etag)
+{
+        struct slice_t item;
+        const char *p;
+        const char *end;
+        const char *comma;
+
+        for (p = value->p, end = p + value->len; p < end; p = comma + 1) {
+                if (comma = memchr(p, ',', end - p), !comma)
+                        comma = end;
+
+                for (item.p = p; item.p < comma && *item.p == ' '; item.p++)
+                        ;
+                for (item.len = comma - item.p; item.len && item.p[item.len-1] == ' '; item.len--)
+                        ;
+
+                if (item.len == 1 && item.p[0] == '*')
+                        return 1;
+
+                if (item.len > 2 && item.p[0] == 'W' && item.p[1] == '/')
+                        item.p += 2, item.len -= 2;
+
+                if (item.len == strlen(etag) && !memcmp(item.p, etag, item.len))
+                        return 1;
+        }
+        return 0;
+}
+
+
+/**
+ * http_fresh -- decide whether the client's copy is still good
+ * @req: the parsed request
+ * @rep: the representation that would be sent
+ *  RET: 1 to answer 304 Not Modified, else 0
+ *
+ * If-None-Match, when present, decides on its own (RFC 7232 6).
+ */
+int http_fresh(const struct req_t *req, const struct rep_t *rep)
+{
+        const struct slice_t *value;
+        time_t since;
+
+        if (value = parse_header(req, "If-None-Match"), value)
+                return etag_match(value, rep->etag);
+
+        if (value = parse_header(req, "If-Modified-Since"), value) {
+                if (since = http_date(value), since != -1)
+                        return rep->mtime <= since;
+        }
+        return 0;
+}
+
+
+/**
+ * number -- parse a decimal byte position
+ * @p  : first digit
+ * @end: end of the text
+ * @n  : will hold the number
+ *  RET: pointer past the digits, or NULL if there are none or too many
+ */
+static const char *number(const char *p, const char *end, off_t *n)
+{
+        const char *start = p;
+
+        for (*n = 0; p < end && *p >= '0' && *p <= '9'; p++) {
+                if (*n > (INT64_MAX - 9) / 10)
+                        return NULL;
+                *n = *n * 10 + (*p - '0');
+        }
+        return (p == start) ? NULL : p;
+}
+
+
+/**
+ * http_ranges -- find the byte ranges a request asks for
+ * @req  : the parsed request
+ * @rep  : the representation
+ * @range: will hold up to MAX_RANGES ranges, clamped to the body
+ *  RET: the number of ranges; 0 to send the whole body (no Range, an
+ *       If-Range that doesn't match, a malformed or too long list),
+ *       or -1 if no range overlaps the body.
+ */
+int http_ranges(const struct req_t *req, const struct rep_t *rep, struct range_t *range)
+{
+        const struct slice_t *value;
+        const struct slice_t *cond;
+        const char *p;
+        const char *end;
+        off_t first;
+        off_t last;
+        int n = 0;
+        int any = 0;
+
+        if (value = parse_header(req, "Range"), !value)
+                return 0;
+
+        /* If-Range: ranges of this version only, else the whole thing */
+        if (cond = parse_header(req, "If-Range"), cond) {
+                if (cond->len && cond->p[0] == '"') {
+                        if (cond->len != strlen(rep->etag) || memcmp(cond->p, rep->etag, cond->len))
+                                return 0;
+                } else if (http_date(cond) != rep->mtime) {
+                        return 0;
+                }
+        }
+
+        if (value->len < 6 || strncasecmp(value->p, "bytes=", 6))
+                return 0;
+
+        for (p = value->p + 6, end = value->p + value->len; p < end; p++) {
+                while (p < end && (*p == ' ' || *p == '\t'))
+                        p++;
+
+                if (p < end && *p == '-') {
+                        /* The last N bytes */
+                        if (p = number(p+1, end, &last), !p)
+                                return 0;
+                        if (last == 0)
+                                first = rep->size;
+                        else
+                                first = (last >= rep->size) ? 0 : rep->size - last;
+                        last = rep->size - 1;
+                } else {
+                        if (p = number(p, end, &first), !p || p == end || *p != '-')
+                                return 0;
+                        if (p+1 < end && p[1] >= '0' && p[1] <= '9') {
+                                if (p = number(p+1, end, &last), !p || last < first)
+                                        return 0;
+                        } else {
+                                p++;
+                                last = rep->size - 1;
+                        }
+                        if (last >= rep->size)
+                                last = rep->size - 1;
+                }
+
+                while (p < end && (*p == ' ' || *p == '\t'))
+                        p++;
+                if (p < end && *p != ',')
+                        return 0;
+
+                any = 1;
+
+                /* Ranges outside the body are dropped */
+                if (first >= rep->size)
+                        continue;
+                if (n == MAX_RANGES)
+                        return 0;
+
+                range[n++] = (struct range_t){ first, last };
+        }
+
+        if (!any)
+                return 0;
+
+        return n ? n : -1;
+}
+
+
+/**
+ * http_error -- format a complete HTTP error response into a buffer
+ * @buf    : destination buffer
+ * @len    : size of the destination buffer
+ * @code     : the cloth status code
+ * @message  : an additional explanatory message
+ * @keepalive: the connection stays open after it
+ *  RET: length of the formatted response
+ *
+ * Only an error in the framing of a request (a malformed or oversized
+ * one) must close the connection, since whatever follows it on the wire
+ * can no longer be trusted; after any other, the next request is read.
+ */
+int http_error(char *buf, size_t len, int code, const char *message, int keepalive)
+{
+        char body[256];
+        int blen;
+        int n;
+
+        blen = snprintf(body, sizeof(body), "cloth says: %hd %s\r\n",
+                        STATUS[code].http, message);
+        blen = MIN((size_t)blen, sizeof(body)-1);
+
+        n = snprintf(buf, len,
+                     "HTTP/1.1 %hd %s\r\n"
+                     "Content-Type: text/plain\r\n"
+                     "Content-Length: %d\r\n"
+                     "%s"
+                     "Connection: %s\r\n\r\n"
+                     "%s",
+                     STATUS[code].http, STATUS[code].reason, blen,
+                     clock_now()->date, keepalive ? "keep-alive" : "close", body);
+
+        return (n < 0) ? 0 : MIN((size_t)n, len-1);
+}
+
+
+/******************************************************************************
+ * TRANSMISSION
+ ******************************************************************************/
+/**
+ * send_file -- send part of a file over a socket without copying it
+ * @fd_socket: the socket
+ * @fd_file  : the open file
+ * @offset   : offset of the next byte to send (advanced by the bytes sent)
+ * @end      : offset one past the last byte to send
+ *  RET: bytes sent, 0 if the file ended early, else -1 with errno set
+ *
+ * The body goes from the page cache to the socket with sendfile(). Should
+ * the file system not support that, it falls back to pread() and send()
+ * through a stack buffer, re-reading whatever a short send left behind.
+ * On a non-blocking socket a short count or EAGAIN simply means "call
+ * again when the socket is writable".
+ */
+ssize_t send_file(int fd_socket, int fd_file, off_t *offset, off_t end)
+{
+        char block[BUFSIZE];
+        ssize_t n;
+
+        n = sendfile(fd_socket, fd_file, offset, end - *offset);
+
+        if (n >= 0 || (errno != EINVAL && errno != ENOSYS))
+                return n;
+
+        if (n = pread(fd_file, block, MIN(BUFSIZE, end - *offset), *offset), n <= 0)
+                return n;
+
+        if (n = send(fd_socket, block, n, MSG_NOSIGNAL), n > 0)
+                *offset += n;
+
+        return n;
+}
@@ -0,0 +1,73 @@
+#ifndef __HTTP_H
+#define __HTTP_H
+
+#include <time.h>
+#include <sys/types.h>
+#include "parse.h"
+
+
+/* For static buffers */
+#define BUFSIZE 8096
+
+/* Room for the status line and headers of a response */
+#define HEADER_SIZE 512
+
+
+/* Room for an ETag, quotes included */
+#define ETAG_LEN 64
+
+/* Most ranges answered at once; the whole file is sent for more */
+#define MAX_RANGES 16
+
+
+/* Content codings, least preferred first */
+enum encodings { ENC_IDENTITY, ENC_GZIP, ENC_BR, ENC_COUNT };
+
+#define ENC_BIT(enc) (1 << (enc))
+
+extern const char *ENCODING[];
+extern const char *ENCODING_SUFFIX[];
+
+
+/* A representation of a file: what its entity headers describe */
+struct rep_t {
+        const char *type;            // MIME type of the decoded body
+        off_t size;                  // Length of the body as sent
+        time_t mtime;                // Last-Modified
+        int enc;                     // Content coding
+        char etag[ETAG_LEN];         // Strong validator, quoted
+};
+
+
+/* A byte range of a representation, both ends included */
+struct range_t {
+        off_t first;
+        off_t last;
+};
+
+
+/* Function prototypes */
+int http_path(const struct req_t *req, char *path, size_t size, char **filetype, char **why);
+int http_route(const struct req_t *req, char **filetype, int *enc, int *fd_file, char **why);
+int http_unopened(int err, char **why);
+void http_rep(struct rep_t *rep, const char *type, off_t size, int enc,
+              ino_t ino, off_t fsize, const struct timespec *mtime);
+int http_header(char *buf, size_t len, const struct rep_t *rep);
+int http_generated(char *buf, size_t len, const char *type, size_t length);
+int http_partial(char *buf, size_t len, const struct rep_t *rep,
+                 const struct range_t *range, const char *boundary, off_t length);
+int http_part(char *buf, size_t len, const struct rep_t *rep,
+              const struct range_t *range, const char *boundary);
+int http_not_modified(char *buf, size_t len, const struct rep_t *rep);
+int http_unsatisfied(char *buf, size_t len, const struct rep_t *rep);
+int http_fresh(const struct req_t *req, const struct rep_t *rep);
+int http_ranges(const struct req_t *req, const struct rep_t *rep, struct range_t *range);
+int http_compressible(const char *filetype);
+int http_encodings(const struct req_t *req);
+int http_keepalive(const struct req_t *req);
+int http_bodyless(const struct req_t *req);
+int http_error(char *buf, size_t len, int code, const char *message, int keepalive);
+ssize_t send_file(int fd_socket, int fd_file, off_t *offset, off_t end);
+
+
+#endif
@@ -0,0 +1,690 @@
+/*
+ * listing.c -- list the directories that have no index.html.
+ *
+ * With listing=1, a request for a directory ("/a/b/") that has no
+ * index.html is answered with a page listing its files and directories.
+ * Only what could be served is listed: files with a type in mime.types,
+ * and directories; names starting with '.', names a link can't reach
+ * (see linkable()) and symbolic links are left out. The directory is opened with root_open(), so it can't be one
+ * outside the www root.
+ *
+ * A directory is read (readdir(), and an fstatat() per entry) the first
+ * time it is asked for, into an array sorted by name, and kept. From
+ * then on the inotify events cache_notify() passes on keep it current an
+ * entry at a time: the file named is found by binary search and stat()ed
+ * alone, or removed. The directory is not held open in between, so that
+ * its removal is reported too. Without inotify, a listing is read again
+ * once its directory's mtime changes, or after open_files_ttl seconds.
+ *
+ * A large directory is listed listing_page entries at a time, with
+ * "?page=2" and so on. Each page is rendered the first time it is asked
+ * for and kept as an entry (see cache_entry()), so it is sent like any
+ * cached file, validators and ranges included. A change drops only the
+ * pages from the one it falls on onwards (and the one before, whose
+ * "next" link may go). Each worker keeps listing_dirs listings, least
+ * recently used dropped first.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <time.h>
+#include <sys/param.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include "listing.h"
+#include "http.h"
+#include "mime.h"
+#include "root.h"
+#include "conf.h"
+#include "log.h"
+
+
+/* A page being rendered */
+struct buf_t { char *p; size_t len; size_t room; int failed; };
+
+#define put_str(b, s) put((b), (s), sizeof(s) - 1)
+
+
+static struct listing_t *listings;
+static int nlistings;
+
+
+/**
+ * per_page -- the entries listed on a page
+ */
+static size_t per_page(void)
+{
+        return (conf.listing_page > 0) ? (size_t)conf.listing_page : SIZE_MAX;
+}
+
+
+/**
+ * pages -- the pages a listing takes (an empty one takes one)
+ */
+static size_t pages(const struct listing_t *l)
+{
+        return l->n ? (l->n - 1) / per_page() + 1 : 1;
+}
+
+
+/******************************************************************************
+ * ENTRIES
+ ******************************************************************************/
+/**
+ * by_name -- qsort() comparison of entries
+ */
+static int by_name(const void *a, const void *b)
+{
+        return strcmp(((const struct dent_t *)a)->name, ((const struct dent_t *)b)->name);
+}
+
+
+/**
+ * search -- find where a name is, or would go, in a listing
+ * @l    : the listing
+ * @name : the name
+ * @found: will be 1 if it is there, else 0
+ *  RET: its index
+ */
+static size_t search(const struct listing_t *l, const char *name, int *found)
+{
+        size_t lo = 0;
+        size_t hi = l->n;
+        size_t mid;
+        int cmp;
+
+        while (lo < hi) {
+                mid = lo + (hi - lo) / 2;
+
+                if (cmp = strcmp(l->ent[mid].name, name), cmp == 0)
+                        return *found = 1, mid;
+                if (cmp < 0)
+                        lo = mid + 1;
+                else
+                        hi = mid;
+        }
+
+        return *found = 0, lo;
+}
+
+
+/**
+ * linkable -- check that a link to a name leads back to it
+ * @name: the name
+ *  RET: 1 if it does, else 0
+ *
+ * Paths are not percent-decoded, so a name a browser would escape in a
+ * link (spaces, '%', non-ASCII), or read as the start of a query or a
+ * fragment ('?', '#'), could only be linked to as something else.
+ */
+static int linkable(const char *name)
+{
+        const unsigned char *p;
+
+        for (p = (const unsigned char *)name; *p; p++) {
+                if (*p <= ' ' || *p >= 0x7f || strchr("\"#%<>?\\^`{|}", *p))
+                        return 0;
+        }
+        return 1;
+}
+
+
+/**
+ * describe -- stat an entry of a directory, if it is one to list
+ * @fd  : the directory
+ * @name: the entry's name
+ * @d   : will describe it (but for its name)
+ *  RET: 0 if it is listed, else -1
+ */
+static int describe(int fd, const char *name, struct dent_t *d)
+{
+        struct stat st;
+
+        if (name[0] == '.' || !linkable(name)
+        ||  fstatat(fd, name, &st, AT_SYMLINK_NOFOLLOW) < 0)
+                return -1;
+
+        if (S_ISDIR(st.st_mode))
+                d->dir = 1;
+        else if (S_ISREG(st.st_mode) && mime_lookup(name, strlen(name)))
+                d->dir = 0;
+        else
+                return -1;
+
+        d->size  = st.st_size;
+        d->mtime = st.st_mtim.tv_sec;
+
+        return 0;
+}
+
+
+/**
+ * insert_at -- add an entry to a listing
+ * @l: the listing
+ * @i: the index it goes at
+ * @d: the entry (its name malloc()ed; the listing takes it)
+ *  RET: 0 on success, -1 if out of memory
+ */
+static int insert_at(struct listing_t *l, size_t i, const struct dent_t *d)
+{
+        struct dent_t *more;
+        size_t room;
+
+        if (l->n == l->room) {
+                room = l->room ? 2 * l->room : 64;
+                if (more = realloc(l->ent, room * sizeof(*more)), !more)
+                        return -1;
+                l->ent  = more;
+                l->room = room;
+        }
+
+        memmove(&l->ent[i+1], &l->ent[i], (l->n - i) * sizeof(*l->ent));
+
+        l->ent[i] = *d;
+        l->n++;
+
+        return 0;
+}
+
+
+/**
+ * remove_at -- take an entry out of a listing
+ * @l: the listing
+ * @i: the index of the entry
+ */
+static void remove_at(struct listing_t *l, size_t i)
+{
+        free(l->ent[i].name);
+
+        memmove(&l->ent[i], &l->ent[i+1], (l->n - i - 1) * sizeof(*l->ent));
+
+        l->n--;
+}
+
+
+/**
+ * invalidate -- drop the pages a change to a listing affects
+ * @l: the listing
+ * @i: the index of the entry added, changed or removed
+ */
+static void invalidate(struct listing_t *l, size_t i)
+{
+        size_t k;
+
+        k = i / per_page();
+
+        for (k = k ? k - 1 : 0; k < l->npage; k++) {
+                if (l->page[k]) {
+                        cache_release(l->page[k]);
+                        l->page[k] = NULL;
+                }
+        }
+
+        clock_gettime(CLOCK_REALTIME, &l->changed);
+}
+
+
+/******************************************************************************
+ * LISTINGS
+ ******************************************************************************/
+/**
+ * listing_free -- release a listing (pages still being sent live on)
+ * @l: the listing (freed on return)
+ */
+static void listing_free(struct listing_t *l)
+{
+        size_t i;
+
+        for (i=0; i<l->npage; i++) {
+                if (l->page[i])
+                        cache_release(l->page[i]);
+        }
+        for (i=0; i<l->n; i++)
+                free(l->ent[i].name);
+
+        free(l->page);
+        free(l->ent);
+        free(l->dir);
+        free(l->url);
+        free(l);
+}
+
+
+/**
+ * listing_drop -- forget a listing
+ * @l: the listing
+ */
+static void listing_drop(struct listing_t *l)
+{
+        struct listing_t **p;
+
+        for (p = &listings; *p; p = &(*p)->next) {
+                if (*p == l) {
+                        *p = l->next;
+                        nlistings--;
+                        break;
+                }
+        }
+
+        listing_free(l);
+}
+
+
+/**
+ * listing_read -- read a directory into a new listing
+ * @dir: the directory, relative to the www root ("." for the root)
+ * @url: its path in URLs
+ *  RET: the listing, or NULL with errno set
+ */
+static struct listing_t *listing_read(const char *dir, const char *url)
+{
+        struct listing_t *l;
+        struct dirent *de;
+        struct dent_t d;
+        struct stat st;
+        DIR *dp;
+        int err;
+        int fd;
+
+        if (l = calloc(1, sizeof(*l)), !l)
+                return NULL;
+
+        l->dir = strdup(dir);
+        l->url = strdup(url);
+
+        if (!l->dir || !l->url)
+                goto fail;
+
+        if (fd = root_open(dir, O_RDONLY|O_DIRECTORY|O_CLOEXEC), fd < 0)
+                goto fail;
+
+        /* Watched before it is read, so that no change goes unseen */
+        l->watched = (cache_watch(dir) == 0);
+
+        if (fstat(fd, &st) < 0 || (dp = fdopendir(fd)) == NULL) {
+                close(fd);
+                goto fail;
+        }
+
+        while ((de = readdir(dp)) != NULL) {
+                if (describe(fd, de->d_name, &d) < 0)
+                        continue;
+                if (!(d.name = strdup(de->d_name)) || insert_at(l, l->n, &d) < 0) {
+                        free(d.name);
+                        closedir(dp);
+                        goto fail;
+                }
+        }
+
+        closedir(dp);
+
+        qsort(l->ent, l->n, sizeof(*l->ent), by_name);
+
+        l->ino     = st.st_ino;
+        l->dmtime  = st.st_mtim;
+        l->expires = time(NULL) + conf.open_files_ttl;
+
+        clock_gettime(CLOCK_REALTIME, &l->changed);
+
+        return l;
+
+fail:
+        err = errno;
+        listing_free(l);
+        errno = err;
+        return NULL;
+}
+
+
+/**
+ * stale -- check a listing inotify doesn't keep current
+ * @l: the listing
+ *  RET: 1 if it must be read again, else 0
+ */
+static int stale(const struct listing_t *l)
+{
+        struct stat st;
+        int fd;
+
+        if (l->watched)
+                return 0;
+
+        if (time(NULL) >= l->expires || (fd = root_open(l->dir, O_PATH|O_DIRECTORY|O_CLOEXEC)) < 0)
+                return 1;
+
+        if (fstat(fd, &st) < 0)
+                st.st_nlink = 0;
+
+        close(fd);
+
+        return st.st_nlink == 0
+            || st.st_ino != l->ino
+            || st.st_mtim.tv_sec  != l->dmtime.tv_sec
+            || st.st_mtim.tv_nsec != l->dmtime.tv_nsec;
+}
+
+
+/******************************************************************************
+ * PAGES
+ ******************************************************************************/
+/**
+ * put -- append bytes to a page
+ */
+static void put(struct buf_t *b, const char *s, size_t len)
+{
+        size_t room;
+        char *more;
+
+        if (b->failed)
+                return;
+
+        if (b->len + len > b->room) {
+                for (room = b->room ? b->room : 4096; room < b->len + len; room *= 2)
+                        ;
+                if (more = realloc(b->p, room), !more) {
+                        b->failed = 1;
+                        return;
+                }
+                b->p    = more;
+                b->room = room;
+        }
+
+        memcpy(b->p + b->len, s, len);
+        b->len += len;
+}
+
+
+/**
+ * putf -- append formatted text (a line's worth at most) to a page
+ */
+static void putf(struct buf_t *b, const char *fmt, ...)
+{
+        char line[256];
+        va_list ap;
+        int n;
+
+        va_start(ap, fmt);
+        n = vsnprintf(line, sizeof(line), fmt, ap);
+        va_end(ap);
+
+        if (n > 0)
+                put(b, line, MIN((size_t)n, sizeof(line)-1));
+}
+
+
+/**
+ * put_html -- append text to a page, escaped for HTML
+ */
+static void put_html(struct buf_t *b, const char *s)
+{
+        const char *run;
+        const char *ent;
+
+        for (run = s; *s; s++) {
+                switch (*s) {
+                case '&':  ent = "&amp;";  break;
+                case '<':  ent = "&lt;";   break;
+                case '>':  ent = "&gt;";   break;
+                case '"':  ent = "&quot;"; break;
+                case '\'': ent = "&#39;";  break;
+                default:   continue;
+                }
+                put(b, run, s - run);
+                put(b, ent, strlen(ent));
+                run = s + 1;
+        }
+
+        put(b, run, s - run);
+}
+
+
+/**
+ * render -- render a page of a listing
+ * @l: the listing
+ * @k: the page, from 0
+ *  RET: the page, or NULL if out of memory
+ */
+static struct entry_t *render(struct listing_t *l, size_t k)
+{
+        struct buf_t b = { NULL, 0, 0, 0 };
+        struct entry_t **more;
+        const struct dent_t *d;
+        const char *type;
+        char when[32];
+        struct tm tm;
+        size_t first;
+        size_t last;
+        size_t n;
+        size_t i;
+
+        if (k >= l->npage) {
+                n = pages(l);
+                if (more = realloc(l->page, n * sizeof(*more)), !more)
+                        return NULL;
+                memset(more + l->npage, 0, (n - l->npage) * sizeof(*more));
+                l->page  = more;
+                l->npage = n;
+        }
+
+        first = k * per_page();
+        last  = (l->n - first < per_page()) ? l->n : first + per_page();
+
+        put_str(&b, "<!DOCTYPE html>\n<html><head><meta charset=\"utf-8\"><title>Index of ");
+        put_html(&b, l->url);
+        put_str(&b, "</title></head>\n<body>\n<h1>Index of ");
+        put_html(&b, l->url);
+        put_str(&b, "</h1>\n<table>\n");
+
+        if (strcmp(l->dir, "."))
+                put_str(&b, "<tr><td><a href=\"../\">../</a></td><td></td><td></td></tr>\n");
+
+        for (i = first; i < last; i++) {
+                d = &l->ent[i];
+
+                gmtime_r(&d->mtime, &tm);
+                strftime(when, sizeof(when), "%Y-%m-%d %H:%M", &tm);
+
+                /* "./", so a name like "x:y" isn't taken for a scheme */
+                put_str(&b, "<tr><td><a href=\"./");
+                put_html(&b, d->name);
+                put(&b, "/", d->dir);
+                put_str(&b, "\">");
+                put_html(&b, d->name);
+                put(&b, "/", d->dir);
+                put_str(&b, "</a></td><td>");
+                if (d->dir)
+                        put_str(&b, "-");
+                else
+                        putf(&b, "%lld", (long long)d->size);
+                putf(&b, "</td><td>%s</td></tr>\n", when);
+        }
+
+        put_str(&b, "</table>\n");
+
+        if (k > 0 || last < l->n) {
+                put_str(&b, "<p>");
+                if (k > 0)
+                        putf(&b, "<a href=\"?page=%zu\">previous</a> ", k);
+                putf(&b, "page %zu", k + 1);
+                if (last < l->n)
+                        putf(&b, " <a href=\"?page=%zu\">next</a>", k + 2);
+                put_str(&b, "</p>\n");
+        }
+
+        put_str(&b, "</body></html>\n");
+
+        if (b.failed) {
+                free(b.p);
+                return NULL;
+        }
+
+        if (type = mime_lookup("index.html", 10), !type)
+                type = "text/html";
+
+        return l->page[k] = cache_entry(l->url, type, b.p, b.len, l->ino, &l->changed);
+}
+
+
+/******************************************************************************
+ * INTERFACE
+ ******************************************************************************/
+/**
+ * listing_get -- list a directory, for a request its index.html failed
+ * @req  : the request
+ * @path : the file that was not found, e.g. "a/b/index.html"
+ * @entry: will point to the page, which the caller must cache_release()
+ * @why  : will point to an explanatory message on failure
+ *  RET: RESPONSE on success, else the cloth status code of the failure
+ *       (NOT_FOUND, leaving why alone, if the request is not for a
+ *       directory at all).
+ */
+int listing_get(const struct req_t *req, const char *path, struct entry_t **entry, char **why)
+{
+        struct listing_t **p;
+        struct listing_t *l;
+        char dir[BUFSIZE];
+        char url[BUFSIZE];
+        const char *query;
+        const char *end;
+        size_t len;
+        size_t k = 0;
+
+        /* Only a request for a directory, "/a/b/", was given index.html */
+        end = req->target.p + req->target.len;
+        if (query = memchr(req->target.p, '?', req->target.len), query)
+                end = query;
+        if (end == req->target.p || end[-1] != '/')
+                return NOT_FOUND;
+
+        /* "a/b/index.html" lists "a/b"; "index.html", the root, "." */
+        len = strlen(path) - strlen("index.html");
+
+        if (len == 0)
+                snprintf(dir, sizeof(dir), ".");
+        else
+                snprintf(dir, sizeof(dir), "%.*s", (int)len - 1, path);
+
+        snprintf(url, sizeof(url), "/%.*s", (int)len, path);
+
+        /* Names inotify couldn't report on, and hidden ones, aren't listed */
+        if ((len && dir[0] == '.') || strstr(dir, "/.") || strstr(dir, "//"))
+                return NOT_FOUND;
+
+        /* "?page=N", from 1 */
+        if (query && req->target.p + req->target.len - query > 6 && !memcmp(query, "?page=", 6)) {
+                for (query += 6; query < req->target.p + req->target.len
+                              && *query >= '0' && *query <= '9' && k < 100000000; query++)
+                        k = 10*k + (*query - '0');
+                k = k ? k - 1 : 0;
+        }
+
+        /* The most recently used go first */
+        for (p = &listings; *p && strcmp((*p)->dir, dir); p = &(*p)->next)
+                ;
+
+        if (l = *p, l) {
+                *p = l->next;
+                nlistings--;
+                if (stale(l)) {
+                        listing_free(l);
+                        l = NULL;
+                }
+        }
+
+        if (!l && !(l = listing_read(dir, url)))
+                return http_unopened(errno, why);
+
+        while (listings && nlistings >= conf.listing_dirs) {
+                for (p = &listings; (*p)->next; p = &(*p)->next)
+                        ;
+                listing_drop(*p);
+        }
+
+        l->next  = listings;
+        listings = l;
+        nlistings++;
+
+        if (k >= pages(l))
+                return *why = "no such page", NOT_FOUND;
+
+        if ((k >= l->npage || !l->page[k]) && !render(l, k))
+                return *why = "out of memory", ERROR;
+
+        *entry = l->page[k];
+        (*entry)->refs++;
+
+        return *why = "listing", RESPONSE;
+}
+
+
+/**
+ * listing_notify -- bring a listing up to date with an inotify event
+ * @dir : the directory the event is about ("." for the root)
+ * @name: the name of the entry in it
+ * @mask: the event
+ */
+void listing_notify(const char *dir, const char *name, uint32_t mask)
+{
+        struct listing_t *l;
+        struct dent_t d;
+        int listed;
+        int found;
+        size_t i;
+        int fd;
+
+        for (l = listings; l && strcmp(l->dir, dir); l = l->next)
+                ;
+        if (!l)
+                return;
+
+        /* The directory itself going away is reported as well */
+        if (fd = root_open(dir, O_PATH|O_DIRECTORY|O_CLOEXEC), fd < 0) {
+                listing_drop(l);
+                return;
+        }
+
+        listed = !(mask & (IN_DELETE|IN_MOVED_FROM)) && describe(fd, name, &d) == 0;
+
+        close(fd);
+
+        i = search(l, name, &found);
+
+        if (listed) {
+                if (found) {
+                        if (l->ent[i].size == d.size && l->ent[i].mtime == d.mtime
+                        &&  l->ent[i].dir  == d.dir)
+                                return;
+                        d.name    = l->ent[i].name;
+                        l->ent[i] = d;
+                } else if (!(d.name = strdup(name)) || insert_at(l, i, &d) < 0) {
+                        /* It can't be kept current, so it must be read again */
+                        free(d.name);
+                        listing_drop(l);
+                        return;
+                }
+        } else if (found) {
+                remove_at(l, i);
+        } else {
+                return;
+        }
+
+        invalidate(l, i);
+}
+
+
+/**
+ * listing_flush -- drop every listing, to be read again when asked for
+ *
+ * For when inotify events were lost.
+ */
+void listing_flush(void)
+{
+        while (listings)
+                listing_drop(listings);
+}
@@ -0,0 +1,44 @@
+#ifndef __LISTING_H
+#define __LISTING_H
+
+#include <stdint.h>
+#include <time.h>
+#include <sys/types.h>
+#include "cache.h"
+#include "parse.h"
+
+
+/* A file or directory in a listing */
+struct dent_t {
+        char *name;
+        off_t size;
+        time_t mtime;
+        int dir;
+};
+
+
+/* The listing of a directory, and the pages of it rendered so far */
+struct listing_t {
+        char *dir;                   // Key: the directory, as cache.c names it
+        char *url;                   // Its path in URLs, e.g. "/a/b/"
+        int watched;                 // Kept current by inotify, or else
+        time_t expires;              //   read again after this,
+        struct timespec dmtime;      //   or once its mtime differs from this
+        ino_t ino;                   // Inode of the directory
+        struct timespec changed;     // When the listing last changed
+        struct dent_t *ent;          // Its entries, sorted by name
+        size_t n;
+        size_t room;
+        struct entry_t **page;       // Pages rendered, each an entry, or NULL
+        size_t npage;                //   and the room for them
+        struct listing_t *next;      // Most recently used first
+};
+
+
+/* Function prototypes */
+int listing_get(const struct req_t *req, const char *path, struct entry_t **entry, char **why);
+void listing_notify(const char *dir, const char *name, uint32_t mask);
+void listing_flush(void);
+
+
+#endif
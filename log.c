@@ -9,9 +9,19 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/param.h>
+#include <sys/uio.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include "textutils.h"
+#include "parse.h"
+#include "clock.h"
+#include "conf.h"
 #include "log.h"
 
 
@@ -19,9 +29,8 @@
 #define LOG_PATH "cloth.log"
 #define INFO_PATH "cloth.info"
 
-/* strftime format strings */
-#define COMMON_LOG_TIME "%d/%b/%Y:%H:%M:%S %z"
-#define ISO_TIME        "%Y-%m-%d %H:%M:%S"
+/* Room for a log line formatted on the stack */
+#define LINE_SIZE 1024
 
 
 /******************************************************************************
@@ -40,56 +49,42 @@
  *
  * It also contains a 'buffer' member to accomodate the formatted string 
  * produced from the 7 values above, which will be an element in the log.
+ * The string is formatted in the session's arena, if it has one, and is
+ * let go of along with everything else in the arena.
  *
  ******************************************************************************/
 /** 
  * sesinfo_http -- Insert parsed HTTP request into the session struct 
  * @session: the uninitialized session struct 
- * @request: the raw text of the HTTP request 
+ * @req    : the parsed HTTP request 
  *
  * PROVIDES: resource, host, agent 
+ *
+ * The fields are slices of the receive buffer; nothing is copied.
  */
-void sesinfo_http(struct ses_t *session, char *request)
+static inline void sesinfo_http(struct ses_t *session, const struct req_t *req)
 {
-        char *copy;  // copy of HTTP request
-        char *token; // tokenized substring of copy
-        char *clean; // cleaned-up version of token
-        int i=0;
-
-        copy = bdup(request);
+        static const struct slice_t none = { "-", 1 };
+        const struct slice_t *value;
 
-        /* 
-         * Search tokens are truncated before being placed in the struct.
-         * See field() in textutils.h for details.
-         */
-        for (token  = strtok(copy, "**"); 
-             token != NULL; 
-             token  = strtok(NULL, "**")) 
-        {
-                if (clean = field(token, "GET "), clean != NULL) {
-                        while (clean[++i] != ' ') // Remove HTTP/1.x
-                        ;
-                        clean[i] = '\0';
-                        pumpf(&session->resource, "%s", clean);
-                }
+        session->resource = req->target;
 
-                if (clean = field(token, "Host: "), clean != NULL)
-                        pumpf(&session->host, "%s", clean);
+        value = parse_header(req, "Host");
+        session->host = value ? *value : none;
 
-                if (clean = field(token, "User-Agent: "), clean != NULL)
-                        pumpf(&session->agent, "%s", clean);
-        }
+        value = parse_header(req, "User-Agent");
+        session->agent = value ? *value : none;
 }
 
 
 /**
  * sesinfo_addr -- Insert remote host address and port into the session struct
  * @session: the uninitialized session struct
- * @remote : a copy of the remote sockaddr_in 
+ * @remote : the remote sockaddr_in
  * 
  * PROVIDES: remote_addr, remote_port
  */
-inline void sesinfo_addr(struct ses_t *session, struct sockaddr_in *remote) 
+static inline void sesinfo_addr(struct ses_t *session, const struct sockaddr_in *remote) 
 {
         session->remote_addr = inet_ntoa(remote->sin_addr);
         session->remote_port = ntohs(remote->sin_port);
@@ -99,11 +94,14 @@ inline void sesinfo_addr(struct ses_t *session, struct sockaddr_in *remote)
 /**
  * sesinfo_time -- Insert the formatted time into the session struct
  * @session: the uninitialized session struct
- * @time   : current time
+ *
+ * The string is the clock's, formatted at most once a second.
  */
-inline void sesinfo_time(struct ses_t *session, time_t time)
+static inline void sesinfo_time(struct ses_t *session)
 {
-        strftime(session->time, ISO_LEN, ISO_TIME, gmtime(&time));
+        const struct stamp_t *now = clock_now();
+
+        session->time = conf.log_clf ? now->clf : now->iso;
 }
 
 
@@ -111,17 +109,19 @@ inline void sesinfo_time(struct ses_t *session, time_t time)
  * sesprep -- Write a formatted string containing session information
  * @session: previously-initialized session struct
  * @status : the status code
+ * @arena  : where to format it
  */
-inline void sesprep(struct ses_t *session, struct http_status *status)
+static inline void sesprep(struct ses_t *session, struct http_status *status,
+                           struct arena_t *arena)
 {
-        pumpf(&session->buffer, "%s: %s %s %s %s:%hu (%s)",
+        session->buffer = arena_printf(arena, "%s: %.*s %.*s %s %s:%hu (%s)",
               status->tag,
-              session->resource,
-              session->host,
+              (int)session->resource.len, session->resource.p,
+              (int)session->host.len, session->host.p,
               status->figure,
               session->remote_addr,
               session->remote_port,
-              session->time);
+              session->time ? session->time : "-");
 }
 
 
@@ -130,33 +130,356 @@ inline void sesprep(struct ses_t *session, struct http_status *status)
  * @session: the uninitialized session struct
  * @socket : file descriptor of active socket
  * @remote : sockaddr of remote client
- * @request: HTTP request
+ * @req    : parsed HTTP request
  */
-void sesinfo(struct ses_t *session, int socket, struct sockaddr_in *remote, char *request)
+void sesinfo(struct ses_t *session, int socket, const struct sockaddr_in *remote, const struct req_t *req)
 {
-        sesinfo_http(session, request);    // get resource, host, agent
+        sesinfo_http(session, req);        // get resource, host, agent
         sesinfo_addr(session, remote);     // get remote_addr, remote_port
-        sesinfo_time(session, time(NULL)); // get formatted time
+        sesinfo_time(session);             // get formatted time
         session->socket = socket;          // get socket descriptor
 }
 
 
+/******************************************************************************
+ * ASYNC WRITER
+ *
+ * Each worker formats its log lines into a single-producer/single-consumer
+ * ring buffer, and a background thread writes them out in large batches:
+ * whatever has accumulated is sent with one writev() every log_flush_ms,
+ * or sooner once the ring is half full. The event loop never blocks on
+ * the log file, and the only synchronisation between the two threads is
+ * a pair of atomic offsets.
+ *
+ * A line that doesn't fit is dropped and counted (or, with log_block set,
+ * the event loop waits for room, which is counted as a stall). The counts
+ * are reported in the log itself when the writer next flushes.
+ ******************************************************************************/
+static int fd_log = -1;
+static volatile sig_atomic_t reopening;
+
+static struct ring_t {
+        char *buf;
+        size_t size;                 // A power of two
+        _Atomic size_t head;         // Next byte to be written by the loop
+        _Atomic size_t tail;         // Next byte to be flushed by the writer
+        _Atomic int woken;           // A wakeup is pending on fd_wake
+        _Atomic int stopping;        // The writer should drain and exit
+        int fd_wake;                 // eventfd used to wake the writer early
+        pthread_t writer;
+        struct log_stats_t stats;
+} ring;
+
+
+/**
+ * reopen -- (re)open the log file, replacing the current descriptor
+ *
+ * Called at startup and after SIGHUP, so a rotated log is let go of.
+ */
+static void reopen(void)
+{
+        int fd;
+
+        if (fd = open(LOG_PATH, O_CREAT|O_WRONLY|O_APPEND|O_CLOEXEC, 0644), fd < 0)
+                return;
+
+        if (fd_log >= 0)
+                close(fd_log);
+
+        fd_log = fd;
+}
+
+
+/**
+ * write_all -- write an iovec array to the log, retrying short writes
+ * @iov: the iovecs (modified)
+ * @cnt: number of iovecs
+ */
+static void write_all(struct iovec *iov, int cnt)
+{
+        ssize_t n;
+
+        while (cnt > 0) {
+                if (n = writev(fd_log, iov, cnt), n < 0) {
+                        if (errno == EINTR)
+                                continue;
+                        return;
+                }
+                while (cnt > 0 && (size_t)n >= iov->iov_len)
+                        n -= iov->iov_len, iov++, cnt--;
+                if (cnt > 0) {
+                        iov->iov_base = (char *)iov->iov_base + n;
+                        iov->iov_len -= n;
+                }
+        }
+}
+
+
+/**
+ * ring_wake -- wake the writer ahead of its next flush
+ */
+static void ring_wake(void)
+{
+        uint64_t one = 1;
+
+        if (!atomic_exchange(&ring.woken, 1)) {
+                ring.stats.wakeups++;
+                write(ring.fd_wake, &one, sizeof(one));
+        }
+}
+
+
+/**
+ * ring_push -- copy a line (and its newline) into the ring
+ * @line: the line
+ * @len : its length
+ */
+static void ring_push(const char *line, size_t len)
+{
+        size_t head;
+        size_t tail;
+        size_t off;
+        size_t n;
+
+        head = atomic_load_explicit(&ring.head, memory_order_relaxed);
+        tail = atomic_load_explicit(&ring.tail, memory_order_acquire);
+
+        if (len + 1 > ring.size) {
+                ring.stats.dropped++;
+                return;
+        }
+
+        while (head - tail + len + 1 > ring.size) {
+                if (!conf.log_block) {
+                        ring.stats.dropped++;
+                        ring_wake();
+                        return;
+                }
+                ring.stats.stalls++;
+                ring_wake();
+                sched_yield();
+                tail = atomic_load_explicit(&ring.tail, memory_order_acquire);
+        }
+
+        /* Copy, wrapping around the end of the buffer */
+        off = head & (ring.size - 1);
+        n   = MIN(len, ring.size - off);
+
+        memcpy(ring.buf + off, line, n);
+        memcpy(ring.buf, line + n, len - n);
+        ring.buf[(head + len) & (ring.size - 1)] = '\n';
+
+        atomic_store_explicit(&ring.head, head + len + 1, memory_order_release);
+
+        ring.stats.lines++;
+
+        if (head + len + 1 - tail > ring.size / 2)
+                ring_wake();
+}
+
+
+/**
+ * ring_flush -- write out everything in the ring (writer thread only)
+ */
+static void ring_flush(void)
+{
+        static unsigned long reported;
+        struct iovec iov[2];
+        char note[128];
+        size_t head;
+        size_t tail;
+        size_t off;
+        size_t len;
+        int cnt;
+
+        tail = atomic_load_explicit(&ring.tail, memory_order_relaxed);
+        head = atomic_load_explicit(&ring.head, memory_order_acquire);
+
+        if (head != tail) {
+                off = tail & (ring.size - 1);
+                len = head - tail;
+
+                iov[0] = (struct iovec){ ring.buf + off, MIN(len, ring.size - off) };
+                iov[1] = (struct iovec){ ring.buf, len - iov[0].iov_len };
+                cnt    = iov[1].iov_len ? 2 : 1;
+
+                write_all(iov, cnt);
+
+                atomic_store_explicit(&ring.tail, head, memory_order_release);
+        }
+
+        /* A racy read of the loop's counter is good enough for a report */
+        if (ring.stats.dropped != reported) {
+                len = snprintf(note, sizeof(note), "WARN: log: %lu lines dropped\n",
+                               ring.stats.dropped - reported);
+                reported = ring.stats.dropped;
+                iov[0] = (struct iovec){ note, MIN(len, sizeof(note)-1) };
+                write_all(iov, 1);
+        }
+}
+
+
+/**
+ * ring_writer -- body of the writer thread
+ */
+static void *ring_writer(void *arg)
+{
+        struct pollfd pfd = { .events = POLLIN };
+        uint64_t count;
+
+        pfd.fd = ring.fd_wake;
+
+        for (;;) {
+                if (poll(&pfd, 1, conf.log_flush_ms) > 0) {
+                        read(ring.fd_wake, &count, sizeof(count));
+                        atomic_store(&ring.woken, 0);
+                }
+
+                if (reopening) {
+                        reopening = 0;
+                        reopen();
+                }
+
+                ring_flush();
+
+                if (atomic_load(&ring.stopping)) {
+                        ring_flush();
+                        return NULL;
+                }
+        }
+}
+
+
+/**
+ * log_open -- open the log file, and reopen it whenever SIGHUP arrives
+ *
+ * Called once, at startup; forked processes inherit the descriptor.
+ */
+void log_open(void)
+{
+        struct sigaction sa = { .sa_handler = log_reopen };
+
+        sigemptyset(&sa.sa_mask);
+        sa.sa_flags = SA_RESTART;
+        sigaction(SIGHUP, &sa, NULL);
+
+        reopen();
+}
+
+
+/**
+ * log_reopen -- have the log file reopened before the next write
+ *
+ * Async-signal-safe; this is the SIGHUP handler.
+ */
+void log_reopen(int sig)
+{
+        reopening = 1;
+}
+
+
+/**
+ * log_async -- hand log writes in this process to a background thread
+ *
+ * Called by each worker, after it is forked. If the ring or the thread
+ * can't be had, writes simply stay synchronous.
+ */
+void log_async(void)
+{
+        sigset_t all;
+        sigset_t old;
+        size_t size;
+
+        for (size = 4096; size < (size_t)conf.log_ring_kb * 1024; size <<= 1)
+                ;
+
+        if (ring.buf = malloc(size), !ring.buf)
+                return;
+
+        if (ring.fd_wake = eventfd(0, EFD_CLOEXEC), ring.fd_wake < 0) {
+                free(ring.buf);
+                ring.buf = NULL;
+                return;
+        }
+
+        ring.size = size;
+
+        /* Signals are for the event loop, not the writer */
+        sigfillset(&all);
+        pthread_sigmask(SIG_SETMASK, &all, &old);
+
+        if (pthread_create(&ring.writer, NULL, ring_writer, NULL) != 0) {
+                close(ring.fd_wake);
+                free(ring.buf);
+                ring.buf = NULL;
+        }
+
+        pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+
+/**
+ * log_flush -- write out all pending lines and stop the writer thread
+ *
+ * Called before the process exits; later writes are synchronous.
+ */
+void log_flush(void)
+{
+        if (!ring.buf)
+                return;
+
+        atomic_store(&ring.stopping, 1);
+        ring_wake();
+        pthread_join(ring.writer, NULL);
+
+        free(ring.buf);
+        ring.buf = NULL;
+}
+
+
+/**
+ * log_stats -- the async writer's counters
+ */
+const struct log_stats_t *log_stats(void)
+{
+        return &ring.stats;
+}
+
+
 /******************************************************************************
  * WRITE
  * Functions to write to the log and to write over the open socket.
  ******************************************************************************/
 /**
- * write_log -- Write a char buffer to the designated LOG_PATH
+ * write_log -- Write a char buffer to the log as a line
  * @buffer: string to be written to log file
+ *
+ * With an async writer running, the line is only copied into the ring;
+ * otherwise it goes out in a single write() to the open log file.
  */
-void write_log(const char *path, const char *buffer)
+void write_log(const char *buffer)
 {
-	int fd;
-	if ((fd = open(path, O_CREAT| O_WRONLY | O_APPEND, 0644)) >= 0) {
-		write(fd, buffer, strlen(buffer)); 
-		write(fd, "\n", 1);      
-		close(fd);
-	}
+        struct iovec iov[2];
+        size_t len;
+
+        len = strlen(buffer);
+
+        if (ring.buf) {
+                ring_push(buffer, len);
+                return;
+        }
+
+        if (reopening) {
+                reopening = 0;
+                reopen();
+        }
+        if (fd_log < 0)
+                reopen();
+
+        iov[0] = (struct iovec){ (char *)buffer, len };
+        iov[1] = (struct iovec){ "\n", 1 };
+
+        write_all(iov, 2);
 }
 
 
@@ -173,7 +496,7 @@ void write_socket(int socket, int http_code, const char *message)
 
         /* Check that socket is a valid file descriptor */
         if (fcntl(socket, F_GETFD) == EBADF)
-                log(WARN, NULL, "Socket write failure");
+                record(ERROR, NULL, "Socket write failure");
         else
 	        write(socket, buffer, strlen(buffer));
 
@@ -186,29 +509,59 @@ void write_socket(int socket, int http_code, const char *message)
  * Entry point for outside callers seeking to write to the log.
  ******************************************************************************/
 /**
- * log -- write a message to the log file and/or over a socket
+ * record -- write a message to the log file, and nothing else
  * @code: the cloth status code
- * @session: an initialized session struct
+ * @session: an initialized session struct, or NULL
  * @message: an additional explanatory message
+ *
+ * Unlike log(), this never exits or writes to the socket, so it is safe
+ * to call from a process that serves more than one connection.
  */
-void log(int code, struct ses_t *session, char *message)
+void record(int code, struct ses_t *session, char *message)
 {
-	char *buffer;
+        char scratch[LINE_SIZE];
+        struct arena_t local;
+        struct arena_t *arena;
+        char *buffer;
+
+        /* Without an arena of the caller's, format on the stack */
+        if (session && session->arena) {
+                arena = session->arena;
+        } else {
+                arena = &local;
+                arena_init(arena, scratch, sizeof(scratch));
+        }
 
         if (session) {
-                sesprep(session, &STATUS[code]);
-                pumpf(&buffer, "%s", session->buffer);
+                sesprep(session, &STATUS[code], arena);
+                buffer = session->buffer;
         } else
-                pumpf(&buffer, "%s: %s (%d)", STATUS[code].tag, message, errno);
+                buffer = arena_printf(arena, "%s: %s (%d)", STATUS[code].tag, message, errno);
+
+        if (buffer)
+                write_log(buffer); // All codes get written to the log
+
+        if (arena == &local)
+                arena_reset(arena);
+}
+
 
-        write_log(LOG_PATH, buffer); // All codes get written to the log
+/**
+ * log -- write a message to the log file and/or over a socket
+ * @code: the cloth status code
+ * @session: an initialized session struct
+ * @message: an additional explanatory message
+ */
+void log(int code, struct ses_t *session, char *message)
+{
+        record(code, session, message);
 
 	switch (STATUS[code].code) 
         {
 	case INFO: 
-                free(buffer);
                 break;
 	case OUCH: 
+                log_flush();
                 exit(3);
                 break;
         case WARN:
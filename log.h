@@ -1,6 +1,10 @@
 #ifndef __HTTP_LOG_H
 #define __HTTP_LOG_H
 
+#include <netinet/in.h>
+#include "parse.h"
+#include "arena.h"
+
 
 /* Collects multiple representations of a status. */
 struct http_status {
@@ -8,6 +12,7 @@ struct http_status {
         short code;
         short http;
         const char *figure;
+        const char *reason;
 };
 
 
@@ -20,53 +25,77 @@ struct http_status {
 /* HTTP status codes */
 #define HTTP_OK                 200
 #define HTTP_ACCEPTED           202
+#define HTTP_PARTIAL            206
+#define HTTP_NOT_MODIFIED       304
 #define HTTP_BAD_REQUEST        400
 #define HTTP_NOT_FOUND          404
 #define HTTP_METHOD_FORBIDDEN   405
+#define HTTP_RANGE_UNSATISFIED  416
 #define HTTP_HEADER_OVERFLOW    431
 #define HTTP_SERVER_ERROR       500
 #define HTTP_NOT_IMPLEMENTED    501
+#define HTTP_UNAVAILABLE        503
 #define HTTP_FATAL_ERROR        555 
 
 
 /* cloth status codes */
 enum codes { RESPONSE, ACCEPT, BAD_REQUEST, NOT_FOUND, BAD_METHOD, OVERFLOW,
-             ERROR, NO_METHOD, FATAL };
-
-
-/* status codes are indices into the global STATUS vector */
-static struct http_status STATUS[]={
-        { "INFO", INFO, HTTP_OK,               "--->" }, // RESPONSE
-        { "INFO", INFO, HTTP_ACCEPTED,         "<---" }, // ACCEPT
-        { "WARN", WARN, HTTP_BAD_REQUEST,      "x---" }, // BAD_REQUEST
-        { "WARN", WARN, HTTP_NOT_FOUND,        "?---" }, // NOT_FOUND
-        { "WARN", WARN, HTTP_METHOD_FORBIDDEN, "x---" }, // BAD_METHOD
-        { "WARN", WARN, HTTP_HEADER_OVERFLOW,  "+---" }, // OVERFLOW
-        { "WARN", WARN, HTTP_SERVER_ERROR,     "---x" }, // ERROR
-        { "WARN", WARN, HTTP_NOT_IMPLEMENTED,  "---?" }, // NO_METHOD
-        { "OUCH", OUCH, HTTP_FATAL_ERROR,      "xxxx" }, // FATAL
+             ERROR, NO_METHOD, FATAL, PARTIAL, NOT_MODIFIED, UNSATISFIED,
+             UNAVAILABLE };
+
+
+/* status codes are indices into the global STATUS vector (unused by some
+ * of the files that include this, hence the attribute) */
+static struct http_status STATUS[] __attribute__((unused))={
+        { "INFO", INFO, HTTP_OK,               "--->", "OK"                    }, // RESPONSE
+        { "INFO", INFO, HTTP_ACCEPTED,         "<---", "Accepted"              }, // ACCEPT
+        { "WARN", WARN, HTTP_BAD_REQUEST,      "x---", "Bad Request"           }, // BAD_REQUEST
+        { "WARN", WARN, HTTP_NOT_FOUND,        "?---", "Not Found"             }, // NOT_FOUND
+        { "WARN", WARN, HTTP_METHOD_FORBIDDEN, "x---", "Method Not Allowed"    }, // BAD_METHOD
+        { "WARN", WARN, HTTP_HEADER_OVERFLOW,  "+---", "Request Header Fields Too Large" }, // OVERFLOW
+        { "WARN", WARN, HTTP_SERVER_ERROR,     "---x", "Internal Server Error" }, // ERROR
+        { "WARN", WARN, HTTP_NOT_IMPLEMENTED,  "---?", "Not Implemented"       }, // NO_METHOD
+        { "OUCH", OUCH, HTTP_FATAL_ERROR,      "xxxx", "Fatal Error"           }, // FATAL
+        { "INFO", INFO, HTTP_PARTIAL,          "-->-", "Partial Content"       }, // PARTIAL
+        { "INFO", INFO, HTTP_NOT_MODIFIED,     "===>", "Not Modified"          }, // NOT_MODIFIED
+        { "WARN", WARN, HTTP_RANGE_UNSATISFIED,"--?-", "Range Not Satisfiable" }, // UNSATISFIED
+        { "WARN", WARN, HTTP_UNAVAILABLE,      "-//-", "Service Unavailable"   }, // UNAVAILABLE
 };
 
 
-#define ISO_LEN 24
-
 
 /* Session structure */
 struct ses_t {
         int  socket;                 // File descriptor of the socket
-        char time[ISO_LEN];          // Formatted time of processing 
-        char *host;                  // Hostname submitted by remote end
-        char *agent;                 // Remote user-agent id
-        char *resource;              // Resource (file) being requested
+        const char *time;            // Formatted time of processing
+        struct slice_t host;         // Hostname submitted by remote end
+        struct slice_t agent;        // Remote user-agent id
+        struct slice_t resource;     // Resource (file) being requested
         char *remote_addr;           // Address of the remote host
         unsigned short remote_port;  // Port of the remote host
         char *buffer;                // The formatted output string
+        struct arena_t *arena;       // Where it is formatted, or NULL
+};
+
+
+/* Counters kept by the async log writer */
+struct log_stats_t {
+        unsigned long lines;         // Lines queued
+        unsigned long dropped;       // Lines dropped, the ring being full
+        unsigned long stalls;        // Waits for room (log_block only)
+        unsigned long wakeups;       // Early wakeups of the writer
 };
 
 
 /* Function prototypes */
+void log_open(void);
+void log_async(void);
+void log_flush(void);
+void log_reopen(int sig);
+const struct log_stats_t *log_stats(void);
 void log(int code, struct ses_t *session, char *message);
-void sesinfo(struct ses_t *, int, struct sockaddr_in *, char *);
+void record(int code, struct ses_t *session, char *message);
+void sesinfo(struct ses_t *, int, const struct sockaddr_in *, const struct req_t *);
 
 
 #endif
@@ -0,0 +1,202 @@
+/*
+ * metrics.c -- counters kept by every worker, merged when asked for.
+ *
+ * Before any worker is forked, cloth maps one struct metrics_t per
+ * worker into memory that all of them share. A worker counts into its
+ * own slot with relaxed atomic adds, which cost next to nothing on a
+ * cache line no other process writes. Whichever worker is asked for
+ * METRICS_PATH adds up every slot and answers in the Prometheus text
+ * exposition format, so there is nothing to collect or send in between.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <netinet/in.h>
+#include "metrics.h"
+
+
+/* Counted into until metrics_init(), or if it fails */
+static struct metrics_t local;
+
+struct metrics_t *metrics = &local;
+
+static struct metrics_t *slots = &local;
+static int nslots = 1;
+
+
+/**
+ * metrics_init -- map shared counters for n workers, and count into the first
+ * @n: the number of workers (at least 1)
+ */
+void metrics_init(int n)
+{
+        struct metrics_t *m;
+
+        m = mmap(NULL, n * sizeof(struct metrics_t), PROT_READ|PROT_WRITE,
+                 MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+
+        if (m == MAP_FAILED) {
+                record(ERROR, NULL, "metrics: mmap");
+                return;
+        }
+
+        slots   = m;
+        nslots  = n;
+        metrics = &slots[0];
+}
+
+
+/**
+ * metrics_attach -- count into the slot of worker n
+ * @n: the worker
+ *
+ * A worker restarted in a slot starts with none of its predecessor's
+ * connections, which died with it; the totals carry on.
+ */
+void metrics_attach(int n)
+{
+        if (n >= nslots)
+                return;
+
+        metrics = &slots[n];
+
+        __atomic_store_n(&metrics->active, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&metrics->buffers, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&metrics->pooled, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&metrics->maps,   0, __ATOMIC_RELAXED);
+        __atomic_store_n(&metrics->mapped, 0, __ATOMIC_RELAXED);
+}
+
+
+#define LOAD(x) __atomic_load_n(&(x), __ATOMIC_RELAXED)
+
+
+/**
+ * metrics_render -- add up every worker's counters and format them
+ * @buf: destination buffer
+ * @len: size of the destination buffer
+ *  RET: length of the formatted text
+ */
+size_t metrics_render(char *buf, size_t len)
+{
+        struct metrics_t sum;
+        uint64_t count = 0;
+        size_t n = 0;
+        int i;
+        int w;
+
+        memset(&sum, 0, sizeof(sum));
+
+        for (w=0; w<nslots; w++) {
+                for (i=0; i<(int)METRICS_CODES; i++)
+                        sum.status[i] += LOAD(slots[w].status[i]);
+                for (i=0; i<LATENCY_BUCKETS; i++)
+                        sum.latency[i] += LOAD(slots[w].latency[i]);
+
+                sum.bytes      += LOAD(slots[w].bytes);
+                sum.accepted   += LOAD(slots[w].accepted);
+                sum.active     += LOAD(slots[w].active);
+                sum.buffers    += LOAD(slots[w].buffers);
+                sum.pooled     += LOAD(slots[w].pooled);
+                sum.maps       += LOAD(slots[w].maps);
+                sum.mapped     += LOAD(slots[w].mapped);
+                sum.zerocopy   += LOAD(slots[w].zerocopy);
+                sum.zerocopy_copied += LOAD(slots[w].zerocopy_copied);
+                sum.tls_handshakes  += LOAD(slots[w].tls_handshakes);
+                sum.tls_resumed     += LOAD(slots[w].tls_resumed);
+                sum.tls_offloaded   += LOAD(slots[w].tls_offloaded);
+                sum.h2_conns        += LOAD(slots[w].h2_conns);
+                sum.h2_streams      += LOAD(slots[w].h2_streams);
+                sum.latency_us += LOAD(slots[w].latency_us);
+        }
+
+        #define EMIT(...) n += snprintf(buf + n, (n < len) ? len - n : 0, __VA_ARGS__)
+
+        EMIT("# HELP cloth_responses_total Responses sent, by HTTP status.\n"
+             "# TYPE cloth_responses_total counter\n");
+        for (i=0; i<(int)METRICS_CODES; i++) {
+                if (i != ACCEPT)
+                        EMIT("cloth_responses_total{code=\"%d\"} %llu\n",
+                             STATUS[i].http, (unsigned long long)sum.status[i]);
+        }
+
+        EMIT("# HELP cloth_sent_bytes_total Bytes sent, headers included.\n"
+             "# TYPE cloth_sent_bytes_total counter\n"
+             "cloth_sent_bytes_total %llu\n",
+             (unsigned long long)sum.bytes);
+
+        EMIT("# HELP cloth_connections_accepted_total Connections accepted.\n"
+             "# TYPE cloth_connections_accepted_total counter\n"
+             "cloth_connections_accepted_total %llu\n",
+             (unsigned long long)sum.accepted);
+
+        EMIT("# HELP cloth_connections_active Connections open.\n"
+             "# TYPE cloth_connections_active gauge\n"
+             "cloth_connections_active %lld\n",
+             (long long)sum.active);
+
+        EMIT("# HELP cloth_connection_buffers Request buffers held by open connections.\n"
+             "# TYPE cloth_connection_buffers gauge\n"
+             "cloth_connection_buffers %lld\n"
+             "# HELP cloth_pool_bytes Bytes of connections and buffers, in use or kept ready.\n"
+             "# TYPE cloth_pool_bytes gauge\n"
+             "cloth_pool_bytes %lld\n",
+             (long long)sum.buffers, (long long)sum.pooled);
+
+        EMIT("# HELP cloth_mapped_files Open files mapped into memory (mmap=1).\n"
+             "# TYPE cloth_mapped_files gauge\n"
+             "cloth_mapped_files %lld\n"
+             "# HELP cloth_mapped_bytes Bytes of the mapped files.\n"
+             "# TYPE cloth_mapped_bytes gauge\n"
+             "cloth_mapped_bytes %lld\n",
+             (long long)sum.maps, (long long)sum.mapped);
+
+        EMIT("# HELP cloth_zerocopy_sends_total MSG_ZEROCOPY sends completed (zerocopy=1).\n"
+             "# TYPE cloth_zerocopy_sends_total counter\n"
+             "cloth_zerocopy_sends_total %llu\n"
+             "# HELP cloth_zerocopy_copied_total Of those, sends the kernel copied anyway.\n"
+             "# TYPE cloth_zerocopy_copied_total counter\n"
+             "cloth_zerocopy_copied_total %llu\n",
+             (unsigned long long)sum.zerocopy,
+             (unsigned long long)sum.zerocopy_copied);
+
+        EMIT("# HELP cloth_tls_handshakes_total TLS handshakes completed.\n"
+             "# TYPE cloth_tls_handshakes_total counter\n"
+             "cloth_tls_handshakes_total %llu\n"
+             "# HELP cloth_tls_resumed_total TLS handshakes that resumed a session.\n"
+             "# TYPE cloth_tls_resumed_total counter\n"
+             "cloth_tls_resumed_total %llu\n"
+             "# HELP cloth_tls_offloaded_total TLS connections handed to kernel TLS.\n"
+             "# TYPE cloth_tls_offloaded_total counter\n"
+             "cloth_tls_offloaded_total %llu\n",
+             (unsigned long long)sum.tls_handshakes,
+             (unsigned long long)sum.tls_resumed,
+             (unsigned long long)sum.tls_offloaded);
+
+        EMIT("# HELP cloth_h2_connections_total Connections that spoke HTTP/2.\n"
+             "# TYPE cloth_h2_connections_total counter\n"
+             "cloth_h2_connections_total %llu\n"
+             "# HELP cloth_h2_streams_total HTTP/2 streams opened by clients.\n"
+             "# TYPE cloth_h2_streams_total counter\n"
+             "cloth_h2_streams_total %llu\n",
+             (unsigned long long)sum.h2_conns,
+             (unsigned long long)sum.h2_streams);
+
+        EMIT("# HELP cloth_response_seconds Time from a complete request to its last byte sent.\n"
+             "# TYPE cloth_response_seconds histogram\n");
+        for (i=0; i<LATENCY_BUCKETS-1; i++) {
+                count += sum.latency[i];
+                EMIT("cloth_response_seconds_bucket{le=\"%g\"} %llu\n",
+                     (double)(1ull << i) / 1e6, (unsigned long long)count);
+        }
+        count += sum.latency[i];
+        EMIT("cloth_response_seconds_bucket{le=\"+Inf\"} %llu\n"
+             "cloth_response_seconds_sum %.6f\n"
+             "cloth_response_seconds_count %llu\n",
+             (unsigned long long)count, sum.latency_us / 1e6,
+             (unsigned long long)count);
+
+        #undef EMIT
+
+        return (n < len) ? n : len - 1;
+}
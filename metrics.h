@@ -0,0 +1,94 @@
+#ifndef __METRICS_H
+#define __METRICS_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+#include "log.h"
+
+
+/* The reserved path the counters are served at */
+#define METRICS_PATH "/_cloth/metrics"
+
+/* Room for the rendered counters */
+#define METRICS_SIZE 8192
+
+/* Cloth status codes counted (every row of STATUS) */
+#define METRICS_CODES (sizeof(STATUS) / sizeof(STATUS[0]))
+
+/* Latency buckets: under 1us, 2us, 4us, ... 2^(N-2)us, and the rest */
+#define LATENCY_BUCKETS 26
+
+
+/*
+ * One worker's counters, in memory shared with every other process.
+ * Only that worker writes them (the forked children of -e fork share
+ * one), and any process may read them; each fits in a cache line of
+ * its own so the workers never contend.
+ */
+struct metrics_t {
+        uint64_t status[METRICS_CODES];    // Responses, by cloth status code
+        uint64_t bytes;                    // Bytes sent
+        uint64_t accepted;                 // Connections accepted
+        int64_t  active;                   // Connections open now
+        int64_t  buffers;                  //   and the I/O buffers they hold
+        int64_t  pooled;                   // Bytes of pools in memory
+        int64_t  maps;                     // Files mapped now
+        int64_t  mapped;                   //   and their bytes
+        uint64_t zerocopy;                 // MSG_ZEROCOPY sends completed
+        uint64_t zerocopy_copied;          //   for which the kernel copied anyway
+        uint64_t tls_handshakes;           // TLS handshakes completed
+        uint64_t tls_resumed;              //   of them resuming a session
+        uint64_t tls_offloaded;            //   and handed to kernel TLS
+        uint64_t h2_conns;                 // Connections that spoke HTTP/2
+        uint64_t h2_streams;               //   and the streams they opened
+        uint64_t latency[LATENCY_BUCKETS]; // Responses by time to send
+        uint64_t latency_us;               //   and their total, in us
+} __attribute__((aligned(64)));
+
+
+/* This process's counters */
+extern struct metrics_t *metrics;
+
+
+#define METRICS_ADD(field, n) __atomic_fetch_add(&metrics->field, (n), __ATOMIC_RELAXED)
+
+
+/**
+ * metrics_clock -- nanoseconds on a clock that never jumps
+ */
+static inline uint64_t metrics_clock(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+
+        return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+
+/**
+ * metrics_response -- count a response
+ * @code : its cloth status code
+ * @start: metrics_clock() when the request was complete
+ */
+static inline void metrics_response(int code, uint64_t start)
+{
+        uint64_t us = (metrics_clock() - start) / 1000;
+        int b;
+
+        b = us ? 64 - __builtin_clzll(us) : 0;
+
+        METRICS_ADD(status[code], 1);
+        METRICS_ADD(latency[b < LATENCY_BUCKETS ? b : LATENCY_BUCKETS-1], 1);
+        METRICS_ADD(latency_us, us);
+}
+
+
+/* Function prototypes */
+void metrics_init(int n);
+void metrics_attach(int n);
+size_t metrics_render(char *buf, size_t len);
+
+
+#endif
@@ -0,0 +1,70 @@
+/*
+ * mime.c -- map file extensions to MIME types.
+ *
+ * The table is mime.types, compiled by mkmime into a perfect hash
+ * (mime_table.h), so a lookup costs the same whether it holds ten
+ * extensions or a thousand: two hashes of the extension and one compare
+ * against the only slot it can be in.
+ */
+#include <string.h>
+#include "mime.h"
+#include "mime_table.h"
+
+
+/**
+ * mime_type -- find the MIME type of an extension
+ * @ext: the extension, without the dot (case is ignored)
+ * @len: its length
+ *  RET: the MIME type, or NULL if the extension is not in mime.types
+ */
+const char *mime_type(const char *ext, size_t len)
+{
+        const struct mime_t *m;
+        unsigned char c;
+        uint32_t d;
+        size_t i;
+
+        if (len == 0 || len > MIME_EXT_MAX)
+                return NULL;
+
+        d = mime_disp[mime_hash(ext, len, 0) & (MIME_BUCKETS-1)];
+        m = &mime_table[mime_hash(ext, len, d) & (MIME_SLOTS-1)];
+
+        if (!m->ext || m->len != len)
+                return NULL;
+
+        for (i=0; i<len; i++) {
+                if (c = ext[i], c >= 'A' && c <= 'Z')
+                        c += 'a' - 'A';
+                if (c != (unsigned char)m->ext[i])
+                        return NULL;
+        }
+
+        return m->type;
+}
+
+
+/**
+ * mime_lookup -- find the MIME type of a file from its name
+ * @path: path of the file
+ * @len : length of the path
+ *  RET: the MIME type, or NULL if the name has no known extension
+ *
+ * The extension is what follows the last dot of the last component,
+ * so "foo.tgz" is not taken for "gz", and ".gz" (a hidden file with
+ * no extension) is not either.
+ */
+const char *mime_lookup(const char *path, size_t len)
+{
+        const char *end = path + len;
+        const char *p;
+
+        for (p = end; p > path && p[-1] != '.' && p[-1] != '/'; p--)
+                ;
+
+        /* No dot, or the dot starts the name */
+        if (p == path || p[-1] != '.' || p - 1 == path || p[-2] == '/')
+                return NULL;
+
+        return mime_type(p, end - p);
+}
@@ -0,0 +1,57 @@
+#ifndef __MIME_H
+#define __MIME_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+/* Longest extension that can be looked up */
+#define MIME_EXT_MAX 16
+
+
+/* A slot of the generated table */
+struct mime_t {
+        const char *ext;             // Extension, lower case, without the dot
+        unsigned char len;           // Its length
+        const char *type;            // MIME type, e.g. "text/html"
+};
+
+
+/**
+ * mime_hash -- hash an extension, ignoring case
+ * @ext : the extension
+ * @len : its length
+ * @seed: selects one of a family of hash functions
+ *
+ * Shared by mkmime, which builds the table, and mime_type(), which
+ * looks things up in it.
+ */
+static inline uint32_t mime_hash(const char *ext, size_t len, uint32_t seed)
+{
+        uint32_t h = 2166136261u ^ (seed * 0x9e3779b9u);
+        unsigned char c;
+
+        while (len--) {
+                c = *ext++;
+                if (c >= 'A' && c <= 'Z')
+                        c += 'a' - 'A';
+                h = (h ^ c) * 16777619u;
+        }
+
+        /* Finish so that the low bits depend on every byte */
+        h ^= h >> 16;
+        h *= 0x85ebca6bu;
+        h ^= h >> 13;
+        h *= 0xc2b2ae35u;
+        h ^= h >> 16;
+
+        return h;
+}
+
+
+/* Function prototypes */
+const char *mime_type(const char *ext, size_t len);
+const char *mime_lookup(const char *path, size_t len);
+
+
+#endif
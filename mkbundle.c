@@ -0,0 +1,396 @@
+/*
+ * mkbundle.c -- pack a www directory into a bundle for cloth -b.
+ *
+ * usage: mkbundle <WWW-DIRECTORY> <BUNDLE>
+ *
+ * Every file cloth would serve from the directory is packed: regular
+ * files with an extension listed in mime.types, not under a name that
+ * starts with '.'; symbolic links are not followed. Each is stored with
+ * its response header rendered as cloth renders it (see http_header()),
+ * and text is stored gzip- and brotli-encoded too, from a precompressed
+ * sibling ("style.css.gz") if there is one, else compressed here at the
+ * highest levels; an encoding that saves nothing is left out.
+ *
+ * The bundle is laid out as bundle.h describes: the bodies, large ones
+ * each from the start of a page, small ones packed so that none spans
+ * two pages; then the file records, an open-addressing hash index
+ * over their paths, and the paths, types and headers. It is written
+ * beside the old one and renamed over it, so a running server that has
+ * it mapped is never left with a truncated file.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#include <brotli/encode.h>
+#include "bundle.h"
+#include "compress.h"
+#include "mime.h"
+
+
+/* A file to pack */
+struct item_t {
+        char *path;                  // Relative to the www directory
+        const char *type;
+        struct stat st;
+};
+
+
+/* The records, paths, types and headers, collected while bodies are written */
+struct blob_t { char *p; size_t len; size_t room; };
+
+
+static struct item_t *items;
+static size_t nitems;
+static size_t rootlen;
+
+
+/**
+ * die -- give up, with a reason
+ */
+static void die(const char *what)
+{
+        perror(what);
+        exit(1);
+}
+
+
+/**
+ * visit -- nftw() callback: add a file worth packing to the list
+ */
+static int visit(const char *name, const struct stat *st, int flag, struct FTW *ftw)
+{
+        static size_t room;
+        const char *path;
+        const char *type;
+
+        path = name + rootlen;
+
+        /* Hidden files and directories are left out, with all they hold */
+        if (ftw->level > 0 && name[ftw->base] == '.')
+                return (flag == FTW_D) ? FTW_SKIP_SUBTREE : FTW_CONTINUE;
+
+        if (flag != FTW_F || !S_ISREG(st->st_mode))
+                return FTW_CONTINUE;
+
+        if (type = mime_lookup(path, strlen(path)), !type)
+                return FTW_CONTINUE;
+
+        if (nitems == room) {
+                room  = room ? 2 * room : 1024;
+                if (items = realloc(items, room * sizeof(*items)), !items)
+                        die("realloc");
+        }
+
+        items[nitems].path = strdup(path);
+        items[nitems].type = type;
+        items[nitems].st   = *st;
+
+        if (!items[nitems++].path)
+                die("strdup");
+
+        return FTW_CONTINUE;
+}
+
+
+/**
+ * by_path -- qsort() comparison of items, so the same tree packs the same
+ */
+static int by_path(const void *a, const void *b)
+{
+        return strcmp(((const struct item_t *)a)->path, ((const struct item_t *)b)->path);
+}
+
+
+/**
+ * slurp -- read a whole file
+ * @name: the file
+ * @len : will hold its length
+ *  RET: its bytes (malloc()ed), or NULL if it can't be read
+ */
+static char *slurp(const char *name, size_t *len)
+{
+        struct stat st;
+        char *buf;
+        ssize_t n;
+        size_t got;
+        int fd;
+
+        if (fd = open(name, O_RDONLY|O_NOFOLLOW|O_CLOEXEC), fd < 0)
+                return NULL;
+
+        if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || !(buf = malloc(st.st_size + 1))) {
+                close(fd);
+                return NULL;
+        }
+
+        for (got = 0; got < (size_t)st.st_size; got += n) {
+                if (n = read(fd, buf + got, st.st_size - got), n <= 0)
+                        break;
+        }
+
+        close(fd);
+        *len = got;
+
+        return buf;
+}
+
+
+/**
+ * encode -- compress a body in a content coding
+ *  RET: the encoded bytes (malloc()ed), or NULL
+ */
+static char *encode(int enc, const char *in, size_t len, size_t *outlen)
+{
+        uLongf zlen;
+        z_stream z = { 0 };
+        char *out;
+
+        if (enc == ENC_BR) {
+                *outlen = BrotliEncoderMaxCompressedSize(len);
+                if (out = malloc(*outlen ? *outlen : len + 1024), !out)
+                        return NULL;
+                if (!BrotliEncoderCompress(BROTLI_MAX_QUALITY, BROTLI_DEFAULT_WINDOW,
+                                           BROTLI_MODE_TEXT, len, (const uint8_t *)in,
+                                           outlen, (uint8_t *)out)) {
+                        free(out);
+                        return NULL;
+                }
+                return out;
+        }
+
+        if (deflateInit2(&z, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+                return NULL;
+
+        zlen = deflateBound(&z, len);
+
+        if (out = malloc(zlen), !out) {
+                deflateEnd(&z);
+                return NULL;
+        }
+
+        z.next_in   = (unsigned char *)in;
+        z.avail_in  = len;
+        z.next_out  = (unsigned char *)out;
+        z.avail_out = zlen;
+
+        if (deflate(&z, Z_FINISH) != Z_STREAM_END) {
+                deflateEnd(&z);
+                free(out);
+                return NULL;
+        }
+
+        *outlen = z.total_out;
+        deflateEnd(&z);
+
+        return out;
+}
+
+
+/**
+ * append -- add bytes to a blob
+ *  RET: their offset in the blob
+ */
+static size_t append(struct blob_t *b, const void *p, size_t len)
+{
+        size_t off = b->len;
+
+        if (b->len + len > b->room) {
+                while (b->len + len > b->room)
+                        b->room = b->room ? 2 * b->room : 1 << 20;
+                if (b->p = realloc(b->p, b->room), !b->p)
+                        die("realloc");
+        }
+
+        memcpy(b->p + b->len, p, len);
+        b->len += len;
+
+        return off;
+}
+
+
+/**
+ * put_body -- write a body to the bundle
+ * @out: the bundle
+ * @off: offset of the end of the bundle so far (advanced)
+ *  RET: the offset the body was written at
+ *
+ * A body of a page or more starts on a page; a smaller one is packed in
+ * after the last, unless it would then straddle two pages.
+ */
+static uint64_t put_body(FILE *out, uint64_t *off, const char *body, size_t len)
+{
+        static const char zero[BUNDLE_ALIGN];
+        uint64_t at;
+
+        at = *off;
+
+        if (len >= BUNDLE_ALIGN || at / BUNDLE_ALIGN != (at + len - (len > 0)) / BUNDLE_ALIGN)
+                at = (at + BUNDLE_ALIGN - 1) & ~(uint64_t)(BUNDLE_ALIGN - 1);
+
+        if (fwrite(zero, 1, at - *off, out) != at - *off || fwrite(body, 1, len, out) != len)
+                die("fwrite");
+
+        *off = at + len;
+
+        return at;
+}
+
+
+int main(int argc, char **argv)
+{
+        struct bundle_head_t head = { BUNDLE_MAGIC };
+        struct bundle_file_t *files;
+        struct blob_t strings = { 0 };
+        char header[HEADER_SIZE];
+        char name[BUFSIZE];
+        struct rep_t rep;
+        char tmp[BUFSIZE];
+        uint32_t *slots;
+        uint64_t strbase;
+        uint64_t off;
+        size_t blen[ENC_COUNT];
+        char *body[ENC_COUNT];
+        size_t hdr[ENC_COUNT];
+        size_t hlen[ENC_COUNT];
+        size_t i;
+        size_t j;
+        FILE *out;
+        int enc;
+
+        if (argc != 3) {
+                fprintf(stderr, "usage: mkbundle <WWW-DIRECTORY> <BUNDLE>\n");
+                return 1;
+        }
+
+        /* Paths are taken relative to the directory */
+        snprintf(name, sizeof(name), "%s/", argv[1]);
+        rootlen = strlen(name);
+
+        if (nftw(name, visit, 64, FTW_PHYS|FTW_ACTIONRETVAL) < 0)
+                die(argv[1]);
+
+        qsort(items, nitems, sizeof(*items), by_path);
+
+        if (nitems >= UINT32_MAX / 2) {
+                fprintf(stderr, "mkbundle: too many files\n");
+                return 1;
+        }
+
+        if (files = calloc(nitems ? nitems : 1, sizeof(*files)), !files)
+                die("calloc");
+
+        snprintf(tmp, sizeof(tmp), "%s.tmp", argv[2]);
+
+        if (out = fopen(tmp, "w"), !out)
+                die(tmp);
+
+        /* The head is written last, when the offsets are known */
+        if (fwrite(&head, sizeof(head), 1, out) != 1)
+                die("fwrite");
+
+        off = sizeof(head);
+
+        for (i=0; i<nitems; i++) {
+                snprintf(name, sizeof(name), "%s/%s", argv[1], items[i].path);
+
+                if (body[ENC_IDENTITY] = slurp(name, &blen[ENC_IDENTITY]), !body[ENC_IDENTITY])
+                        die(name);
+
+                /* Text in each coding that makes it smaller */
+                for (enc = ENC_IDENTITY+1; enc < ENC_COUNT; enc++) {
+                        body[enc] = NULL;
+
+                        if (!http_compressible(items[i].type) || blen[ENC_IDENTITY] < COMPRESS_MIN)
+                                continue;
+
+                        snprintf(tmp, sizeof(tmp), "%s%s", name, ENCODING_SUFFIX[enc]);
+
+                        if (body[enc] = slurp(tmp, &blen[enc]), !body[enc])
+                                body[enc] = encode(enc, body[ENC_IDENTITY], blen[ENC_IDENTITY], &blen[enc]);
+
+                        if (body[enc] && blen[enc] >= blen[ENC_IDENTITY]) {
+                                free(body[enc]);
+                                body[enc] = NULL;
+                        }
+                }
+
+                files[i].plen       = strlen(items[i].path);
+                files[i].hash       = bundle_hash(items[i].path, files[i].plen);
+                files[i].path       = append(&strings, items[i].path, files[i].plen);
+                files[i].type       = append(&strings, items[i].type, strlen(items[i].type) + 1);
+                files[i].ino        = items[i].st.st_ino;
+                files[i].fsize      = items[i].st.st_size;
+                files[i].mtime_sec  = items[i].st.st_mtim.tv_sec;
+                files[i].mtime_nsec = items[i].st.st_mtim.tv_nsec;
+
+                for (enc = ENC_IDENTITY; enc < ENC_COUNT; enc++) {
+                        if (!body[enc])
+                                continue;
+
+                        http_rep(&rep, items[i].type, blen[enc], enc, items[i].st.st_ino,
+                                 items[i].st.st_size, &items[i].st.st_mtim);
+
+                        hlen[enc] = http_header(header, sizeof(header), &rep);
+                        hdr[enc]  = append(&strings, header, hlen[enc]);
+
+                        files[i].var[enc].body = put_body(out, &off, body[enc], blen[enc]);
+                        files[i].var[enc].blen = blen[enc];
+                        files[i].var[enc].hlen = hlen[enc];
+                        files[i].var[enc].header = hdr[enc];
+
+                        free(body[enc]);
+                }
+        }
+
+        /* The records, the index, then the strings (and headers) */
+        head.count = nitems;
+        head.files = off = (off + 7) & ~(uint64_t)7;
+
+        for (head.slots = 16; head.slots < 2 * head.count; head.slots *= 2)
+                ;
+
+        head.index = head.files + nitems * sizeof(*files);
+        strbase    = head.index + (uint64_t)head.slots * sizeof(*slots);
+        head.size  = strbase + strings.len;
+
+        if (slots = calloc(head.slots, sizeof(*slots)), !slots)
+                die("calloc");
+
+        for (i=0; i<nitems; i++) {
+                files[i].path += strbase;
+                files[i].type += strbase;
+                for (enc = ENC_IDENTITY; enc < ENC_COUNT; enc++) {
+                        if (files[i].var[enc].hlen)
+                                files[i].var[enc].header += strbase;
+                }
+
+                for (j = files[i].hash & (head.slots - 1); slots[j]; j = (j + 1) & (head.slots - 1))
+                        ;
+                slots[j] = i + 1;
+        }
+
+        if (fseeko(out, head.files, SEEK_SET) < 0
+        ||  fwrite(files, sizeof(*files), nitems, out) != nitems
+        ||  fwrite(slots, sizeof(*slots), head.slots, out) != head.slots
+        ||  fwrite(strings.p, 1, strings.len, out) != strings.len
+        ||  fseeko(out, 0, SEEK_SET) < 0
+        ||  fwrite(&head, sizeof(head), 1, out) != 1
+        ||  fclose(out) != 0)
+                die("write");
+
+        snprintf(tmp, sizeof(tmp), "%s.tmp", argv[2]);
+
+        if (rename(tmp, argv[2]) < 0)
+                die(argv[2]);
+
+        printf("%s: %zu files, %llu bytes\n", argv[2], nitems, (unsigned long long)head.size);
+
+        return 0;
+}
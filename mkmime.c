@@ -0,0 +1,249 @@
+/*
+ * mkmime.c -- compile mime.types into a perfect hash table.
+ *
+ * usage: mkmime mime.types > mime_table.h
+ *
+ * Each line of mime.types is a MIME type followed by the extensions that
+ * map to it; '#' starts a comment. Where an extension is listed twice,
+ * the first line wins.
+ *
+ * The table is built by hash and displace: the extensions are spread over
+ * MIME_BUCKETS buckets by mime_hash(ext, 0), and each bucket, largest
+ * first, is given the smallest seed d for which mime_hash(ext, d) puts
+ * every extension in it in an empty slot. A lookup is then two hashes, one
+ * string compare and no probing.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include "mime.h"
+
+
+/* Seeds tried per bucket before the table is made bigger */
+#define MAX_SEED 65535
+
+
+struct key_t {
+        char ext[MIME_EXT_MAX+1];
+        size_t len;
+        char *type;
+        int bucket;
+};
+
+static struct key_t *keys;
+static int nkeys;
+
+
+/**
+ * add -- add an extension, unless it is already there or can't be matched
+ * @ext : the extension, as it appears in the file
+ * @type: its MIME type
+ */
+static void add(const char *ext, char *type)
+{
+        struct key_t *k;
+        size_t len;
+        int i;
+
+        /* Only the part after the last dot of a name is ever looked up */
+        if (len = strlen(ext), len == 0 || len > MIME_EXT_MAX || strchr(ext, '.'))
+                return;
+
+        for (i=0; i<(int)len; i++) {
+                if (!isgraph((unsigned char)ext[i]) || ext[i] == '"' || ext[i] == '\\')
+                        return;
+        }
+
+        for (i=0; i<nkeys; i++) {
+                if (keys[i].len == len && !strncasecmp(keys[i].ext, ext, len))
+                        return;
+        }
+
+        if (keys = realloc(keys, (nkeys+1)*sizeof(*keys)), !keys) {
+                perror("mkmime");
+                exit(1);
+        }
+
+        k = &keys[nkeys++];
+        for (i=0; i<(int)len; i++)
+                k->ext[i] = tolower((unsigned char)ext[i]);
+        k->ext[len] = '\0';
+        k->len  = len;
+        k->type = type;
+}
+
+
+/**
+ * load -- read every extension in a mime.types file
+ * @path: the file
+ */
+static void load(const char *path)
+{
+        char line[1024];
+        char *type;
+        char *ext;
+        FILE *f;
+
+        if (f = fopen(path, "r"), !f) {
+                perror(path);
+                exit(1);
+        }
+
+        while (fgets(line, sizeof(line), f)) {
+                if (strchr(line, '#'))
+                        *strchr(line, '#') = '\0';
+
+                if (type = strtok(line, " \t\r\n"), !type)
+                        continue;
+                if (strchr(type, '"') || strchr(type, '\\'))
+                        continue;
+                if (type = strdup(type), !type) {
+                        perror("mkmime");
+                        exit(1);
+                }
+
+                while ((ext = strtok(NULL, " \t\r\n")))
+                        add(ext, type);
+        }
+
+        fclose(f);
+}
+
+
+/**
+ * by_size -- order buckets largest first (qsort callback)
+ */
+static int *bucket_size;
+
+static int by_size(const void *a, const void *b)
+{
+        return bucket_size[*(const int *)b] - bucket_size[*(const int *)a];
+}
+
+
+/**
+ * build -- find a seed for every bucket of a table of a given size
+ * @slots  : number of slots (a power of two)
+ * @buckets: number of buckets (a power of two)
+ * @disp   : will hold the seed of each bucket
+ * @slot   : will hold the key in each slot, or -1
+ *  RET: 0 on success, -1 if some bucket has no seed that works
+ */
+static int build(int slots, int buckets, unsigned *disp, int *slot)
+{
+        int *order;
+        int *taken;
+        int b, i, n;
+        unsigned d;
+        uint32_t s;
+
+        bucket_size = calloc(buckets, sizeof(int));
+        order = malloc(buckets * sizeof(int));
+        taken = malloc((nkeys + 1) * sizeof(int));
+
+        for (i=0; i<nkeys; i++) {
+                keys[i].bucket = mime_hash(keys[i].ext, keys[i].len, 0) & (buckets-1);
+                bucket_size[keys[i].bucket]++;
+        }
+        for (b=0; b<buckets; b++)
+                order[b] = b;
+        qsort(order, buckets, sizeof(int), by_size);
+
+        for (i=0; i<slots; i++)
+                slot[i] = -1;
+
+        for (b=0; b<buckets; b++) {
+                disp[order[b]] = 0;
+
+                if (bucket_size[order[b]] == 0)
+                        continue;
+
+                for (d = 1; d <= MAX_SEED; d++) {
+                        /* Try to place every key of the bucket with seed d */
+                        for (n = 0, i = 0; i < nkeys; i++) {
+                                if (keys[i].bucket != order[b])
+                                        continue;
+                                s = mime_hash(keys[i].ext, keys[i].len, d) & (slots-1);
+                                if (slot[s] != -1)
+                                        break;
+                                slot[s] = i;
+                                taken[n++] = s;
+                        }
+                        if (i == nkeys)
+                                break;
+
+                        /* It didn't fit: undo, try the next seed */
+                        while (n > 0)
+                                slot[taken[--n]] = -1;
+                }
+
+                if (d > MAX_SEED) {
+                        free(bucket_size);
+                        free(order);
+                        free(taken);
+                        return -1;
+                }
+                disp[order[b]] = d;
+        }
+
+        free(bucket_size);
+        free(order);
+        free(taken);
+        return 0;
+}
+
+
+int main(int argc, char *argv[])
+{
+        unsigned *disp;
+        int *slot;
+        int slots;
+        int buckets;
+        int i;
+
+        if (argc != 2) {
+                fprintf(stderr, "usage: mkmime mime.types > mime_table.h\n");
+                return 1;
+        }
+
+        load(argv[1]);
+
+        /* Start at a load factor between 1/2 and 1; grow if stuck */
+        for (slots = 16; slots < nkeys; slots <<= 1)
+                ;
+
+        for (;; slots <<= 1) {
+                buckets = slots / 4 ? slots / 4 : 1;
+                disp = malloc(buckets * sizeof(*disp));
+                slot = malloc(slots * sizeof(*slot));
+
+                if (build(slots, buckets, disp, slot) == 0)
+                        break;
+
+                free(disp);
+                free(slot);
+        }
+
+        printf("/* Generated by mkmime from %s; do not edit. */\n\n", argv[1]);
+        printf("#define MIME_KEYS    %d\n", nkeys);
+        printf("#define MIME_SLOTS   %d\n", slots);
+        printf("#define MIME_BUCKETS %d\n\n", buckets);
+
+        printf("static const uint16_t mime_disp[MIME_BUCKETS]={");
+        for (i=0; i<buckets; i++)
+                printf("%s%u,", (i % 16) ? " " : "\n        ", disp[i]);
+        printf("\n};\n\n");
+
+        printf("static const struct mime_t mime_table[MIME_SLOTS]={\n");
+        for (i=0; i<slots; i++) {
+                if (slot[i] == -1)
+                        continue;
+                printf("        [%d] = { \"%s\", %zu, \"%s\" },\n", i,
+                       keys[slot[i]].ext, keys[slot[i]].len, keys[slot[i]].type);
+        }
+        printf("};\n");
+
+        return 0;
+}
@@ -0,0 +1,227 @@
+/*
+ * parse.c -- single-pass, in-place HTTP/1.x request parser.
+ *
+ * The parser never copies or allocates: the method, target and every
+ * header name and value are returned as (pointer, length) slices into
+ * the receive buffer, which is left untouched.
+ *
+ * It is incremental. A request that arrives over several reads is parsed
+ * one complete line at a time; each call resumes at the first line not
+ * yet parsed, and the search for the end of that line resumes where the
+ * last call gave up, so no byte is scanned twice.
+ *
+ * Line ends are found 16 bytes at a time with SSE2 where available.
+ */
+#include <string.h>
+#include <strings.h>
+#include "parse.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+
+/**
+ * find_eol -- find the first '\n' in [p, end)
+ *  RET: pointer to it, or NULL
+ */
+static inline const char *find_eol(const char *p, const char *end)
+{
+#ifdef __SSE2__
+        const __m128i nl = _mm_set1_epi8('\n');
+        __m128i block;
+        int mask;
+
+        for (; end - p >= 16; p += 16) {
+                block = _mm_loadu_si128((const __m128i *)p);
+                if (mask = _mm_movemask_epi8(_mm_cmpeq_epi8(block, nl)), mask)
+                        return p + __builtin_ctz(mask);
+        }
+#endif
+        return memchr(p, '\n', end - p);
+}
+
+
+/**
+ * trim -- make a slice of [p, end) without surrounding spaces and tabs
+ */
+static inline struct slice_t trim(const char *p, const char *end)
+{
+        while (p < end && (*p == ' ' || *p == '\t'))
+                p++;
+        while (end > p && (end[-1] == ' ' || end[-1] == '\t'))
+                end--;
+
+        return (struct slice_t){ p, end - p };
+}
+
+
+/**
+ * request_line -- parse "METHOD SP TARGET [SP HTTP/1.x]"
+ * @req: the request
+ * @p  : start of the line
+ * @end: end of the line (CR/LF excluded)
+ *  RET: 0, or PARSE_BAD
+ */
+static int request_line(struct req_t *req, const char *p, const char *end)
+{
+        const char *sp;
+
+        if (sp = memchr(p, ' ', end - p), !sp || sp == p)
+                return PARSE_BAD;
+
+        req->method = (struct slice_t){ p, sp - p };
+
+        for (p = sp + 1; p < end && *p == ' '; p++)
+                ;
+
+        if (sp = memchr(p, ' ', end - p), !sp)
+                sp = end;
+        if (sp == p)
+                return PARSE_BAD;
+
+        req->target = (struct slice_t){ p, sp - p };
+
+        /* A bare "GET /path" is taken as HTTP/1.0 */
+        if (p = sp, p == end) {
+                req->minor = -1;
+                return 0;
+        }
+
+        while (p < end && *p == ' ')
+                p++;
+
+        if (end - p != 8 || strncmp(p, "HTTP/1.", 7) || p[7] < '0' || p[7] > '9')
+                return PARSE_BAD;
+
+        req->minor = p[7] - '0';
+
+        return 0;
+}
+
+
+/**
+ * header_line -- parse "Name: value"
+ * @req: the request
+ * @p  : start of the line
+ * @end: end of the line (CR/LF excluded)
+ *  RET: 0, PARSE_BAD or PARSE_OVERFLOW
+ */
+static int header_line(struct req_t *req, const char *p, const char *end)
+{
+        struct header_t *h;
+        const char *colon;
+
+        /* Obsolete line folding is not accepted (RFC 7230 3.2.4) */
+        if (*p == ' ' || *p == '\t')
+                return PARSE_BAD;
+
+        if (colon = memchr(p, ':', end - p), !colon || colon == p)
+                return PARSE_BAD;
+
+        /* No whitespace is allowed between the name and the colon */
+        if (colon[-1] == ' ' || colon[-1] == '\t')
+                return PARSE_BAD;
+
+        if (req->nheaders == MAX_HEADERS)
+                return PARSE_OVERFLOW;
+
+        h = &req->headers[req->nheaders++];
+        h->name  = (struct slice_t){ p, colon - p };
+        h->value = trim(colon + 1, end);
+
+        return 0;
+}
+
+
+/**
+ * parse_reset -- prepare a request structure for a new request
+ * @req: the request
+ */
+void parse_reset(struct req_t *req)
+{
+        req->nheaders = 0;
+        req->line     = 0;
+        req->probe    = 0;
+        req->started  = 0;
+        req->minor    = -1;
+}
+
+
+/**
+ * parse_request -- parse as much of a request as the buffer holds
+ * @req: the request, parse_reset() before the first call
+ * @buf: the receive buffer; must not move between calls
+ * @len: bytes in the buffer
+ *  RET: length of the request including its blank line once it is
+ *       complete; else PARSE_AGAIN, PARSE_BAD or PARSE_OVERFLOW.
+ */
+int parse_request(struct req_t *req, const char *buf, size_t len)
+{
+        const char *line;
+        const char *eol;
+        const char *end;
+        int ret;
+
+        for (;;) {
+                line = buf + req->line;
+
+                if (eol = find_eol(buf + req->probe, buf + len), !eol) {
+                        req->probe = len;
+                        return PARSE_AGAIN;
+                }
+
+                end = (eol > line && eol[-1] == '\r') ? eol - 1 : eol;
+
+                req->line = req->probe = eol + 1 - buf;
+
+                if (end == line) {
+                        /* Blank lines before the request line are ignored */
+                        if (!req->started)
+                                continue;
+                        return req->line;
+                }
+
+                if (!req->started) {
+                        req->started = 1;
+                        ret = request_line(req, line, end);
+                } else {
+                        ret = header_line(req, line, end);
+                }
+
+                if (ret < 0)
+                        return ret;
+        }
+}
+
+
+/**
+ * parse_header -- find a header by name (case-insensitive)
+ * @req : a parsed request
+ * @name: the header name, e.g. "Connection"
+ *  RET: the header's value, or NULL if the request has none
+ */
+const struct slice_t *parse_header(const struct req_t *req, const char *name)
+{
+        size_t len;
+        int i;
+
+        len = strlen(name);
+
+        for (i=0; i<req->nheaders; i++) {
+                if (req->headers[i].name.len == len
+                && !strncasecmp(req->headers[i].name.p, name, len))
+                        return &req->headers[i].value;
+        }
+        return NULL;
+}
+
+
+/**
+ * slice_is -- compare a slice to a string (case-insensitive)
+ *  RET: 1 if they are equal, else 0
+ */
+int slice_is(const struct slice_t *s, const char *str)
+{
+        return s && s->len == strlen(str) && !strncasecmp(s->p, str, s->len);
+}
@@ -0,0 +1,51 @@
+#ifndef __PARSE_H
+#define __PARSE_H
+
+#include <stddef.h>
+
+
+/* Headers kept per request; more is an error */
+#define MAX_HEADERS 32
+
+
+/* Results of parse_request() other than a request length */
+#define PARSE_AGAIN      0  // incomplete, call again with more bytes
+#define PARSE_BAD       -1  // malformed
+#define PARSE_OVERFLOW  -2  // too many headers
+
+
+/* A run of bytes inside the receive buffer, not '\0'-terminated */
+struct slice_t {
+        const char *p;
+        size_t len;
+};
+
+
+/* A header line, split into name and value (whitespace trimmed) */
+struct header_t {
+        struct slice_t name;
+        struct slice_t value;
+};
+
+
+/* A parsed request, and the parser's place in it */
+struct req_t {
+        struct slice_t method;       // e.g. "GET"
+        struct slice_t target;       // e.g. "/index.html?q"
+        int minor;                   // HTTP/1.<minor>; -1 if no version
+        struct header_t headers[MAX_HEADERS];
+        int nheaders;
+        size_t line;                 // Offset of the first unparsed line
+        size_t probe;                // Offset where the scan for '\n' resumes
+        int started;                 // Request line seen
+};
+
+
+/* Function prototypes */
+void parse_reset(struct req_t *req);
+int parse_request(struct req_t *req, const char *buf, size_t len);
+const struct slice_t *parse_header(const struct req_t *req, const char *name);
+int slice_is(const struct slice_t *s, const char *str);
+
+
+#endif
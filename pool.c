@@ -0,0 +1,127 @@
+/*
+ * pool.c -- slabs of fixed-size objects, for connections and their buffers.
+ *
+ * A pool hands out objects of one size, carved one after another from
+ * slabs of POOL_SLAB bytes mapped from the kernel. An object given back
+ * goes on the pool's free list and is the next one handed out, while its
+ * memory is still in the cache; getting and putting one is a push or a
+ * pop, with no malloc() and no lock (every worker has pools of its own).
+ *
+ * A slab is only address space until its objects are first used, so a
+ * pool costs memory for the most objects that were ever out at once. To
+ * keep a burst from pinning that memory for good, only pool_kb of free
+ * objects are kept ready; the pages of any more are handed back to the
+ * kernel (MADV_DONTNEED) and only faulted in again if they are reused.
+ * Objects smaller than a page share pages with others, so those are kept
+ * whatever their number.
+ */
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <netinet/in.h>
+#include "pool.h"
+#include "conf.h"
+#include "log.h"
+#include "metrics.h"
+
+
+/**
+ * pool_carve -- take a new object from the slab, mapping another if need be
+ * @p: the pool
+ *  RET: the object, or NULL if out of memory
+ */
+static void *pool_carve(struct pool_t *p)
+{
+        size_t page = sysconf(_SC_PAGESIZE);
+        size_t slab;
+        void *obj;
+
+        /* Whole pages for an object of a page or more, else cache lines */
+        if (!p->step) {
+                if (p->pages = (p->size >= page), p->pages)
+                        p->step = (p->size + page - 1) & ~(page - 1);
+                else
+                        p->step = (p->size + 63) & ~(size_t)63;
+        }
+
+        if (p->left < p->step) {
+                slab = (p->step > POOL_SLAB) ? p->step : POOL_SLAB - POOL_SLAB % p->step;
+
+                p->slab = mmap(NULL, slab, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+
+                if (p->slab == MAP_FAILED) {
+                        record(ERROR, NULL, "mmap pool slab");
+                        p->slab = NULL;
+                        p->left = 0;
+                        return NULL;
+                }
+                p->left = slab;
+        }
+
+        obj = p->slab;
+        p->slab += p->step;
+        p->left -= p->step;
+
+        METRICS_ADD(pooled, p->step);
+
+        return obj;
+}
+
+
+/**
+ * pool_get -- take an object from a pool
+ * @p: the pool
+ *  RET: the object (its contents undefined), or NULL if out of memory
+ */
+void *pool_get(struct pool_t *p)
+{
+        struct slot_t *s;
+
+        if (s = p->ready, s) {
+                p->ready = s->next;
+                p->nready--;
+                return s;
+        }
+
+        if (p->ncold > 0) {
+                METRICS_ADD(pooled, p->step);
+                return p->cold[--p->ncold];
+        }
+
+        return pool_carve(p);
+}
+
+
+/**
+ * pool_put -- give an object back to its pool
+ * @p  : the pool
+ * @obj: the object, from pool_get() on the same pool
+ */
+void pool_put(struct pool_t *p, void *obj)
+{
+        struct slot_t *s = obj;
+        void **cold;
+
+        /* Past pool_kb of them, the pages of a large one go back */
+        if (p->pages && (p->nready + 1) * p->step > (size_t)conf.pool_kb * 1024) {
+                if (p->ncold == p->room) {
+                        cold = realloc(p->cold, (p->room ? 2 * p->room : 64) * sizeof(*cold));
+                        if (!cold)
+                                goto ready;
+                        p->cold  = cold;
+                        p->room  = p->room ? 2 * p->room : 64;
+                }
+
+                madvise(obj, p->step, MADV_DONTNEED);
+                p->cold[p->ncold++] = obj;
+
+                METRICS_ADD(pooled, -(int64_t)p->step);
+                return;
+        }
+
+ready:
+        s->next  = p->ready;
+        p->ready = s;
+        p->nready++;
+}
@@ -0,0 +1,44 @@
+#ifndef __POOL_H
+#define __POOL_H
+
+#include <stddef.h>
+
+
+/* Bytes of address space taken from the kernel at a time */
+#define POOL_SLAB (1 << 20)
+
+
+/* An object given back, on the free list */
+struct slot_t {
+        struct slot_t *next;
+};
+
+
+/*
+ * Objects of one size, carved from slabs. Each worker has its own pools
+ * (they live in its memory, not in memory shared with the others), so
+ * nothing is ever locked.
+ */
+struct pool_t {
+        size_t size;                 // Bytes asked for each object
+        size_t step;                 //   and taken, rounded up
+        int pages;                   //   to whole pages, which can go back
+        char *slab;                  // The slab being carved
+        size_t left;                 //   and the bytes of it not yet carved
+        struct slot_t *ready;        // Objects given back, most recent first
+        size_t nready;
+        void **cold;                 // Objects whose pages went back to the kernel
+        size_t ncold;
+        size_t room;                 //   and the room for them
+};
+
+
+#define POOL_INIT(bytes) { .size = (bytes) }
+
+
+/* Function prototypes */
+void *pool_get(struct pool_t *p);
+void pool_put(struct pool_t *p, void *obj);
+
+
+#endif
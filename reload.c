@@ -0,0 +1,184 @@
+/*
+ * reload.c -- replace the running binary without dropping a connection.
+ *
+ * SIGUSR2 makes the server fork and exec the binary it was started as,
+ * with the same arguments, from the same directory. The listening sockets
+ * stay open across the exec and their numbers are passed on in
+ * RELOAD_ENV_FDS, so the new generation serves the very sockets the old
+ * one does: connections queued on them are never refused or reset.
+ *
+ * Once the new generation is listening it sends SIGQUIT to the old one
+ * (named in RELOAD_ENV_PARENT), which stops accepting, lets its open
+ * connections finish their responses, and exits when they are gone or
+ * conf.drain_timeout has passed. Should the new binary fail to start, it
+ * never sends SIGQUIT and the old generation carries on serving.
+ *
+ * SIGQUIT sent by hand drains the same way, for a graceful stop.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+#include "reload.h"
+#include "log.h"
+
+
+/* Room for the numbers of the listening sockets, comma separated */
+#define LIST_SIZE 4096
+
+
+volatile sig_atomic_t reloading;
+volatile sig_atomic_t draining;
+
+
+/* How this process was started, to start the next generation the same way */
+static char **args;
+static char exe[PATH_MAX];
+static char cwd[PATH_MAX];
+
+
+/**
+ * reload_init -- remember the binary, its arguments and the directory
+ * @argv: main()'s argv (kept, not copied)
+ *
+ * Called before anything changes directory, so a relative path to the
+ * binary still resolves.
+ */
+void reload_init(char **argv)
+{
+        args = argv;
+
+        /* A bare name is looked up in $PATH again by execvp() */
+        if (!strchr(argv[0], '/') || !realpath(argv[0], exe))
+                snprintf(exe, sizeof(exe), "%s", argv[0]);
+
+        if (!getcwd(cwd, sizeof(cwd)))
+                cwd[0] = '\0';
+}
+
+
+/**
+ * on_usr2 -- signal handler asking for a new generation
+ */
+static void on_usr2(int sig)
+{
+        reloading = 1;
+}
+
+
+/**
+ * on_quit -- signal handler asking this generation to drain and exit
+ */
+static void on_quit(int sig)
+{
+        draining = 1;
+}
+
+
+/**
+ * reload_signals -- handle SIGUSR2 and SIGQUIT
+ *
+ * Neither restarts an interrupted system call, so a loop blocked in
+ * accept(), epoll_wait() or waitpid() sees the flag at once.
+ */
+void reload_signals(void)
+{
+        struct sigaction su = { .sa_handler = on_usr2 };
+        struct sigaction sq = { .sa_handler = on_quit };
+
+        sigaction(SIGUSR2, &su, NULL);
+        sigaction(SIGQUIT, &sq, NULL);
+}
+
+
+/**
+ * reload_inherited -- the listening sockets left by the previous generation
+ * @fds: will hold them
+ * @max: room in fds
+ *  RET: how many there are (0 on a cold start)
+ */
+int reload_inherited(int *fds, int max)
+{
+        char *list;
+        char *end;
+        int n = 0;
+
+        if (list = getenv(RELOAD_ENV_FDS), !list)
+                return 0;
+
+        while (n < max && *list) {
+                fds[n++] = strtol(list, &end, 10);
+                if (*end != ',')
+                        break;
+                list = end + 1;
+        }
+
+        unsetenv(RELOAD_ENV_FDS);
+
+        return n;
+}
+
+
+/**
+ * reload_exec -- start the new binary, handing it the listening sockets
+ * @fds: the listening sockets
+ * @n  : how many
+ *
+ * Returns at once in the calling process; it will hear from the new
+ * generation by SIGQUIT.
+ */
+void reload_exec(const int *fds, int n)
+{
+        char list[LIST_SIZE] = "";
+        char parent[16];
+        size_t len = 0;
+        pid_t pid;
+        int i;
+
+        if (pid = fork(), pid < 0) {
+                record(ERROR, NULL, "reload: fork");
+                return;
+        }
+
+        if (pid > 0) {
+                record(RESPONSE, NULL, "reload: starting a new generation");
+                return;
+        }
+
+        for (i=0; i<n && len < sizeof(list); i++)
+                len += snprintf(list+len, sizeof(list)-len, "%s%d", i ? "," : "", fds[i]);
+
+        snprintf(parent, sizeof(parent), "%d", (int)getppid());
+
+        setenv(RELOAD_ENV_FDS, list, 1);
+        setenv(RELOAD_ENV_PARENT, parent, 1);
+
+        if (chdir(cwd) < 0 || execvp(exe, args) < 0)
+                record(ERROR, NULL, "reload: exec");
+
+        _exit(1);
+}
+
+
+/**
+ * reload_ready -- tell the previous generation, if any, to drain
+ */
+void reload_ready(void)
+{
+        char *parent;
+        pid_t pid;
+
+        if (parent = getenv(RELOAD_ENV_PARENT), !parent)
+                return;
+
+        if (pid = atoi(parent), pid > 1 && kill(pid, SIGQUIT) < 0)
+                record(ERROR, NULL, "reload: can't signal the previous generation");
+
+        unsetenv(RELOAD_ENV_PARENT);
+}
@@ -0,0 +1,27 @@
+#ifndef __RELOAD_H
+#define __RELOAD_H
+
+#include <signal.h>
+
+
+/* Listening sockets handed from one generation to the next */
+#define RELOAD_ENV_FDS    "CLOTH_FDS"
+#define RELOAD_ENV_PARENT "CLOTH_PARENT"
+
+
+/* Set by SIGUSR2: start the new binary alongside this one */
+extern volatile sig_atomic_t reloading;
+
+/* Set by SIGQUIT: stop accepting, finish what is open, then exit */
+extern volatile sig_atomic_t draining;
+
+
+/* Function prototypes */
+void reload_init(char **argv);
+void reload_signals(void);
+int reload_inherited(int *fds, int max);
+void reload_exec(const int *fds, int n);
+void reload_ready(void);
+
+
+#endif
@@ -0,0 +1,10 @@
+#ifndef __ROOT_H
+#define __ROOT_H
+
+
+/* Function prototypes */
+int root_init(const char *dir);
+int root_open(const char *path, int flags);
+
+
+#endif
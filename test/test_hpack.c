@@ -0,0 +1,161 @@
+/*
+ * test_hpack.c -- the HPACK decoder against blocks that stress its table.
+ *
+ * Built with AddressSanitizer by make test, so a field read from memory
+ * the table has already freed fails it even where the bytes survive.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../hpack.h"
+
+
+/* Entries of 1 KB, as RFC 7541 counts them: four fill the table */
+#define VLEN (1024 - 32 - 6)
+
+/* Dynamic indexes follow the 61 of the static table */
+#define STATIC_COUNT 61
+
+
+static int failed;
+
+
+#define CHECK(cond)                                                     \
+        do {                                                            \
+                if (!(cond)) {                                          \
+                        fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #cond); \
+                        failed = 1;                                     \
+                }                                                       \
+        } while (0)
+
+
+/**
+ * integer -- encode an integer with an n-bit prefix (5.1)
+ *  RET: bytes written
+ */
+static size_t integer(uint8_t *out, uint8_t first, int prefix, size_t v)
+{
+        size_t max = (1u << prefix) - 1;
+        size_t n = 1;
+
+        if (v < max) {
+                out[0] = first | v;
+                return 1;
+        }
+
+        for (out[0] = first | max, v -= max; v >= 0x80; v >>= 7)
+                out[n++] = 0x80 | (v & 0x7f);
+
+        out[n++] = v;
+
+        return n;
+}
+
+
+/**
+ * string -- encode a string literal, not Huffman-coded (5.2)
+ *  RET: bytes written
+ */
+static size_t string(uint8_t *out, const char *s, size_t len)
+{
+        size_t n = integer(out, 0x00, 7, len);
+
+        memcpy(out + n, s, len);
+
+        return n + len;
+}
+
+
+/*
+ * A literal with incremental indexing whose name is the oldest entry's,
+ * while the table is full: adding it evicts the entry it names (4.4).
+ */
+static void test_evicted_name(void)
+{
+        struct hpack_t t;
+        struct header_t hdr[8];
+        static uint8_t in[8 * 1024];
+        static char buf[8 * 1024];
+        char value[VLEN];
+        char name[32];
+        size_t len = 0;
+        int n;
+        int i;
+
+        memset(value, 'v', sizeof(value));
+
+        for (i=0; i<4; i++) {
+                snprintf(name, sizeof(name), "x-old%d", i);
+                len += integer(in + len, 0x40, 6, 0);
+                len += string(in + len, name, 6);
+                len += string(in + len, value, VLEN);
+        }
+
+        /* x-old0 is now the oldest of four, at the last dynamic index */
+        len += integer(in + len, 0x40, 6, STATIC_COUNT + 4);
+        len += string(in + len, value, VLEN);
+
+        hpack_init(&t);
+
+        CHECK(hpack_decode(&t, in, len, buf, sizeof(buf), hdr, 8, &n) == HPACK_OK);
+        CHECK(n == 5);
+        CHECK(n == 5 && hdr[4].name.len == 6 && !memcmp(hdr[4].name.p, "x-old0", 6));
+        CHECK(t.count == 4 && t.size == 4 * 1024);
+
+        /* The new entry, at index 62, has the name; x-old0 itself is gone */
+        len = integer(in, 0x80, 7, STATIC_COUNT + 1);
+
+        CHECK(hpack_decode(&t, in, len, buf, sizeof(buf), hdr, 8, &n) == HPACK_OK);
+        CHECK(n == 1 && hdr[0].name.len == 6 && !memcmp(hdr[0].name.p, "x-old0", 6));
+
+        len = integer(in, 0x80, 7, STATIC_COUNT + 4);
+
+        CHECK(hpack_decode(&t, in, len, buf, sizeof(buf), hdr, 8, &n) == HPACK_OK);
+        CHECK(n == 1 && !memcmp(hdr[0].name.p, "x-old1", 6));
+
+        hpack_free(&t);
+}
+
+
+/*
+ * The same, with a value too big for the table, which just empties it:
+ * the name must still be read from somewhere that was not freed.
+ */
+static void test_emptied_name(void)
+{
+        struct hpack_t t;
+        struct header_t hdr[8];
+        static uint8_t in[16 * 1024];
+        static char buf[16 * 1024];
+        static char value[HPACK_TABLE];
+        size_t len = 0;
+        int n;
+
+        memset(value, 'v', sizeof(value));
+
+        len += integer(in + len, 0x40, 6, 0);
+        len += string(in + len, "x-only", 6);
+        len += string(in + len, value, VLEN);
+
+        len += integer(in + len, 0x40, 6, STATIC_COUNT + 1);
+        len += string(in + len, value, sizeof(value));
+
+        hpack_init(&t);
+
+        CHECK(hpack_decode(&t, in, len, buf, sizeof(buf), hdr, 8, &n) == HPACK_OK);
+        CHECK(n == 2 && hdr[1].name.len == 6 && !memcmp(hdr[1].name.p, "x-only", 6));
+        CHECK(t.count == 0 && t.size == 0);
+
+        hpack_free(&t);
+}
+
+
+int main(void)
+{
+        test_evicted_name();
+        test_emptied_name();
+
+        printf("test_hpack: %s\n", failed ? "FAILED" : "ok");
+
+        return failed;
+}
@@ -0,0 +1,332 @@
+/*
+ * tls.c -- terminate TLS, and hand the record layer to the kernel.
+ *
+ * With a certificate and key (-c, -k), every connection starts with a
+ * handshake, driven by OpenSSL on the non-blocking socket as its bytes
+ * arrive. The context is made once, before any worker is forked, so
+ * the workers share the session ticket keys OpenSSL generates with it:
+ * a client resumes with a ticket from any of them. Sessions are also
+ * cached by id, per worker, for clients without tickets.
+ *
+ * Once the handshake is done, OpenSSL installs the session's keys in
+ * the kernel (kernel TLS, TCP_ULP "tls") if it can. The socket then
+ * encrypts whatever is written to it, and cloth writes to it exactly
+ * as it would in plaintext: headers with sendmsg(), files with
+ * sendfile() straight from the page cache. Where the kernel has no
+ * kTLS, or not for the cipher agreed, or ktls=0, records are sealed in
+ * user space with SSL_write(): small pieces of a response are gathered
+ * into full records, and files are read into a record-sized buffer.
+ *
+ * Reads always go through SSL_read(), which knows whether the kernel or
+ * OpenSSL is decrypting them.
+ *
+ * With http2=1 the client may choose HTTP/2 ("h2") by ALPN during the
+ * handshake; HTTP/1.1 is chosen otherwise.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include "tls.h"
+#include "conf.h"
+#include "log.h"
+#include "metrics.h"
+
+
+SSL_CTX *tls_ctx;
+
+
+/**
+ * tls_alpn -- choose the protocol the client will speak, from its offer
+ *  RET: SSL_TLSEXT_ERR_OK, or SSL_TLSEXT_ERR_NOACK to choose none
+ */
+static int tls_alpn(SSL *ssl, const unsigned char **out, unsigned char *outlen,
+                    const unsigned char *in, unsigned int inlen, void *arg)
+{
+        static const unsigned char ours[] = "\x02h2\x08http/1.1";
+        unsigned char *chosen;
+
+        (void)ssl;
+        (void)arg;
+
+        /* Ours are in order of preference */
+        if (SSL_select_next_proto(&chosen, outlen, ours, sizeof(ours) - 1, in, inlen)
+            != OPENSSL_NPN_NEGOTIATED)
+                return SSL_TLSEXT_ERR_NOACK;
+
+        *out = chosen;
+
+        return SSL_TLSEXT_ERR_OK;
+}
+
+
+/**
+ * tls_init -- make the server's context from a certificate and its key
+ * @cert: PEM file with the certificate (and any chain after it)
+ * @key : PEM file with the private key
+ *  RET: 0 on success, else -1 (with the reason on stderr)
+ */
+int tls_init(const char *cert, const char *key)
+{
+        SSL_CTX *ctx;
+
+        if (ctx = SSL_CTX_new(TLS_server_method()), !ctx)
+                goto fail;
+
+        SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+
+        /* A client that hangs up without close_notify just hung up */
+        SSL_CTX_set_options(ctx, SSL_OP_IGNORE_UNEXPECTED_EOF|SSL_OP_NO_RENEGOTIATION);
+        if (conf.ktls)
+                SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+
+        /* A write may be retried from a buffer rebuilt elsewhere */
+        SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE
+                            | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER
+                            | SSL_MODE_RELEASE_BUFFERS);
+
+        /* Resumption: tickets, and a cache by session id */
+        SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+        SSL_CTX_sess_set_cache_size(ctx, conf.tls_sessions);
+        SSL_CTX_set_session_id_context(ctx, (const unsigned char *)"cloth", 5);
+        SSL_CTX_set_num_tickets(ctx, 1);
+
+        if (conf.http2)
+                SSL_CTX_set_alpn_select_cb(ctx, tls_alpn, NULL);
+
+        if (SSL_CTX_use_certificate_chain_file(ctx, cert) != 1
+        ||  SSL_CTX_use_PrivateKey_file(ctx, key, SSL_FILETYPE_PEM) != 1
+        ||  SSL_CTX_check_private_key(ctx) != 1)
+                goto fail;
+
+        tls_ctx = ctx;
+
+        return 0;
+
+fail:
+        ERR_print_errors_fp(stderr);
+        SSL_CTX_free(ctx);
+        return -1;
+}
+
+
+/**
+ * tls_open -- start the server side of TLS on an accepted socket
+ * @fd: the socket
+ *  RET: the session, or NULL if out of memory
+ */
+SSL *tls_open(int fd)
+{
+        SSL *ssl;
+
+        if (ssl = SSL_new(tls_ctx), !ssl)
+                return NULL;
+
+        if (SSL_set_fd(ssl, fd) != 1) {
+                SSL_free(ssl);
+                return NULL;
+        }
+
+        SSL_set_accept_state(ssl);
+
+        return ssl;
+}
+
+
+/**
+ * tls_error -- turn a failed call into errno
+ * @ssl: the session
+ * @ret: what the call returned
+ *  RET: -1, with errno EAGAIN if the call is only waiting on the socket
+ */
+static int tls_error(SSL *ssl, int ret)
+{
+        switch (SSL_get_error(ssl, ret)) {
+        case SSL_ERROR_WANT_READ:
+        case SSL_ERROR_WANT_WRITE:
+                errno = EAGAIN;
+                break;
+        case SSL_ERROR_SYSCALL:
+                if (errno == 0 || errno == EAGAIN)
+                        errno = EPIPE;
+                break;
+        default:
+                errno = EPROTO;
+                break;
+        }
+
+        return -1;
+}
+
+
+/**
+ * tls_handshake -- take the handshake as far as the socket allows
+ * @ssl: the session
+ *  RET: 1 when it is done, 0 if it must wait on the socket, -1 if it failed
+ */
+int tls_handshake(SSL *ssl)
+{
+        static int warned;
+        int ret;
+
+        ERR_clear_error();
+
+        if (ret = SSL_do_handshake(ssl), ret != 1)
+                return (tls_error(ssl, ret) < 0 && errno == EAGAIN) ? 0 : -1;
+
+        METRICS_ADD(tls_handshakes, 1);
+        if (SSL_session_reused(ssl))
+                METRICS_ADD(tls_resumed, 1);
+
+        if (tls_offloaded(ssl)) {
+                METRICS_ADD(tls_offloaded, 1);
+        } else if (conf.ktls && !warned) {
+                warned = 1;
+                record(ERROR, NULL, "kTLS unavailable, encrypting in user space");
+        }
+
+        return 1;
+}
+
+
+/**
+ * tls_offloaded -- the kernel seals what is written to the socket
+ * @ssl: the session, its handshake done
+ */
+int tls_offloaded(SSL *ssl)
+{
+        return BIO_get_ktls_send(SSL_get_wbio(ssl)) > 0;
+}
+
+
+/**
+ * tls_h2 -- the client chose HTTP/2 during the handshake
+ * @ssl: the session, its handshake done
+ */
+int tls_h2(SSL *ssl)
+{
+        const unsigned char *proto;
+        unsigned int len;
+
+        SSL_get0_alpn_selected(ssl, &proto, &len);
+
+        return len == 2 && !memcmp(proto, "h2", 2);
+}
+
+
+/**
+ * tls_read -- read(), through TLS
+ *  RET: bytes read, 0 at the end, or -1 with errno set (EAGAIN: wait)
+ */
+ssize_t tls_read(SSL *ssl, void *buf, size_t len)
+{
+        size_t n;
+        int ret;
+
+        ERR_clear_error();
+
+        if (ret = SSL_read_ex(ssl, buf, len, &n), ret == 1)
+                return n;
+
+        if (SSL_get_error(ssl, ret) == SSL_ERROR_ZERO_RETURN)
+                return 0;
+
+        return tls_error(ssl, ret);
+}
+
+
+/**
+ * tls_write -- write(), through TLS, sealing the bytes in user space
+ *  RET: bytes written, or -1 with errno set (EAGAIN: call again later,
+ *       with the same bytes)
+ */
+static ssize_t tls_write(SSL *ssl, const void *buf, size_t len)
+{
+        size_t n;
+        int ret;
+
+        ERR_clear_error();
+
+        if (ret = SSL_write_ex(ssl, buf, len, &n), ret == 1)
+                return n;
+
+        return tls_error(ssl, ret);
+}
+
+
+/**
+ * tls_writev -- write a run of pieces in memory, through TLS
+ * @ssl: the session
+ * @iov: the pieces
+ * @n  : the number of pieces
+ *  RET: bytes written, which may end mid-piece, or -1 with errno set
+ *
+ * A run of small pieces (a header, the Date line, the start of a body)
+ * is copied into one record, rather than sealed into a record apiece;
+ * called again with the same pieces, it copies the same bytes, as a
+ * retried SSL_write() must.
+ */
+ssize_t tls_writev(SSL *ssl, const struct iovec *iov, int n)
+{
+        char record[TLS_RECORD];
+        size_t len = 0;
+        size_t take;
+        int i;
+
+        if (n == 1 || iov[0].iov_len >= sizeof(record))
+                return tls_write(ssl, iov[0].iov_base, iov[0].iov_len);
+
+        for (i=0; i<n && len < sizeof(record); i++) {
+                take = sizeof(record) - len;
+                take = (iov[i].iov_len < take) ? iov[i].iov_len : take;
+
+                memcpy(record + len, iov[i].iov_base, take);
+                len += take;
+        }
+
+        return tls_write(ssl, record, len);
+}
+
+
+/**
+ * tls_send_file -- send part of a file through TLS, a record at a time
+ * @ssl     : the session
+ * @fd_file : the open file
+ * @offset  : offset of the next byte to send (advanced by the bytes sent)
+ * @end     : offset one past the last byte to send
+ *  RET: bytes sent, 0 if the file ended early, else -1 with errno set
+ *
+ * The counterpart of send_file() for a session the kernel can't seal.
+ */
+ssize_t tls_send_file(SSL *ssl, int fd_file, off_t *offset, off_t end)
+{
+        char record[TLS_RECORD];
+        ssize_t n;
+
+        n = (end - *offset < TLS_RECORD) ? end - *offset : TLS_RECORD;
+
+        if (n = pread(fd_file, record, n, *offset), n <= 0)
+                return n;
+
+        if (n = tls_write(ssl, record, n), n > 0)
+                *offset += n;
+
+        return n;
+}
+
+
+/**
+ * tls_close -- say goodbye, if the socket will take it, and free the session
+ * @ssl: the session
+ */
+void tls_close(SSL *ssl)
+{
+        ERR_clear_error();
+
+        if (SSL_is_init_finished(ssl))
+                SSL_shutdown(ssl);
+
+        SSL_free(ssl);
+}
@@ -0,0 +1,29 @@
+#ifndef __TLS_H
+#define __TLS_H
+
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <openssl/ssl.h>
+
+
+/* Most plaintext a TLS record holds */
+#define TLS_RECORD 16384
+
+
+/* The server's context, or NULL when it speaks plaintext */
+extern SSL_CTX *tls_ctx;
+
+
+/* Function prototypes */
+int tls_init(const char *cert, const char *key);
+SSL *tls_open(int fd);
+int tls_handshake(SSL *ssl);
+int tls_offloaded(SSL *ssl);
+int tls_h2(SSL *ssl);
+ssize_t tls_read(SSL *ssl, void *buf, size_t len);
+ssize_t tls_writev(SSL *ssl, const struct iovec *iov, int n);
+ssize_t tls_send_file(SSL *ssl, int fd_file, off_t *offset, off_t end);
+void tls_close(SSL *ssl);
+
+
+#endif
@@ -0,0 +1,725 @@
+/*
+ * uring.c -- serve many connections from one process with io_uring.
+ *
+ * The same connections and state machine as event.c, driven by completions
+ * instead of readiness. Work is queued on a ring shared with the kernel
+ * and a single io_uring_enter() both submits it and waits for what has
+ * finished, so a busy loop makes about one system call per batch of
+ * events rather than several per request:
+ *
+ *      accept  - one multishot accept, which stays armed and completes
+ *                once for every connection
+ *      receive - one recv at a time per connection, into a buffer the
+ *                kernel picks from a ring of them provided up front, so
+ *                an idle connection pins none; it is only armed while a
+ *                request is wanted, which keeps pipelining clients at bay
+ *      send    - pieces in memory go out in one sendmsg(); a range of a
+ *                file is spliced into a pipe of the connection's own,
+ *                linked to a splice out of it to the socket, both queued
+ *                together, so file bytes are never copied
+ *
+ * A connection with operations in flight cannot be freed, as their
+ * completions will still name it: conn_close() then shuts the socket down
+ * so they finish at once, and the last of them frees it.
+ *
+ * Kernels without io_uring (or where it is disabled) make engine_uring()
+ * return without serving anything, and the caller falls back to epoll.
+ * Provided buffer rings (5.19) and multishot accept (5.19) are used when
+ * the kernel has them, and done without when it does not.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <netinet/in.h>
+#include <linux/io_uring.h>
+#include "uring.h"
+#include "event.h"
+#include "admit.h"
+#include "clock.h"
+#include "compress.h"
+#include "conf.h"
+#include "metrics.h"
+#include "reload.h"
+
+
+/* Submission queue entries (the completion queue gets twice as many) */
+#define RING_ENTRIES 4096
+
+/* Receive buffers provided to the kernel, and the size of each */
+#define RECV_BUFFERS 1024
+#define RECV_SIZE    4096
+
+/* Bytes of a file spliced through a connection's pipe at a time */
+#define PIPE_SIZE    262144
+
+
+/*
+ * What a completion is for. Operations on a connection carry a pointer
+ * to it with the tag in its low bits (a conn_t is at least 8-aligned);
+ * the rest carry only the tag.
+ */
+enum uring_op { OP_NONE, OP_RECV, OP_SEND, OP_READ,
+                OP_ACCEPT, OP_NOTIFY, OP_COMPRESS, OP_TICK };
+
+#define OP_MASK 7
+
+
+/* The ring, mapped from the kernel */
+static struct {
+        int fd;
+        unsigned entries;
+        unsigned *sq_head;
+        unsigned *sq_tail;
+        unsigned sq_mask;
+        unsigned tail;               // Our copy of *sq_tail, ahead of it
+        unsigned queued;             // Entries not yet submitted
+        struct io_uring_sqe *sqes;
+        unsigned *cq_head;
+        unsigned *cq_tail;
+        unsigned cq_mask;
+        struct io_uring_cqe *cqes;
+} ring;
+
+
+/* Provided receive buffers, or NULL to receive into the connection */
+static struct io_uring_buf_ring *bufring;
+static char *bufs;
+static unsigned short buftail;
+
+
+static int fd_listen;
+static int fd_notify;
+static int fd_compress;
+static int multishot = 1;
+
+
+/* Wake at least once a second to expire idle connections */
+static struct __kernel_timespec tick = { .tv_sec = 1 };
+
+
+/******************************************************************************
+ * RING
+ * Setting up the ring, and queueing work on it.
+ ******************************************************************************/
+/**
+ * ring_init -- set up and map the ring
+ *  RET: 0 on success, else -1
+ */
+static int ring_init(void)
+{
+        /* Run completions only when we ask, from this thread alone */
+        unsigned flags[] = { IORING_SETUP_COOP_TASKRUN|IORING_SETUP_SINGLE_ISSUER
+                                                     |IORING_SETUP_DEFER_TASKRUN, 0 };
+        struct io_uring_params p;
+        unsigned *array;
+        size_t size;
+        char *sq;
+        unsigned i;
+
+        for (i=0; i<2; i++) {
+                memset(&p, 0, sizeof(p));
+                p.flags = flags[i];
+
+                if (ring.fd = syscall(SYS_io_uring_setup, RING_ENTRIES, &p), ring.fd >= 0)
+                        break;
+                if (errno != EINVAL)
+                        return -1;
+        }
+        if (ring.fd < 0)
+                return -1;
+
+        /* Kernels before 5.4 map the two queues separately; don't bother */
+        if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+                close(ring.fd);
+                errno = ENOSYS;
+                return -1;
+        }
+
+        size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+        if (size < p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe))
+                size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+
+        sq = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+                  ring.fd, IORING_OFF_SQ_RING);
+        ring.sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+                         PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+                         ring.fd, IORING_OFF_SQES);
+
+        if (sq == MAP_FAILED || ring.sqes == MAP_FAILED) {
+                close(ring.fd);
+                return -1;
+        }
+
+        ring.entries = p.sq_entries;
+        ring.sq_head = (unsigned *)(sq + p.sq_off.head);
+        ring.sq_tail = (unsigned *)(sq + p.sq_off.tail);
+        ring.sq_mask = *(unsigned *)(sq + p.sq_off.ring_mask);
+        ring.tail    = *ring.sq_tail;
+        ring.cq_head = (unsigned *)(sq + p.cq_off.head);
+        ring.cq_tail = (unsigned *)(sq + p.cq_off.tail);
+        ring.cq_mask = *(unsigned *)(sq + p.cq_off.ring_mask);
+        ring.cqes    = (struct io_uring_cqe *)(sq + p.cq_off.cqes);
+
+        /* Entry i of the queue is always sqes[i] */
+        array = (unsigned *)(sq + p.sq_off.array);
+        for (i=0; i<p.sq_entries; i++)
+                array[i] = i;
+
+        return 0;
+}
+
+
+/**
+ * bufring_init -- provide the kernel with buffers to receive into
+ *
+ * Without them (before 5.19), each recv() goes straight into the
+ * connection's request buffer instead.
+ */
+static void bufring_init(void)
+{
+        struct io_uring_buf_reg reg;
+        int i;
+
+        bufring = mmap(NULL, RECV_BUFFERS * sizeof(struct io_uring_buf),
+                       PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+        bufs    = malloc((size_t)RECV_BUFFERS * RECV_SIZE);
+
+        if (bufring == MAP_FAILED || !bufs)
+                goto fail;
+
+        memset(&reg, 0, sizeof(reg));
+        reg.ring_addr    = (uintptr_t)bufring;
+        reg.ring_entries = RECV_BUFFERS;
+        reg.bgid         = 0;
+
+        if (syscall(SYS_io_uring_register, ring.fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+                goto fail;
+
+        for (i=0; i<RECV_BUFFERS; i++) {
+                bufring->bufs[i].addr = (uintptr_t)(bufs + (size_t)i * RECV_SIZE);
+                bufring->bufs[i].len  = RECV_SIZE;
+                bufring->bufs[i].bid  = i;
+        }
+        buftail = RECV_BUFFERS;
+        __atomic_store_n(&bufring->tail, buftail, __ATOMIC_RELEASE);
+
+        return;
+fail:
+        if (bufring != MAP_FAILED)
+                munmap(bufring, RECV_BUFFERS * sizeof(struct io_uring_buf));
+        free(bufs);
+        bufring = NULL;
+        bufs    = NULL;
+}
+
+
+/**
+ * buf_recycle -- give a receive buffer back to the kernel
+ * @bid: its index
+ */
+static void buf_recycle(int bid)
+{
+        struct io_uring_buf *b = &bufring->bufs[buftail & (RECV_BUFFERS-1)];
+
+        b->addr = (uintptr_t)(bufs + (size_t)bid * RECV_SIZE);
+        b->len  = RECV_SIZE;
+        b->bid  = bid;
+
+        __atomic_store_n(&bufring->tail, ++buftail, __ATOMIC_RELEASE);
+}
+
+
+/**
+ * ring_submit -- hand the queued entries to the kernel
+ * @wait: also wait for at least one completion
+ *  RET: 0, or -1 on error
+ */
+static int ring_submit(int wait)
+{
+        int n;
+
+        __atomic_store_n(ring.sq_tail, ring.tail, __ATOMIC_RELEASE);
+
+        n = syscall(SYS_io_uring_enter, ring.fd, ring.queued, wait,
+                    wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+        if (n < 0)
+                return -1;
+
+        ring.queued -= n;
+
+        return 0;
+}
+
+
+/**
+ * sqe_get -- queue an entry, submitting those before it if the ring is full
+ * @data: what its completion is for
+ *  RET: the entry, zeroed, or NULL if there is no room
+ */
+static struct io_uring_sqe *sqe_get(uint64_t data)
+{
+        struct io_uring_sqe *sqe;
+
+        if (ring.tail - __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE) == ring.entries) {
+                ring_submit(0);
+                if (ring.tail - __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE) == ring.entries) {
+                        record(ERROR, NULL, "io_uring: submission queue full");
+                        return NULL;
+                }
+        }
+
+        sqe = &ring.sqes[ring.tail & ring.sq_mask];
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->user_data = data;
+
+        ring.tail++;
+        ring.queued++;
+
+        return sqe;
+}
+
+
+/**
+ * conn_sqe -- queue an operation on a connection
+ * @c : the connection
+ * @op: one of enum uring_op
+ * @fd: the descriptor operated on
+ *  RET: the entry, or NULL if there is no room
+ */
+static struct io_uring_sqe *conn_sqe(struct conn_t *c, int op, int fd)
+{
+        struct io_uring_sqe *sqe;
+
+        if (sqe = sqe_get((uintptr_t)c | op), !sqe)
+                return NULL;
+
+        sqe->fd = fd;
+        c->inflight++;
+
+        return sqe;
+}
+
+
+/**
+ * arm -- queue one of the operations that belong to no connection
+ * @op: OP_ACCEPT, OP_NOTIFY, OP_COMPRESS or OP_TICK
+ */
+static void arm(int op)
+{
+        struct io_uring_sqe *sqe;
+
+        if (sqe = sqe_get(op), !sqe)
+                log(FATAL, NULL, "io_uring: can't arm");
+
+        switch (op) {
+        case OP_ACCEPT:
+                sqe->opcode       = IORING_OP_ACCEPT;
+                sqe->fd           = fd_listen;
+                sqe->accept_flags = SOCK_CLOEXEC;
+                sqe->ioprio       = multishot ? IORING_ACCEPT_MULTISHOT : 0;
+                break;
+        case OP_NOTIFY:
+        case OP_COMPRESS:
+                sqe->opcode       = IORING_OP_POLL_ADD;
+                sqe->fd           = (op == OP_NOTIFY) ? fd_notify : fd_compress;
+                sqe->poll32_events = POLLIN;
+                sqe->len          = IORING_POLL_ADD_MULTI;
+                break;
+        case OP_TICK:
+                sqe->opcode       = IORING_OP_TIMEOUT;
+                sqe->fd           = -1;
+                sqe->addr         = (uintptr_t)&tick;
+                sqe->len          = 1;
+                break;
+        }
+}
+
+
+/******************************************************************************
+ * CONNECTIONS
+ * Each step queues what the connection's state needs next, and returns 0
+ * if it could not.
+ ******************************************************************************/
+/**
+ * uring_recv -- queue a receive of more of the request
+ * @c: the connection
+ */
+static int uring_recv(struct conn_t *c)
+{
+        struct io_uring_sqe *sqe;
+        size_t room = BUFSIZE - c->nread;
+
+        /* From the kernel's buffers, the request is copied into one of
+         * ours when it arrives; without them, an idle connection holds one */
+        if (!bufring && conn_buffer(c) < 0)
+                return 0;
+
+        if (sqe = conn_sqe(c, OP_RECV, c->fd), !sqe)
+                return 0;
+
+        sqe->opcode = IORING_OP_RECV;
+
+        if (bufring) {
+                sqe->flags     = IOSQE_BUFFER_SELECT;
+                sqe->buf_group = 0;
+                sqe->len       = (room < RECV_SIZE) ? room : RECV_SIZE;
+        } else {
+                sqe->addr      = (uintptr_t)(c->buf->request + c->nread);
+                sqe->len       = room;
+        }
+
+        return 1;
+}
+
+
+/**
+ * pipe_open -- make the pipe a connection splices file ranges through
+ * @c: the connection
+ *  RET: 0 on success, else -1
+ */
+static int pipe_open(struct conn_t *c)
+{
+        if (pipe2(c->pipe, O_CLOEXEC) < 0) {
+                record(ERROR, NULL, "pipe2");
+                return -1;
+        }
+
+        /* A smaller pipe only means more, shorter splices */
+        fcntl(c->pipe[1], F_SETPIPE_SZ, PIPE_SIZE);
+
+        return 0;
+}
+
+
+/**
+ * uring_send -- queue the sending of the next piece(s) of the response
+ * @c: the connection
+ */
+static int uring_send(struct conn_t *c)
+{
+        struct io_uring_sqe *sqe;
+        struct seg_t *s = &c->seg[c->segidx];
+        size_t len;
+        int more;
+
+        /* A run of pieces in memory goes out in one sendmsg() */
+        if (s->p) {
+                c->msg.msg_iov    = c->buf->iov;
+                c->msg.msg_iovlen = conn_iov(c, c->buf->iov, &more);
+
+                if (sqe = conn_sqe(c, OP_SEND, c->fd), !sqe)
+                        return 0;
+
+                sqe->opcode    = IORING_OP_SENDMSG;
+                sqe->addr      = (uintptr_t)&c->msg;
+                sqe->len       = 1;
+                sqe->msg_flags = MSG_NOSIGNAL|more;
+                return 1;
+        }
+
+        /* A range of the file is spliced through the pipe, a piece at a time */
+        if (c->piped == 0) {
+                if (c->pipe[0] < 0 && pipe_open(c) < 0)
+                        return 0;
+
+                len = s->len < PIPE_SIZE ? s->len : PIPE_SIZE;
+
+                /* Filling the pipe short cancels the splice out of it */
+                if (sqe = conn_sqe(c, OP_READ, c->pipe[1]), !sqe)
+                        return 0;
+
+                sqe->opcode        = IORING_OP_SPLICE;
+                sqe->flags         = IOSQE_IO_LINK;
+                sqe->splice_fd_in  = c->file->fd;
+                sqe->splice_off_in = s->off;
+                sqe->off           = -1;
+                sqe->len           = len;
+                sqe->splice_flags  = SPLICE_F_MOVE;
+
+                c->piped = len;
+        }
+
+        more = (s->len > c->piped || c->segidx+1 < c->nseg) ? SPLICE_F_MORE : 0;
+
+        if (sqe = conn_sqe(c, OP_SEND, c->fd), !sqe)
+                return 0;
+
+        sqe->opcode        = IORING_OP_SPLICE;
+        sqe->splice_fd_in  = c->pipe[0];
+        sqe->splice_off_in = -1;
+        sqe->off           = -1;
+        sqe->len           = c->piped;
+        sqe->splice_flags  = SPLICE_F_MOVE|more;
+
+        return 1;
+}
+
+
+/**
+ * uring_run -- step a connection along until it waits on an operation
+ * @c: the connection (may be freed on return)
+ */
+static void uring_run(struct conn_t *c)
+{
+        for (;;) {
+                switch (c->state) {
+                case CONN_READ:
+                        if (conn_parse(c))
+                                break;
+                        if (c->inflight || uring_recv(c))
+                                return;
+                        c->state = CONN_CLOSE;
+                        break;
+                case CONN_WRITE:
+                        if (c->inflight)
+                                return;
+                        while (c->segidx < c->nseg && c->seg[c->segidx].len == 0)
+                                c->segidx++;
+                        if (c->segidx == c->nseg)
+                                c->state = CONN_DONE;
+                        else if (uring_send(c))
+                                return;
+                        else
+                                c->state = CONN_CLOSE;
+                        break;
+                case CONN_DONE:
+                        conn_done(c);
+                        break;
+                case CONN_CLOSE:
+                        conn_close(c);
+                        return;
+                }
+        }
+}
+
+
+/**
+ * uring_complete -- take the result of an operation on a connection
+ * @c    : the connection
+ * @op   : what the operation was
+ * @res  : its result
+ * @flags: its completion flags
+ */
+static void uring_complete(struct conn_t *c, int op, int res, unsigned flags)
+{
+        struct seg_t *s;
+        int bid = flags >> IORING_CQE_BUFFER_SHIFT;
+
+        c->inflight--;
+
+        if (c->closing) {
+                if (flags & IORING_CQE_F_BUFFER)
+                        buf_recycle(bid);
+                if (c->inflight == 0)
+                        conn_close(c);
+                return;
+        }
+
+        switch (op) {
+        case OP_RECV:
+                if (res == -ENOBUFS)
+                        break; /* every buffer is taken; ask again */
+                if (res <= 0) {
+                        c->state = CONN_CLOSE; /* remote hung up, or error */
+                        break;
+                }
+                if (flags & IORING_CQE_F_BUFFER) {
+                        if (conn_buffer(c) < 0) {
+                                buf_recycle(bid);
+                                c->state = CONN_CLOSE;
+                                break;
+                        }
+                        memcpy(c->buf->request + c->nread, bufs + (size_t)bid * RECV_SIZE, res);
+                        buf_recycle(bid);
+                }
+                c->nread += res;
+                break;
+        case OP_READ:
+                if (res <= 0) {
+                        c->state = CONN_CLOSE; /* error, or file truncated */
+                        break;
+                }
+                c->piped = res;
+                c->seg[c->segidx].off += res;
+                break;
+        case OP_SEND:
+                if (res == -ECANCELED && c->piped > 0)
+                        break; /* the pipe filled short; send what it has */
+                if (res < 0) {
+                        c->state = CONN_CLOSE;
+                        break;
+                }
+                if (s = &c->seg[c->segidx], s->p) {
+                        conn_sent(c, res);
+                        break;
+                }
+                METRICS_ADD(bytes, res);
+                conn_timeout(c, conf.send_timeout);
+                c->piped -= res;
+                s->len   -= res;
+                break;
+        }
+
+        if (c->inflight == 0)
+                uring_run(c);
+}
+
+
+/**
+ * uring_accept -- take a connection from the multishot accept
+ * @fd: the accepted socket
+ */
+static void uring_accept(int fd)
+{
+        struct sockaddr_in remote;
+        socklen_t length = sizeof(remote);
+        struct conn_t *c;
+
+        /* The accept itself had nowhere to put the address */
+        if (getpeername(fd, (struct sockaddr *)&remote, &length) < 0)
+                memset(&remote, 0, sizeof(remote));
+
+        /* Over capacity: a 503 now, rather than a wait in the backlog */
+        if (!admit(&remote)) {
+                admit_refuse(fd);
+                return;
+        }
+
+        if (c = conn_open(fd, &remote), !c) {
+                record(ERROR, NULL, "conn_open");
+                admit_release(&remote);
+                close(fd);
+                return;
+        }
+
+        uring_run(c);
+}
+
+
+/******************************************************************************
+ * ENGINE
+ ******************************************************************************/
+/**
+ * complete -- dispatch a completion
+ * @cqe: the completion
+ */
+static void complete(struct io_uring_cqe *cqe)
+{
+        uint64_t data = cqe->user_data;
+        int more      = cqe->flags & IORING_CQE_F_MORE;
+
+        if (data & ~(uint64_t)OP_MASK) {
+                uring_complete((struct conn_t *)(uintptr_t)(data & ~(uint64_t)OP_MASK),
+                               data & OP_MASK, cqe->res, cqe->flags);
+                return;
+        }
+
+        switch (data) {
+        case OP_ACCEPT:
+                if (cqe->res >= 0)
+                        uring_accept(cqe->res);
+                else if (cqe->res == -EINVAL && multishot)
+                        multishot = 0; /* before 5.19: one accept at a time */
+                else if (cqe->res != -EINTR && cqe->res != -ECONNABORTED
+                     &&  cqe->res != -ECANCELED)
+                        record(ERROR, NULL, "io_uring: accept");
+                if (!more && fd_listen >= 0)
+                        arm(OP_ACCEPT);
+                break;
+        case OP_NOTIFY:
+                cache_notify();
+                if (!more)
+                        arm(OP_NOTIFY);
+                break;
+        case OP_COMPRESS:
+                compress_done();
+                if (!more)
+                        arm(OP_COMPRESS);
+                break;
+        case OP_TICK:
+                conn_expire();
+                cache_report();
+                arm(OP_TICK);
+                break;
+        }
+}
+
+
+/**
+ * engine_uring -- serve connections on a listening socket, forever
+ * @fd: the listening socket
+ *
+ * Returns (having served nothing) only if io_uring can't be set up.
+ */
+void engine_uring(int fd)
+{
+        struct io_uring_sqe *sqe;
+        struct io_uring_cqe *cqe;
+        unsigned head;
+
+        if (ring_init() < 0) {
+                record(ERROR, NULL, "io_uring unavailable, using epoll");
+                return;
+        }
+
+        bufring_init();
+
+        fd_listen = fd;
+
+        /* As engine_epoll(): a log thread, admission, timeouts, a cache... */
+        log_async();
+        admit_init(conf.workers > 0 ? conf.workers : 1);
+        wheel_init();
+
+        if (fd_notify = cache_init(), fd_notify >= 0)
+                arm(OP_NOTIFY);
+        if (fd_compress = compress_init(), fd_compress >= 0)
+                arm(OP_COMPRESS);
+
+        arm(OP_ACCEPT);
+        arm(OP_TICK);
+
+        for (;;) {
+                /* Only without workers; a master does this for its own */
+                if (reloading && !draining)
+                        reload_exec(&fd_listen, 1);
+                reloading = 0;
+
+                /* Stop accepting; the next generation has the socket too */
+                if (draining && fd_listen >= 0) {
+                        if (sqe = sqe_get(OP_NONE), sqe) {
+                                sqe->opcode = IORING_OP_ASYNC_CANCEL;
+                                sqe->fd     = -1;
+                                sqe->addr   = OP_ACCEPT;
+                        }
+                        close(fd_listen);
+                        fd_listen = -1;
+                }
+                if (draining && conn_drain()) {
+                        log_flush();
+                        exit(0);
+                }
+
+                if (ring_submit(1) < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY)
+                        log(FATAL, NULL, "io_uring_enter");
+
+                clock_tick();
+
+                /* Completions may queue more work, submitted next time round */
+                head = *ring.cq_head;
+                while (head != __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE)) {
+                        cqe = &ring.cqes[head & ring.cq_mask];
+                        complete(cqe);
+                        __atomic_store_n(ring.cq_head, ++head, __ATOMIC_RELEASE);
+                }
+        }
+}
@@ -0,0 +1,9 @@
+#ifndef __URING_H
+#define __URING_H
+
+
+/* Function prototypes */
+void engine_uring(int fd_listen);
+
+
+#endif
@@ -0,0 +1,180 @@
+/*
+ * wheel.c -- deadlines for every connection, kept in a hierarchical wheel.
+ *
+ * The wheel has WHEEL_LEVELS levels of WHEEL_SLOTS slots. A slot of the
+ * first level holds the timeouts due in one particular second of the
+ * next WHEEL_SLOTS; a slot of the second level, those due in one span
+ * of WHEEL_SLOTS seconds of the next WHEEL_SLOTS^2; and so on. As the
+ * clock passes the start of a span, its slot is emptied into the level
+ * below, so a timeout moves down at most WHEEL_LEVELS-1 times before it
+ * expires, from a slot of the first level.
+ *
+ * Setting, cancelling and expiring a timeout are all O(1), whatever the
+ * number of connections: a slot is a circular list, and the one a
+ * deadline belongs in is found from its bits. There is no heap to keep
+ * ordered and no timer in the kernel per connection.
+ *
+ * Most deadlines are pushed back long before they come round (a response
+ * that is still being sent is given another send_timeout each time it
+ * makes progress), so pushing one later costs nothing more than storing
+ * it: the timeout stays where it is, and is put where it now belongs
+ * when its slot comes round. Only a deadline brought forward is moved.
+ */
+#include <stddef.h>
+#include "wheel.h"
+
+
+/* The slots, each the head of a circular list */
+static struct timeout_t slots[WHEEL_LEVELS][WHEEL_SLOTS];
+
+/* Timeouts that are due, not yet taken by wheel_next() */
+static struct timeout_t due;
+
+/* Every slot up to this second has been emptied */
+static time_t tick;
+
+
+/**
+ * detach -- take a timeout out of its slot
+ * @t: the timeout
+ */
+static void detach(struct timeout_t *t)
+{
+        t->prev->next = t->next;
+        t->next->prev = t->prev;
+        t->prev = t->next = NULL;
+}
+
+
+/**
+ * place -- put a timeout in the slot a deadline belongs in
+ * @t   : the timeout (in no slot)
+ * @when: the deadline
+ */
+static void place(struct timeout_t *t, time_t when)
+{
+        struct timeout_t *head;
+        time_t delta = when - tick;
+        int shift = 0;
+        int l;
+
+        if (delta <= 0) {
+                head    = &due;
+                t->slot = tick;
+        } else {
+                /* Further off than the wheel reaches: placed again later */
+                if (delta >= WHEEL_SPAN) {
+                        delta = WHEEL_SPAN - 1;
+                        when  = tick + delta;
+                }
+
+                for (l=0; delta >> (shift + WHEEL_BITS); l++)
+                        shift += WHEEL_BITS;
+
+                head    = &slots[l][(when >> shift) & (WHEEL_SLOTS-1)];
+                t->slot = (when >> shift) << shift;
+        }
+
+        t->prev = head->prev;
+        t->next = head;
+        head->prev->next = t;
+        head->prev = t;
+}
+
+
+/**
+ * empty -- put every timeout of a slot where it now belongs
+ * @head: the slot
+ */
+static void empty(struct timeout_t *head)
+{
+        struct timeout_t *t;
+
+        while (t = head->next, t != head) {
+                detach(t);
+                place(t, t->when);
+        }
+}
+
+
+/**
+ * wheel_init -- start the clock of an empty wheel
+ */
+void wheel_init(void)
+{
+        int l;
+        int i;
+
+        for (l=0; l<WHEEL_LEVELS; l++)
+                for (i=0; i<WHEEL_SLOTS; i++)
+                        slots[l][i].prev = slots[l][i].next = &slots[l][i];
+
+        due.prev = due.next = &due;
+        tick = wheel_now();
+}
+
+
+/**
+ * wheel_set -- set, or move, a deadline
+ * @t   : the timeout
+ * @when: the second it is due
+ */
+void wheel_set(struct timeout_t *t, time_t when)
+{
+        t->when = when;
+
+        if (t->prev) {
+                if (t->slot <= when)
+                        return; /* its slot comes round first anyway */
+                detach(t);
+        }
+
+        place(t, when);
+}
+
+
+/**
+ * wheel_cancel -- clear a deadline
+ * @t: the timeout
+ */
+void wheel_cancel(struct timeout_t *t)
+{
+        if (t->prev)
+                detach(t);
+}
+
+
+/**
+ * wheel_next -- take a timeout that is due
+ *  RET: the timeout (no longer set), or NULL when none is due
+ */
+struct timeout_t *wheel_next(void)
+{
+        struct timeout_t *t;
+        time_t now = wheel_now();
+        int shift;
+        int l;
+
+        while (tick < now) {
+                tick++;
+
+                /* At the start of a span, its slot moves down a level */
+                for (l=1, shift=WHEEL_BITS; l<WHEEL_LEVELS; l++, shift+=WHEEL_BITS) {
+                        if (tick & (((time_t)1 << shift) - 1))
+                                break;
+                        empty(&slots[l][(tick >> shift) & (WHEEL_SLOTS-1)]);
+                }
+
+                empty(&slots[0][tick & (WHEEL_SLOTS-1)]);
+        }
+
+        /* Those pushed back since they fell due are put back in the wheel */
+        while (t = due.next, t != &due) {
+                detach(t);
+                if (t->when <= tick)
+                        return t;
+                place(t, t->when);
+        }
+
+        return NULL;
+}
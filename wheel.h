@@ -0,0 +1,45 @@
+#ifndef __WHEEL_H
+#define __WHEEL_H
+
+#include <time.h>
+
+
+/* A wheel of 2^WHEEL_BITS one-second slots, and WHEEL_LEVELS of them */
+#define WHEEL_BITS   6
+#define WHEEL_SLOTS  (1 << WHEEL_BITS)
+#define WHEEL_LEVELS 4
+
+/* The furthest a timeout can be set, in seconds (about 194 days) */
+#define WHEEL_SPAN   ((time_t)1 << (WHEEL_BITS * WHEEL_LEVELS))
+
+
+/* A deadline, embedded in whatever it is the deadline of */
+struct timeout_t {
+        struct timeout_t *prev;      // The slot it is in (NULL: not set)
+        struct timeout_t *next;
+        time_t when;                 // When it is due
+        time_t slot;                 // When its slot comes round
+};
+
+
+/**
+ * wheel_now -- seconds on a clock that never jumps, the wheel's clock
+ */
+static inline time_t wheel_now(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+
+        return ts.tv_sec;
+}
+
+
+/* Function prototypes */
+void wheel_init(void);
+void wheel_set(struct timeout_t *t, time_t when);
+void wheel_cancel(struct timeout_t *t);
+struct timeout_t *wheel_next(void);
+
+
+#endif
@@ -0,0 +1,206 @@
+/*
+ * worker.c -- run one event loop per CPU.
+ *
+ * The master process owns one SO_REUSEPORT listening socket per worker,
+ * so the kernel spreads incoming connections across the workers and no
+ * accept lock is needed. Each worker is a forked process pinned to its
+ * own CPU, with its own socket, epoll set and connection state: nothing
+ * mutable is shared on the request path.
+ *
+ * The master does no serving. It restarts any worker that dies (the new
+ * worker inherits the same listening socket, so queued connections are
+ * not lost) and takes the workers down with it on SIGTERM or SIGINT.
+ * SIGQUIT is passed on to the workers, which drain (see reload.c); the
+ * master exits after the last of them. SIGUSR2 is the master's alone.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <sched.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include "event.h"
+#include "uring.h"
+#include "conf.h"
+#include "worker.h"
+#include "metrics.h"
+#include "reload.h"
+#include "log.h"
+
+
+static pid_t pids[MAX_WORKERS];
+static volatile sig_atomic_t stopping;
+static volatile sig_atomic_t hangup;
+
+
+/**
+ * pin -- bind the calling process to the n-th CPU it is allowed to run on
+ * @n: worker index (wraps around if there are more workers than CPUs)
+ */
+static void pin(int n)
+{
+        cpu_set_t allowed;
+        cpu_set_t mine;
+        int count;
+        int cpu;
+
+        if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0)
+                return;
+
+        if (count = CPU_COUNT(&allowed), count == 0)
+                return;
+
+        n %= count;
+
+        for (cpu=0; cpu<CPU_SETSIZE; cpu++) {
+                if (CPU_ISSET(cpu, &allowed) && n-- == 0)
+                        break;
+        }
+
+        CPU_ZERO(&mine);
+        CPU_SET(cpu, &mine);
+
+        if (sched_setaffinity(0, sizeof(mine), &mine) < 0)
+                record(ERROR, NULL, "sched_setaffinity");
+}
+
+
+/**
+ * spawn -- fork the worker for slot n
+ * @fd_listen: every worker's listening socket
+ * @nworkers : number of workers
+ * @n        : the slot to (re)start
+ */
+static void spawn(int *fd_listen, int nworkers, int n)
+{
+        pid_t pid;
+        int i;
+
+        if (pid = fork(), pid < 0) {
+                record(ERROR, NULL, "fork");
+                return;
+        }
+
+        /* Parent */
+        if (pid > 0) {
+                pids[n] = pid;
+                return;
+        }
+
+        /* Child: keep only its own socket */
+        signal(SIGTERM, SIG_DFL);
+        signal(SIGINT, SIG_DFL);
+        signal(SIGUSR2, SIG_IGN);
+        log_open();
+
+        for (i=0; i<nworkers; i++) {
+                if (i != n)
+                        close(fd_listen[i]);
+        }
+
+        pin(n);
+        metrics_attach(n);
+        if (conf.engine == ENGINE_URING)
+                engine_uring(fd_listen[n]); /* returns if io_uring is unavailable */
+        engine_epoll(fd_listen[n]); /* never returns */
+}
+
+
+/**
+ * stop -- signal handler asking the master to shut down
+ */
+static void stop(int sig)
+{
+        stopping = 1;
+}
+
+
+/**
+ * hup -- signal handler passing SIGHUP (reopen the log) on to the workers
+ */
+static void hup(int sig)
+{
+        hangup = 1;
+        log_reopen(sig);
+}
+
+
+/**
+ * workers -- start n workers and supervise them, forever
+ * @fd_listen: one SO_REUSEPORT listening socket per worker
+ * @n        : number of workers
+ */
+void workers(int *fd_listen, int n)
+{
+        struct sigaction sa = { .sa_handler = stop };
+        struct sigaction sh = { .sa_handler = hup };
+        int told = 0;
+        int live = n;
+        pid_t pid;
+        int i;
+
+        signal(SIGCLD, SIG_DFL); /* The master reaps its workers */
+
+        /* No SA_RESTART, so waitpid() returns when asked to stop */
+        sigaction(SIGTERM, &sa, NULL);
+        sigaction(SIGINT, &sa, NULL);
+
+        for (i=0; i<n; i++)
+                spawn(fd_listen, n, i);
+
+        /* Pass SIGHUP on; workers install their own handler (log_open()) */
+        sigaction(SIGHUP, &sh, NULL);
+
+        while (!stopping) {
+                if (hangup) {
+                        hangup = 0;
+                        for (i=0; i<n; i++)
+                                kill(pids[i], SIGHUP);
+                }
+
+                if (reloading && !draining)
+                        reload_exec(fd_listen, n);
+                reloading = 0;
+
+                /* Let go of the sockets too, or a stop would leave them open */
+                if (draining && !told) {
+                        told = 1;
+                        for (i=0; i<n; i++) {
+                                kill(pids[i], SIGQUIT);
+                                close(fd_listen[i]);
+                        }
+                }
+
+                if (pid = waitpid(-1, NULL, 0), pid < 0) {
+                        if (errno == ECHILD)
+                                sleep(1);
+                        continue;
+                }
+
+                for (i=0; i<n; i++) {
+                        if (pids[i] != pid)
+                                continue;
+                        if (draining) {
+                                pids[i] = 0;
+                                if (--live == 0)
+                                        exit(0);
+                        } else {
+                                record(ERROR, NULL, "worker died, restarting");
+                                spawn(fd_listen, n, i);
+                        }
+                        break;
+                }
+        }
+
+        for (i=0; i<n; i++) {
+                if (pids[i] > 0)
+                        kill(pids[i], SIGTERM);
+        }
+
+        exit(0);
+}
@@ -0,0 +1,13 @@
+#ifndef __WORKER_H
+#define __WORKER_H
+
+
+/* Upper bound on -w */
+#define MAX_WORKERS 256
+
+
+/* Function prototypes */
+void workers(int *fd_listen, int n);
+
+
+#endif